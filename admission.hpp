@@ -0,0 +1,158 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+namespace network
+{
+	// decides whether an accepted client is kept or shed at once.
+	// caps the clients open in total and per source address,and the rate of new clients
+	// with a token bucket.
+	// shared by every event loop: the total and the bucket are atomics,the per address
+	// counts are split over stripes with their own lock,so loops rarely wait for each other.
+	// a limit of 0 is no limit.
+	class Admission
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		Admission();
+		Admission(const Admission &rhs) = delete;
+
+		Admission &operator=(const Admission &rhs) = delete;
+
+		void SetMaxConnections(int maxconnections);
+		void SetMaxPerSource(int maxpersource);
+		// admit rate clients per second on average,and up to burst at once.
+		void SetRate(double rate, int burst);
+		// true if any limit is set,without limits Admit always succeeds.
+		bool Enabled() const;
+
+		// count a client from source as open until Release,return false to shed it.
+		// source is the ipv4 address,or a hash of a longer address.
+		bool Admit(uint32_t source);
+		void Release(uint32_t source);
+
+	protected:
+		static constexpr int stripes = 64;
+
+		struct alignas(64) Stripe
+		{
+			std::mutex mutex;
+			std::unordered_map<uint32_t, int> counts;
+		};
+
+		int maxconnections;
+		int maxpersource;
+		// the bucket is kept as the time it is full again(GCRA),a client takes a token by
+		// moving it one interval ahead,and is shed when it would be more than burst intervals ahead.
+		int64_t interval;
+		int64_t tolerance;
+		alignas(64) std::atomic<int> active;
+		alignas(64) std::atomic<int64_t> full;
+		Stripe sources[stripes];
+
+		bool TakeToken();
+		bool AddSource(uint32_t source);
+		void RemoveSource(uint32_t source);
+	};
+}
+
+namespace network
+{
+	Admission::Admission() : maxconnections(0), maxpersource(0), interval(0), tolerance(0), active(0), full(0), sources() {}
+
+	void Admission::SetMaxConnections(int maxconnections) { this->maxconnections = maxconnections; }
+	void Admission::SetMaxPerSource(int maxpersource) { this->maxpersource = maxpersource; }
+
+	void Admission::SetRate(double rate, int burst)
+	{
+		if (rate <= 0)
+		{
+			this->interval = this->tolerance = 0;
+			return;
+		}
+		this->interval = (int64_t)(1e9 / rate);
+		this->tolerance = this->interval * (burst > 1 ? burst - 1 : 0);
+	}
+
+	bool Admission::Enabled() const { return this->maxconnections > 0 || this->maxpersource > 0 || this->interval > 0; }
+
+	bool Admission::Admit(uint32_t source)
+	{
+		if (this->maxconnections > 0 && this->active.fetch_add(1, std::memory_order_relaxed) >= this->maxconnections)
+		{
+			this->active.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		if (this->maxpersource > 0 && !this->AddSource(source))
+		{
+			if (this->maxconnections > 0)
+				this->active.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		// a client shed by the caps takes no token.
+		if (!this->TakeToken())
+		{
+			if (this->maxpersource > 0)
+				this->RemoveSource(source);
+			if (this->maxconnections > 0)
+				this->active.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	void Admission::Release(uint32_t source)
+	{
+		if (this->maxpersource > 0)
+			this->RemoveSource(source);
+		if (this->maxconnections > 0)
+			this->active.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	bool Admission::TakeToken()
+	{
+		if (this->interval == 0)
+			return true;
+		int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+		int64_t full = this->full.load(std::memory_order_relaxed), start;
+		do
+		{
+			// a bucket full since before now has no credit to carry over.
+			start = full < now ? now : full;
+			if (start - now > this->tolerance)
+				return false;
+		} while (!this->full.compare_exchange_weak(full, start + this->interval, std::memory_order_relaxed));
+		return true;
+	}
+
+	bool Admission::AddSource(uint32_t source)
+	{
+		Stripe &stripe = this->sources[(source * 2654435761u) >> 26];
+		std::lock_guard<std::mutex> lock(stripe.mutex);
+		int &count = stripe.counts[source];
+		if (count >= this->maxpersource)
+			return false;
+		count++;
+		return true;
+	}
+
+	void Admission::RemoveSource(uint32_t source)
+	{
+		Stripe &stripe = this->sources[(source * 2654435761u) >> 26];
+		std::lock_guard<std::mutex> lock(stripe.mutex);
+		std::unordered_map<uint32_t, int>::iterator it = stripe.counts.find(source);
+		if (it == stripe.counts.end())
+			return;
+		// sources without open clients are dropped,so the table holds only the open ones.
+		if (--it->second == 0)
+			stripe.counts.erase(it);
+	}
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef __BALANCER_H__
+#define __BALANCER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace network
+{
+	struct Backend
+	{
+		std::string addr;
+		int port;
+		int weight;
+		// connections currently relayed to the backend,kept on its own cache line
+		// because every event loop updates it.
+		alignas(64) std::atomic<int> active;
+
+		Backend(const std::string &addr, int port, int weight) : addr(addr), port(port), weight(weight), active(0) {}
+	};
+
+	// picks the backend of each new connection.
+	// backends are added before the event loops start,after that Select,Acquire and Release
+	// may be called from every event loop at once,they only use atomic counters and
+	// tables that do not change.
+	class Balancer
+	{
+	public:
+		enum Strategy
+		{
+			RoundRobin,
+			// fewest active connections relative to weight.
+			LeastConnections,
+			// round robin where a backend gets weight turns,spread evenly.
+			Weighted,
+			// consistent hash of the client address,a client keeps its backend
+			// and only the clients of a removed backend move.
+			Hash,
+		};
+
+		Balancer();
+		Balancer(const Balancer &rhs) = delete;
+
+		Balancer &operator=(const Balancer &rhs) = delete;
+
+		void SetStrategy(Strategy strategy);
+		Strategy GetStrategy() const;
+		// return false if name is not a strategy.
+		bool SetStrategy(const char *name);
+		// a weight costs replicas points on the hash ring and a turn in the weighted schedule,so it is capped.
+		static constexpr int MaxWeight = 1000;
+
+		// return false if weight is not between 1 and MaxWeight.
+		bool Add(const std::string &addr, int port, int weight = 1);
+		// build the selection tables,call after the last Add.
+		void Finish();
+
+		// return the index of the backend for a client,clienthash is used by the hash strategy.
+		int Select(uint32_t clienthash);
+		// count a connection to backend index as active until Release.
+		void Acquire(int index);
+		void Release(int index);
+
+		int Size() const;
+		const Backend &Get(int index) const;
+
+		static uint32_t HashBytes(const void *data, size_t size);
+
+	protected:
+		static constexpr int replicas = 160;
+
+		struct Point
+		{
+			uint32_t hash;
+			int index;
+
+			bool operator<(const Point &rhs) const { return this->hash < rhs.hash; }
+		};
+
+		Strategy strategy;
+		// a deque does not move its elements,which atomics can not do.
+		std::deque<Backend> backends;
+		// backend indexes in weighted round robin order.
+		std::vector<int> schedule;
+		// hash ring,sorted by hash.
+		std::vector<Point> ring;
+		std::atomic<unsigned> next;
+
+		int SelectLeastConnections();
+	};
+}
+
+namespace network
+{
+	Balancer::Balancer() : strategy(RoundRobin), backends(), schedule(), ring(), next(0) {}
+
+	void Balancer::SetStrategy(Strategy strategy) { this->strategy = strategy; }
+	Balancer::Strategy Balancer::GetStrategy() const { return this->strategy; }
+
+	bool Balancer::SetStrategy(const char *name)
+	{
+		if (strcmp(name, "round-robin") == 0)
+			this->strategy = RoundRobin;
+		else if (strcmp(name, "least-conn") == 0)
+			this->strategy = LeastConnections;
+		else if (strcmp(name, "weighted") == 0)
+			this->strategy = Weighted;
+		else if (strcmp(name, "hash") == 0)
+			this->strategy = Hash;
+		else
+			return false;
+		return true;
+	}
+
+	bool Balancer::Add(const std::string &addr, int port, int weight)
+	{
+		if (weight < 1 || weight > MaxWeight)
+			return false;
+		this->backends.emplace_back(addr, port, weight);
+		return true;
+	}
+
+	void Balancer::Finish()
+	{
+		// smooth weighted round robin,run once for a whole cycle of sum(weight) turns.
+		std::vector<int64_t> current(this->backends.size(), 0);
+		int64_t total = 0;
+		int i, best;
+		for (const Backend &backend : this->backends)
+			total += backend.weight;
+		this->schedule.clear();
+		for (int64_t turn = 0; turn < total; turn++)
+		{
+			best = 0;
+			for (i = 0; i < (int)this->backends.size(); i++)
+			{
+				current[i] += this->backends[i].weight;
+				if (current[i] > current[best])
+					best = i;
+			}
+			current[best] -= total;
+			this->schedule.push_back(best);
+		}
+
+		this->ring.clear();
+		char key[300];
+		int size;
+		for (i = 0; i < (int)this->backends.size(); i++)
+		{
+			const Backend &backend = this->backends[i];
+			for (int replica = 0; replica < replicas * backend.weight; replica++)
+			{
+				size = snprintf(key, sizeof(key), "%s:%d#%d", backend.addr.c_str(), backend.port, replica);
+				this->ring.push_back(Point{HashBytes(key, size), i});
+			}
+		}
+		std::sort(this->ring.begin(), this->ring.end());
+	}
+
+	int Balancer::Select(uint32_t clienthash)
+	{
+		if (this->backends.size() == 1)
+			return 0;
+		switch (this->strategy)
+		{
+		case LeastConnections:
+			return this->SelectLeastConnections();
+		case Weighted:
+			return this->schedule[this->next.fetch_add(1, std::memory_order_relaxed) % this->schedule.size()];
+		case Hash:
+		{
+			std::vector<Point>::const_iterator it = std::lower_bound(this->ring.begin(), this->ring.end(), Point{clienthash, 0});
+			return it == this->ring.end() ? this->ring.front().index : it->index;
+		}
+		case RoundRobin:
+		default:
+			return this->next.fetch_add(1, std::memory_order_relaxed) % this->backends.size();
+		}
+	}
+
+	// the counts may change while scanning,a slightly stale choice is fine.
+	int Balancer::SelectLeastConnections()
+	{
+		// start at a rotating backend so ties are spread instead of all going to the first one.
+		int size = (int)this->backends.size();
+		int start = this->next.fetch_add(1, std::memory_order_relaxed) % size;
+		int best = start, bestactive = this->backends[start].active.load(std::memory_order_relaxed);
+		int i, index, active;
+		for (i = 1; i < size; i++)
+		{
+			index = (start + i) % size;
+			active = this->backends[index].active.load(std::memory_order_relaxed);
+			if ((long long)active * this->backends[best].weight < (long long)bestactive * this->backends[index].weight)
+			{
+				best = index;
+				bestactive = active;
+			}
+		}
+		return best;
+	}
+
+	void Balancer::Acquire(int index) { this->backends[index].active.fetch_add(1, std::memory_order_relaxed); }
+	void Balancer::Release(int index) { this->backends[index].active.fetch_sub(1, std::memory_order_relaxed); }
+
+	int Balancer::Size() const { return (int)this->backends.size(); }
+	const Backend &Balancer::Get(int index) const { return this->backends[index]; }
+
+	// fnv-1a,followed by a finalizer so close addresses land far apart on the ring.
+	uint32_t Balancer::HashBytes(const void *data, size_t size)
+	{
+		const unsigned char *bytes = static_cast<const unsigned char *>(data);
+		uint32_t hash = 2166136261u;
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 16777619u;
+		}
+		hash ^= hash >> 16;
+		hash *= 0x85ebca6bu;
+		hash ^= hash >> 13;
+		hash *= 0xc2b2ae35u;
+		hash ^= hash >> 16;
+		return hash;
+	}
+}
+
+#endif
@@ -0,0 +1,709 @@
+#ifndef __PRINT_MULTI_ARGS__
+#define __PRINT_MULTI_ARGS__
+#include <iostream>
+
+template <typename T>
+inline void Print(T t) { std::cerr << t; }
+
+template <typename T, typename... Args>
+void Print(T t, Args... args)
+{
+	std::cerr << t << " ";
+	Print(args...);
+}
+
+template <typename... Args>
+void Println(Args... args)
+{
+	Print(args...);
+	std::cerr << std::endl;
+}
+
+#endif
+
+void PrintHelp()
+{
+	Print(R"(usage bench [options] command [command]...
+bench ./forward "./forward --engine uring" ./forward-boost
+
+every command is started as `command localport 127.0.0.1 sinkport` in front of a sink/echo
+server run by bench,then loaded over loopback.results go to stdout as json,progress to stderr.
+linux only.
+
+options:
+  --port P        sink port,the forwarders listen on P+1,P+2...(default 17000)
+  --duration S    seconds of the bulk and connect tests(default 3)
+  --streams N     parallel streams of the bulk test(default 4)
+  --messages N    round trips of the latency test(default 20000)
+  --message-size BYTES
+                  size of a latency test message(default 64)
+  --connectors N  parallel clients of the connect test(default 8)
+  --max-tunnels N stop the scale test after N tunnels(default 10000,
+                  capped by the open file limit)
+)");
+}
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct Options
+{
+	int port;
+	double duration;
+	int streams;
+	int messages;
+	int messagesize;
+	int connectors;
+	int maxtunnels;
+	std::vector<std::string> commands;
+};
+
+struct Result
+{
+	std::string command;
+	std::string error;
+	double bulkgbps;
+	double p50us;
+	double p99us;
+	double p999us;
+	double connectrate;
+	long long connectfailures;
+	int maxtunnels;
+	// the scale test stopped at the limit,not at a failure.
+	bool tunnelslimited;
+	// the forwarder was still running after the tests.
+	bool alive;
+};
+
+// the first byte a client sends selects what the sink does with the rest of the connection.
+enum SinkMode
+{
+	// discard and count.
+	Discard = 'S',
+	Echo = 'E',
+	// echo the first bytes,then close,so the sink side closes first and client ports
+	// do not pile up in TIME_WAIT.
+	EchoClose = 'C',
+};
+
+// sink/echo server on one epoll thread,the backend of every forwarder under test.
+// independent of network.hpp,so it does not share the bugs of what it measures.
+class Sink
+{
+public:
+	Sink();
+	Sink(const Sink &rhs) = delete;
+
+	Sink &operator=(const Sink &rhs) = delete;
+
+	bool Start(int port);
+	// bytes received in Discard mode so far.
+	unsigned long long Received() const;
+
+protected:
+	struct Stream
+	{
+		int mode;
+		// echo bytes the socket did not take yet,reading stops until they are sent.
+		std::string output;
+	};
+
+	int listenfd;
+	int epfd;
+	std::atomic<unsigned long long> received;
+	// indexed by fd.
+	std::vector<Stream> streams;
+
+	void Run();
+	void Accept();
+	void Read(int fd);
+	void Write(int fd);
+	void CloseStream(int fd);
+};
+
+Sink::Sink() : listenfd(-1), epfd(-1), received(0), streams() {}
+
+bool Sink::Start(int port)
+{
+	this->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (this->listenfd < 0)
+		return false;
+	int opt = 1;
+	setsockopt(this->listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(this->listenfd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(this->listenfd, 4096) < 0)
+		return false;
+	this->epfd = epoll_create1(0);
+	if (this->epfd < 0)
+		return false;
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = this->listenfd;
+	if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, this->listenfd, &ev) < 0)
+		return false;
+	std::thread(&Sink::Run, this).detach();
+	return true;
+}
+
+unsigned long long Sink::Received() const { return this->received.load(std::memory_order_relaxed); }
+
+void Sink::Run()
+{
+	epoll_event events[256];
+	int n, i;
+	for (;;)
+	{
+		n = epoll_wait(this->epfd, events, 256, -1);
+		for (i = 0; i < n; i++)
+		{
+			if (events[i].data.fd == this->listenfd)
+				this->Accept();
+			else if (events[i].events & EPOLLOUT)
+				this->Write(events[i].data.fd);
+			else
+				this->Read(events[i].data.fd);
+		}
+	}
+}
+
+void Sink::Accept()
+{
+	int fd;
+	epoll_event ev;
+	while ((fd = accept4(this->listenfd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0)
+	{
+		if ((size_t)fd >= this->streams.size())
+			this->streams.resize(fd + 1);
+		this->streams[fd].mode = 0;
+		this->streams[fd].output.clear();
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+void Sink::Read(int fd)
+{
+	static char buffer[1 << 18];
+	Stream &stream = this->streams[fd];
+	ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+	if (size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+	{
+		this->CloseStream(fd);
+		return;
+	}
+	if (size < 0)
+		return;
+	char *data = buffer;
+	if (stream.mode == 0)
+	{
+		stream.mode = data[0];
+		data++;
+		size--;
+		if (size == 0)
+			return;
+	}
+	if (stream.mode == Discard)
+	{
+		this->received.fetch_add(size, std::memory_order_relaxed);
+		return;
+	}
+	ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+	if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		this->CloseStream(fd);
+		return;
+	}
+	if (sent < 0)
+		sent = 0;
+	if (sent < size)
+	{
+		stream.output.assign(data + sent, size - sent);
+		epoll_event ev;
+		ev.events = EPOLLOUT;
+		ev.data.fd = fd;
+		epoll_ctl(this->epfd, EPOLL_CTL_MOD, fd, &ev);
+		return;
+	}
+	if (stream.mode == EchoClose)
+		this->CloseStream(fd);
+}
+
+void Sink::Write(int fd)
+{
+	Stream &stream = this->streams[fd];
+	ssize_t sent = send(fd, stream.output.data(), stream.output.size(), MSG_NOSIGNAL);
+	if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		this->CloseStream(fd);
+		return;
+	}
+	if (sent > 0)
+		stream.output.erase(0, sent);
+	if (!stream.output.empty())
+		return;
+	if (stream.mode == EchoClose)
+	{
+		this->CloseStream(fd);
+		return;
+	}
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl(this->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void Sink::CloseStream(int fd)
+{
+	epoll_ctl(this->epfd, EPOLL_CTL_DEL, fd, nullptr);
+	this->streams[fd].output.clear();
+	close(fd);
+}
+
+// blocking client socket connected to 127.0.0.1:port,-1 on failure.
+// connect,send and recv give up after timeoutms.
+int Dial(int port, int timeoutms)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	timeval timeout;
+	timeout.tv_sec = timeoutms / 1000;
+	timeout.tv_usec = (timeoutms % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	int opt = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool SendAll(int fd, const char *data, size_t size)
+{
+	ssize_t sent;
+	while (size > 0)
+	{
+		sent = send(fd, data, size, MSG_NOSIGNAL);
+		if (sent <= 0)
+			return false;
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool RecvAll(int fd, char *data, size_t size)
+{
+	ssize_t got;
+	while (size > 0)
+	{
+		got = recv(fd, data, size, 0);
+		if (got <= 0)
+			return false;
+		data += got;
+		size -= got;
+	}
+	return true;
+}
+
+// open a tunnel in mode and check one byte makes the round trip,-1 on failure.
+int OpenTunnel(int port, char mode, int timeoutms)
+{
+	int fd = Dial(port, timeoutms);
+	if (fd < 0)
+		return -1;
+	char request[2] = {mode, 'x'};
+	char reply;
+	if (!SendAll(fd, request, sizeof(request)) || !RecvAll(fd, &reply, 1) || reply != 'x')
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+double Seconds(Clock::time_point begin, Clock::time_point end)
+{
+	return std::chrono::duration<double>(end - begin).count();
+}
+
+// start command with the forward arguments appended,return its pid or -1.
+pid_t StartForwarder(const std::string &command, int localport, int sinkport)
+{
+	std::vector<std::string> words;
+	std::istringstream stream(command);
+	std::string word;
+	while (stream >> word)
+		words.push_back(word);
+	if (words.empty())
+		return -1;
+	words.push_back(std::to_string(localport));
+	words.push_back("127.0.0.1");
+	words.push_back(std::to_string(sinkport));
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	dup2(null, STDERR_FILENO);
+	std::vector<char *> argv;
+	for (std::string &word : words)
+		argv.push_back(&word[0]);
+	argv.push_back(nullptr);
+	execvp(argv[0], argv.data());
+	_exit(127);
+}
+
+// wait until the forwarder relays a round trip,false if it does not within 5 seconds.
+bool WaitReady(int port, pid_t pid)
+{
+	Clock::time_point deadline = Clock::now() + std::chrono::seconds(5);
+	int fd, status;
+	while (Clock::now() < deadline)
+	{
+		if (waitpid(pid, &status, WNOHANG) == pid)
+			return false;
+		fd = OpenTunnel(port, Echo, 1000);
+		if (fd >= 0)
+		{
+			close(fd);
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+	return false;
+}
+
+// bytes per second the sink receives from several streams pushing as fast as they can.
+double BenchBulk(const Options &options, int port, Sink &sink)
+{
+	std::atomic<bool> stop(false);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < options.streams; i++)
+		threads.emplace_back([&]() -> void
+							 {
+								 int fd = Dial(port, 1000);
+								 if (fd < 0)
+									 return;
+								 std::vector<char> chunk(1 << 18, 'b');
+								 chunk[0] = Discard;
+								 if (!SendAll(fd, chunk.data(), 1))
+								 {
+									 close(fd);
+									 return;
+								 }
+								 while (!stop.load(std::memory_order_relaxed))
+								 {
+									 if (send(fd, chunk.data(), chunk.size(), MSG_NOSIGNAL) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+										 break;
+								 }
+								 close(fd); });
+	// let the streams and their buffers ramp up before measuring.
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	unsigned long long begin = sink.Received();
+	Clock::time_point start = Clock::now();
+	std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+	unsigned long long end = sink.Received();
+	double seconds = Seconds(start, Clock::now());
+	stop = true;
+	for (std::thread &thread : threads)
+		thread.join();
+	return (end - begin) * 8 / seconds / 1e9;
+}
+
+// round trip times of small messages on one tunnel,in microseconds and sorted.
+// empty if the tunnel failed.
+std::vector<double> BenchLatency(const Options &options, int port)
+{
+	std::vector<double> rtts;
+	int fd = Dial(port, 2000);
+	if (fd < 0)
+		return rtts;
+	std::vector<char> message(options.messagesize, 'l');
+	std::vector<char> reply(options.messagesize);
+	char mode = Echo;
+	if (!SendAll(fd, &mode, 1))
+	{
+		close(fd);
+		return rtts;
+	}
+	// the first round trips warm up caches and buffers and are not counted.
+	int warmup = std::min(1000, options.messages / 10);
+	Clock::time_point begin;
+	rtts.reserve(options.messages);
+	for (int i = 0; i < warmup + options.messages; i++)
+	{
+		begin = Clock::now();
+		if (!SendAll(fd, message.data(), message.size()) || !RecvAll(fd, reply.data(), reply.size()))
+		{
+			rtts.clear();
+			break;
+		}
+		if (i >= warmup)
+			rtts.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+	}
+	close(fd);
+	std::sort(rtts.begin(), rtts.end());
+	return rtts;
+}
+
+double Percentile(const std::vector<double> &sorted, double percent)
+{
+	if (sorted.empty())
+		return 0;
+	size_t index = (size_t)(percent / 100 * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+// tunnels per second opened,used for one round trip and closed by several clients at once.
+double BenchConnect(const Options &options, int port, long long &failures)
+{
+	std::atomic<long long> done(0), failed(0);
+	std::atomic<bool> stop(false);
+	std::vector<std::thread> threads;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < options.connectors; i++)
+		threads.emplace_back([&]() -> void
+							 {
+								 char rest;
+								 int fd;
+								 while (!stop.load(std::memory_order_relaxed))
+								 {
+									 fd = OpenTunnel(port, EchoClose, 2000);
+									 if (fd < 0)
+									 {
+										 failed++;
+										 continue;
+									 }
+									 // wait for the close of the other side,so the client does not close first.
+									 while (recv(fd, &rest, 1, 0) > 0)
+										 ;
+									 close(fd);
+									 done++;
+								 } });
+	std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+	stop = true;
+	for (std::thread &thread : threads)
+		thread.join();
+	failures = failed;
+	return done / Seconds(start, Clock::now());
+}
+
+// open tunnels one by one and keep them open until one fails or limit are open.
+int BenchTunnels(int port, int limit)
+{
+	std::vector<int> fds;
+	fds.reserve(limit);
+	int fd;
+	while ((int)fds.size() < limit)
+	{
+		fd = OpenTunnel(port, Echo, 2000);
+		if (fd < 0)
+			break;
+		fds.push_back(fd);
+	}
+	int count = (int)fds.size();
+	for (int fd : fds)
+		close(fd);
+	return count;
+}
+
+Result BenchCommand(const Options &options, const std::string &command, int localport, Sink &sink, int tunnellimit)
+{
+	Result result;
+	result.command = command;
+	result.bulkgbps = result.p50us = result.p99us = result.p999us = result.connectrate = 0;
+	result.connectfailures = 0;
+	result.maxtunnels = 0;
+	result.tunnelslimited = false;
+	result.alive = false;
+	pid_t pid = StartForwarder(command, localport, options.port);
+	if (pid < 0)
+	{
+		result.error = "can not start";
+		return result;
+	}
+	if (!WaitReady(localport, pid))
+	{
+		result.error = "not ready";
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+		return result;
+	}
+
+	Println(command, ": bulk");
+	result.bulkgbps = BenchBulk(options, localport, sink);
+	Println(command, ": latency");
+	std::vector<double> rtts = BenchLatency(options, localport);
+	result.p50us = Percentile(rtts, 50);
+	result.p99us = Percentile(rtts, 99);
+	result.p999us = Percentile(rtts, 99.9);
+	Println(command, ": connect");
+	result.connectrate = BenchConnect(options, localport, result.connectfailures);
+	Println(command, ": tunnels");
+	result.maxtunnels = BenchTunnels(localport, tunnellimit);
+	result.tunnelslimited = result.maxtunnels == tunnellimit;
+
+	result.alive = waitpid(pid, nullptr, WNOHANG) == 0;
+	kill(pid, SIGTERM);
+	waitpid(pid, nullptr, 0);
+	return result;
+}
+
+std::string JsonString(const std::string &s)
+{
+	std::string json = "\"";
+	char escape[8];
+	for (unsigned char c : s)
+	{
+		if (c == '"' || c == '\\')
+		{
+			json += '\\';
+			json += c;
+		}
+		else if (c < 0x20)
+		{
+			snprintf(escape, sizeof(escape), "\\u%04x", c);
+			json += escape;
+		}
+		else
+			json += c;
+	}
+	return json + "\"";
+}
+
+void PrintJson(const Options &options, const std::vector<Result> &results)
+{
+	std::ostringstream json;
+	json << "{\"config\":{\"duration\":" << options.duration
+		 << ",\"streams\":" << options.streams
+		 << ",\"messages\":" << options.messages
+		 << ",\"message_size\":" << options.messagesize
+		 << ",\"connectors\":" << options.connectors
+		 << ",\"max_tunnels\":" << options.maxtunnels << "},\"results\":[";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result &result = results[i];
+		if (i > 0)
+			json << ",";
+		json << "{\"command\":" << JsonString(result.command);
+		if (!result.error.empty())
+		{
+			json << ",\"error\":" << JsonString(result.error) << "}";
+			continue;
+		}
+		json << ",\"bulk_gbps\":" << result.bulkgbps
+			 << ",\"latency_us\":{\"p50\":" << result.p50us << ",\"p99\":" << result.p99us << ",\"p999\":" << result.p999us << "}"
+			 << ",\"connect_rate\":" << result.connectrate
+			 << ",\"connect_failures\":" << result.connectfailures
+			 << ",\"max_tunnels\":" << result.maxtunnels
+			 << ",\"max_tunnels_limited\":" << (result.tunnelslimited ? "true" : "false")
+			 << ",\"alive\":" << (result.alive ? "true" : "false") << "}";
+	}
+	json << "]}";
+	std::cout << json.str() << std::endl;
+}
+
+bool ParseOptions(int argc, char **argv, Options &options)
+{
+	options.port = 17000;
+	options.duration = 3;
+	options.streams = 4;
+	options.messages = 20000;
+	options.messagesize = 64;
+	options.connectors = 8;
+	options.maxtunnels = 10000;
+	int i = 1;
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+	{
+		if (i + 1 >= argc)
+			return false;
+		if (strcmp(argv[i], "--port") == 0)
+			options.port = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--duration") == 0)
+			options.duration = atof(argv[++i]);
+		else if (strcmp(argv[i], "--streams") == 0)
+			options.streams = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--messages") == 0)
+			options.messages = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--message-size") == 0)
+			options.messagesize = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--connectors") == 0)
+			options.connectors = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--max-tunnels") == 0)
+			options.maxtunnels = atoi(argv[++i]);
+		else
+			return false;
+	}
+	if (options.port < 1 || options.duration <= 0 || options.streams < 1 || options.messages < 1 ||
+		options.messagesize < 1 || options.connectors < 1 || options.maxtunnels < 1)
+		return false;
+	for (; i < argc; i++)
+		options.commands.push_back(argv[i]);
+	return !options.commands.empty() && options.port + (int)options.commands.size() < 65536;
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintHelp();
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	// the scale test holds a client and a sink socket per tunnel,the forwarders inherit the limit.
+	rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	int tunnellimit = std::min<long long>(options.maxtunnels, ((long long)limit.rlim_cur - 64) / 2);
+
+	Sink sink;
+	if (!sink.Start(options.port))
+	{
+		Println("sink listen failed", errno);
+		return 1;
+	}
+	std::vector<Result> results;
+	for (size_t i = 0; i < options.commands.size(); i++)
+	{
+		// every forwarder gets its own port,the last one may still be in TIME_WAIT.
+		results.push_back(BenchCommand(options, options.commands[i], options.port + 1 + (int)i, sink, tunnellimit));
+	}
+	PrintJson(options, results);
+}
@@ -0,0 +1,113 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stdlib.h>
+#include <vector>
+
+namespace network
+{
+	// pool of relay buffers in power of 2 size classes between minsize and maxsize.
+	// released buffers are kept for reuse until cachesize bytes are cached,the rest is freed.
+	// not thread safe,every event loop owns its pool.
+	class BufferPool
+	{
+	public:
+		BufferPool(size_t minsize = 16384, size_t maxsize = 262144, size_t cachesize = 16 << 20);
+		BufferPool(const BufferPool &rhs) = delete;
+		~BufferPool();
+
+		BufferPool &operator=(const BufferPool &rhs) = delete;
+
+		// return a buffer of at least size bytes,size is clamped to [minsize,maxsize]
+		// and rounded up to its size class.
+		char *Get(size_t &size);
+		// give back a buffer returned by Get() with its size.
+		void Put(char *buffer, size_t size);
+
+		size_t MinSize() const;
+		size_t MaxSize() const;
+		// size the next buffer of a stream from how many bytes of a size buffer the last read used:
+		// double it when full,halve it when less than a quarter was used.
+		size_t NextSize(size_t size, size_t used) const;
+
+	protected:
+		size_t minsize;
+		size_t maxsize;
+		size_t cachesize;
+		size_t cached;
+		std::vector<std::vector<char *>> freelists;
+
+		size_t SizeClass(size_t &size) const;
+	};
+}
+
+namespace network
+{
+	BufferPool::BufferPool(size_t minsize, size_t maxsize, size_t cachesize) : minsize(1024), maxsize(0), cachesize(cachesize),
+																			   cached(0), freelists()
+	{
+		while (this->minsize < minsize)
+			this->minsize <<= 1;
+		this->maxsize = this->minsize;
+		while (this->maxsize < maxsize)
+			this->maxsize <<= 1;
+		size_t size = this->maxsize;
+		this->freelists.resize(this->SizeClass(size) + 1);
+	}
+
+	BufferPool::~BufferPool()
+	{
+		for (std::vector<char *> &freelist : this->freelists)
+			for (char *buffer : freelist)
+				free(buffer);
+	}
+
+	size_t BufferPool::SizeClass(size_t &size) const
+	{
+		size_t index = 0;
+		size_t classsize = this->minsize;
+		while (classsize < size && classsize < this->maxsize)
+		{
+			classsize <<= 1;
+			index++;
+		}
+		size = classsize;
+		return index;
+	}
+
+	char *BufferPool::Get(size_t &size)
+	{
+		std::vector<char *> &freelist = this->freelists[this->SizeClass(size)];
+		if (freelist.empty())
+			return static_cast<char *>(malloc(size));
+		char *buffer = freelist.back();
+		freelist.pop_back();
+		this->cached -= size;
+		return buffer;
+	}
+
+	void BufferPool::Put(char *buffer, size_t size)
+	{
+		if (this->cached + size > this->cachesize)
+		{
+			free(buffer);
+			return;
+		}
+		this->freelists[this->SizeClass(size)].push_back(buffer);
+		this->cached += size;
+	}
+
+	size_t BufferPool::MinSize() const { return this->minsize; }
+	size_t BufferPool::MaxSize() const { return this->maxsize; }
+
+	size_t BufferPool::NextSize(size_t size, size_t used) const
+	{
+		if (used >= size && size < this->maxsize)
+			return size << 1;
+		if (used < size / 4 && size > this->minsize)
+			return size >> 1;
+		return size;
+	}
+}
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+// compression needs zstd,compile with -DFORWARD_ZSTD and link -lzstd.
+#ifdef FORWARD_ZSTD
+
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+#include <zstd.h>
+
+namespace network
+{
+	// a compressed direction of a tunnel is a sequence of blocks,each one the bytes of one read of the sender:
+	// a header of two big endian 32 bit words,the length of the payload with the top bit set if it is compressed
+	// and the length of the plain bytes,then the payload.compressed payloads continue one zstd stream,
+	// flushed at the end of every block,so small messages still profit from what was sent before them
+	// and never wait for more.blocks of incompressible flows are sent raw and leave the stream as it is.
+	namespace compress
+	{
+		constexpr size_t HeaderSize = 8;
+		constexpr uint32_t CompressedFlag = 0x80000000u;
+		// a block is never larger,a peer that claims more is not one.
+		constexpr size_t MaxBlock = 4 << 20;
+	}
+
+	// the sending end of a compressed direction.not thread safe,but it may move between threads
+	// as long as calls do not overlap.
+	class Compressor
+	{
+	public:
+		Compressor(const Compressor &rhs) = delete;
+		~Compressor();
+
+		Compressor &operator=(const Compressor &rhs) = delete;
+
+		// a compressor of level,nullptr if zstd is out of memory.
+		static std::unique_ptr<Compressor> New(int level);
+
+		// replace out with the block of size bytes of data,size is at most compress::MaxBlock.
+		// return false if zstd failed,the stream can not go on then.
+		bool Encode(const char *data, size_t size, std::vector<char> &out);
+
+	protected:
+		// a flow saving less than 1/20 of a probe is sent raw for the next bypass bytes,then probed again.
+		static constexpr size_t probe = 256 << 10;
+		static constexpr size_t bypass = 8 << 20;
+
+		ZSTD_CCtx *ctx;
+		size_t probein;
+		size_t probeout;
+		size_t rawleft;
+
+		Compressor(ZSTD_CCtx *ctx);
+	};
+
+	// the receiving end of a compressed direction,it takes the bytes as they arrive
+	// and hands out the plain bytes of one complete block after the other.
+	class Decompressor
+	{
+	public:
+		Decompressor(const Decompressor &rhs) = delete;
+		~Decompressor();
+
+		Decompressor &operator=(const Decompressor &rhs) = delete;
+
+		// nullptr if zstd is out of memory.
+		static std::unique_ptr<Decompressor> New();
+
+		// keep size bytes of data until their blocks are complete.
+		void Feed(const char *data, size_t size);
+		// bytes fed and not decoded yet.
+		size_t Buffered() const;
+		// replace out with the plain bytes of the next complete block.
+		// return 1 if there was one,0 if more bytes are needed and -1 if the peer sent something wrong.
+		int Decode(std::vector<char> &out);
+
+	protected:
+		ZSTD_DCtx *ctx;
+		std::vector<char> input;
+		// where the next block starts in input.
+		size_t begin;
+
+		Decompressor(ZSTD_DCtx *ctx);
+	};
+}
+
+namespace network
+{
+	inline void PutWord(char *p, uint32_t value)
+	{
+		p[0] = (char)(value >> 24);
+		p[1] = (char)(value >> 16);
+		p[2] = (char)(value >> 8);
+		p[3] = (char)value;
+	}
+
+	inline uint32_t GetWord(const char *p)
+	{
+		return (uint32_t)(unsigned char)p[0] << 24 | (uint32_t)(unsigned char)p[1] << 16 |
+			   (uint32_t)(unsigned char)p[2] << 8 | (uint32_t)(unsigned char)p[3];
+	}
+
+	Compressor::Compressor(ZSTD_CCtx *ctx) : ctx(ctx), probein(0), probeout(0), rawleft(0) {}
+
+	Compressor::~Compressor() { ZSTD_freeCCtx(this->ctx); }
+
+	std::unique_ptr<Compressor> Compressor::New(int level)
+	{
+		ZSTD_CCtx *ctx = ZSTD_createCCtx();
+		if (ctx == nullptr)
+			return nullptr;
+		ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level);
+		return std::unique_ptr<Compressor>(new Compressor(ctx));
+	}
+
+	bool Compressor::Encode(const char *data, size_t size, std::vector<char> &out)
+	{
+		if (this->rawleft > 0)
+		{
+			this->rawleft -= size < this->rawleft ? size : this->rawleft;
+			out.resize(compress::HeaderSize + size);
+			PutWord(out.data(), (uint32_t)size);
+			PutWord(out.data() + 4, (uint32_t)size);
+			memcpy(out.data() + compress::HeaderSize, data, size);
+			return true;
+		}
+		out.resize(compress::HeaderSize + ZSTD_compressBound(size));
+		ZSTD_inBuffer in = {data, size, 0};
+		ZSTD_outBuffer output = {out.data() + compress::HeaderSize, out.size() - compress::HeaderSize, 0};
+		// the bound leaves room for all of it,so one flush ends the block.
+		size_t left = ZSTD_compressStream2(this->ctx, &output, &in, ZSTD_e_flush);
+		if (ZSTD_isError(left) || left != 0)
+			return false;
+		out.resize(compress::HeaderSize + output.pos);
+		PutWord(out.data(), (uint32_t)output.pos | compress::CompressedFlag);
+		PutWord(out.data() + 4, (uint32_t)size);
+		this->probein += size;
+		this->probeout += output.pos;
+		if (this->probein >= probe)
+		{
+			if (this->probeout * 20 > this->probein * 19)
+				this->rawleft = bypass;
+			this->probein = 0;
+			this->probeout = 0;
+		}
+		return true;
+	}
+
+	Decompressor::Decompressor(ZSTD_DCtx *ctx) : ctx(ctx), input(), begin(0) {}
+
+	Decompressor::~Decompressor() { ZSTD_freeDCtx(this->ctx); }
+
+	std::unique_ptr<Decompressor> Decompressor::New()
+	{
+		ZSTD_DCtx *ctx = ZSTD_createDCtx();
+		if (ctx == nullptr)
+			return nullptr;
+		return std::unique_ptr<Decompressor>(new Decompressor(ctx));
+	}
+
+	void Decompressor::Feed(const char *data, size_t size)
+	{
+		// drop the blocks decoded already before the buffer grows.
+		if (this->begin > 0)
+		{
+			this->input.erase(this->input.begin(), this->input.begin() + this->begin);
+			this->begin = 0;
+		}
+		this->input.insert(this->input.end(), data, data + size);
+	}
+
+	size_t Decompressor::Buffered() const { return this->input.size() - this->begin; }
+
+	int Decompressor::Decode(std::vector<char> &out)
+	{
+		if (this->Buffered() < compress::HeaderSize)
+			return 0;
+		const char *header = this->input.data() + this->begin;
+		uint32_t length = GetWord(header) & ~compress::CompressedFlag;
+		uint32_t plain = GetWord(header + 4);
+		bool compressed = (GetWord(header) & compress::CompressedFlag) != 0;
+		if (length > ZSTD_compressBound(compress::MaxBlock) || plain > compress::MaxBlock || (!compressed && length != plain))
+			return -1;
+		if (this->Buffered() < compress::HeaderSize + length)
+			return 0;
+		const char *payload = header + compress::HeaderSize;
+		this->begin += compress::HeaderSize + length;
+		if (!compressed)
+		{
+			out.assign(payload, payload + length);
+			return 1;
+		}
+		out.resize(plain);
+		ZSTD_inBuffer in = {payload, length, 0};
+		ZSTD_outBuffer output = {out.data(), out.size(), 0};
+		// a flushed block decodes to exactly its plain bytes,anything else is not what a Compressor sent.
+		while (in.pos < in.size)
+		{
+			size_t inpos = in.pos, outpos = output.pos;
+			size_t ret = ZSTD_decompressStream(this->ctx, &output, &in);
+			if (ZSTD_isError(ret) || (in.pos == inpos && output.pos == outpos))
+				return -1;
+		}
+		if (in.pos != in.size || output.pos != plain)
+			return -1;
+		return 1;
+	}
+}
+
+#endif
+
+#endif
@@ -1,10 +1,42 @@
+// boost 1.74 uses std::exchange in awaitable.hpp without including <utility>.
+#include <utility>
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
+#include "admission.hpp"
+#include "balancer.hpp"
+#include "buffer.hpp"
+#include "compress.hpp"
+#include "metrics.hpp"
+#include "log.hpp"
+#include "mapping.hpp"
+#include "resolver.hpp"
+#include "shaper.hpp"
+#include "trunk.hpp"
+#include "wheel.hpp"
+#include <chrono>
+#include <deque>
 #include <iostream>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifndef _WIN32
+#include <signal.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// tunnels are coroutines(co_spawn/awaitable).
+#ifndef BOOST_ASIO_HAS_CO_AWAIT
+#error forward-boost needs c++20 coroutines,compile with -std=c++20
+#endif
 
 using namespace boost::system;
 using namespace boost::asio;
@@ -14,30 +46,124 @@ using namespace std;
 void PrintHelp()
 {
     std::cout << R"(usage:
-./forward <src_port> <dst_ip> <dst_port>
+./forward [options] <src_port> <dst_ip> <dst_port>[:weight] [<dst_ip> <dst_port>[:weight]]...
+./forward [options] --config FILE
+
+<dst_ip> is an ipv4 or ipv6 address or a name,names are resolved without
+blocking the io_services and cached for the ttl of their records,a dst with
+ipv6 and ipv4 addresses is connected to with happy eyeballs.
+
+options:
+--threads N   run N io_services,each with its own SO_REUSEPORT acceptor
+--pin         pin io_service i to cpu i
+--buffer-min BYTES
+--buffer-max BYTES
+              relay buffers start at buffer-min and grow up to buffer-max for
+              busy streams(default 16384 and 262144),idle streams hold no buffer
+--prewarm N   keep N idle connections to dst ready per io_service,a new client
+              is paired with one of them instead of waiting for a connect
+--prewarm-idle MS
+              close prewarmed connections idle for MS milliseconds(default 30000)
+--idle-timeout MS
+              close a tunnel when neither side sent anything for MS milliseconds
+              (default 0,never)
+--keepalive SEC
+              send tcp keepalive probes after SEC seconds idle on both sides of a
+              tunnel,so peers that vanished are noticed(default 0,off)
+--compress-upstream
+--compress-client
+              compress what is sent to dsts,or to clients,with zstd and decompress
+              what comes back from there,for two forward-boost across a slow link:
+              the one near the clients compresses upstream,the one near the dsts
+              compresses its clients.reads are coded on worker threads,flows that
+              do not compress are sent as they are.needs a build with -DFORWARD_ZSTD
+              -lzstd(tcp only)
+--compress-level N
+              zstd level from 1(default,fastest) to 19
+--compress-threads N
+              worker threads coding compressed tunnels(default the number of cpus),
+              0 codes on the io_services
+--trunk-upstream N
+--trunk-client
+              carry the clients as streams over N long-lived trunks to dsts,which
+              are forward-boost with --trunk-client accepting them,so a client
+              waits for no connect across the link.a stream sends up to 1M before
+              its peer grants more,so a slow one never stalls the others.a client
+              waits up to 5s for a trunk to connect.streams are not shaped and
+              have no idle timeout(tcp only)
+--client-sockopt SPEC
+--upstream-sockopt SPEC
+              tcp options of the acceptors and the clients they accept,and of the
+              connections to dsts,SPEC is a comma separated list of nodelay,
+              rcvbuf=BYTES,sndbuf=BYTES,notsent-lowat=BYTES,fastopen[=QUEUE],
+              keepalive=SEC and autotune[=MAXBYTES](default 32M),which grows the
+              buffers of busy tunnels to what their path carries(tcp only)
+--backlog N   length of the queue of clients waiting to be accepted
+              (default SOMAXCONN,capped by net.core.somaxconn)
+--max-connections N
+              reset new clients while N clients are open(default 0,no limit)
+--max-per-ip N
+              reset new clients from an address that has N clients open
+              (default 0,no limit)
+--accept-rate N[:BURST]
+              admit N new clients per second on average and BURST at once
+              (default N),reset the others(default 0,no limit)
+--rate-tunnel BYTES
+--rate-ip BYTES
+--rate-total BYTES
+              limit the bytes per second relayed by a tunnel(both directions
+              together),by the tunnels of a client address and by the whole
+              process,K,M and G suffixes multiply by 1024(default 0,no limit)
+--bulk-threshold BYTES
+              tunnels relaying more than BYTES per second are bulk,they leave the
+              last quarter of the per address and total limits to interactive
+              tunnels(default 0,no priority)
+--udp         forward udp datagrams instead of tcp connections,every client
+              endpoint gets a session with its own socket to a dst
+--udp-timeout MS
+              close a udp session when no datagram went either way for MS
+              milliseconds(default 30000)
+--balance STRATEGY
+              how a dst is chosen for a client when several are given:
+              round-robin(default),least-conn,weighted or hash(of the client address)
+--config FILE forward every mapping of FILE from the same io_services,a line is
+              [--balance STRATEGY] [--*-sockopt SPEC] [--compress-*] [--trunk-*] <src_port> <dst_ip> <dst_port>[:weight]...,
+              # starts a comment.SIGHUP reads FILE again,acceptors of new ports
+              open,those of removed ports close,open tunnels are kept(tcp only)
+--bind ADDR   address the acceptors bind(default 0.0.0.0),:: accepts ipv6
+              and ipv4 clients(tcp only)
+--metrics [ADDR:]PORT
+              serve prometheus metrics on http://ADDR:PORT/metrics(ADDR defaults
+              to 127.0.0.1)
+--log-level LEVEL
+              log debug,info(default),warn,error or off to stderr,debug messages
+              are only compiled in with -DLOG_MIN_LEVEL=0
 
 example:
 ./forward 66022 192.168.1.12 22
 
 this will proxy all connection from port 66022
 of host machine to 192.168.1.12:22.
+
+./forward --balance weighted 8080 10.0.0.1 80 10.0.0.2 80:2
 )";
 }
 
-#define HandleError(ec)                                       \
-    do                                                        \
-    {                                                         \
-        std::cerr << __FILE__ << ":" << __LINE__ << std::endl \
-                  << ec << std::endl                          \
-                  << ec.value() << std::endl                  \
-                  << ec.message() << std::endl;               \
-    } while (0)
+// true for the errors a tunnel normally ends with.
+inline bool Disconnected(const boost::system::error_code &ec)
+{
+    return ec == error::eof || ec == error::operation_aborted || ec == error::connection_reset ||
+           ec == error::broken_pipe || ec == error::connection_aborted;
+}
 
-#define DebugInfo(info)                                       \
-    do                                                        \
-    {                                                         \
-        std::cout << __FILE__ << ":" << __LINE__ << std::endl \
-                  << info << std::endl;                       \
+// a tunnel ending is logged at debug level,which is compiled out by default.
+#define HandleError(ec)                                                                       \
+    do                                                                                        \
+    {                                                                                         \
+        if (Disconnected(ec))                                                                 \
+            LOG_DEBUG("disconnected error=%d message=%s", ec.value(), ec.message().c_str()); \
+        else                                                                                  \
+            LOG_WARN("socket error error=%d message=%s", ec.value(), ec.message().c_str());  \
     } while (0)
 
 inline bool CheckPort(int port)
@@ -45,124 +171,2549 @@ inline bool CheckPort(int port)
     return (port >= 1 && port <= 65535);
 }
 
-template <size_t bufferSize>
+// relay buffers of the io_service running on this thread.
+thread_local network::BufferPool *pPool = nullptr;
+// counters of the io_service running on this thread,nullptr without --metrics.
+thread_local network::Metrics *pMetrics = nullptr;
+// keepalive idle time of the sockets of a tunnel in seconds,0 if off.
+int keepAlive = 0;
+// shared by every io_service,nullptr if no limit is set.
+network::Admission *pAdmission = nullptr;
+// shared by every io_service,nullptr if no rate is set.
+network::Shaper *pShaper = nullptr;
+// forward udp instead of tcp,sessions close after udpTimeout milliseconds idle.
+bool udpMode = false;
+int udpTimeout = 30000;
+// the mappings served now,reloaded from configFile on SIGHUP,nullptr without --config.
+network::MappingTable *pTable = nullptr;
+std::string configFile;
+// strategy of the mappings of configFile without --balance.
+network::Balancer::Strategy defaultStrategy = network::Balancer::RoundRobin;
+// socket options,compression and trunks of the mappings that do not set their own.
+network::MappingOptions defaultOptions;
+// zstd level of compressed tunnels and the number of worker threads they compress on,0 to compress on the io_services.
+int compressLevel = 1;
+int compressThreads = (int)std::thread::hardware_concurrency();
+#ifdef FORWARD_ZSTD
+// the workers of every io_service,nullptr if compressThreads is 0.
+thread_pool *pWorkers = nullptr;
+#endif
+// resolves the names of dsts,shared by every io_service.
+network::Resolver *pResolver = nullptr;
+// address the acceptors bind.
+address bindAddress = address_v4::any();
+
+#ifdef TCP_KEEPIDLE
+using keep_idle = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE>;
+using keep_interval = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL>;
+using keep_count = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPCNT>;
+#endif
+
+template <typename SocketType>
+void EnableKeepAlive(SocketType &socket, int seconds)
+{
+    boost::system::error_code ec;
+    socket.set_option(socket_base::keep_alive(true), ec);
+#ifdef TCP_KEEPIDLE
+    // probe every few seconds after the idle time,give up after 3 unanswered probes.
+    socket.set_option(keep_idle(seconds), ec);
+    socket.set_option(keep_interval(seconds < 30 ? (seconds + 2) / 3 : 10), ec);
+    socket.set_option(keep_count(3), ec);
+#endif
+}
+
+// idle timers of the tunnels of one io_service.
+// they live on a timing wheel,so a tunnel costs no timer operation per read,
+// and one steady_timer wakes the wheel up when its next slot is due.
+class IdleReaper
+{
+public:
+    IdleReaper(io_service &ios, int idleMs) : idle(idleMs), wheel(), timer(ios), armed(false) {}
+
+    int GetIdle() const { return idle; }
+
+    network::TimingWheel::TimerId Add(int ms, network::TimingWheel::OnTimer onTimer)
+    {
+        // the wheel only moves when woken up,catch up first so the delay counts from now.
+        wheel.Advance(std::chrono::steady_clock::now());
+        network::TimingWheel::TimerId id = wheel.Add(ms, std::move(onTimer));
+        Arm();
+        return id;
+    }
+
+    void Cancel(network::TimingWheel::TimerId id) { wheel.Cancel(id); }
+
+protected:
+    int idle;
+    network::TimingWheel wheel;
+    steady_timer timer;
+    bool armed;
+
+    // idle timers all have the same length,so a timer added later never expires before the armed wakeup.
+    void Arm()
+    {
+        int timeout = wheel.NextTimeout(std::chrono::steady_clock::now());
+        if (armed || timeout < 0)
+            return;
+        armed = true;
+        timer.expires_after(std::chrono::milliseconds(timeout));
+        timer.async_wait([this](const boost::system::error_code &ec) -> void
+                         {
+                             armed = false;
+                             if (ec)
+                                 return;
+                             wheel.Advance(std::chrono::steady_clock::now());
+                             Arm();
+                         });
+    }
+};
+
+// idle timers of the io_service running on this thread,nullptr without --idle-timeout.
+thread_local IdleReaper *pReaper = nullptr;
+
+// relay buffer of one direction,taken from the pool only while bytes are in flight.
 class Buffer
 {
 public:
-    Buffer() { memset(buffer, 0, bufferSize); }
-    inline ~Buffer() { DebugInfo("buffer destructor"); }
+    Buffer(network::BufferPool &pool) : pool(pool), buffer(nullptr), size(pool.MinSize()), nextSize(size) {}
+    ~Buffer() { Release(); }
 
-    char *Get() { return buffer; }
-    const size_t GetSize() { return bufferSize; }
+    char *Get()
+    {
+        if (buffer == nullptr)
+            buffer = pool.Get(size);
+        return buffer;
+    }
+    const size_t GetSize() { return size; }
+    // size the next buffer from how much of this one the last read used.
+    void Adapt(size_t length) { nextSize = pool.NextSize(size, length); }
+    void Release()
+    {
+        if (buffer == nullptr)
+            return;
+        pool.Put(buffer, size);
+        buffer = nullptr;
+        size = nextSize;
+    }
 
 protected:
-    char buffer[bufferSize];
+    network::BufferPool &pool;
+    char *buffer;
+    size_t size;
+    size_t nextSize;
 };
 
-void Forward(boost::shared_ptr<tcp::socket> pSrc,
-             boost::shared_ptr<tcp::socket> pDst,
-             boost::shared_ptr<Buffer<1024>> pBuffer)
+// connects to the first endpoint that answers,the next one is tried after connectDelay
+// or as soon as an attempt fails(happy eyeballs),the others are closed once one connected.
+class Connector : public boost::enable_shared_from_this<Connector>
 {
-    pSrc->async_read_some(buffer(pBuffer->Get(), pBuffer->GetSize()),
-                          [pSrc,
-                           pDst,
-                           pBuffer](const boost::system::error_code &ec,
-                                    size_t length) -> void
-                          {
-                              if (ec)
+public:
+    using OnConnect = std::function<void(const boost::system::error_code &ec, boost::shared_ptr<tcp::socket> socket)>;
+
+    Connector(io_service &ios, std::vector<tcp::endpoint> endpoints, const network::SocketOptions &options, OnConnect onConnect)
+        : ios(ios), endpoints(std::move(endpoints)), options(options), next(0), pending(0), done(false), timer(ios), onConnect(std::move(onConnect)) {}
+
+    void Start()
+    {
+        if (endpoints.empty())
+        {
+            done = true;
+            onConnect(error::host_not_found, nullptr);
+            return;
+        }
+        Next();
+    }
+
+protected:
+    static constexpr int connectDelay = 250;
+
+    io_service &ios;
+    std::vector<tcp::endpoint> endpoints;
+    network::SocketOptions options;
+    size_t next;
+    int pending;
+    bool done;
+    steady_timer timer;
+    std::vector<boost::shared_ptr<tcp::socket>> attempts;
+    OnConnect onConnect;
+
+    void Next()
+    {
+        boost::shared_ptr<Connector> self = shared_from_this();
+        boost::shared_ptr<tcp::socket> socket = boost::make_shared<tcp::socket>(ios);
+        attempts.push_back(socket);
+        pending++;
+        const tcp::endpoint &endpoint = endpoints[next++];
+        if (!options.Empty())
+        {
+            // set before the connect,so the handshake carries them.async_connect opens the socket itself if this failed.
+            boost::system::error_code ec;
+            socket->open(endpoint.protocol(), ec);
+            if (!ec)
+                network::SetSocketOptions(socket->native_handle(), options, network::SocketOptions::Connecting);
+        }
+        socket->async_connect(endpoint,
+                              [this, self, socket](const boost::system::error_code &ec) -> void
                               {
-                                  HandleError(ec);
-                                  return;
-                              }
-                              pDst->async_write_some(
-                                  buffer(pBuffer->Get(), length),
-                                  [pSrc,
-                                   pDst,
-                                   pBuffer](const boost::system::error_code &ec,
-                                            size_t length) -> void
+                                  pending--;
+                                  if (done)
+                                      return;
+                                  if (ec)
                                   {
-                                      if (ec)
+                                      // the next endpoint gets its turn at once instead of after the delay.
+                                      if (next < endpoints.size())
+                                          Next();
+                                      else if (pending == 0)
                                       {
-                                          HandleError(ec);
-                                          return;
+                                          done = true;
+                                          onConnect(ec, nullptr);
                                       }
-                                      Forward(pSrc, pDst, pBuffer);
-                                  });
-                          });
+                                      return;
+                                  }
+                                  done = true;
+                                  boost::system::error_code closeEc;
+                                  timer.cancel();
+                                  for (boost::shared_ptr<tcp::socket> &other : attempts)
+                                  {
+                                      if (other != socket)
+                                          other->close(closeEc);
+                                  }
+                                  onConnect(ec, socket);
+                              });
+        if (next < endpoints.size())
+        {
+            timer.expires_after(std::chrono::milliseconds(connectDelay));
+            timer.async_wait([this, self](const boost::system::error_code &ec) -> void
+                             {
+                                 if (!ec && !done && next < endpoints.size())
+                                     Next();
+                             });
+        }
+    }
+};
+
+// the endpoints of addresses,in their order.
+std::vector<tcp::endpoint> Endpoints(const network::Resolver::Addresses &addresses)
+{
+    std::vector<tcp::endpoint> endpoints(addresses.size());
+    for (size_t i = 0; i < addresses.size(); i++)
+    {
+        size_t length = network::SockAddrLength((const sockaddr *)&addresses[i]);
+        memcpy(endpoints[i].data(), &addresses[i], length);
+        endpoints[i].resize(length);
+    }
+    return endpoints;
 }
 
-void BeginForward(io_service &ios,
-                  boost::shared_ptr<tcp::socket> client,
-                  int dstPort,
-                  const std::string &dstAddr)
+// connect to addr and port with options,addr is resolved first unless the resolver knows it already,
+// onConnect runs on ios either way.
+void ConnectBackend(io_service &ios, const std::string &addr, int port, const network::SocketOptions &options, Connector::OnConnect onConnect)
 {
-    boost::shared_ptr<tcp::socket> target = boost::make_shared<tcp::socket>(ios);
-    target->async_connect(tcp::endpoint(address::from_string(dstAddr), dstPort),
-                          [client, target](const boost::system::error_code &ec) -> void
-                          {
-                              if (ec)
-                              {
-                                  HandleError(ec);
-                                  return;
-                              }
-                              Forward(client, target, boost::make_shared<Buffer<1024>>());
-                              Forward(target, client, boost::make_shared<Buffer<1024>>());
-                          });
+    network::Resolver::Addresses addresses;
+    if (pResolver->Lookup(addr, port, addresses))
+    {
+        boost::make_shared<Connector>(ios, Endpoints(addresses), options, std::move(onConnect))->Start();
+        return;
+    }
+    pResolver->Resolve(addr, port, [&ios, options, onConnect](const network::Resolver::Addresses &addresses) -> void
+                       {
+                           std::vector<tcp::endpoint> endpoints = Endpoints(addresses);
+                           post(ios, [&ios, options, onConnect, endpoints]() -> void
+                                { boost::make_shared<Connector>(ios, endpoints, options, onConnect)->Start(); });
+                       });
+}
+
+// connections to the destination established ahead of clients,refilled in the background.
+// idle connections are checked when taken and every second,those closed by the destination
+// or idle for too long are dropped and replaced.
+class UpstreamPool : public boost::enable_shared_from_this<UpstreamPool>
+{
+public:
+    UpstreamPool(io_service &ios, const std::string &addr, int port, const network::SocketOptions &options, size_t depth, int idleMs)
+        : ios(ios), addr(addr), port(port), options(options), depth(depth), idle(idleMs), warming(0), timer(ios), stopped(false) {}
+
+    void Start()
+    {
+        Refill();
+        Sweep();
+    }
+
+    // close the idle connections and stop refilling,the mapping was removed or replaced.
+    // the pool is freed once its pending connects and its timer ended.
+    void Stop()
+    {
+        stopped = true;
+        idleList.clear();
+        timer.cancel();
+    }
+
+    // return a healthy connection,nullptr if none is ready.
+    boost::shared_ptr<tcp::socket> Take()
+    {
+        boost::shared_ptr<tcp::socket> socket;
+        std::chrono::steady_clock::time_point oldest = std::chrono::steady_clock::now() - idle;
+        while (!idleList.empty())
+        {
+            // the newest connection is the least likely to be timed out by the destination.
+            IdleSocket last = idleList.back();
+            idleList.pop_back();
+            if (last.since >= oldest && Healthy(*last.socket))
+            {
+                socket = last.socket;
+                break;
+            }
+        }
+        Refill();
+        return socket;
+    }
+
+protected:
+    struct IdleSocket
+    {
+        boost::shared_ptr<tcp::socket> socket;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    io_service &ios;
+    std::string addr;
+    int port;
+    network::SocketOptions options;
+    size_t depth;
+    std::chrono::milliseconds idle;
+    // oldest first.
+    std::deque<IdleSocket> idleList;
+    size_t warming;
+    // a connect failed,do not retry before this.
+    std::chrono::steady_clock::time_point refillAfter;
+    steady_timer timer;
+    bool stopped;
+
+    // a connection closed by the destination reads eof,data sent first by the destination
+    // stays for the client.
+    static bool Healthy(tcp::socket &socket)
+    {
+        char byte;
+        boost::system::error_code ec;
+        socket.non_blocking(true);
+        socket.receive(buffer(&byte, 1), socket_base::message_peek, ec);
+        return !ec || ec == error::would_block;
+    }
+
+    void Refill()
+    {
+        if (stopped || std::chrono::steady_clock::now() < refillAfter)
+            return;
+        boost::shared_ptr<UpstreamPool> self = shared_from_this();
+        while (idleList.size() + warming < depth)
+        {
+            warming++;
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            ConnectBackend(ios, addr, port, options,
+                           [this, self, begin](const boost::system::error_code &ec, boost::shared_ptr<tcp::socket> socket) -> void
+                           {
+                               warming--;
+                               if (stopped)
+                                   return;
+                               if (ec)
+                               {
+                                   HandleError(ec);
+                                   if (pMetrics != nullptr)
+                                       pMetrics->Add(network::Metrics::ConnectFailures);
+                                   refillAfter = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+                                   return;
+                               }
+                               if (pMetrics != nullptr)
+                                   pMetrics->Connected(begin);
+                               idleList.push_back(IdleSocket{socket, std::chrono::steady_clock::now()});
+                           });
+        }
+    }
+
+    void Sweep()
+    {
+        std::chrono::steady_clock::time_point oldest = std::chrono::steady_clock::now() - idle;
+        while (!idleList.empty() && idleList.front().since < oldest)
+            idleList.pop_front();
+        for (size_t i = 0; i < idleList.size();)
+        {
+            if (Healthy(*idleList[i].socket))
+                i++;
+            else
+                idleList.erase(idleList.begin() + i);
+        }
+        Refill();
+        timer.expires_after(std::chrono::seconds(1));
+        boost::shared_ptr<UpstreamPool> self = shared_from_this();
+        timer.async_wait([this, self](const boost::system::error_code &ec) -> void
+                         {
+                             if (!ec && !stopped)
+                                 Sweep();
+                         });
+    }
+};
+
+#ifdef SO_REUSEPORT
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+class TrunkPool;
+
+// the acceptor of one mapping on one io_service,and its prewarmed connections by backend index,
+// empty without --prewarm,or its trunks to the backends with --trunk-upstream.
+// a reload that changes the mapping keeps the acceptor and swaps the mapping and the pools,
+// the pending accept holds the listener,so closing the acceptor frees it.
+class Listener
+{
+public:
+    Listener(io_service &ios, std::shared_ptr<network::Mapping> mapping, int prewarm, int prewarmIdle)
+        : ios(ios), acceptor(ios), mapping(), prewarm(prewarm), prewarmIdle(prewarmIdle)
+    {
+        SetMapping(std::move(mapping));
+    }
+    ~Listener()
+    {
+        StopUpstreams();
+        StopTrunks();
+    }
+
+    bool Listen(int backlog, bool reusePort, boost::system::error_code &ec)
+    {
+        tcp::endpoint endpoint(bindAddress, mapping->localport);
+        acceptor.open(endpoint.protocol(), ec);
+        if (!ec)
+            acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+        if (!ec && endpoint.protocol() == tcp::v6())
+            acceptor.set_option(v6_only(false), ec);
+        if (!ec && !SetOptions())
+            ec.assign(errno, boost::system::system_category());
+#ifdef SO_REUSEPORT
+        if (!ec && reusePort)
+            acceptor.set_option(reuse_port(true), ec);
+#endif
+        if (!ec)
+            acceptor.bind(endpoint, ec);
+        if (!ec)
+            acceptor.listen(backlog, ec);
+        if (!ec)
+            acceptor.non_blocking(true, ec);
+        return !ec;
+    }
+
+    void Close()
+    {
+        boost::system::error_code ec;
+        acceptor.close(ec);
+        StopUpstreams();
+        StopTrunks();
+    }
+
+    tcp::acceptor &GetAcceptor() { return acceptor; }
+    const std::shared_ptr<network::Mapping> &GetMapping() const { return mapping; }
+
+    // new clients go to mapping,tunnels that are open keep the mapping they started with.
+    // an open acceptor takes the client options of mapping,what the old one set and mapping leaves out stays.
+    void SetMapping(std::shared_ptr<network::Mapping> mapping)
+    {
+        StopUpstreams();
+        this->mapping = std::move(mapping);
+        if (acceptor.is_open() && !SetOptions())
+            LOG_WARN("set socket options failed port=%d errno=%d", this->mapping->localport, errno);
+        if (this->mapping->options.trunkupstream > 0)
+        {
+            // streams of trunks are open at once,there is nothing to prewarm.
+            // the old trunks take new clients until one of the new ones is connected.
+            StartTrunks();
+            return;
+        }
+        StopTrunks();
+        // the prewarmed connections are spread over the backends.
+        const network::Balancer &balancer = this->mapping->balancer;
+        for (int i = 0; prewarm > 0 && i < balancer.Size(); i++)
+        {
+            const network::Backend &backend = balancer.Get(i);
+            upstreams.push_back(boost::make_shared<UpstreamPool>(ios, backend.addr, backend.port, this->mapping->options.upstream,
+                                                                 (prewarm + balancer.Size() - 1) / balancer.Size(), prewarmIdle));
+            upstreams.back()->Start();
+        }
+    }
+
+    // a prewarmed connection to backend index,nullptr if none is ready.
+    boost::shared_ptr<tcp::socket> TakeUpstream(int index)
+    {
+        if (upstreams.empty())
+            return nullptr;
+        return upstreams[index]->Take();
+    }
+
+    // the trunks of a mapping with --trunk-upstream,nullptr without.
+    const boost::shared_ptr<TrunkPool> &GetTrunks() const { return trunks; }
+
+protected:
+    io_service &ios;
+    tcp::acceptor acceptor;
+    std::shared_ptr<network::Mapping> mapping;
+    int prewarm;
+    int prewarmIdle;
+    std::vector<boost::shared_ptr<UpstreamPool>> upstreams;
+    boost::shared_ptr<TrunkPool> trunks;
+
+    // set the client options of the mapping on the acceptor,return false if one could not be set.
+    bool SetOptions()
+    {
+        const network::SocketOptions &options = mapping->options.client;
+        return options.Empty() || network::SetSocketOptions(acceptor.native_handle(), options, network::SocketOptions::Listener);
+    }
+
+    void StopUpstreams()
+    {
+        for (boost::shared_ptr<UpstreamPool> &upstream : upstreams)
+            upstream->Stop();
+        upstreams.clear();
+    }
+
+    // defined with TrunkPool,StartTrunks hands the pool of the old mapping to the new one.
+    void StartTrunks();
+    void StopTrunks();
+};
+
+// tunnels run on the executor of their io_service itself,not the type erased any_io_executor,
+// so resuming a direction dispatches without indirection or work counting.
+using Executor = io_service::executor_type;
+using Socket = tcp::socket::rebind_executor<Executor>::other;
+template <typename T>
+using Task = awaitable<T, Executor>;
+constexpr use_awaitable_t<Executor> useTask;
+
+#ifdef FORWARD_ZSTD
+// the end of a compressed side a direction reads from or writes to,and the block it hands out.
+struct Codec
+{
+    std::unique_ptr<network::Compressor> compressor;
+    std::unique_ptr<network::Decompressor> decompressor;
+    std::vector<char> out;
+};
+
+// reads smaller than this are coded on the io_service,handing them to a worker would cost more than it saves.
+constexpr size_t offloadSize = 4096;
+
+// run work on a worker and resume the awaiting direction on its io_service after it,
+// so coding a large read does not hold up the other tunnels of the io_service.
+// size is how many bytes work codes,small ones and all without workers run at once.
+template <typename Work>
+Task<void> Offload(size_t size, Work work)
+{
+    if (pWorkers == nullptr || size < offloadSize)
+    {
+        work();
+        co_return;
+    }
+    co_await async_initiate<decltype(useTask), void()>(
+        [](auto handler, Work work) -> void
+        {
+            executor_work_guard<Executor> guard(get_associated_executor(handler));
+            post(*pWorkers, [handler = std::move(handler), work = std::move(work), guard = std::move(guard)]() mutable -> void
+                 {
+                     work();
+                     Executor executor = guard.get_executor();
+                     post(executor, std::move(handler));
+                 });
+        },
+        useTask, std::move(work));
+}
+#else
+// without zstd no side is compressed.
+struct Codec
+{
+};
+#endif
+
+// take over from,a socket connected by a Connector,into to.
+bool Adopt(Socket &to, tcp::socket &from)
+{
+    boost::system::error_code ec;
+    tcp::endpoint local = from.local_endpoint(ec);
+    if (!ec)
+        to.assign(local.protocol(), from.release(ec), ec);
+    if (ec)
+    {
+        HandleError(ec);
+        return false;
+    }
+    return true;
+}
+
+// write all of data to dst,what it takes at once straight away,then wait for the rest.
+Task<void> WriteAll(Socket &dst, const char *data, size_t length, boost::system::error_code &ec)
+{
+    size_t written = dst.write_some(buffer(data, length), ec);
+    if (ec == error::would_block)
+        ec.clear();
+    if (!ec && written < length)
+        co_await async_write(dst, buffer(data + written, length - written), redirect_error(useTask, ec));
+}
+
+// one tunnel: both sockets,the relay buffers of both directions and the state they share,in one allocation.
+// each direction is a coroutine holding the session once,so a forwarded chunk copies no shared pointer.
+// keeps its client counted by admission control,and its connection counted as active on its backend while it lives,
+// holds the bandwidth limits both directions draw from,
+// counts the tunnel as closed when it is freed,and closes it once idle for too long.
+// the idle timer holds it weakly,so a session whose directions both ended is freed at once.
+class Session : public boost::enable_shared_from_this<Session>
+{
+public:
+    // the mapping is held,a reload may replace it while the tunnel is open.
+    Session(Socket client, std::shared_ptr<network::Mapping> mapping, int index, uint32_t source, network::Metrics *metrics)
+        : client(std::move(client)), target(this->client.get_executor()), clientBuffer(*pPool), targetBuffer(*pPool),
+          clientCodec(), targetCodec(), mapping(std::move(mapping)), index(index), source(source), metrics(metrics), flow(), lastActive(), tuneAt(),
+          idleTimer(network::TimingWheel::InvalidTimer)
+    {
+        this->mapping->balancer.Acquire(index);
+        if (pShaper != nullptr)
+            flow.reset(new network::Flow(*pShaper, source));
+    }
+    ~Session()
+    {
+        if (pReaper != nullptr)
+            pReaper->Cancel(idleTimer);
+        if (pAdmission != nullptr)
+            pAdmission->Release(source);
+        mapping->balancer.Release(index);
+        if (metrics != nullptr)
+            metrics->Add(network::Metrics::Closes);
+    }
+
+    // the session starts relaying between its client and target,which is taken over from its connector.
+    void Start(tcp::socket &target)
+    {
+        if (!Adopt(this->target, target))
+            return;
+        client.non_blocking(true);
+        this->target.non_blocking(true);
+        const network::MappingOptions &options = mapping->options;
+        // the target got its options before it connected.
+        if (!options.client.Empty())
+            network::SetSocketOptions(client.native_handle(), options.client, network::SocketOptions::Accepted);
+        if (keepAlive > 0 && options.client.keepalive == 0)
+            EnableKeepAlive(client, keepAlive);
+        if (keepAlive > 0 && options.upstream.keepalive == 0)
+            EnableKeepAlive(this->target, keepAlive);
+#ifdef FORWARD_ZSTD
+        if (options.Compressed() && !NewCodecs(options.compressupstream))
+        {
+            LOG_WARN("zstd out of memory");
+            return;
+        }
+#endif
+        Touch();
+        if (pReaper != nullptr)
+            StartIdleTimer(pReaper->GetIdle());
+        boost::shared_ptr<Session> self = shared_from_this();
+        co_spawn(client.get_executor(), Forward(self, client, this->target, clientBuffer, clientCodec.get(), network::Metrics::BytesIn), detached);
+        co_spawn(client.get_executor(), Forward(self, this->target, client, targetBuffer, targetCodec.get(), network::Metrics::BytesOut), detached);
+    }
+
+    // close both sockets,the pending operations of both directions end with operation_aborted.
+    void Close()
+    {
+        boost::system::error_code ec;
+        client.close(ec);
+        target.close(ec);
+    }
+
+    // close both sockets with a RST,so neither peer takes what it got for the whole stream.
+    void Reset()
+    {
+        boost::system::error_code ec;
+        client.set_option(socket_base::linger(true, 0), ec);
+        target.set_option(socket_base::linger(true, 0), ec);
+        Close();
+    }
+
+protected:
+    Socket client;
+    Socket target;
+    Buffer clientBuffer;
+    Buffer targetBuffer;
+    // what is read from client and from target goes through these when a side is compressed,nullptr if not.
+    std::unique_ptr<Codec> clientCodec;
+    std::unique_ptr<Codec> targetCodec;
+    std::shared_ptr<network::Mapping> mapping;
+    int index;
+    uint32_t source;
+    network::Metrics *metrics;
+    std::unique_ptr<network::Flow> flow;
+    std::chrono::steady_clock::time_point lastActive;
+    // when the buffers may be tuned next.
+    std::chrono::steady_clock::time_point tuneAt;
+    network::TimingWheel::TimerId idleTimer;
+
+    // bytes moved.
+    void Touch()
+    {
+        lastActive = std::chrono::steady_clock::now();
+        if (lastActive >= tuneAt)
+            Tune();
+    }
+
+    // grow the buffers of both sockets with network::TuneBuffer up to the autotune limit of their side,
+    // at most once a second.
+    void Tune()
+    {
+        tuneAt = lastActive + std::chrono::seconds(1);
+        const network::MappingOptions &options = mapping->options;
+        if (options.client.autotune > 0)
+        {
+            network::TuneBuffer(client.native_handle(), false, options.client.autotune);
+            network::TuneBuffer(client.native_handle(), true, options.client.autotune);
+        }
+        if (options.upstream.autotune > 0)
+        {
+            network::TuneBuffer(target.native_handle(), false, options.upstream.autotune);
+            network::TuneBuffer(target.native_handle(), true, options.upstream.autotune);
+        }
+    }
+
+    Task<void> Forward(boost::shared_ptr<Session> self, Socket &src, Socket &dst, Buffer &relayBuffer, Codec *codec,
+                       network::Metrics::Counter direction);
+
+#ifdef FORWARD_ZSTD
+    // what is read from the side that is not compressed is compressed,what is read from the other one decompressed.
+    bool NewCodecs(bool upstream)
+    {
+        clientCodec.reset(new Codec());
+        targetCodec.reset(new Codec());
+        Codec &compressing = upstream ? *clientCodec : *targetCodec;
+        Codec &decompressing = upstream ? *targetCodec : *clientCodec;
+        compressing.compressor = network::Compressor::New(compressLevel);
+        decompressing.decompressor = network::Decompressor::New();
+        return compressing.compressor && decompressing.decompressor;
+    }
+
+    // pass length bytes of data through codec to dst,the coding runs on a worker.
+    // a decompressing codec writes every block that is complete,a block it can not decode is a bad_message.
+    Task<void> Transcode(Codec &codec, Socket &dst, const char *data, size_t length, boost::system::error_code &ec)
+    {
+        if (codec.compressor)
+        {
+            bool encoded = false;
+            co_await Offload(length, [&codec, data, length, &encoded]() -> void
+                             { encoded = codec.compressor->Encode(data, length, codec.out); });
+            if (!encoded)
+                ec = boost::system::errc::make_error_code(boost::system::errc::not_enough_memory);
+            else
+                co_await WriteAll(dst, codec.out.data(), codec.out.size(), ec);
+            co_return;
+        }
+        codec.decompressor->Feed(data, length);
+        while (!ec)
+        {
+            int decoded = 0;
+            co_await Offload(codec.decompressor->Buffered(), [&codec, &decoded]() -> void
+                             { decoded = codec.decompressor->Decode(codec.out); });
+            if (decoded == 0)
+                break;
+            if (decoded < 0)
+                ec = boost::system::errc::make_error_code(boost::system::errc::bad_message);
+            else
+                co_await WriteAll(dst, codec.out.data(), codec.out.size(), ec);
+        }
+    }
+#endif
+
+    void StartIdleTimer(int ms)
+    {
+        boost::weak_ptr<Session> weak = shared_from_this();
+        idleTimer = pReaper->Add(ms, [weak]() -> void
+                                 {
+                                     boost::shared_ptr<Session> session = weak.lock();
+                                     if (session)
+                                         session->CheckIdle();
+                                 });
+    }
+
+    void CheckIdle()
+    {
+        idleTimer = network::TimingWheel::InvalidTimer;
+        int idle = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lastActive).count();
+        if (idle >= pReaper->GetIdle())
+        {
+            LOG_DEBUG("idle tunnel closed idle=%dms", idle);
+            Close();
+            return;
+        }
+        StartIdleTimer(pReaper->GetIdle() - idle);
+    }
+};
+
+// wait until src is readable without holding a buffer,so idle tunnels cost no buffer memory,
+// then read and write until src has no more before waiting again.
+// writes go straight to the non-blocking dst,only what it can not take at once is waited for,
+// and src is not read again until then,so a slow destination throttles its source.
+// the end of src is passed on as a shutdown of the write side of dst,the direction then
+// ends on its own,and the session is freed once both ended. an error closes both sockets.
+// with shaping a direction reads no more than its flow allows,and is parked on a timer
+// while the flow has nothing left.with a codec what is read is compressed or decompressed before it is written.
+// self keeps the session alive while the direction runs,direction is the counter of the bytes read from src.
+Task<void> Session::Forward(boost::shared_ptr<Session> self, Socket &src, Socket &dst, Buffer &relayBuffer, Codec *codec,
+                            network::Metrics::Counter direction)
+{
+    boost::system::error_code ec;
+    for (;;)
+    {
+        relayBuffer.Release();
+        co_await src.async_wait(tcp::socket::wait_read, redirect_error(useTask, ec));
+        if (ec)
+        {
+            HandleError(ec);
+            Close();
+            co_return;
+        }
+        for (;;)
+        {
+            size_t size = relayBuffer.GetSize();
+            int64_t now = 0;
+            if (flow)
+            {
+                now = network::Shaper::Now();
+                int64_t available = flow->Available(now);
+                if (available == 0)
+                {
+                    if (pMetrics != nullptr)
+                        pMetrics->Add(network::Metrics::Throttles);
+                    relayBuffer.Release();
+                    steady_timer timer(src.get_executor());
+                    timer.expires_after(std::chrono::milliseconds(flow->Wait(now)));
+                    co_await timer.async_wait(redirect_error(useTask, ec));
+                    // closed while parked.
+                    if (ec || !src.is_open())
+                        co_return;
+                    continue;
+                }
+                if (available < (int64_t)size)
+                    size = (size_t)available;
+            }
+            char *data = relayBuffer.Get();
+            if (data == nullptr)
+            {
+                Close();
+                co_return;
+            }
+            size_t length = src.read_some(buffer(data, size), ec);
+            if (ec == error::would_block)
+                break;
+#ifdef FORWARD_ZSTD
+            // a compressed peer that ends inside a block was cut off,a FIN would pass the stream on as complete.
+            if (ec == error::eof && codec != nullptr && codec->decompressor && codec->decompressor->Buffered() > 0)
+            {
+                LOG_WARN("compressed stream ended inside a block buffered=%zu", codec->decompressor->Buffered());
+                Reset();
+                co_return;
+            }
+#endif
+            if (ec == error::eof)
+            {
+                HandleError(ec);
+                relayBuffer.Release();
+                dst.shutdown(tcp::socket::shutdown_send, ec);
+                if (ec)
+                    Close();
+                co_return;
+            }
+            if (ec)
+            {
+                HandleError(ec);
+                Close();
+                co_return;
+            }
+            relayBuffer.Adapt(length);
+            Touch();
+            if (flow)
+                flow->Take(length, now);
+            if (pMetrics != nullptr)
+                pMetrics->Add(direction, length);
+#ifdef FORWARD_ZSTD
+            if (codec != nullptr)
+                co_await Transcode(*codec, dst, data, length, ec);
+            else
+#endif
+            {
+                size_t written = dst.write_some(buffer(data, length), ec);
+                if (ec == error::would_block)
+                    ec.clear();
+                // async_write completes only after every byte is written.
+                if (!ec && written < length)
+                    co_await async_write(dst, buffer(data + written, length - written), redirect_error(useTask, ec));
+            }
+            if (ec)
+            {
+                HandleError(ec);
+                Close();
+                co_return;
+            }
+            // a short read drained src,a read now would only block.
+            if (length < size)
+                break;
+        }
+    }
+}
+
+// an ipv4 client keeps its hash when it comes over a dual-stack acceptor.
+uint32_t ClientHash(uint32_t source)
+{
+    return network::Balancer::HashBytes(&source, sizeof(source));
+}
+
+class Trunk;
+
+// one client tunnel carried by a trunk,with the socket of its client on the forwarder that opened it
+// and the socket of its backend on the other one.
+// upload reads the socket into Data frames while the peer granted room for them,download writes the Data
+// of the peer to the socket and grants the room back with Window,so a stream holds at most one window
+// of bytes in flight and a slow socket only stops its own stream.
+// keeps its client counted by admission control on the opening side,and its backend counted as active.
+// the table of its trunk holds it until both directions ended or it was reset.
+class TrunkStream : public boost::enable_shared_from_this<TrunkStream>
+{
+public:
+    TrunkStream(boost::shared_ptr<Trunk> trunk, std::shared_ptr<network::Mapping> mapping, uint32_t id, Socket socket,
+                int index, uint32_t source, bool opener)
+        : trunk(std::move(trunk)), mapping(std::move(mapping)), id(id), socket(std::move(socket)), readBuffer(*pPool),
+          index(index), source(source), opener(opener), metrics(pMetrics), sendWindow(network::TrunkFrame::InitialWindow),
+          receiveWindow(network::TrunkFrame::InitialWindow), written(0), inbound(), finReceived(false), uploadDone(false),
+          downloadDone(false), closed(false), uploadWake(this->socket.get_executor()), downloadWake(this->socket.get_executor())
+    {
+        this->mapping->balancer.Acquire(index);
+    }
+    ~TrunkStream()
+    {
+        if (opener && pAdmission != nullptr)
+            pAdmission->Release(source);
+        mapping->balancer.Release(index);
+        if (metrics != nullptr)
+            metrics->Add(network::Metrics::Closes);
+    }
+
+    // start both directions,the socket is connected.
+    void Start();
+    // the stream takes over target,the backend connected for it,and starts.
+    void Start(tcp::socket &target);
+    // size bytes of Data from the peer,return false if it sent more than it was granted.
+    bool Receive(const char *data, size_t size);
+    // the peer granted length more bytes.
+    void Grant(uint32_t length);
+    // the peer sent Fin.
+    void Finish();
+    // close the socket and end both directions,tell the peer with Reset if reset.
+    void Close(bool reset);
+
+protected:
+    boost::shared_ptr<Trunk> trunk;
+    std::shared_ptr<network::Mapping> mapping;
+    uint32_t id;
+    Socket socket;
+    Buffer readBuffer;
+    int index;
+    uint32_t source;
+    bool opener;
+    network::Metrics *metrics;
+    // bytes that may still be sent,and that the peer may still send.
+    uint32_t sendWindow;
+    uint32_t receiveWindow;
+    // bytes written to the socket and not granted back yet.
+    uint32_t written;
+    // Data of the peer not written to the socket yet.
+    std::deque<std::vector<char>> inbound;
+    bool finReceived;
+    bool uploadDone;
+    bool downloadDone;
+    bool closed;
+    // cancelled to wake a direction waiting for room or for Data.
+    steady_timer uploadWake;
+    steady_timer downloadWake;
+
+    Task<void> Upload(boost::shared_ptr<TrunkStream> self);
+    Task<void> Download(boost::shared_ptr<TrunkStream> self);
+    // a direction ended,the stream closes once both did.
+    void Ended();
+};
+
+// a tcp connection to or from another forwarder carrying many streams.
+// the forwarder near the clients connects trunks and opens streams on them,the one near the backends
+// accepts trunks and connects a backend for every stream opened.
+// one coroutine reads frames and hands them to their streams,another one writes the frames
+// the streams queue,several of them with one gathered write.
+// a trunk that fails closes all its streams.
+class Trunk : public boost::enable_shared_from_this<Trunk>
+{
+public:
+    using OnClose = std::function<void()>;
+
+    // index is the backend of the trunk on the opening side,source the key of the peer in admission control on the other.
+    Trunk(Socket socket, std::shared_ptr<network::Mapping> mapping, int index, uint32_t source, bool opener)
+        : socket(std::move(socket)), mapping(std::move(mapping)), index(index), source(source), opener(opener),
+          streams(), nextId(0), outbound(), writeWake(this->socket.get_executor()), closed(false), draining(false), onClose(),
+          tuneAt() {}
+    ~Trunk()
+    {
+        if (!opener && pAdmission != nullptr)
+            pAdmission->Release(source);
+    }
+
+    // start reading and writing,onClose runs once the trunk failed or was closed.
+    void Start(OnClose onClose);
+    // carry client as a new stream,its Data may follow the Open at once.
+    void Open(Socket client, uint32_t source);
+    size_t Streams() const { return streams.size(); }
+    bool Closed() const { return closed; }
+    // take no new streams and close once the open ones ended.
+    void Drain();
+    void Close();
+
+    // queue a frame,header and payload,to be written after those queued before it.
+    void Send(std::vector<char> frame);
+    void Send(const network::TrunkFrame &frame);
+    // the stream id ended.
+    void Remove(uint32_t id);
+
+protected:
+    // frames that may be queued for one write.
+    static constexpr size_t writeBatch = 64;
+    // bytes read at once,room for the largest frame.
+    static constexpr size_t readSize = 256 << 10;
+
+    Socket socket;
+    std::shared_ptr<network::Mapping> mapping;
+    int index;
+    uint32_t source;
+    bool opener;
+    std::unordered_map<uint32_t, boost::shared_ptr<TrunkStream>> streams;
+    uint32_t nextId;
+    std::deque<std::vector<char>> outbound;
+    steady_timer writeWake;
+    bool closed;
+    bool draining;
+    OnClose onClose;
+    std::chrono::steady_clock::time_point tuneAt;
+
+    Task<void> Read(boost::shared_ptr<Trunk> self);
+    Task<void> Write(boost::shared_ptr<Trunk> self);
+    // handle a frame of the peer,return false if it broke the protocol.
+    bool Dispatch(const network::TrunkFrame &frame, const char *payload);
+    // the peer opened stream id for a client with source,connect a backend for it.
+    bool Accept(uint32_t id, uint32_t source);
+    // the socket options of the side the trunk is on.
+    const network::SocketOptions &Options() const { return opener ? mapping->options.upstream : mapping->options.client; }
+};
+
+void TrunkStream::Start()
+{
+    socket.non_blocking(true);
+    boost::shared_ptr<TrunkStream> self = shared_from_this();
+    co_spawn(socket.get_executor(), Upload(self), detached);
+    co_spawn(socket.get_executor(), Download(self), detached);
+}
+
+void TrunkStream::Start(tcp::socket &target)
+{
+    if (closed)
+        return;
+    if (!Adopt(socket, target))
+    {
+        Close(true);
+        return;
+    }
+    if (keepAlive > 0 && mapping->options.upstream.keepalive == 0)
+        EnableKeepAlive(socket, keepAlive);
+    Start();
+}
+
+bool TrunkStream::Receive(const char *data, size_t size)
+{
+    if (size > receiveWindow || finReceived)
+        return false;
+    receiveWindow -= size;
+    if (metrics != nullptr)
+        metrics->Add(opener ? network::Metrics::BytesOut : network::Metrics::BytesIn, size);
+    inbound.emplace_back(data, data + size);
+    downloadWake.cancel();
+    return true;
+}
+
+void TrunkStream::Grant(uint32_t length)
+{
+    sendWindow += length;
+    uploadWake.cancel();
 }
 
-void BeginAccept(io_service &ios,
-                 tcp::acceptor &acceptor,
-                 int dstPort,
-                 const std::string &dstAddr)
+void TrunkStream::Finish()
 {
-    boost::shared_ptr<tcp::socket> pSocket = boost::make_shared<tcp::socket>(ios);
-    acceptor.async_accept(*pSocket,
-                          [pSocket,
-                           &acceptor,
-                           &ios,
-                           dstPort,
-                           &dstAddr](const boost::system::error_code &ec) -> void
+    finReceived = true;
+    downloadWake.cancel();
+}
+
+void TrunkStream::Close(bool reset)
+{
+    if (closed)
+        return;
+    closed = true;
+    if (reset)
+        trunk->Send(network::TrunkFrame(network::TrunkFrame::Reset, id, 0));
+    boost::system::error_code ec;
+    socket.close(ec);
+    inbound.clear();
+    uploadWake.cancel();
+    downloadWake.cancel();
+    trunk->Remove(id);
+}
+
+void TrunkStream::Ended()
+{
+    if (uploadDone && downloadDone)
+        Close(false);
+}
+
+Task<void> TrunkStream::Upload(boost::shared_ptr<TrunkStream> self)
+{
+    boost::system::error_code ec;
+    for (;;)
+    {
+        readBuffer.Release();
+        while (sendWindow == 0 && !closed)
+        {
+            uploadWake.expires_at(std::chrono::steady_clock::time_point::max());
+            co_await uploadWake.async_wait(redirect_error(useTask, ec));
+        }
+        if (!closed)
+            co_await socket.async_wait(tcp::socket::wait_read, redirect_error(useTask, ec));
+        if (closed)
+            co_return;
+        if (ec)
+        {
+            HandleError(ec);
+            Close(true);
+            co_return;
+        }
+        while (sendWindow > 0)
+        {
+            size_t size = std::min<size_t>({readBuffer.GetSize(), sendWindow, network::TrunkFrame::MaxData});
+            char *data = readBuffer.Get();
+            if (data == nullptr)
+            {
+                Close(true);
+                co_return;
+            }
+            size_t length = socket.read_some(buffer(data, size), ec);
+            if (ec == error::would_block)
+                break;
+            if (ec == error::eof)
+            {
+                trunk->Send(network::TrunkFrame(network::TrunkFrame::Fin, id, 0));
+                uploadDone = true;
+                Ended();
+                co_return;
+            }
+            if (ec)
+            {
+                HandleError(ec);
+                Close(true);
+                co_return;
+            }
+            readBuffer.Adapt(length);
+            sendWindow -= length;
+            if (metrics != nullptr)
+                metrics->Add(opener ? network::Metrics::BytesIn : network::Metrics::BytesOut, length);
+            // the frame is sized to what was read,so queued frames of interactive streams stay small.
+            std::vector<char> frame(network::TrunkFrame::HeaderSize + length);
+            network::TrunkFrame(network::TrunkFrame::Data, id, length).Encode(frame.data());
+            memcpy(frame.data() + network::TrunkFrame::HeaderSize, data, length);
+            trunk->Send(std::move(frame));
+            if (length < size)
+                break;
+        }
+    }
+}
+
+Task<void> TrunkStream::Download(boost::shared_ptr<TrunkStream> self)
+{
+    boost::system::error_code ec;
+    while (!closed)
+    {
+        if (inbound.empty())
+        {
+            if (finReceived)
+            {
+                socket.shutdown(tcp::socket::shutdown_send, ec);
+                downloadDone = true;
+                Ended();
+                co_return;
+            }
+            downloadWake.expires_at(std::chrono::steady_clock::time_point::max());
+            co_await downloadWake.async_wait(redirect_error(useTask, ec));
+            continue;
+        }
+        std::vector<char> data = std::move(inbound.front());
+        inbound.pop_front();
+        co_await WriteAll(socket, data.data(), data.size(), ec);
+        if (closed)
+            co_return;
+        if (ec)
+        {
+            HandleError(ec);
+            Close(true);
+            co_return;
+        }
+        // room is granted back in quarters of the window,not for every write.
+        written += data.size();
+        if (written >= network::TrunkFrame::InitialWindow / 4)
+        {
+            trunk->Send(network::TrunkFrame(network::TrunkFrame::Window, id, written));
+            receiveWindow += written;
+            written = 0;
+        }
+    }
+}
+
+void Trunk::Start(OnClose onClose)
+{
+    this->onClose = std::move(onClose);
+    boost::system::error_code ec;
+    // frames are batched by the writer,small ones must not wait for the ack of the last write.
+    socket.set_option(tcp::no_delay(true), ec);
+    socket.non_blocking(true, ec);
+    const network::SocketOptions &options = Options();
+    if (!opener && !options.Empty())
+        network::SetSocketOptions(socket.native_handle(), options, network::SocketOptions::Accepted);
+    if (keepAlive > 0 && options.keepalive == 0)
+        EnableKeepAlive(socket, keepAlive);
+    boost::shared_ptr<Trunk> self = shared_from_this();
+    co_spawn(socket.get_executor(), Read(self), detached);
+    co_spawn(socket.get_executor(), Write(self), detached);
+}
+
+void Trunk::Open(Socket client, uint32_t source)
+{
+    uint32_t id;
+    do
+        id = ++nextId;
+    while (id == 0 || streams.count(id) != 0);
+    boost::shared_ptr<TrunkStream> stream = boost::make_shared<TrunkStream>(shared_from_this(), mapping, id, std::move(client), index, source, true);
+    streams[id] = stream;
+    std::vector<char> frame(network::TrunkFrame::HeaderSize + 4);
+    network::TrunkFrame(network::TrunkFrame::Open, id, 4).Encode(frame.data());
+    for (int i = 0; i < 4; i++)
+        frame[network::TrunkFrame::HeaderSize + i] = (char)(source >> (24 - 8 * i));
+    Send(std::move(frame));
+    stream->Start();
+}
+
+void Trunk::Drain()
+{
+    draining = true;
+    if (streams.empty())
+        Close();
+}
+
+void Trunk::Close()
+{
+    if (closed)
+        return;
+    closed = true;
+    boost::system::error_code ec;
+    socket.close(ec);
+    outbound.clear();
+    writeWake.cancel();
+    std::unordered_map<uint32_t, boost::shared_ptr<TrunkStream>> open;
+    open.swap(streams);
+    for (std::pair<const uint32_t, boost::shared_ptr<TrunkStream>> &stream : open)
+        stream.second->Close(false);
+    if (onClose)
+        onClose();
+}
+
+void Trunk::Send(std::vector<char> frame)
+{
+    if (closed)
+        return;
+    outbound.push_back(std::move(frame));
+    writeWake.cancel();
+}
+
+void Trunk::Send(const network::TrunkFrame &frame)
+{
+    std::vector<char> header(network::TrunkFrame::HeaderSize);
+    frame.Encode(header.data());
+    Send(std::move(header));
+}
+
+void Trunk::Remove(uint32_t id)
+{
+    streams.erase(id);
+    if (draining && streams.empty())
+        Close();
+}
+
+bool Trunk::Accept(uint32_t id, uint32_t source)
+{
+    if (opener || streams.count(id) != 0)
+        return false;
+    network::Balancer &balancer = mapping->balancer;
+    int index = balancer.Select(balancer.GetStrategy() == network::Balancer::Hash ? ClientHash(source) : 0);
+    boost::shared_ptr<TrunkStream> stream = boost::make_shared<TrunkStream>(shared_from_this(), mapping, id, Socket(socket.get_executor()),
+                                                                          index, source, false);
+    streams[id] = stream;
+    if (pMetrics != nullptr)
+        pMetrics->Add(network::Metrics::Accepts);
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    // Data of the client waits in the stream until the backend is connected.
+    ConnectBackend(socket.get_executor().context(), balancer.Get(index).addr, balancer.Get(index).port, mapping->options.upstream,
+                   [stream, begin](const boost::system::error_code &ec, boost::shared_ptr<tcp::socket> target) -> void
+                   {
+                       if (ec)
+                       {
+                           HandleError(ec);
+                           if (pMetrics != nullptr)
+                               pMetrics->Add(network::Metrics::ConnectFailures);
+                           stream->Close(true);
+                           return;
+                       }
+                       if (pMetrics != nullptr)
+                           pMetrics->Connected(begin);
+                       stream->Start(*target);
+                   });
+    return true;
+}
+
+bool Trunk::Dispatch(const network::TrunkFrame &frame, const char *payload)
+{
+    if (frame.type == network::TrunkFrame::Open)
+    {
+        const unsigned char *bytes = (const unsigned char *)payload;
+        return Accept(frame.stream, (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3]);
+    }
+    std::unordered_map<uint32_t, boost::shared_ptr<TrunkStream>>::iterator it = streams.find(frame.stream);
+    // frames in flight for a stream closed here are dropped.
+    if (it == streams.end())
+        return true;
+    boost::shared_ptr<TrunkStream> stream = it->second;
+    switch (frame.type)
+    {
+    case network::TrunkFrame::Data:
+        return stream->Receive(payload, frame.length);
+    case network::TrunkFrame::Window:
+        stream->Grant(frame.length);
+        return true;
+    case network::TrunkFrame::Fin:
+        stream->Finish();
+        return true;
+    default:
+        stream->Close(false);
+        return true;
+    }
+}
+
+Task<void> Trunk::Read(boost::shared_ptr<Trunk> self)
+{
+    boost::system::error_code ec;
+    std::vector<char> input(readSize);
+    size_t length = 0;
+    for (;;)
+    {
+        size_t size = co_await socket.async_read_some(buffer(input.data() + length, input.size() - length), redirect_error(useTask, ec));
+        if (closed)
+            co_return;
+        if (ec)
+        {
+            HandleError(ec);
+            Close();
+            co_return;
+        }
+        length += size;
+        size_t used = 0;
+        network::TrunkFrame frame;
+        while (length - used >= network::TrunkFrame::HeaderSize)
+        {
+            if (!frame.Decode(input.data() + used))
+            {
+                LOG_WARN("trunk protocol error frame=%d", (int)(unsigned char)input[used]);
+                Close();
+                co_return;
+            }
+            size_t payload = frame.type == network::TrunkFrame::Open || frame.type == network::TrunkFrame::Data ? frame.length : 0;
+            if (length - used < network::TrunkFrame::HeaderSize + payload)
+                break;
+            if (!Dispatch(frame, input.data() + used + network::TrunkFrame::HeaderSize))
+            {
+                LOG_WARN("trunk protocol error frame=%d stream=%u", (int)frame.type, frame.stream);
+                Close();
+                co_return;
+            }
+            used += network::TrunkFrame::HeaderSize + payload;
+        }
+        memmove(input.data(), input.data() + used, length - used);
+        length -= used;
+        // trunks are the long fat connections autotune is for.
+        const network::SocketOptions &options = Options();
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (options.autotune > 0 && now >= tuneAt)
+        {
+            tuneAt = now + std::chrono::seconds(1);
+            network::TuneBuffer(socket.native_handle(), false, options.autotune);
+            network::TuneBuffer(socket.native_handle(), true, options.autotune);
+        }
+    }
+}
+
+Task<void> Trunk::Write(boost::shared_ptr<Trunk> self)
+{
+    boost::system::error_code ec;
+    std::vector<const_buffer> buffers;
+    while (!closed)
+    {
+        if (outbound.empty())
+        {
+            writeWake.expires_at(std::chrono::steady_clock::time_point::max());
+            co_await writeWake.async_wait(redirect_error(useTask, ec));
+            continue;
+        }
+        // frames queued later are appended to the deque,which leaves these where they are.
+        size_t count = std::min(outbound.size(), writeBatch);
+        buffers.clear();
+        for (size_t i = 0; i < count; i++)
+            buffers.push_back(buffer(outbound[i]));
+        co_await async_write(socket, buffers, redirect_error(useTask, ec));
+        if (closed)
+            co_return;
+        if (ec)
+        {
+            HandleError(ec);
+            Close();
+            co_return;
+        }
+        outbound.erase(outbound.begin(), outbound.begin() + count);
+    }
+}
+
+// the trunks of a mapping with --trunk-upstream on one io_service,spread over its backends.
+// a trunk that fails is connected again after a second,its streams are lost.
+// a client that finds no trunk connected waits for one up to holdTime,then it is dropped like one whose connect failed.
+// after a reload the pool of the old mapping keeps taking clients until a trunk of the new one is connected.
+class TrunkPool : public boost::enable_shared_from_this<TrunkPool>
+{
+public:
+    TrunkPool(io_service &ios, std::shared_ptr<network::Mapping> mapping, boost::shared_ptr<TrunkPool> previous)
+        : ios(ios), mapping(std::move(mapping)), trunks(this->mapping->options.trunkupstream), previous(std::move(previous)),
+          waiting(), holdTimer(ios), holding(false), stopped(false) {}
+
+    void Start()
+    {
+        // clients the old pool was holding wait here now.
+        if (previous)
+        {
+            std::move(previous->waiting.begin(), previous->waiting.end(), std::back_inserter(waiting));
+            previous->waiting.clear();
+            Hold();
+        }
+        for (size_t slot = 0; slot < trunks.size(); slot++)
+            Connect(slot);
+    }
+
+    // stop connecting and drop the clients waiting,the trunks close once their streams ended.
+    void Stop()
+    {
+        stopped = true;
+        for (boost::shared_ptr<Trunk> &trunk : trunks)
+        {
+            if (trunk)
+                trunk->Drain();
+        }
+        trunks.clear();
+        for (Waiting &client : waiting)
+            Drop(client);
+        waiting.clear();
+        boost::system::error_code ec;
+        holdTimer.cancel(ec);
+        if (previous)
+            previous->Stop();
+        previous.reset();
+    }
+
+    // carry client as a stream of the connected trunk with the fewest streams,or hold it until one is connected.
+    void Open(Socket client, uint32_t source)
+    {
+        boost::shared_ptr<Trunk> trunk = Pick();
+        if (trunk)
+        {
+            trunk->Open(std::move(client), source);
+            return;
+        }
+        waiting.push_back(Waiting{std::move(client), source, std::chrono::steady_clock::now() + std::chrono::milliseconds(holdTime)});
+        Hold();
+    }
+
+protected:
+    // milliseconds a client waits for a trunk.
+    static constexpr int holdTime = 5000;
+
+    struct Waiting
+    {
+        Socket client;
+        uint32_t source;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    io_service &ios;
+    std::shared_ptr<network::Mapping> mapping;
+    // nullptr while connecting.
+    std::vector<boost::shared_ptr<Trunk>> trunks;
+    // the pool replaced by a reload,nullptr once a trunk of this one is connected.
+    boost::shared_ptr<TrunkPool> previous;
+    // clients waiting for a trunk,oldest first,what they send waits in their sockets.
+    std::deque<Waiting> waiting;
+    steady_timer holdTimer;
+    bool holding;
+    bool stopped;
+
+    // the connected trunk with the fewest streams,one of the previous pool if none is connected,nullptr if that has none either.
+    boost::shared_ptr<Trunk> Pick()
+    {
+        boost::shared_ptr<Trunk> best;
+        for (boost::shared_ptr<Trunk> &trunk : trunks)
+        {
+            if (trunk && !trunk->Closed() && (!best || trunk->Streams() < best->Streams()))
+                best = trunk;
+        }
+        if (!best && previous)
+            return previous->Pick();
+        return best;
+    }
+
+    // open the waiting clients on the trunks connected now.
+    void Flush()
+    {
+        while (!waiting.empty())
+        {
+            boost::shared_ptr<Trunk> trunk = Pick();
+            if (!trunk)
+                return;
+            trunk->Open(std::move(waiting.front().client), waiting.front().source);
+            waiting.pop_front();
+        }
+    }
+
+    // drop the clients that waited too long,then wait for the deadline of the oldest one left.
+    void Hold()
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        while (!waiting.empty() && waiting.front().deadline <= now)
+        {
+            LOG_WARN("no trunk connected,client dropped port=%d", mapping->localport);
+            Drop(waiting.front());
+            waiting.pop_front();
+        }
+        if (holding || waiting.empty())
+            return;
+        holding = true;
+        holdTimer.expires_at(waiting.front().deadline);
+        boost::shared_ptr<TrunkPool> self = shared_from_this();
+        holdTimer.async_wait([this, self](const boost::system::error_code &ec) -> void
+                             {
+                                 holding = false;
+                                 if (!ec && !stopped)
+                                     Hold();
+                             });
+    }
+
+    // reset the client,like one shed by admission control,and count it as a failed connect.
+    void Drop(Waiting &client)
+    {
+        boost::system::error_code ec;
+        client.client.set_option(socket_base::linger(true, 0), ec);
+        client.client.close(ec);
+        if (pAdmission != nullptr)
+            pAdmission->Release(client.source);
+        if (pMetrics != nullptr)
+        {
+            pMetrics->Add(network::Metrics::ConnectFailures);
+            pMetrics->Add(network::Metrics::Closes);
+        }
+    }
+
+    void Connect(size_t slot)
+    {
+        const network::Balancer &balancer = mapping->balancer;
+        int index = (int)(slot % balancer.Size());
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        boost::shared_ptr<TrunkPool> self = shared_from_this();
+        ConnectBackend(ios, balancer.Get(index).addr, balancer.Get(index).port, mapping->options.upstream,
+                       [this, self, slot, index, begin](const boost::system::error_code &ec, boost::shared_ptr<tcp::socket> socket) -> void
+                       {
+                           if (stopped)
+                               return;
+                           Socket trunkSocket(ios);
+                           if (ec || !Adopt(trunkSocket, *socket))
+                           {
+                               if (ec)
+                                   HandleError(ec);
+                               if (pMetrics != nullptr)
+                                   pMetrics->Add(network::Metrics::ConnectFailures);
+                               Retry(slot);
+                               return;
+                           }
+                           if (pMetrics != nullptr)
+                               pMetrics->Connected(begin);
+                           LOG_INFO("trunk connected port=%d backend=%s:%d", mapping->localport, mapping->balancer.Get(index).addr.c_str(),
+                                    mapping->balancer.Get(index).port);
+                           boost::shared_ptr<Trunk> trunk = boost::make_shared<Trunk>(std::move(trunkSocket), mapping, index, 0, true);
+                           trunks[slot] = trunk;
+                           boost::weak_ptr<TrunkPool> weak = self;
+                           trunk->Start([weak, slot]() -> void
+                                        {
+                                            boost::shared_ptr<TrunkPool> pool = weak.lock();
+                                            if (pool && !pool->stopped)
+                                            {
+                                                LOG_WARN("trunk lost port=%d", pool->mapping->localport);
+                                                pool->trunks[slot].reset();
+                                                pool->Retry(slot);
+                                            }
+                                        });
+                           // the old trunks take no new streams from now on.
+                           if (previous)
+                               previous->Stop();
+                           previous.reset();
+                           Flush();
+                       });
+    }
+
+    void Retry(size_t slot)
+    {
+        boost::shared_ptr<steady_timer> timer = boost::make_shared<steady_timer>(ios);
+        timer->expires_after(std::chrono::seconds(1));
+        boost::shared_ptr<TrunkPool> self = shared_from_this();
+        timer->async_wait([this, self, timer, slot](const boost::system::error_code &ec) -> void
                           {
-                              if (ec)
-                              {
-                                  HandleError(ec);
-                                  return;
-                              }
-                              BeginForward(ios, pSocket, dstPort, dstAddr);
-                              BeginAccept(ios, acceptor, dstPort, dstAddr);
+                              if (!ec && !stopped)
+                                  Connect(slot);
                           });
+    }
+};
+
+void Listener::StartTrunks()
+{
+    boost::shared_ptr<TrunkPool> previous = std::move(trunks);
+    trunks = boost::make_shared<TrunkPool>(ios, mapping, std::move(previous));
+    trunks->Start();
 }
 
-void Begin(int port, int dstPort, const std::string &dstAddr)
+void Listener::StopTrunks()
 {
+    if (trunks)
+        trunks->Stop();
+    trunks.reset();
+}
+
+// source is the key of the client in admission control,network::SourceKey of its address.
+void BeginForward(io_service &ios,
+                  Socket client,
+                  Listener &listener,
+                  uint32_t source)
+{
+    const std::shared_ptr<network::Mapping> &mapping = listener.GetMapping();
+    if (mapping->options.trunkupstream > 0)
+    {
+        listener.GetTrunks()->Open(std::move(client), source);
+        return;
+    }
+    network::Balancer &balancer = mapping->balancer;
+    int index = balancer.Select(balancer.GetStrategy() == network::Balancer::Hash ? ClientHash(source) : 0);
+    boost::shared_ptr<Session> pSession = boost::make_shared<Session>(std::move(client), mapping, index, source, pMetrics);
+    boost::shared_ptr<tcp::socket> target = listener.TakeUpstream(index);
+    if (target)
+    {
+        pSession->Start(*target);
+        return;
+    }
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    ConnectBackend(ios, balancer.Get(index).addr, balancer.Get(index).port, mapping->options.upstream,
+                   [pSession, begin](const boost::system::error_code &ec, boost::shared_ptr<tcp::socket> target) -> void
+                   {
+                       if (ec)
+                       {
+                           HandleError(ec);
+                           if (pMetrics != nullptr)
+                               pMetrics->Add(network::Metrics::ConnectFailures);
+                           return;
+                       }
+                       if (pMetrics != nullptr)
+                           pMetrics->Connected(begin);
+                       pSession->Start(*target);
+                   });
+}
+
+// admit an accepted client and start its tunnel,or reset it at once.
+void Admit(io_service &ios,
+           Socket client,
+           Listener &listener)
+{
+    boost::system::error_code ec;
+    uint32_t source = network::SourceKey(client.remote_endpoint(ec).data());
+    if (pAdmission != nullptr && !pAdmission->Admit(source))
+    {
+        // a RST instead of a FIN,so a shed client leaves no TIME_WAIT behind.
+        client.set_option(socket_base::linger(true, 0), ec);
+        client.close(ec);
+        if (pMetrics != nullptr)
+            pMetrics->Add(network::Metrics::Rejects);
+        return;
+    }
+    // a trunk is no tunnel,the streams opened on it are counted.
+    if (listener.GetMapping()->options.trunkclient)
+    {
+        boost::make_shared<Trunk>(std::move(client), listener.GetMapping(), -1, source, false)->Start(nullptr);
+        return;
+    }
+    if (pMetrics != nullptr)
+        pMetrics->Add(network::Metrics::Accepts);
+    BeginForward(ios, std::move(client), listener, source);
+}
+
+// milliseconds an acceptor waits after an accept failed.
+constexpr int acceptBackoff = 100;
+
+// the acceptor is non-blocking,so after a wakeup the clients already waiting are
+// accepted in one go instead of one per completion.
+// pListener is held by the coroutine,closing the acceptor ends it and frees the listener.
+Task<void> Accept(io_service &ios,
+                  boost::shared_ptr<Listener> pListener)
+{
+    tcp::acceptor &acceptor = pListener->GetAcceptor();
+    boost::system::error_code ec;
+    for (;;)
+    {
+        Socket client = co_await acceptor.async_accept(ios, redirect_error(useTask, ec));
+        if (ec == error::operation_aborted || !acceptor.is_open())
+            co_return;
+        if (ec)
+        {
+            // out of fds or memory,accepting again at once would fail again,the clients wait in the backlog.
+            HandleError(ec);
+            if (pMetrics != nullptr)
+                pMetrics->Add(network::Metrics::AcceptFailures);
+            steady_timer timer(ios);
+            timer.expires_after(std::chrono::milliseconds(acceptBackoff));
+            co_await timer.async_wait(redirect_error(useTask, ec));
+            if (!acceptor.is_open())
+                co_return;
+            continue;
+        }
+        Admit(ios, std::move(client), *pListener);
+        for (;;)
+        {
+            Socket next(ios);
+            acceptor.accept(next, ec);
+            if (ec)
+            {
+                if (ec != error::would_block)
+                {
+                    HandleError(ec);
+                    if (pMetrics != nullptr)
+                        pMetrics->Add(network::Metrics::AcceptFailures);
+                }
+                break;
+            }
+            Admit(ios, std::move(next), *pListener);
+        }
+    }
+}
+
+// the listeners of one io_service,one per mapping.
+// Update moves the io_service to a new list of mappings: the acceptors of removed ports close,
+// a port whose mapping changed keeps its acceptor and sends new clients to the new mapping,
+// tunnels that are open stay as they are.
+class Shard
+{
+public:
+    Shard(io_service &ios, bool reusePort, int backlog, int prewarm, int prewarmIdle)
+        : ios(ios), reusePort(reusePort), backlog(backlog), prewarm(prewarm), prewarmIdle(prewarmIdle) {}
+    ~Shard()
+    {
+        for (std::pair<const int, boost::shared_ptr<Listener>> &listener : listeners)
+            listener.second->Close();
+    }
+
+    // run on the thread of the io_service,return false if a port could not be listened on.
+    bool Update(const network::MappingList &mappings)
+    {
+        std::unordered_map<int, boost::shared_ptr<Listener>> kept;
+        bool listening = true;
+        for (const std::shared_ptr<network::Mapping> &mapping : mappings)
+        {
+            std::unordered_map<int, boost::shared_ptr<Listener>>::iterator it = listeners.find(mapping->localport);
+            if (it != listeners.end())
+            {
+                if (it->second->GetMapping() != mapping)
+                    it->second->SetMapping(mapping);
+                kept[mapping->localport] = it->second;
+                listeners.erase(it);
+                continue;
+            }
+            boost::shared_ptr<Listener> pListener = boost::make_shared<Listener>(ios, mapping, prewarm, prewarmIdle);
+            boost::system::error_code ec;
+            if (!pListener->Listen(backlog, reusePort, ec))
+            {
+                LOG_ERROR("listen failed port=%d error=%d message=%s", mapping->localport, ec.value(), ec.message().c_str());
+                listening = false;
+                continue;
+            }
+            co_spawn(ios, Accept(ios, pListener), detached);
+            kept[mapping->localport] = pListener;
+        }
+        for (std::pair<const int, boost::shared_ptr<Listener>> &removed : listeners)
+            removed.second->Close();
+        listeners.swap(kept);
+        return listening;
+    }
+
+protected:
+    io_service &ios;
+    bool reusePort;
+    int backlog;
+    int prewarm;
+    int prewarmIdle;
+    std::unordered_map<int, boost::shared_ptr<Listener>> listeners;
+};
+
+// udp mode of one io_service.
+// every client endpoint gets a session with a socket of its own connected to a dst,what the dst
+// answers goes back to the client from the listening socket.
+// a socket is waited on until readable and then drained without blocking into one shared buffer,
+// so a session holds no buffer. a datagram a socket can not take at once is dropped.
+// sessions are closed once no datagram went either way for the udp timeout.
+class UdpForwarder
+{
+public:
+    UdpForwarder(io_service &ios, network::Balancer &balancer, int timeoutMs)
+        : ios(ios), balancer(balancer), listener(ios), reaper(ios, timeoutMs), data(new char[maxDatagram]) {}
+
+    bool Listen(int port, bool reusePort)
+    {
+        boost::system::error_code ec;
+        listener.open(udp::v4(), ec);
+#ifdef SO_REUSEPORT
+        if (!ec && reusePort)
+            listener.set_option(reuse_port(true), ec);
+#endif
+        if (!ec)
+            listener.bind(udp::endpoint(bindAddress, port), ec);
+        if (!ec)
+            listener.non_blocking(true, ec);
+        if (ec)
+            return false;
+        SetBuffers(listener);
+        return true;
+    }
+
+    void Start() { WaitClients(); }
+
+protected:
+    static constexpr size_t maxDatagram = 65536;
+    // a burst of datagrams not read yet must not overflow the socket buffers.
+    static constexpr int socketBuffer = 4 << 20;
+
+    struct Session
+    {
+        Session(io_service &ios) : socket(ios), index(0), source(0), timer(network::TimingWheel::InvalidTimer) {}
+
+        udp::socket socket;
+        udp::endpoint client;
+        int index;
+        uint32_t source;
+        std::chrono::steady_clock::time_point lastActive;
+        network::TimingWheel::TimerId timer;
+    };
+
+    io_service &ios;
+    network::Balancer &balancer;
+    udp::socket listener;
+    IdleReaper reaper;
+    std::unique_ptr<char[]> data;
+    // sessions by client address and port.
+    std::unordered_map<uint64_t, boost::shared_ptr<Session>> sessions;
+
+    static uint64_t Key(const udp::endpoint &endpoint) { return (uint64_t)endpoint.address().to_v4().to_uint() << 16 | endpoint.port(); }
+
+    static void SetBuffers(udp::socket &socket)
+    {
+        boost::system::error_code ec;
+        socket.set_option(socket_base::receive_buffer_size(socketBuffer), ec);
+        socket.set_option(socket_base::send_buffer_size(socketBuffer), ec);
+    }
+
+    void Drop()
+    {
+        if (pMetrics != nullptr)
+            pMetrics->Add(network::Metrics::Drops);
+    }
+
+    void WaitClients()
+    {
+        listener.async_wait(socket_base::wait_read, [this](const boost::system::error_code &ec) -> void
+                            {
+                                if (ec)
+                                {
+                                    HandleError(ec);
+                                    return;
+                                }
+                                ReceiveClients();
+                                WaitClients(); });
+    }
+
+    void ReceiveClients()
+    {
+        udp::endpoint client;
+        boost::system::error_code ec;
+        for (;;)
+        {
+            size_t length = listener.receive_from(buffer(data.get(), maxDatagram), client, 0, ec);
+            if (ec)
+            {
+                if (ec != error::would_block)
+                    HandleError(ec);
+                return;
+            }
+            boost::shared_ptr<Session> session = Find(client);
+            if (!session)
+            {
+                Drop();
+                continue;
+            }
+            session->lastActive = std::chrono::steady_clock::now();
+            if (pMetrics != nullptr)
+                pMetrics->Add(network::Metrics::BytesIn, length);
+            session->socket.send(buffer(data.get(), length), 0, ec);
+            if (ec)
+                Drop();
+        }
+    }
+
+    void WaitUpstream(boost::shared_ptr<Session> session)
+    {
+        session->socket.async_wait(socket_base::wait_read, [this, session](const boost::system::error_code &ec) -> void
+                                   {
+                                       // a closed session ends with operation_aborted.
+                                       if (ec)
+                                           return;
+                                       ReceiveUpstream(session);
+                                       if (session->socket.is_open())
+                                           WaitUpstream(session); });
+    }
+
+    void ReceiveUpstream(const boost::shared_ptr<Session> &session)
+    {
+        boost::system::error_code ec;
+        for (;;)
+        {
+            size_t length = session->socket.receive(buffer(data.get(), maxDatagram), 0, ec);
+            // the icmp error of an earlier datagram is reported once,reading goes on after it.
+            if (ec == error::connection_refused)
+                continue;
+            if (ec)
+            {
+                if (ec != error::would_block)
+                {
+                    HandleError(ec);
+                    Close(session);
+                }
+                return;
+            }
+            session->lastActive = std::chrono::steady_clock::now();
+            if (pMetrics != nullptr)
+                pMetrics->Add(network::Metrics::BytesOut, length);
+            listener.send_to(buffer(data.get(), length), session->client, 0, ec);
+            if (ec)
+                Drop();
+        }
+    }
+
+    // the session of client,opened if it has none,nullptr if it may not have one.
+    boost::shared_ptr<Session> Find(const udp::endpoint &client)
+    {
+        uint64_t key = Key(client);
+        std::unordered_map<uint64_t, boost::shared_ptr<Session>>::iterator it = sessions.find(key);
+        if (it != sessions.end())
+            return it->second;
+        uint32_t source = network::SourceKey(client.data());
+        if (pAdmission != nullptr && !pAdmission->Admit(source))
+        {
+            if (pMetrics != nullptr)
+                pMetrics->Add(network::Metrics::Rejects);
+            return nullptr;
+        }
+        int index = balancer.Select(balancer.GetStrategy() == network::Balancer::Hash ? ClientHash(source) : 0);
+        const network::Backend &backend = balancer.Get(index);
+        network::Resolver::Addresses addresses;
+        if (!pResolver->Lookup(backend.addr, backend.port, addresses) || addresses.empty())
+        {
+            // datagrams are dropped until the name is known,the client sends again.
+            pResolver->Resolve(backend.addr, backend.port, [](const network::Resolver::Addresses &addresses) -> void {});
+            if (pAdmission != nullptr)
+                pAdmission->Release(source);
+            return nullptr;
+        }
+        boost::shared_ptr<Session> session = boost::make_shared<Session>(ios);
+        session->client = client;
+        session->source = source;
+        session->index = index;
+        session->lastActive = std::chrono::steady_clock::now();
+        balancer.Acquire(session->index);
+        sessions[key] = session;
+        if (pMetrics != nullptr)
+            pMetrics->Add(network::Metrics::Accepts);
+        tcp::endpoint dst = Endpoints(addresses)[0];
+        boost::system::error_code ec;
+        session->socket.open(dst.protocol() == tcp::v6() ? udp::v6() : udp::v4(), ec);
+        if (!ec)
+            session->socket.connect(udp::endpoint(dst.address(), dst.port()), ec);
+        if (!ec)
+            session->socket.non_blocking(true, ec);
+        if (ec)
+        {
+            HandleError(ec);
+            Close(session);
+            return nullptr;
+        }
+        SetBuffers(session->socket);
+        StartIdleTimer(key, reaper.GetIdle());
+        WaitUpstream(session);
+        return session;
+    }
+
+    void Close(const boost::shared_ptr<Session> &session)
+    {
+        uint64_t key = Key(session->client);
+        std::unordered_map<uint64_t, boost::shared_ptr<Session>>::iterator it = sessions.find(key);
+        if (it == sessions.end() || it->second != session)
+            return;
+        boost::system::error_code ec;
+        session->socket.close(ec);
+        reaper.Cancel(session->timer);
+        balancer.Release(session->index);
+        if (pAdmission != nullptr)
+            pAdmission->Release(session->source);
+        if (pMetrics != nullptr)
+            pMetrics->Add(network::Metrics::Closes);
+        sessions.erase(it);
+    }
+
+    void StartIdleTimer(uint64_t key, int ms)
+    {
+        sessions[key]->timer = reaper.Add(ms, [this, key]() -> void
+                                          { CheckIdle(key); });
+    }
+
+    // a busy session costs nothing per datagram,its timer only moves when it fires.
+    void CheckIdle(uint64_t key)
+    {
+        std::unordered_map<uint64_t, boost::shared_ptr<Session>>::iterator it = sessions.find(key);
+        if (it == sessions.end())
+            return;
+        boost::shared_ptr<Session> session = it->second;
+        session->timer = network::TimingWheel::InvalidTimer;
+        int idle = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - session->lastActive).count();
+        if (idle >= reaper.GetIdle())
+        {
+            LOG_DEBUG("idle udp session closed idle=%dms", idle);
+            Close(session);
+            return;
+        }
+        StartIdleTimer(key, reaper.GetIdle() - idle);
+    }
+};
+
+// one shard of the forwarder,every shard owns its io_service,acceptors and sockets.
+// with --config the shard follows the mappings of pTable,reloads are posted to its io_service.
+void RunShard(const network::MappingList &mappings, bool reusePort, size_t bufferMin, size_t bufferMax,
+              int prewarm, int prewarmIdle, int idleTimeout, int backlog, network::Metrics *metrics)
+{
+    network::BufferPool pool(bufferMin, bufferMax);
+    pPool = &pool;
+    pMetrics = metrics;
     io_service ios;
-    tcp::acceptor acceptor(ios, tcp::endpoint(tcp::v4(), port));
-    BeginAccept(ios, acceptor, dstPort, dstAddr);
-    ios.run();
+    if (udpMode)
+    {
+        UdpForwarder forwarder(ios, mappings[0]->balancer, udpTimeout);
+        if (!forwarder.Listen(mappings[0]->localport, reusePort))
+        {
+            LOG_ERROR("udp bind failed port=%d", mappings[0]->localport);
+            return;
+        }
+        forwarder.Start();
+        ios.run();
+        return;
+    }
+    IdleReaper reaper(ios, idleTimeout);
+    if (idleTimeout > 0)
+        pReaper = &reaper;
+    Shard shard(ios, reusePort, backlog, prewarm, prewarmIdle);
+    if (pTable == nullptr)
+    {
+        if (!shard.Update(mappings))
+            return;
+        ios.run();
+    }
+    else
+    {
+        network::MappingList current;
+        Shard *pShard = &shard;
+        int subscription = pTable->Subscribe([&ios, pShard](const network::MappingList &mappings) -> void
+                                             { post(ios, [pShard, mappings]() -> void
+                                                    { pShard->Update(mappings); }); },
+                                             current);
+        shard.Update(current);
+        ios.run();
+        pTable->Unsubscribe(subscription);
+    }
+    // the tunnels left are freed with ios,after the reaper is gone.
+    pReaper = nullptr;
+}
+
+void PinThread(std::thread &thread, int cpu)
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu % std::thread::hardware_concurrency(), &cpuset);
+    if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset) != 0)
+        LOG_WARN("pin thread failed cpu=%d", cpu);
+#endif
+}
+
+void LogMappings(const network::MappingList &mappings, const char *protocol)
+{
+    for (const std::shared_ptr<network::Mapping> &mapping : mappings)
+    {
+        for (int i = 0; i < mapping->balancer.Size(); i++)
+            LOG_INFO("forwarding port=%d protocol=%s backend=%s:%d", mapping->localport, protocol,
+                     mapping->balancer.Get(i).addr.c_str(), mapping->balancer.Get(i).port);
+    }
+}
+
+// tls is served by forward only,and compression by a build with zstd,not on trunks,
+// set error for the first mapping asking for them.
+bool PlainMappings(const network::MappingList &mappings, std::string &error)
+{
+    for (const std::shared_ptr<network::Mapping> &mapping : mappings)
+    {
+        if (mapping->options.tls.Enabled())
+        {
+            error = "port " + std::to_string(mapping->localport) + " needs tls,which only forward serves";
+            return false;
+        }
+#ifndef FORWARD_ZSTD
+        if (mapping->options.Compressed())
+        {
+            error = "port " + std::to_string(mapping->localport) + " needs compression,build with -DFORWARD_ZSTD and link -lzstd";
+            return false;
+        }
+#endif
+        if (mapping->options.Trunked() && mapping->options.Compressed())
+        {
+            error = "port " + std::to_string(mapping->localport) + " can not compress streams of trunks";
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifndef _WIN32
+// read configFile again on every SIGHUP,a wrong file keeps the mappings served now.
+void ReloadOnHangup(const sigset_t &signals)
+{
+    int signal;
+    while (sigwait(&signals, &signal) == 0)
+    {
+        network::MappingList mappings;
+        std::string error;
+        if (!network::LoadMappings(configFile.c_str(), defaultStrategy, pTable->Get(), mappings, error, defaultOptions) || !PlainMappings(mappings, error))
+        {
+            LOG_ERROR("reload failed %s", error.c_str());
+            continue;
+        }
+        LOG_INFO("reloaded config=%s mappings=%d", configFile.c_str(), (int)mappings.size());
+        LogMappings(mappings, "tcp");
+        pTable->Replace(mappings);
+    }
+}
+#endif
+
+// metrics holds a shard per thread,nullptr without --metrics.
+void Begin(const network::MappingList &mappings, int threads, bool pin, size_t bufferMin, size_t bufferMax,
+           int prewarm, int prewarmIdle, int idleTimeout, int backlog, network::MetricsServer *metrics)
+{
+    LogMappings(mappings, udpMode ? "udp" : "tcp");
+#ifndef _WIN32
+    // blocked before the threads start so they inherit the mask and only sigwait gets SIGHUP.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    if (pTable != nullptr)
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+#endif
+#ifdef FORWARD_ZSTD
+    // after the mask,so the workers leave SIGHUP to sigwait too.
+    std::unique_ptr<thread_pool> workers;
+    if (compressThreads > 0)
+    {
+        workers.reset(new thread_pool(compressThreads));
+        pWorkers = workers.get();
+    }
+#endif
+    if (threads == 1 && pTable == nullptr)
+    {
+        RunShard(mappings, false, bufferMin, bufferMax, prewarm, prewarmIdle, idleTimeout, backlog,
+                 metrics != nullptr ? metrics->GetShard(0) : nullptr);
+        return;
+    }
+    std::vector<std::thread> shards;
+    for (int i = 0; i < threads; i++)
+    {
+        shards.emplace_back(RunShard, std::cref(mappings), threads > 1, bufferMin, bufferMax, prewarm, prewarmIdle, idleTimeout, backlog,
+                            metrics != nullptr ? metrics->GetShard(i) : nullptr);
+        if (pin)
+            PinThread(shards.back(), i);
+    }
+#ifndef _WIN32
+    if (pTable != nullptr)
+        ReloadOnHangup(signals);
+#endif
+    for (std::thread &shard : shards)
+        shard.join();
 }
 
 int main(int argc, char **argv)
 {
-    if (argc < 4)
+    int threads = 1;
+    bool pin = false;
+    int bufferMin = 16384;
+    int bufferMax = 262144;
+    int prewarm = 0;
+    int prewarmIdle = 30000;
+    int idleTimeout = 0;
+    int backlog = SOMAXCONN;
+    std::string metricsAddr = "127.0.0.1";
+    int metricsPort = 0;
+    network::Admission admission;
+    network::Shaper shaper;
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
     {
-        std::cerr << "wrong usage" << std::endl;
-        PrintHelp();
-        return 1;
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+            if (threads < 1)
+            {
+                std::cerr << "invalid thread count " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--pin") == 0)
+            pin = true;
+        else if ((strcmp(argv[i], "--buffer-min") == 0 || strcmp(argv[i], "--buffer-max") == 0) && i + 1 < argc)
+        {
+            int &size = strcmp(argv[i], "--buffer-min") == 0 ? bufferMin : bufferMax;
+            size = atoi(argv[++i]);
+            if (size < 1)
+            {
+                std::cerr << "invalid buffer size " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--prewarm") == 0 && i + 1 < argc)
+        {
+            prewarm = atoi(argv[++i]);
+            if (prewarm < 0)
+            {
+                std::cerr << "invalid prewarm count " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--prewarm-idle") == 0 && i + 1 < argc)
+        {
+            prewarmIdle = atoi(argv[++i]);
+            if (prewarmIdle < 1)
+            {
+                std::cerr << "invalid prewarm idle time " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc)
+        {
+            idleTimeout = atoi(argv[++i]);
+            if (idleTimeout < 0)
+            {
+                std::cerr << "invalid idle timeout " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--keepalive") == 0 && i + 1 < argc)
+        {
+            keepAlive = atoi(argv[++i]);
+            if (keepAlive < 0)
+            {
+                std::cerr << "invalid keepalive time " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc)
+        {
+            backlog = atoi(argv[++i]);
+            if (backlog < 1)
+            {
+                std::cerr << "invalid backlog " << argv[i];
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[i], "--max-connections") == 0 || strcmp(argv[i], "--max-per-ip") == 0) && i + 1 < argc)
+        {
+            bool perIp = strcmp(argv[i], "--max-per-ip") == 0;
+            int limit = atoi(argv[++i]);
+            if (limit < 0)
+            {
+                std::cerr << "invalid connection limit " << argv[i];
+                return 1;
+            }
+            if (perIp)
+                admission.SetMaxPerSource(limit);
+            else
+                admission.SetMaxConnections(limit);
+        }
+        else if (strcmp(argv[i], "--accept-rate") == 0 && i + 1 < argc)
+        {
+            double rate = atof(argv[++i]);
+            const char *burst = strchr(argv[i], ':');
+            if (rate < 0 || (burst != nullptr && atoi(burst + 1) < 1))
+            {
+                std::cerr << "invalid accept rate " << argv[i];
+                return 1;
+            }
+            admission.SetRate(rate, burst != nullptr ? atoi(burst + 1) : (int)rate);
+        }
+        else if ((strcmp(argv[i], "--rate-tunnel") == 0 || strcmp(argv[i], "--rate-ip") == 0 ||
+                  strcmp(argv[i], "--rate-total") == 0 || strcmp(argv[i], "--bulk-threshold") == 0) &&
+                 i + 1 < argc)
+        {
+            const char *name = argv[i];
+            int64_t bytes = network::Shaper::ParseBytes(argv[++i]);
+            if (bytes < 0)
+            {
+                std::cerr << "invalid byte count " << argv[i];
+                return 1;
+            }
+            if (strcmp(name, "--rate-tunnel") == 0)
+                shaper.SetTunnelRate(bytes);
+            else if (strcmp(name, "--rate-ip") == 0)
+                shaper.SetSourceRate(bytes);
+            else if (strcmp(name, "--rate-total") == 0)
+                shaper.SetGlobalRate(bytes);
+            else
+                shaper.SetBulkThreshold(bytes);
+        }
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+        {
+            const char *colon = strrchr(argv[++i], ':');
+            if (colon != nullptr)
+                metricsAddr.assign(argv[i], colon - argv[i]);
+            metricsPort = atoi(colon != nullptr ? colon + 1 : argv[i]);
+            if (!CheckPort(metricsPort))
+            {
+                std::cerr << "invalid metrics port " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc)
+        {
+            if (!network::Logger::Get().SetLevel(argv[++i]))
+            {
+                std::cerr << "invalid log level " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--udp") == 0)
+            udpMode = true;
+        else if (strcmp(argv[i], "--udp-timeout") == 0 && i + 1 < argc)
+        {
+            udpTimeout = atoi(argv[++i]);
+            if (udpTimeout < 1)
+            {
+                std::cerr << "invalid udp timeout " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--balance") == 0 && i + 1 < argc)
+        {
+            network::Balancer balancer;
+            if (!balancer.SetStrategy(argv[++i]))
+            {
+                std::cerr << "invalid balance strategy " << argv[i];
+                return 1;
+            }
+            defaultStrategy = balancer.GetStrategy();
+        }
+        else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+            configFile = argv[++i];
+        else if (strcmp(argv[i], "--compress-upstream") == 0 || strcmp(argv[i], "--compress-client") == 0)
+        {
+            defaultOptions.compressupstream = strcmp(argv[i], "--compress-upstream") == 0;
+            defaultOptions.compressclient = !defaultOptions.compressupstream;
+        }
+        else if (strcmp(argv[i], "--trunk-upstream") == 0 && i + 1 < argc)
+        {
+            defaultOptions.trunkupstream = atoi(argv[++i]);
+            defaultOptions.trunkclient = false;
+            if (defaultOptions.trunkupstream < 1)
+            {
+                std::cerr << "invalid trunk count " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--trunk-client") == 0)
+        {
+            defaultOptions.trunkclient = true;
+            defaultOptions.trunkupstream = 0;
+        }
+        else if (strcmp(argv[i], "--compress-level") == 0 && i + 1 < argc)
+        {
+            compressLevel = atoi(argv[++i]);
+            if (compressLevel < 1 || compressLevel > 19)
+            {
+                std::cerr << "invalid compress level " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--compress-threads") == 0 && i + 1 < argc)
+        {
+            compressThreads = atoi(argv[++i]);
+            if (compressThreads < 0)
+            {
+                std::cerr << "invalid compress threads " << argv[i];
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[i], "--client-sockopt") == 0 || strcmp(argv[i], "--upstream-sockopt") == 0) && i + 1 < argc)
+        {
+            network::SocketOptions &options = argv[i][2] == 'c' ? defaultOptions.client : defaultOptions.upstream;
+            if (!network::ParseSocketOptions(argv[++i], options))
+            {
+                std::cerr << "invalid socket options " << argv[i];
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc)
+        {
+            boost::system::error_code ec;
+            bindAddress = make_address(argv[++i], ec);
+            if (ec)
+            {
+                std::cerr << "invalid bind address " << argv[i];
+                return 1;
+            }
+        }
+        else
+        {
+            std::cerr << "unknown option " << argv[i] << std::endl;
+            PrintHelp();
+            return 1;
+        }
     }
 
-    int port = atoi(argv[1]);
-    if (!CheckPort(port))
+    if (udpMode && bindAddress.is_v6())
     {
-        std::cerr << "invalid port " << argv[1];
+        // udp sessions are keyed by ipv4 client endpoints.
+        std::cerr << "--udp takes no ipv6 --bind address" << std::endl;
         return 1;
     }
-    int dstPort = atoi(argv[3]);
-    if (!CheckPort(dstPort))
+    if (udpMode && (!defaultOptions.client.Empty() || !defaultOptions.upstream.Empty() || defaultOptions.Compressed() ||
+                    defaultOptions.Trunked()))
     {
-        std::cerr << "invalid port " << argv[3];
+        std::cerr << "--udp takes no tcp socket options,no compression and no trunks" << std::endl;
         return 1;
     }
-
-    std::string dstAddr(argv[2]);
-    Begin(port, dstPort, dstAddr);
+    network::MappingList mappings;
+    if (!configFile.empty())
+    {
+        if (i < argc || udpMode)
+        {
+            // udp sessions are not kept across a reload.
+            std::cerr << "--config takes no mapping on the command line and no --udp" << std::endl;
+            return 1;
+        }
+        std::string error;
+        if (!network::LoadMappings(configFile.c_str(), defaultStrategy, network::MappingList(), mappings, error, defaultOptions) || !PlainMappings(mappings, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        if (argc - i < 3 || (argc - i) % 2 == 0)
+        {
+            std::cerr << "wrong usage" << std::endl;
+            PrintHelp();
+            return 1;
+        }
+        std::shared_ptr<network::Mapping> mapping = network::ParseMapping(std::vector<std::string>(argv + i, argv + argc), defaultStrategy, defaultOptions);
+        if (!mapping)
+        {
+            std::cerr << "invalid port or weight" << std::endl;
+            return 1;
+        }
+        mappings.push_back(mapping);
+        std::string error;
+        if (!PlainMappings(mappings, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+    network::Resolver resolver;
+    if (!resolver.Start())
+    {
+        LOG_ERROR("resolver start failed");
+        return 1;
+    }
+    pResolver = &resolver;
+    network::MappingTable table(mappings);
+    if (!configFile.empty())
+        pTable = &table;
+    if (admission.Enabled())
+        pAdmission = &admission;
+    if (shaper.Enabled())
+        pShaper = &shaper;
+    network::MetricsServer metrics;
+    if (metricsPort != 0)
+    {
+        for (int shard = 0; shard < threads; shard++)
+            metrics.AddShard();
+        metrics.AddCollector([&table](std::string &text) -> void
+                             {
+                                 text += "# HELP forward_backend_active_tunnels Tunnels relayed to a backend.\n"
+                                         "# TYPE forward_backend_active_tunnels gauge\n";
+                                 for (const std::shared_ptr<network::Mapping> &mapping : table.Get())
+                                 {
+                                     for (int index = 0; index < mapping->balancer.Size(); index++)
+                                     {
+                                         const network::Backend &backend = mapping->balancer.Get(index);
+                                         text += "forward_backend_active_tunnels{port=\"" + std::to_string(mapping->localport) + "\",backend=\"" +
+                                                 backend.addr + ":" + std::to_string(backend.port) + "\"} " +
+                                                 std::to_string(backend.active.load(std::memory_order_relaxed)) + "\n";
+                                     }
+                                 }
+                             });
+        if (!metrics.Start(metricsAddr.c_str(), metricsPort))
+        {
+            LOG_ERROR("metrics listen failed addr=%s:%d", metricsAddr.c_str(), metricsPort);
+            return 1;
+        }
+    }
+    Begin(mappings, threads, pin, bufferMin, bufferMax, prewarm, prewarmIdle, idleTimeout, backlog, metricsPort != 0 ? &metrics : nullptr);
 }
\ No newline at end of file
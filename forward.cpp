@@ -12,23 +12,124 @@ void Print(T t, Args... args)
 	Print(args...);
 }
 
-template <typename... Args>
-void Println(Args... args)
-{
-	Print(args...);
-	std::cout << std::endl;
-}
-
 #endif
 
 void PrintHelp()
 {
-	Print(R"(usage forward localport remoteaddr remoteport
+	Print(R"(usage forward [options] localport remoteaddr remoteport[:weight] [remoteaddr remoteport[:weight]]...
+      forward [options] --config FILE
 forward 61111 192.168.1.1 22
+forward --balance least-conn 8080 10.0.0.1 80 10.0.0.2 80:2
+forward 8443 backend.example.com 443 ::1 8443
+
+remoteaddr is an ipv4 or ipv6 address or a name,names are resolved without blocking
+the event loops and cached for the ttl of their records,a backend with ipv6 and ipv4
+addresses is connected to with happy eyeballs(the uring engine falls back to poll)
+
+options:
+  --threads N   run N event loops,each with its own SO_REUSEPORT listener
+  --pin         pin event loop i to cpu i
+  --relay MODE  how bytes are moved between sockets: splice or copy
+                (default splice on linux,copy elsewhere)
+  --engine NAME event engine: poll(epoll/select) or uring(io_uring,linux only)
+  --connect-timeout MS
+                give up connecting to remoteaddr after MS milliseconds(default 10000)
+  --max-connecting N
+                stop accepting while N connects to remoteaddr are pending(default 1024)
+  --backlog N   length of the queue of clients waiting to be accepted(default SOMAXCONN,
+                capped by net.core.somaxconn)
+  --max-connections N
+                reset new clients while N clients are open(default 0,no limit)
+  --max-per-ip N
+                reset new clients from an address that has N clients open(default 0,no limit)
+  --accept-rate N[:BURST]
+                admit N new clients per second on average and BURST at once(default N),
+                reset the others(default 0,no limit)
+  --buffer-min BYTES
+  --buffer-max BYTES
+                relay buffers start at buffer-min and grow up to buffer-max for busy
+                streams(default 16384 and 262144),idle streams hold no buffer
+  --prewarm N   keep N idle connections to remoteaddr ready per event loop,
+                a new client is paired with one of them instead of waiting for a connect
+  --prewarm-idle MS
+                close prewarmed connections idle for MS milliseconds(default 30000)
+  --idle-timeout MS
+                close a tunnel when neither side sent anything for MS milliseconds
+                (default 0,never)
+  --keepalive SEC
+                send tcp keepalive probes after SEC seconds idle on both sides of a tunnel,
+                so peers that vanished are noticed(default 0,off)
+  --client-sockopt SPEC
+  --upstream-sockopt SPEC
+                tcp options of the listeners and the clients they accept,and of the
+                connections to backends,SPEC is a comma separated list of nodelay,
+                rcvbuf=BYTES,sndbuf=BYTES,notsent-lowat=BYTES,fastopen[=QUEUE],
+                keepalive=SEC and autotune[=MAXBYTES](default 32M),which grows the
+                buffers of busy connections to what their path carries,measured with
+                TCP_INFO.may also start a line of --config(tcp only,the uring engine
+                falls back to poll)
+  --rate-tunnel BYTES
+  --rate-ip BYTES
+  --rate-total BYTES
+                limit the bytes per second relayed by a tunnel(both directions together),
+                by the tunnels of a client address and by the whole process,K,M and G
+                suffixes multiply by 1024(default 0,no limit),throttled tunnels wait
+                without polling,the uring engine falls back to poll
+  --bulk-threshold BYTES
+                tunnels relaying more than BYTES per second are bulk,they leave the last
+                quarter of the per address and total limits to interactive tunnels
+                (default 0,no priority)
+  --udp         forward udp datagrams instead of tcp connections,every client address
+                gets a session with its own socket to a backend
+  --udp-timeout MS
+                close a udp session when no datagram went either way for MS milliseconds
+                (default 30000)
+  --udp-offload let the kernel coalesce the datagrams of a flow(UDP_GRO) and split them
+                again on send(UDP_SEGMENT),linux only
+  --balance STRATEGY
+                how a backend is chosen for a client when several are given:
+                round-robin(default),least-conn,weighted or hash(of the client address)
+  --config FILE forward every mapping of FILE from the same event loops,a line is
+                [--balance STRATEGY] [--tls-...] [--*-sockopt SPEC] localport remoteaddr remoteport[:weight]...,
+                # starts a comment.SIGHUP reads FILE again,listeners of new ports open,
+                those of removed ports close,open tunnels are kept(poll engine,tcp only)
+  --tls-cert FILE
+  --tls-key FILE
+                accept tls from clients with the pem certificate chain and key,
+                --connect-timeout also bounds the handshake
+  --tls-connect connect to backends with tls,their certificates are checked against
+                the system store,or the pem file of --tls-ca FILE,unless --tls-insecure
+                is given.after a handshake the kernel takes the records(kTLS) where it
+                can,so the relay still splices.tls options may also start a line of
+                --config,they need a build with -DFORWARD_TLS -lssl -lcrypto(tcp only,
+                the uring engine falls back to poll)
+  --bind ADDR   address the listeners bind(default 0.0.0.0),:: accepts ipv6 and ipv4
+                clients(tcp only)
+  --metrics [ADDR:]PORT
+                serve prometheus metrics on http://ADDR:PORT/metrics(ADDR defaults to 127.0.0.1)
+  --log-level LEVEL
+                log debug,info(default),warn,error or off to stderr,debug messages
+                are only compiled in with -DLOG_MIN_LEVEL=0
 )");
 }
 
 #include "network.hpp"
+#include "admission.hpp"
+#include "shaper.hpp"
+#include "balancer.hpp"
+#include "buffer.hpp"
+#include "metrics.hpp"
+#include "log.hpp"
+#include "uring.hpp"
+#include "udp.hpp"
+#include "mapping.hpp"
+#include "resolver.hpp"
+#include "tls.hpp"
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <unordered_map>
 
 #ifdef _WIN32
 using network::socklen_t;
@@ -43,156 +144,1486 @@ inline int ioctlsocket(int fd, unsigned long int arg, u_long *val)
 	return ioctl(fd, arg, val);
 }
 
+#include <signal.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #endif
 
-std::map<network::socket_fd, network::socket_fd> fdmap;
+#endif
+
+struct Options
+{
+	int threads;
+	bool pin;
+	bool splice;
+	bool uring;
+	int connecttimeout;
+	int maxconnecting;
+	int buffermin;
+	int buffermax;
+	int prewarm;
+	int prewarmidle;
+	int idletimeout;
+	int keepalive;
+	int backlog;
+	bool udp;
+	int udptimeout;
+	bool udpoffload;
+	// default strategy of mappings without --balance.
+	network::Balancer::Strategy strategy;
+	// tls and socket options of mappings that do not set their own.
+	network::MappingOptions defaults;
+	// mappings of the command line or of config,shared by every event loop.
+	network::MappingList mappings;
+	// the first mapping,the only one of the uring engine and of udp mode.
+	int localport;
+	network::Balancer *balancer;
+	// address the listeners bind,:: listens on ipv6 and ipv4.
+	std::string bind;
+	// resolves the names of backends,shared by every event loop.
+	network::Resolver *resolver;
+	// file the mappings are read from,empty if they are given on the command line.
+	std::string config;
+	// the mappings served now,reloaded from config on SIGHUP,nullptr without config.
+	network::MappingTable *table;
+	// shared by every event loop,nullptr if no limit is set.
+	network::Admission *admission;
+	// shared by every event loop,nullptr if no rate is set.
+	network::Shaper *shaper;
+	// metrics endpoint,0 if disabled.
+	std::string metricsaddr;
+	int metricsport;
+	// shard i holds the counters of event loop i,nullptr if disabled.
+	network::MetricsServer *metrics;
+};
 
-int NewForward(const char *remoteaddr, int remoteport)
+// poll engine,built on the reactor of network::tcp::Server.
+// a PollForwarder serves the clients of one mapping on one event loop.
+// forward connections are connected without blocking,the client is not read until its
+// forward connection is established,and accepting pauses while too many connects are pending.
+// the server then relays the pair,a side is not read while the other side is slow.
+// with --prewarm a number of forward connections is kept established ahead of time,
+// bytes a prewarmed connection receives before it is paired are kept for its client.
+// callbacks hold the forwarder,so one retired by a reload lives until its last connect ends.
+class PollForwarder : public std::enable_shared_from_this<PollForwarder>
 {
-	network::tcp::Client client(remoteaddr, remoteport);
-	if (!client.Connect())
-		return INVALID_SOCKET;
-	return client.GetFd();
+public:
+	// connecting counts the pending connects of every forwarder of the server.
+	PollForwarder(const Options &options, network::tcp::Server &server, std::shared_ptr<network::Mapping> mapping, int &connecting);
+	void Init();
+	bool OnConnection(network::tcp::Connection &client);
+	// stop prewarming and close the prewarmed connections,the mapping was removed or replaced.
+	void Retire();
+	const std::shared_ptr<network::Mapping> &GetMapping() const;
+
+protected:
+	// a prewarmed connection is not read beyond this many bytes until it is paired.
+	static constexpr size_t earlylimit = 65536;
+
+	struct WarmConnection
+	{
+		network::tcp::Connection *connection;
+		int backend;
+		// bytes the remote sent first.
+		std::string early;
+		network::tcp::Server::TimerId expire;
+	};
+
+	const Options &options;
+	network::tcp::Server &server;
+	std::shared_ptr<network::Mapping> mapping;
+	int &connecting;
+	network::SlotTable<WarmConnection> warmtable;
+	// handles of prewarmed connections,newest last,closed ones are skipped.
+	std::deque<network::SlotHandle> warmlist;
+	int warming;
+	// a prewarm connect failed,refilling waits for a timer.
+	bool refillpaused;
+	// backend of the next prewarmed connection,they are spread over all backends.
+	int refillnext;
+	bool retired;
+
+	// choose a backend for client and pair it with a prewarmed or a new connection,return false to close client.
+	bool Route(network::tcp::Connection &client);
+	void FinishConnect();
+	// connect to backend,its name is resolved first unless the resolver knows it already.
+	// onConnect runs on the event loop either way,with nullptr if the name did not resolve.
+	// with tls to the backends onConnect gets the connection once its handshake is done.
+	bool ConnectBackend(int backend, network::tcp::Server::OnConnect onConnect);
+#ifdef FORWARD_TLS
+	// onConnect,after a tls handshake with backend.
+	network::tcp::Server::OnConnect SecureConnect(int backend, network::tcp::Server::OnConnect onConnect);
+#endif
+	void Pair(network::tcp::Connection &client, network::tcp::Connection &remote, const std::string &early);
+	// start connects until warm and warming connections reach options.prewarm.
+	void Refill();
+	void PauseRefill();
+	void Warmed(network::tcp::Connection *remote, int backend);
+	// take a prewarmed connection to backend and what it received,nullptr if none is ready.
+	network::tcp::Connection *TakeWarm(int backend, std::string &early);
+	void DropWarm(network::SlotHandle handle);
+};
+
+PollForwarder::PollForwarder(const Options &options, network::tcp::Server &server, std::shared_ptr<network::Mapping> mapping, int &connecting)
+	: options(options), server(server), mapping(std::move(mapping)), connecting(connecting), warmtable(), warmlist(), warming(0),
+	  refillpaused(false), refillnext(0), retired(false) {}
+
+void PollForwarder::Init() { this->Refill(); }
+
+const std::shared_ptr<network::Mapping> &PollForwarder::GetMapping() const { return this->mapping; }
+
+void PollForwarder::Retire()
+{
+	this->retired = true;
+	for (network::SlotHandle handle : this->warmlist)
+	{
+		WarmConnection *warm = this->warmtable.Get(handle);
+		if (warm != nullptr)
+			warm->connection->Close();
+	}
+	this->warmlist.clear();
 }
 
-void Forward(int localport, const char *remoteaddr, int remoteport)
+bool PollForwarder::OnConnection(network::tcp::Connection &client)
 {
-	Println(localport, remoteaddr, remoteport);
-	network::tcp::Server server("0.0.0.0", localport);
-	if (!server.Listen())
+#ifdef FORWARD_TLS
+	if (this->mapping->accepttls)
 	{
-		Println(server.Errno());
-		return;
+		std::unique_ptr<network::Stream> stream = this->mapping->accepttls->NewStream(client.GetFd(), std::string());
+		if (!stream)
+			return false;
+		// the backend is chosen once the client finished its handshake.
+		std::shared_ptr<PollForwarder> self = this->shared_from_this();
+		client.onData = nullptr;
+		client.onClose = nullptr;
+		client.SetStream(std::move(stream), this->options.connecttimeout, [self](network::tcp::Connection &client) -> void
+						 {
+							 if (!self->Route(client))
+								 client.Close(); });
+		return true;
 	}
+#endif
+	return this->Route(client);
+}
 
-	network::socket_fd sfd = server.GetFd();
-	network::socket_fd maxfd = sfd;
-	network::socket_fd cfd;
-	network::socket_fd tofd;
+bool PollForwarder::Route(network::tcp::Connection &client)
+{
+	std::shared_ptr<network::Mapping> mapping = this->mapping;
+	network::Balancer &balancer = mapping->balancer;
+	uint32_t source = network::SourceKey(client.GetSockAddr());
+	int backend = balancer.Select(network::Balancer::HashBytes(&source, sizeof(source)));
+	balancer.Acquire(backend);
+	client.onData = nullptr;
+	// the mapping may be replaced by a reload meanwhile,the connection is released on the balancer it was counted on.
+	client.onClose = [mapping, backend](network::tcp::Connection &client) -> void
+	{ mapping->balancer.Release(backend); };
+	std::string early;
+	network::tcp::Connection *remote = this->TakeWarm(backend, early);
+	if (remote != nullptr)
+	{
+		this->Pair(client, *remote, early);
+		this->Refill();
+		return true;
+	}
+	client.PauseRead(true);
+	network::SlotHandle handle = client.GetHandle();
+	std::shared_ptr<PollForwarder> self = this->shared_from_this();
+	if (!this->ConnectBackend(backend, [self, handle](network::tcp::Connection *remote) -> void
+							  {
+								  self->FinishConnect();
+								  network::tcp::Connection *client = self->server.GetConnection(handle);
+								  if (client == nullptr || remote == nullptr)
+								  {
+									  if (client != nullptr)
+										  client->Close();
+									  if (remote != nullptr)
+										  remote->Close();
+									  return;
+								  }
+								  self->Pair(*client, *remote, std::string());
+							  }))
+	{
+		// released here,the tls path closes the client itself and would release it again.
+		client.onClose = nullptr;
+		balancer.Release(backend);
+		return false;
+	}
+	this->connecting++;
+	if (this->connecting >= this->options.maxconnecting)
+	{
+		// leave further clients in the listen backlog until some connects finish.
+		this->server.PauseAccept(true);
+	}
+	return true;
+}
 
-	fd_set fdset, rlist;
-	FD_ZERO(&fdset);
-	FD_SET(sfd, &fdset);
-	int count, size;
-	unsigned int i;
-	sockaddr_in clientaddr;
-	socklen_t addrlen = sizeof(clientaddr);
+bool PollForwarder::ConnectBackend(int backend, network::tcp::Server::OnConnect onConnect)
+{
+	const network::Backend &target = this->mapping->balancer.Get(backend);
+#ifdef FORWARD_TLS
+	if (this->mapping->connecttls)
+		onConnect = this->SecureConnect(backend, std::move(onConnect));
+#endif
+	network::Resolver::Addresses addrs;
+	if (this->options.resolver->Lookup(target.addr, target.port, addrs))
+		return this->server.Connect(addrs, this->options.connecttimeout, std::move(onConnect), &this->mapping->options.upstream);
+	std::shared_ptr<PollForwarder> self = this->shared_from_this();
+	this->options.resolver->Resolve(target.addr, target.port, [self, onConnect](const network::Resolver::Addresses &addrs) -> void
+									{ self->server.Post([self, onConnect, addrs]() -> void
+														{
+															if (!self->server.Connect(addrs, self->options.connecttimeout, onConnect, &self->mapping->options.upstream))
+																onConnect(nullptr); }); });
+	return true;
+}
 
-	static constexpr int buffersize = 1024;
-	static char buf[buffersize];
+#ifdef FORWARD_TLS
+network::tcp::Server::OnConnect PollForwarder::SecureConnect(int backend, network::tcp::Server::OnConnect onConnect)
+{
+	std::shared_ptr<network::TlsContext> context = this->mapping->connecttls;
+	std::string servername = this->mapping->balancer.Get(backend).addr;
+	int timeout = this->options.connecttimeout;
+	return [context, servername, timeout, onConnect](network::tcp::Connection *remote) -> void
+	{
+		if (remote == nullptr)
+		{
+			onConnect(nullptr);
+			return;
+		}
+		// a failed handshake closes the connection.
+		remote->onData = nullptr;
+		remote->onClose = [onConnect](network::tcp::Connection &remote) -> void
+		{ onConnect(nullptr); };
+		std::unique_ptr<network::Stream> stream = context->NewStream(remote->GetFd(), servername);
+		if (!stream)
+		{
+			remote->Close();
+			return;
+		}
+		remote->SetStream(std::move(stream), timeout, [onConnect](network::tcp::Connection &remote) -> void
+						  {
+							  remote.onClose = nullptr;
+							  onConnect(&remote); });
+	};
+}
+#endif
 
-	network::socket_fd clientfdlist[1024];
-	for (i = 0; i < 1024; i++)
-		clientfdlist[i] = 0;
-	for (;;)
+void PollForwarder::FinishConnect()
+{
+	this->connecting--;
+	if (this->connecting < this->options.maxconnecting)
+		this->server.PauseAccept(false);
+}
+
+void PollForwarder::Pair(network::tcp::Connection &client, network::tcp::Connection &remote, const std::string &early)
+{
+	remote.onData = nullptr;
+	remote.onClose = nullptr;
+	if ((!early.empty() && !client.Write(early.data(), (int)early.size())) || !this->server.Relay(client, remote))
 	{
-		rlist = fdset;
-		count = select(maxfd + 1, &rlist, NULL, NULL, NULL);
-		if (count == SOCKET_ERROR)
+		client.Close();
+		remote.Close();
+	}
+}
+
+void PollForwarder::Refill()
+{
+	if (this->refillpaused || this->retired)
+		return;
+	while (!this->warmlist.empty() && this->warmtable.Get(this->warmlist.front()) == nullptr)
+		this->warmlist.pop_front();
+	network::Balancer &balancer = this->mapping->balancer;
+	std::shared_ptr<PollForwarder> self;
+	while ((int)this->warmtable.Size() + this->warming < this->options.prewarm)
+	{
+		int backend = this->refillnext;
+		this->refillnext = (this->refillnext + 1) % balancer.Size();
+		if (!self)
+			self = this->shared_from_this();
+		if (!this->ConnectBackend(backend, [self, backend](network::tcp::Connection *remote) -> void
+								  {
+									  self->warming--;
+									  self->Warmed(remote, backend);
+								  }))
 		{
-			Println("socket error on I/O select");
+			this->PauseRefill();
 			return;
 		}
-		if (FD_ISSET(sfd, &rlist))
+		this->warming++;
+	}
+}
+
+void PollForwarder::PauseRefill()
+{
+	if (this->refillpaused)
+		return;
+	this->refillpaused = true;
+	std::shared_ptr<PollForwarder> self = this->shared_from_this();
+	this->server.AddTimer(1000, [self]() -> void
+						  {
+							  self->refillpaused = false;
+							  self->Refill(); });
+}
+
+void PollForwarder::Warmed(network::tcp::Connection *remote, int backend)
+{
+	if (remote == nullptr)
+	{
+		this->PauseRefill();
+		return;
+	}
+	if (this->retired)
+	{
+		remote->Close();
+		return;
+	}
+	network::SlotHandle handle;
+	WarmConnection *warm = this->warmtable.Add(handle);
+	warm->connection = remote;
+	warm->backend = backend;
+	std::shared_ptr<PollForwarder> self = this->shared_from_this();
+	// reading it notices the remote closing it,and keeps what a remote speaking first sends.
+	remote->onData = [self, handle](network::tcp::Connection &remote, char *data, int size) -> bool
+	{
+		WarmConnection *warm = self->warmtable.Get(handle);
+		warm->early.append(data, size);
+		if (warm->early.size() >= earlylimit)
+			remote.PauseRead(true);
+		return true;
+	};
+	remote->onClose = [self, handle](network::tcp::Connection &remote) -> void
+	{
+		self->DropWarm(handle);
+		self->Refill();
+	};
+	warm->expire = this->server.AddTimer(this->options.prewarmidle, [self, handle]() -> void
+										 {
+											 // idle for too long,the remote may drop it any time.
+											 WarmConnection *warm = self->warmtable.Get(handle);
+											 if (warm != nullptr)
+												 warm->connection->Close(); });
+	this->warmlist.push_back(handle);
+}
+
+network::tcp::Connection *PollForwarder::TakeWarm(int backend, std::string &early)
+{
+	// the newest connection is the least likely to be timed out by the remote.
+	for (size_t i = this->warmlist.size(); i > 0;)
+	{
+		i--;
+		network::SlotHandle handle = this->warmlist[i];
+		WarmConnection *warm = this->warmtable.Get(handle);
+		if (warm != nullptr && warm->backend != backend)
+			continue;
+		this->warmlist.erase(this->warmlist.begin() + i);
+		if (warm == nullptr)
+			continue;
+		network::tcp::Connection *remote = warm->connection;
+		early.swap(warm->early);
+		this->DropWarm(handle);
+		return remote;
+	}
+	return nullptr;
+}
+
+void PollForwarder::DropWarm(network::SlotHandle handle)
+{
+	WarmConnection *warm = this->warmtable.Get(handle);
+	if (warm == nullptr)
+		return;
+	this->server.CancelTimer(warm->expire);
+	this->warmtable.Remove(handle);
+}
+
+// the listeners of one event loop of the poll engine,a listener and a PollForwarder per mapping.
+// Update moves the loop to a new list of mappings: the listeners of removed ports close,
+// a port whose mapping changed keeps its listener and sends new clients to the new mapping,
+// tunnels that are open stay as they are.
+class PollShard
+{
+public:
+	PollShard(const Options &options, network::tcp::Server &server);
+	// run on the thread of the event loop,return false if a port could not be listened on.
+	bool Update(const network::MappingList &mappings);
+
+protected:
+	struct Port
+	{
+		network::SlotHandle listener;
+		std::shared_ptr<PollForwarder> forwarder;
+	};
+
+	const Options &options;
+	network::tcp::Server &server;
+	// pending connects of all forwarders,accepting pauses on every listener at options.maxconnecting.
+	int connecting;
+	std::unordered_map<int, Port> ports;
+};
+
+PollShard::PollShard(const Options &options, network::tcp::Server &server) : options(options), server(server), connecting(0), ports() {}
+
+bool PollShard::Update(const network::MappingList &mappings)
+{
+	std::unordered_map<int, Port> ports;
+	bool listening = true;
+	for (const std::shared_ptr<network::Mapping> &mapping : mappings)
+	{
+		int localport = mapping->localport;
+		Port port;
+		std::unordered_map<int, Port>::iterator it = this->ports.find(localport);
+		if (it != this->ports.end())
 		{
-			count--;
-			cfd = accept(sfd, (sockaddr *)&clientaddr, &addrlen);
-			if (cfd == SOCKET_ERROR)
-			{
-				Println("accept socket failed");
-				return;
-			}
-			tofd = NewForward(remoteaddr, remoteport);
-			if (tofd != INVALID_SOCKET)
-			{
-				fdmap[cfd] = tofd;
-				fdmap[tofd] = cfd;
-				if (cfd > maxfd)
-					maxfd = cfd;
-				if (tofd > maxfd)
-					maxfd = tofd;
-				FD_SET(cfd, &fdset);
-				FD_SET(tofd, &fdset);
-				for (i = 0; i < 1024; i++)
-				{
-					if (clientfdlist[i] == 0)
-					{
-						clientfdlist[i] = cfd;
-						break;
-					}
-				}
-				for (i = 0; i < 1024; i++)
-				{
-					if (clientfdlist[i] == 0)
-					{
-						clientfdlist[i] = tofd;
-						break;
-					}
-				}
-			}
-			else
+			port = it->second;
+			this->ports.erase(it);
+			if (port.forwarder->GetMapping() == mapping)
 			{
-				closesocket(cfd);
+				ports[localport] = port;
+				continue;
 			}
+			port.forwarder->Retire();
+			if (!this->server.SetListenerOptions(port.listener, mapping->options.client))
+				LOG_WARN("set socket options failed port=%d errno=%d", localport, network::GetErrno());
 		}
-		i = 0;
-		while (count > 0)
+		else
 		{
-			cfd = clientfdlist[i];
-			if (FD_ISSET(cfd, &rlist))
+			port.listener = this->server.AddListener(this->options.bind.c_str(), localport, [this, localport](network::tcp::Connection &client) -> bool
+													 {
+														 std::unordered_map<int, Port>::iterator it = this->ports.find(localport);
+														 return it != this->ports.end() && it->second.forwarder->OnConnection(client); },
+													 mapping->options.client);
+			if (port.listener == network::SlotTable<network::tcp::Connection>::InvalidHandle)
 			{
-				count--;
-				size = recv(cfd, buf, buffersize, 0);
-				if (size > 0)
-				{
-					size = send(fdmap.at(cfd), buf, size, 0);
-					if (size == -1)
-					{
-						closesocket(fdmap.at(cfd));
-						closesocket(cfd);
-						for (i = 0; i < 1024; i++)
-						{
-							if (clientfdlist[i] == fdmap.at(cfd))
-							{
-								clientfdlist[i] = 0;
-								break;
-							}
-						}
-						for (i = 0; i < 1024; i++)
+				LOG_ERROR("listen failed port=%d errno=%d", localport, network::GetErrno());
+				listening = false;
+				continue;
+			}
+		}
+		port.forwarder = std::make_shared<PollForwarder>(this->options, this->server, mapping, this->connecting);
+		port.forwarder->Init();
+		ports[localport] = port;
+	}
+	for (std::pair<const int, Port> &removed : this->ports)
+	{
+		this->server.RemoveListener(removed.second.listener);
+		removed.second.forwarder->Retire();
+	}
+	this->ports.swap(ports);
+	return listening;
+}
+
+// one shard of the forwarder,every shard owns its listeners,reactor and connections.
+// with a config file the shard follows the mappings of options.table,reloads are posted to its loop.
+void ForwardPoll(const Options &options, int shard)
+{
+	network::tcp::Server server(options.bind.c_str(), 0);
+	server.SetReusePort(options.threads > 1);
+	server.SetRelay(options.splice, options.buffermin, options.buffermax);
+	server.SetIdleTimeout(options.idletimeout);
+	server.SetKeepAlive(options.keepalive);
+	server.SetBacklog(options.backlog);
+	server.SetAdmission(options.admission);
+	server.SetShaper(options.shaper);
+	server.SetOnError([](const char *message) -> void
+					  { LOG_WARN("%s", message); });
+	if (options.metrics != nullptr)
+		server.SetMetrics(options.metrics->GetShard(shard));
+	PollShard forwarder(options, server);
+	if (options.table == nullptr)
+	{
+		if (!forwarder.Update(options.mappings))
+			return;
+		server.Begin();
+		return;
+	}
+	network::MappingList mappings;
+	network::tcp::Server *pServer = &server;
+	PollShard *pForwarder = &forwarder;
+	int subscription = options.table->Subscribe([pServer, pForwarder](const network::MappingList &mappings) -> void
+												{ pServer->Post([pForwarder, mappings]() -> void
+																{ pForwarder->Update(mappings); }); },
+												mappings);
+	forwarder.Update(mappings);
+	server.Begin();
+	options.table->Unsubscribe(subscription);
+}
+
+// udp mode,one shard: datagrams of a client go to the backend the balancer picked for its session.
+// the kernel hashes a client to the same SO_REUSEPORT shard every time,so sessions are never shared.
+void ForwardUdp(const Options &options, int shard)
+{
+	network::udp::Server server("0.0.0.0", options.localport);
+	server.SetReusePort(options.threads > 1);
+	server.SetIdleTimeout(options.udptimeout);
+	server.SetOffload(options.udpoffload);
+	server.SetAdmission(options.admission);
+	if (options.metrics != nullptr)
+		server.SetMetrics(options.metrics->GetShard(shard));
+	network::Balancer *balancer = options.balancer;
+	network::Resolver *resolver = options.resolver;
+	server.SetOnSession([balancer, resolver](network::udp::Session &session) -> bool
 						{
-							if (clientfdlist[i] == cfd)
+							uint32_t source = network::SourceKey((const sockaddr *)&session.GetClient());
+							int backend = balancer->Select(network::Balancer::HashBytes(&source, sizeof(source)));
+							const network::Backend &target = balancer->Get(backend);
+							network::Resolver::Addresses addrs;
+							if (!resolver->Lookup(target.addr, target.port, addrs))
 							{
-								clientfdlist[i] = 0;
-								break;
+								// datagrams are dropped until the name is known,the client sends again.
+								resolver->Resolve(target.addr, target.port, [](const network::Resolver::Addresses &addrs) -> void {});
+								return false;
 							}
-						}
-						FD_CLR(fdmap.at(cfd), &fdset);
-						FD_CLR(cfd, &fdset);
-						fdmap.erase(fdmap.at(cfd));
-						fdmap.erase(cfd);
-					}
-				}
-				else
-				{
-					closesocket(fdmap.at(cfd));
-					closesocket(cfd);
-					FD_CLR(fdmap.at(cfd), &fdset);
-					FD_CLR(cfd, &fdset);
-					fdmap.erase(fdmap.at(cfd));
-					fdmap.erase(cfd);
-				}
-			}
+							if (addrs.empty())
+								return false;
+							balancer->Acquire(backend);
+							session.onClose = [balancer, backend](network::udp::Session &session) -> void
+							{ balancer->Release(backend); };
+							session.SetUpstream((const sockaddr *)&addrs[0]);
+							return true; });
+	server.SetOnError([](const char *message) -> void
+					  { LOG_WARN("%s", message); });
+	if (!server.Listen())
+	{
+		LOG_ERROR("udp bind failed shard=%d errno=%d", shard, server.Errno());
+		return;
+	}
+	server.Begin();
+}
+
+#ifdef __linux__
+// io_uring engine.
+// every operation carries the peer it works for in user_data,the low bits hold the operation.
+// a direction has at most one recv or send in flight: recv into a provided buffer,
+// send it to the other side,give the buffer back and recv again.
+// a recv of 0 shuts down the write side of the other peer,the tunnel closes once both sides ended.
+enum UringOp
+{
+	UringAccept = 0,
+	UringConnect = 1,
+	UringRecv = 2,
+	UringSend = 3,
+};
+
+static constexpr unsigned uringentries = 4096;
+static constexpr unsigned uringbuffers = 1024;
+static constexpr unsigned short uringbufgroup = 0;
+// user_data of the timeout driving the idle timers,no peer lives at this address.
+static constexpr uint64_t uringtick = 4;
+// user_data of the timeout after which an accept that ran out of fds or memory is armed again.
+static constexpr uint64_t uringacceptretry = 8;
+static constexpr int uringacceptbackoff = 100;
+
+struct UringTunnel;
+
+struct UringPeer
+{
+	int fd;
+	UringPeer *other;
+	UringTunnel *tunnel;
+	// provided buffer being sent to other,-1 if none.
+	int bid;
+	unsigned size;
+	unsigned sent;
+	// the peer sent its FIN and it was passed on to other.
+	bool eof;
+};
+
+struct UringTunnel
+{
+	network::SlotHandle handle;
+	UringPeer client;
+	UringPeer remote;
+	// operations submitted and not completed yet,the tunnel is freed when it drops to 0 after closing.
+	int inflight;
+	bool closed;
+	int backend;
+	// address of the client,counted by admission control.
+	uint32_t source;
+	std::chrono::steady_clock::time_point connectbegin;
+	// last time either peer received bytes.
+	std::chrono::steady_clock::time_point lastactive;
+	network::TimingWheel::TimerId idletimer;
+};
+
+class UringForwarder
+{
+public:
+	UringForwarder(const Options &options, network::socket_fd sfd, network::Metrics *metrics);
+	bool Init();
+	void Run();
+
+protected:
+	const Options &options;
+	network::socket_fd sfd;
+	// address of every backend,by backend index.
+	std::vector<sockaddr_storage> remoteaddrs;
+	__kernel_timespec connecttimeout;
+	network::Uring ring;
+	network::SlotTable<UringTunnel> tunnels;
+	// peers waiting for a provided buffer to be returned.
+	std::vector<UringPeer *> starved;
+	network::Metrics *metrics;
+	// idle timers of the tunnels,a timeout is in flight while it holds any.
+	network::TimingWheel wheel;
+	__kernel_timespec tick;
+	bool ticking;
+	__kernel_timespec acceptbackoff;
+	// time of the current batch of completions,kept only with an idle timeout.
+	std::chrono::steady_clock::time_point now;
+
+	io_uring_sqe *NextSqe();
+	void SubmitAccept();
+	// arm the accept again after uringacceptbackoff milliseconds,failing again at once would spin.
+	void SubmitAcceptRetry();
+	void SubmitConnect(UringTunnel *tunnel);
+	void SubmitRecv(UringPeer *peer);
+	void SubmitSend(UringPeer *peer);
+	// arm a timeout for the next idle timer,if there is one and none is armed.
+	void SubmitTick();
+	void StartIdleTimer(UringTunnel *tunnel, int ms);
+	void CheckIdle(network::SlotHandle handle);
+	void ReturnBuffer(unsigned short bid);
+	void CloseTunnel(UringTunnel *tunnel);
+	void Complete(UringTunnel *tunnel);
+	void HandleCqe(const io_uring_cqe &cqe);
+};
+
+UringForwarder::UringForwarder(const Options &options, network::socket_fd sfd, network::Metrics *metrics) : options(options), sfd(sfd), remoteaddrs(), connecttimeout(), ring(),
+																											 tunnels(), starved(), metrics(metrics),
+																											 wheel(), tick(), ticking(false), acceptbackoff(), now()
+{
+	this->acceptbackoff.tv_sec = uringacceptbackoff / 1000;
+	this->acceptbackoff.tv_nsec = (uringacceptbackoff % 1000) * 1000000LL;
+	this->connecttimeout.tv_sec = options.connecttimeout / 1000;
+	this->connecttimeout.tv_nsec = (options.connecttimeout % 1000) * 1000000LL;
+	for (int i = 0; i < options.balancer->Size(); i++)
+	{
+		// the engine is only used with literal addresses.
+		const network::Backend &backend = options.balancer->Get(i);
+		sockaddr_storage remoteaddr;
+		network::ParseAddress(backend.addr.c_str(), backend.port, remoteaddr);
+		this->remoteaddrs.push_back(remoteaddr);
+	}
+}
+
+bool UringForwarder::Init()
+{
+	// the kernel picks buffers from a fixed ring,so they all have the minimum relay buffer size.
+	return this->ring.Init(uringentries) && this->ring.RegisterBufferRing(uringbufgroup, uringbuffers, this->options.buffermin);
+}
+
+io_uring_sqe *UringForwarder::NextSqe()
+{
+	io_uring_sqe *sqe = this->ring.GetSqe();
+	while (sqe == nullptr)
+	{
+		this->ring.Submit(0);
+		sqe = this->ring.GetSqe();
+	}
+	return sqe;
+}
+
+void UringForwarder::SubmitAccept()
+{
+	io_uring_sqe *sqe = this->NextSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = this->sfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = UringAccept;
+}
+
+void UringForwarder::SubmitAcceptRetry()
+{
+	io_uring_sqe *sqe = this->NextSqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long)&this->acceptbackoff;
+	sqe->len = 1;
+	sqe->user_data = uringacceptretry;
+}
+
+void UringForwarder::SubmitConnect(UringTunnel *tunnel)
+{
+	io_uring_sqe *sqe = this->NextSqe();
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = tunnel->remote.fd;
+	sqe->addr = (unsigned long)&this->remoteaddrs[tunnel->backend];
+	sqe->off = network::SockAddrLength((const sockaddr *)&this->remoteaddrs[tunnel->backend]);
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = (uintptr_t)&tunnel->remote | UringConnect;
+	tunnel->inflight++;
+	tunnel->connectbegin = std::chrono::steady_clock::now();
+	// cancels the connect with -ECANCELED when it takes longer than the connect timeout.
+	sqe = this->NextSqe();
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->addr = (unsigned long)&this->connecttimeout;
+	sqe->len = 1;
+	sqe->user_data = network::Uring::InternalUserData;
+}
+
+void UringForwarder::SubmitRecv(UringPeer *peer)
+{
+	io_uring_sqe *sqe = this->NextSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = peer->fd;
+	sqe->len = this->ring.GetBufferSize();
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = uringbufgroup;
+	sqe->user_data = (uintptr_t)peer | UringRecv;
+	peer->tunnel->inflight++;
+}
+
+void UringForwarder::SubmitSend(UringPeer *peer)
+{
+	io_uring_sqe *sqe = this->NextSqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = peer->other->fd;
+	sqe->addr = (unsigned long)(this->ring.GetBuffer(peer->bid) + peer->sent);
+	sqe->len = peer->size - peer->sent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t)peer | UringSend;
+	peer->tunnel->inflight++;
+}
+
+void UringForwarder::SubmitTick()
+{
+	// idle timers all have the same length,so a timer added later never expires before the armed timeout.
+	int timeout = this->wheel.NextTimeout(this->now);
+	if (this->ticking || timeout < 0)
+		return;
+	this->tick.tv_sec = timeout / 1000;
+	this->tick.tv_nsec = (timeout % 1000) * 1000000LL;
+	io_uring_sqe *sqe = this->NextSqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long)&this->tick;
+	sqe->len = 1;
+	sqe->user_data = uringtick;
+	this->ticking = true;
+}
+
+void UringForwarder::StartIdleTimer(UringTunnel *tunnel, int ms)
+{
+	network::SlotHandle handle = tunnel->handle;
+	tunnel->idletimer = this->wheel.Add(ms, [this, handle]() -> void
+										{ this->CheckIdle(handle); });
+}
+
+void UringForwarder::CheckIdle(network::SlotHandle handle)
+{
+	UringTunnel *tunnel = this->tunnels.Get(handle);
+	if (tunnel == nullptr || tunnel->closed)
+		return;
+	tunnel->idletimer = network::TimingWheel::InvalidTimer;
+	int idle = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tunnel->lastactive).count();
+	if (idle >= this->options.idletimeout)
+	{
+		LOG_DEBUG("idle tunnel closed fd=%d idle=%dms", tunnel->client.fd, idle);
+		this->CloseTunnel(tunnel);
+		return;
+	}
+	this->StartIdleTimer(tunnel, this->options.idletimeout - idle);
+}
+
+void UringForwarder::ReturnBuffer(unsigned short bid)
+{
+	this->ring.ProvideBuffer(bid);
+	while (!this->starved.empty())
+	{
+		UringPeer *peer = this->starved.back();
+		this->starved.pop_back();
+		peer->tunnel->inflight--;
+		if (peer->tunnel->closed)
+		{
+			this->Complete(peer->tunnel);
+			continue;
+		}
+		this->SubmitRecv(peer);
+		break;
+	}
+}
+
+void UringForwarder::CloseTunnel(UringTunnel *tunnel)
+{
+	if (tunnel->closed)
+		return;
+	tunnel->closed = true;
+	// wake up the operations still pending,their completions release the tunnel.
+	shutdown(tunnel->client.fd, SHUT_RDWR);
+	shutdown(tunnel->remote.fd, SHUT_RDWR);
+}
+
+// called after an operation of a closed tunnel completes.
+void UringForwarder::Complete(UringTunnel *tunnel)
+{
+	if (tunnel->inflight > 0)
+		return;
+	close(tunnel->client.fd);
+	close(tunnel->remote.fd);
+	this->wheel.Cancel(tunnel->idletimer);
+	if (this->options.admission != nullptr)
+		this->options.admission->Release(tunnel->source);
+	this->options.balancer->Release(tunnel->backend);
+	if (this->metrics != nullptr)
+		this->metrics->Add(network::Metrics::Closes);
+	this->tunnels.Remove(tunnel->handle);
+}
+
+void UringForwarder::HandleCqe(const io_uring_cqe &cqe)
+{
+	if (cqe.user_data == network::Uring::InternalUserData)
+		return;
+	// the timeout only wakes the loop,the wheel advances after every batch.
+	if (cqe.user_data == uringtick)
+	{
+		this->ticking = false;
+		return;
+	}
+	if (cqe.user_data == uringacceptretry)
+	{
+		this->SubmitAccept();
+		return;
+	}
+	UringOp op = (UringOp)(cqe.user_data & 3);
+	if (op == UringAccept)
+	{
+		// out of fds or memory the accept fails again until a tunnel closes,so it waits a while.
+		bool exhausted = cqe.res == -EMFILE || cqe.res == -ENFILE || cqe.res == -ENOBUFS || cqe.res == -ENOMEM;
+		if (exhausted && this->metrics != nullptr)
+			this->metrics->Add(network::Metrics::AcceptFailures);
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+		{
+			if (exhausted)
+				this->SubmitAcceptRetry();
+			else
+				this->SubmitAccept();
+		}
+		if (cqe.res < 0)
+			return;
+		sockaddr_storage clientaddr = {};
+		uint32_t source = 0;
+		if (this->options.balancer->GetStrategy() == network::Balancer::Hash || this->options.admission != nullptr)
+		{
+			// multishot accept does not return addresses.
+			socklen_t addrlen = sizeof(clientaddr);
+			getpeername(cqe.res, (sockaddr *)&clientaddr, &addrlen);
+			source = network::SourceKey((const sockaddr *)&clientaddr);
+		}
+		if (this->options.admission != nullptr && !this->options.admission->Admit(source))
+		{
+			network::CloseReset(cqe.res);
+			if (this->metrics != nullptr)
+				this->metrics->Add(network::Metrics::Rejects);
+			return;
+		}
+		uint32_t clienthash = 0;
+		if (this->options.balancer->GetStrategy() == network::Balancer::Hash)
+			clienthash = network::Balancer::HashBytes(&source, sizeof(source));
+		int backend = this->options.balancer->Select(clienthash);
+		int tofd = socket(this->remoteaddrs[backend].ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (tofd == -1)
+		{
+			close(cqe.res);
+			if (this->options.admission != nullptr)
+				this->options.admission->Release(source);
+			return;
+		}
+		if (this->options.keepalive > 0)
+		{
+			network::EnableKeepAlive(cqe.res, this->options.keepalive);
+			network::EnableKeepAlive(tofd, this->options.keepalive);
+		}
+		this->options.balancer->Acquire(backend);
+		if (this->metrics != nullptr)
+			this->metrics->Add(network::Metrics::Accepts);
+		network::SlotHandle handle;
+		UringTunnel *tunnel = this->tunnels.Add(handle);
+		*tunnel = UringTunnel{handle, {cqe.res, nullptr, nullptr, -1, 0, 0, false}, {tofd, nullptr, nullptr, -1, 0, 0, false}, 0, false, backend,
+							  source};
+		tunnel->idletimer = network::TimingWheel::InvalidTimer;
+		tunnel->client.other = &tunnel->remote;
+		tunnel->client.tunnel = tunnel;
+		tunnel->remote.other = &tunnel->client;
+		tunnel->remote.tunnel = tunnel;
+		this->SubmitConnect(tunnel);
+		return;
+	}
+
+	UringPeer *peer = reinterpret_cast<UringPeer *>(cqe.user_data & ~(uintptr_t)3);
+	UringTunnel *tunnel = peer->tunnel;
+	tunnel->inflight--;
+	if (tunnel->closed)
+	{
+		if (cqe.flags & IORING_CQE_F_BUFFER)
+			this->ReturnBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		if (op == UringSend)
+			this->ReturnBuffer(peer->bid);
+		this->Complete(tunnel);
+		return;
+	}
+	switch (op)
+	{
+	case UringConnect:
+		if (this->metrics != nullptr)
+		{
+			if (cqe.res < 0)
+				this->metrics->Add(network::Metrics::ConnectFailures);
+			else
+				this->metrics->Connected(tunnel->connectbegin);
+		}
+		if (cqe.res < 0)
+		{
+			this->CloseTunnel(tunnel);
+			this->Complete(tunnel);
+			return;
+		}
+		this->SubmitRecv(&tunnel->client);
+		this->SubmitRecv(&tunnel->remote);
+		if (this->options.idletimeout > 0)
+		{
+			tunnel->lastactive = this->now;
+			this->StartIdleTimer(tunnel, this->options.idletimeout);
+		}
+		return;
+	case UringRecv:
+		if (cqe.res == -ENOBUFS)
+		{
+			// counted as in flight until a buffer comes back.
+			tunnel->inflight++;
+			this->starved.push_back(peer);
+			return;
+		}
+		if (cqe.res <= 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+			this->ReturnBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		if (cqe.res == 0)
+		{
+			// the last send of this direction completed before the recv,pass the FIN on.
+			peer->eof = true;
+			if (shutdown(peer->other->fd, SHUT_WR) == 0 && !peer->other->eof)
+				return;
+		}
+		if (cqe.res <= 0)
+		{
+			this->CloseTunnel(tunnel);
+			this->Complete(tunnel);
+			return;
+		}
+		tunnel->lastactive = this->now;
+		if (this->metrics != nullptr)
+			this->metrics->Add(peer == &tunnel->client ? network::Metrics::BytesIn : network::Metrics::BytesOut, cqe.res);
+		peer->bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		peer->size = cqe.res;
+		peer->sent = 0;
+		this->SubmitSend(peer);
+		return;
+	case UringSend:
+		if (cqe.res <= 0)
+		{
+			this->ReturnBuffer(peer->bid);
+			peer->bid = -1;
+			this->CloseTunnel(tunnel);
+			this->Complete(tunnel);
+			return;
+		}
+		peer->sent += cqe.res;
+		if (peer->sent < peer->size)
+		{
+			this->SubmitSend(peer);
+			return;
+		}
+		this->ReturnBuffer(peer->bid);
+		peer->bid = -1;
+		this->SubmitRecv(peer);
+		return;
+	default:
+		return;
+	}
+}
+
+void UringForwarder::Run()
+{
+	this->SubmitAccept();
+	for (;;)
+	{
+		// one io_uring_enter per iteration submits everything queued by the last batch of completions.
+		if (this->ring.Submit(1) < 0)
+		{
+			LOG_ERROR("io_uring_enter failed errno=%d", errno);
+			return;
+		}
+		if (this->options.idletimeout > 0)
+			this->now = std::chrono::steady_clock::now();
+		this->ring.ForEachCqe([this](const io_uring_cqe &cqe) -> void
+							  { this->HandleCqe(cqe); });
+		if (this->options.idletimeout > 0)
+		{
+			this->wheel.Advance(this->now);
+			this->SubmitTick();
+		}
+	}
+}
+
+// true if every backend is an address literal,which needs no resolver.
+bool LiteralBackends(const network::Balancer &balancer)
+{
+	sockaddr_storage addr;
+	for (int i = 0; i < balancer.Size(); i++)
+	{
+		if (!network::ParseAddress(balancer.Get(i).addr.c_str(), 0, addr))
+			return false;
+	}
+	return true;
+}
+
+// return false if io_uring is not usable,the caller falls back to the poll engine.
+bool ForwardUring(const Options &options, int shard)
+{
+	network::tcp::Server server(options.bind.c_str(), options.localport);
+	server.SetReusePort(options.threads > 1);
+	server.SetBacklog(options.backlog);
+	if (!server.Listen())
+	{
+		LOG_ERROR("listen failed shard=%d errno=%d", shard, server.Errno());
+		return true;
+	}
+	UringForwarder forwarder(options, server.GetFd(), options.metrics != nullptr ? options.metrics->GetShard(shard) : nullptr);
+	if (!forwarder.Init())
+	{
+		LOG_WARN("io_uring setup failed,using poll shard=%d errno=%d", shard, errno);
+		server.Close();
+		return false;
+	}
+	forwarder.Run();
+	return true;
+}
+#endif
+
+// build the tls contexts of the mappings that need them and do not have them yet,
+// return false and set error if a certificate,key or ca can not be loaded,
+// or a mapping asks for compression or trunks,which only forward-boost serves.
+bool LoadTls(const network::MappingList &mappings, std::string &error)
+{
+	for (const std::shared_ptr<network::Mapping> &mapping : mappings)
+	{
+		if (mapping->options.Compressed() || mapping->options.Trunked())
+		{
+			error = "port " + std::to_string(mapping->localport) + " needs compression or trunks,which only forward-boost serves";
+			return false;
+		}
+		const network::TlsSettings &tls = mapping->options.tls;
+		if (!tls.Enabled())
+			continue;
+#ifdef FORWARD_TLS
+		if (!tls.cert.empty() && !mapping->accepttls && !(mapping->accepttls = network::TlsContext::NewServer(tls.cert, tls.key, error)))
+			return false;
+		if (tls.connect && !mapping->connecttls && !(mapping->connecttls = network::TlsContext::NewClient(tls.ca, tls.insecure, error)))
+			return false;
+#else
+		error = "port " + std::to_string(mapping->localport) + " needs tls,build with -DFORWARD_TLS and link -lssl -lcrypto";
+		return false;
+#endif
+	}
+	return true;
+}
+
+void Forward(const Options &options, int shard)
+{
+	if (options.udp)
+	{
+		ForwardUdp(options, shard);
+		return;
+	}
+#ifdef __linux__
+	// prewarmed connections,shaping,several mappings,tls,socket options and backends given by name are kept by the poll engine only.
+	if (options.uring && options.prewarm == 0 && options.shaper == nullptr && options.mappings.size() == 1 && options.table == nullptr &&
+		!options.mappings[0]->options.tls.Enabled() && options.mappings[0]->options.client.Empty() &&
+		options.mappings[0]->options.upstream.Empty() && LiteralBackends(*options.balancer) && ForwardUring(options, shard))
+		return;
+#endif
+	ForwardPoll(options, shard);
+}
+
+void PinThread(std::thread &thread, int cpu)
+{
+#ifdef __linux__
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu % std::thread::hardware_concurrency(), &cpuset);
+	if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset) != 0)
+		LOG_WARN("pin thread failed cpu=%d", cpu);
+#endif
+}
+
+void LogMappings(const network::MappingList &mappings, const char *protocol)
+{
+	for (const std::shared_ptr<network::Mapping> &mapping : mappings)
+	{
+		for (int i = 0; i < mapping->balancer.Size(); i++)
+			LOG_INFO("forwarding port=%d protocol=%s backend=%s:%d", mapping->localport, protocol, mapping->balancer.Get(i).addr.c_str(), mapping->balancer.Get(i).port);
+	}
+}
+
+#ifndef _WIN32
+// read config again on every SIGHUP,a wrong file keeps the mappings served now.
+void ReloadOnHangup(const Options &options, const sigset_t &signals)
+{
+	int signal;
+	while (sigwait(&signals, &signal) == 0)
+	{
+		network::MappingList mappings;
+		std::string error;
+		if (!network::LoadMappings(options.config.c_str(), options.strategy, options.table->Get(), mappings, error, options.defaults) ||
+			!LoadTls(mappings, error))
+		{
+			LOG_ERROR("reload failed %s", error.c_str());
+			continue;
+		}
+		LOG_INFO("reloaded config=%s mappings=%d", options.config.c_str(), (int)mappings.size());
+		LogMappings(mappings, "tcp");
+		options.table->Replace(mappings);
+	}
+}
+#endif
+
+void Begin(const Options &options)
+{
+	LogMappings(options.mappings, options.udp ? "udp" : "tcp");
+#ifndef _WIN32
+	// blocked before the threads start so they inherit the mask and only sigwait gets SIGHUP.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	if (options.table != nullptr)
+		pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+#endif
+	if (options.threads == 1 && options.table == nullptr)
+	{
+		Forward(options, 0);
+		return;
+	}
+	std::vector<std::thread> threads;
+	for (int i = 0; i < options.threads; i++)
+	{
+		threads.emplace_back(Forward, std::cref(options), i);
+		if (options.pin)
+			PinThread(threads.back(), i);
+	}
+#ifndef _WIN32
+	if (options.table != nullptr)
+		ReloadOnHangup(options, signals);
+#endif
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+// parse options,return false on wrong usage.
+bool ParseOptions(int argc, char **argv, Options &options)
+{
+	options.threads = 1;
+	options.pin = false;
+	options.uring = false;
+	options.connecttimeout = 10000;
+	options.maxconnecting = 1024;
+	options.buffermin = 16384;
+	options.buffermax = 262144;
+	options.prewarm = 0;
+	options.prewarmidle = 30000;
+	options.idletimeout = 0;
+	options.keepalive = 0;
+	options.backlog = SOMAXCONN;
+	options.udp = false;
+	options.udptimeout = 30000;
+	options.udpoffload = false;
+	options.strategy = network::Balancer::RoundRobin;
+	options.bind = "0.0.0.0";
+	options.metricsaddr = "127.0.0.1";
+	options.metricsport = 0;
+#ifdef __linux__
+	options.splice = true;
+#else
+	options.splice = false;
+#endif
+	int i = 1;
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			options.threads = atoi(argv[++i]);
+			if (options.threads < 1)
+				return false;
+		}
+		else if (strcmp(argv[i], "--pin") == 0)
+			options.pin = true;
+		else if (strcmp(argv[i], "--relay") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "copy") == 0)
+				options.splice = false;
+			else if (strcmp(argv[i], "splice") == 0)
+				options.splice = true;
+			else
+				return false;
+		}
+		else if (strcmp(argv[i], "--connect-timeout") == 0 && i + 1 < argc)
+		{
+			options.connecttimeout = atoi(argv[++i]);
+			if (options.connecttimeout < 1)
+				return false;
+		}
+		else if (strcmp(argv[i], "--max-connecting") == 0 && i + 1 < argc)
+		{
+			options.maxconnecting = atoi(argv[++i]);
+			if (options.maxconnecting < 1)
+				return false;
+		}
+		else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc)
+		{
+			options.backlog = atoi(argv[++i]);
+			if (options.backlog < 1)
+				return false;
+		}
+		else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc)
+		{
+			int maxconnections = atoi(argv[++i]);
+			if (maxconnections < 0)
+				return false;
+			options.admission->SetMaxConnections(maxconnections);
+		}
+		else if (strcmp(argv[i], "--max-per-ip") == 0 && i + 1 < argc)
+		{
+			int maxperip = atoi(argv[++i]);
+			if (maxperip < 0)
+				return false;
+			options.admission->SetMaxPerSource(maxperip);
+		}
+		else if (strcmp(argv[i], "--accept-rate") == 0 && i + 1 < argc)
+		{
+			double rate = atof(argv[++i]);
+			const char *burst = strchr(argv[i], ':');
+			if (rate < 0 || (burst != nullptr && atoi(burst + 1) < 1))
+				return false;
+			options.admission->SetRate(rate, burst != nullptr ? atoi(burst + 1) : (int)rate);
+		}
+		else if (strcmp(argv[i], "--buffer-min") == 0 && i + 1 < argc)
+		{
+			options.buffermin = atoi(argv[++i]);
+			if (options.buffermin < 1)
+				return false;
+		}
+		else if (strcmp(argv[i], "--buffer-max") == 0 && i + 1 < argc)
+		{
+			options.buffermax = atoi(argv[++i]);
+			if (options.buffermax < 1)
+				return false;
+		}
+		else if (strcmp(argv[i], "--prewarm") == 0 && i + 1 < argc)
+		{
+			options.prewarm = atoi(argv[++i]);
+			if (options.prewarm < 0)
+				return false;
+		}
+		else if (strcmp(argv[i], "--prewarm-idle") == 0 && i + 1 < argc)
+		{
+			options.prewarmidle = atoi(argv[++i]);
+			if (options.prewarmidle < 1)
+				return false;
+		}
+		else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc)
+		{
+			options.idletimeout = atoi(argv[++i]);
+			if (options.idletimeout < 0)
+				return false;
+		}
+		else if (strcmp(argv[i], "--keepalive") == 0 && i + 1 < argc)
+		{
+			options.keepalive = atoi(argv[++i]);
+			if (options.keepalive < 0)
+				return false;
+		}
+		else if (strncmp(argv[i], "--rate-", 7) == 0 && i + 1 < argc)
+		{
+			int64_t rate = network::Shaper::ParseBytes(argv[i + 1]);
+			if (rate < 0)
+				return false;
+			if (strcmp(argv[i], "--rate-tunnel") == 0)
+				options.shaper->SetTunnelRate(rate);
+			else if (strcmp(argv[i], "--rate-ip") == 0)
+				options.shaper->SetSourceRate(rate);
+			else if (strcmp(argv[i], "--rate-total") == 0)
+				options.shaper->SetGlobalRate(rate);
+			else
+				return false;
 			i++;
 		}
+		else if (strcmp(argv[i], "--bulk-threshold") == 0 && i + 1 < argc)
+		{
+			int64_t threshold = network::Shaper::ParseBytes(argv[++i]);
+			if (threshold < 0)
+				return false;
+			options.shaper->SetBulkThreshold(threshold);
+		}
+		else if (strcmp(argv[i], "--udp") == 0)
+			options.udp = true;
+		else if (strcmp(argv[i], "--udp-timeout") == 0 && i + 1 < argc)
+		{
+			options.udptimeout = atoi(argv[++i]);
+			if (options.udptimeout < 1)
+				return false;
+		}
+		else if (strcmp(argv[i], "--udp-offload") == 0)
+			options.udpoffload = true;
+		else if (strcmp(argv[i], "--balance") == 0 && i + 1 < argc)
+		{
+			network::Balancer balancer;
+			if (!balancer.SetStrategy(argv[++i]))
+				return false;
+			options.strategy = balancer.GetStrategy();
+		}
+		else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+			options.config = argv[++i];
+		else if (strcmp(argv[i], "--tls-cert") == 0 && i + 1 < argc)
+			options.defaults.tls.cert = argv[++i];
+		else if (strcmp(argv[i], "--tls-key") == 0 && i + 1 < argc)
+			options.defaults.tls.key = argv[++i];
+		else if (strcmp(argv[i], "--tls-connect") == 0)
+			options.defaults.tls.connect = true;
+		else if (strcmp(argv[i], "--tls-ca") == 0 && i + 1 < argc)
+			options.defaults.tls.ca = argv[++i];
+		else if (strcmp(argv[i], "--tls-insecure") == 0)
+			options.defaults.tls.insecure = true;
+		else if (strcmp(argv[i], "--client-sockopt") == 0 && i + 1 < argc)
+		{
+			if (!network::ParseSocketOptions(argv[++i], options.defaults.client))
+				return false;
+		}
+		else if (strcmp(argv[i], "--upstream-sockopt") == 0 && i + 1 < argc)
+		{
+			if (!network::ParseSocketOptions(argv[++i], options.defaults.upstream))
+				return false;
+		}
+		else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc)
+		{
+			sockaddr_storage addr;
+			options.bind = argv[++i];
+			if (!network::ParseAddress(options.bind.c_str(), 0, addr))
+				return false;
+		}
+		else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+		{
+			const char *port = strrchr(argv[++i], ':');
+			if (port != nullptr)
+				options.metricsaddr.assign(argv[i], port - argv[i]);
+			options.metricsport = atoi(port != nullptr ? port + 1 : argv[i]);
+			if (options.metricsport < 1 || options.metricsport > 65535)
+				return false;
+		}
+		else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc)
+		{
+			if (!network::Logger::Get().SetLevel(argv[++i]))
+				return false;
+		}
+		else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "uring") == 0)
+				options.uring = true;
+			else if (strcmp(argv[i], "poll") == 0)
+				options.uring = false;
+			else
+				return false;
+		}
+		else
+			return false;
+	}
+	if (!options.config.empty())
+	{
+		// udp sessions are not kept across a reload.
+		if (i < argc || options.udp)
+			return false;
+		std::string error;
+		if (!network::LoadMappings(options.config.c_str(), options.strategy, network::MappingList(), options.mappings, error, options.defaults))
+		{
+			LOG_ERROR("%s", error.c_str());
+			return false;
+		}
 	}
+	else
+	{
+		std::shared_ptr<network::Mapping> mapping = network::ParseMapping(std::vector<std::string>(argv + i, argv + argc), options.strategy, options.defaults);
+		if (!mapping)
+			return false;
+		options.mappings.push_back(mapping);
+	}
+	// udp sessions are keyed by ipv4 client addresses,and tls and socket options are of tcp streams.
+	if (options.udp && (options.bind.find(':') != std::string::npos || options.mappings[0]->options.tls.Enabled() ||
+						!options.mappings[0]->options.client.Empty() || !options.mappings[0]->options.upstream.Empty()))
+		return false;
+	std::string error;
+	if (!LoadTls(options.mappings, error))
+	{
+		LOG_ERROR("%s", error.c_str());
+		return false;
+	}
+	options.localport = options.mappings[0]->localport;
+	options.balancer = &options.mappings[0]->balancer;
+	if (!options.admission->Enabled())
+		options.admission = nullptr;
+	if (!options.shaper->Enabled())
+		options.shaper = nullptr;
+	return true;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc < 4)
+#ifndef _WIN32
+	// a peer closing while we write must fail the write instead of killing the process.
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	network::Admission admission;
+	network::Shaper shaper;
+	network::MetricsServer metrics;
+	network::Resolver resolver;
+	Options options;
+	options.admission = &admission;
+	options.shaper = &shaper;
+	options.metrics = nullptr;
+	options.table = nullptr;
+	options.resolver = &resolver;
+	if (!ParseOptions(argc, argv, options))
 	{
 		PrintHelp();
 		return 1;
 	}
-	Forward(atoi(argv[1]), argv[2], atoi(argv[3]));
+	if (!resolver.Start())
+	{
+		LOG_ERROR("resolver start failed errno=%d", network::GetErrno());
+		return 1;
+	}
+	network::MappingTable table(options.mappings);
+	if (!options.config.empty())
+		options.table = &table;
+	if (options.metricsport != 0)
+	{
+		for (int i = 0; i < options.threads; i++)
+			metrics.AddShard();
+		metrics.AddCollector([&table](std::string &text) -> void
+							 {
+								 text += "# HELP forward_backend_active_tunnels Tunnels relayed to a backend.\n# TYPE forward_backend_active_tunnels gauge\n";
+								 for (const std::shared_ptr<network::Mapping> &mapping : table.Get())
+								 {
+									 for (int i = 0; i < mapping->balancer.Size(); i++)
+									 {
+										 const network::Backend &backend = mapping->balancer.Get(i);
+										 text += "forward_backend_active_tunnels{port=\"" + std::to_string(mapping->localport) + "\",backend=\"" + backend.addr + ":" + std::to_string(backend.port) + "\"} " +
+												 std::to_string(backend.active.load(std::memory_order_relaxed)) + "\n";
+									 }
+								 } });
+		if (!metrics.Start(options.metricsaddr.c_str(), options.metricsport))
+		{
+			LOG_ERROR("metrics listen failed addr=%s:%d", options.metricsaddr.c_str(), options.metricsport);
+			return 1;
+		}
+		options.metrics = &metrics;
+	}
+	Begin(options);
 }
\ No newline at end of file
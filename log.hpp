@@ -0,0 +1,243 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+// messages below this level are compiled out with their arguments,
+// build with -DLOG_MIN_LEVEL=0 to keep debug messages.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+// log a printf style message,by convention a few words followed by key=value fields.
+#define LOG_AT(level, ...)                                                                           \
+	do                                                                                               \
+	{                                                                                                \
+		if ((level) >= LOG_MIN_LEVEL && network::Logger::Get().Enabled(level))                       \
+			network::Logger::Get().Write(level, __FILE__, __LINE__, __VA_ARGS__);                    \
+	} while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#ifdef __GNUC__
+#define LOG_PRINTF_FORMAT(formatindex, argsindex) __attribute__((format(printf, formatindex, argsindex)))
+#else
+#define LOG_PRINTF_FORMAT(formatindex, argsindex)
+#endif
+
+namespace network
+{
+	// asynchronous logger writing to stderr.
+	// every thread formats its messages into its own single producer ring,a background thread
+	// drains the rings and does the writing,so logging never blocks on the console and
+	// threads never contend with each other.
+	// messages are dropped when a ring is full,and the count of dropped messages is logged.
+	class Logger
+	{
+	public:
+		static Logger &Get();
+
+		Logger(const Logger &rhs) = delete;
+		~Logger();
+
+		Logger &operator=(const Logger &rhs) = delete;
+
+		bool Enabled(int level) const;
+		void SetLevel(int level);
+		// debug,info,warn,error or off,return false for another name.
+		bool SetLevel(const char *name);
+		void Write(int level, const char *file, int line, const char *format, ...) LOG_PRINTF_FORMAT(5, 6);
+
+	protected:
+		static constexpr size_t ringsize = 1024;
+		static constexpr size_t textsize = 200;
+
+		struct Record
+		{
+			long long time;
+			const char *file;
+			int line;
+			int level;
+			char text[textsize];
+		};
+
+		// ring of one producer thread and the writer thread.
+		struct Ring
+		{
+			std::unique_ptr<Record[]> records;
+			// next record to write,only the writer thread moves it.
+			std::atomic<size_t> head;
+			// next free record,only the producer moves it.
+			std::atomic<size_t> tail;
+			std::atomic<unsigned long long> dropped;
+
+			Ring() : records(new Record[ringsize]), head(0), tail(0), dropped(0) {}
+		};
+
+		std::atomic<int> level;
+		// taken only to register the ring of a new thread and by the writer thread.
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Ring>> rings;
+		// the writer drains what is left and exits,at the end of the process.
+		std::atomic<bool> stopped;
+		std::thread writer;
+
+		Logger();
+
+		Ring *LocalRing();
+		void Run();
+		// write what the rings hold,return the number of messages written.
+		size_t Drain();
+		void Output(const Record &record);
+	};
+}
+
+namespace network
+{
+	Logger &Logger::Get()
+	{
+		static Logger logger;
+		return logger;
+	}
+
+	Logger::Logger() : level(LOG_MIN_LEVEL), mutex(), rings(), stopped(false), writer()
+	{
+		this->writer = std::thread(&Logger::Run, this);
+	}
+
+	Logger::~Logger()
+	{
+		this->stopped = true;
+		if (this->writer.joinable())
+			this->writer.join();
+	}
+
+	bool Logger::Enabled(int level) const { return level >= this->level.load(std::memory_order_relaxed); }
+
+	void Logger::SetLevel(int level) { this->level = level < LOG_MIN_LEVEL ? LOG_MIN_LEVEL : level; }
+
+	bool Logger::SetLevel(const char *name)
+	{
+		static const char *names[] = {"debug", "info", "warn", "error", "off"};
+		for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_OFF; level++)
+		{
+			if (strcmp(name, names[level]) == 0)
+			{
+				this->SetLevel(level);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	Logger::Ring *Logger::LocalRing()
+	{
+		thread_local Ring *ring = nullptr;
+		if (ring == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->rings.emplace_back(new Ring());
+			ring = this->rings.back().get();
+		}
+		return ring;
+	}
+
+	void Logger::Write(int level, const char *file, int line, const char *format, ...)
+	{
+		Ring *ring = this->LocalRing();
+		size_t tail = ring->tail.load(std::memory_order_relaxed);
+		if (tail - ring->head.load(std::memory_order_acquire) >= ringsize)
+		{
+			ring->dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		Record &record = ring->records[tail % ringsize];
+		record.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		record.file = file;
+		record.line = line;
+		record.level = level;
+		va_list args;
+		va_start(args, format);
+		vsnprintf(record.text, textsize, format, args);
+		va_end(args);
+		ring->tail.store(tail + 1, std::memory_order_release);
+	}
+
+	void Logger::Run()
+	{
+		while (!this->stopped.load())
+		{
+			// sleep only while idle,a busy logger is drained back to back.
+			if (this->Drain() == 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		this->Drain();
+	}
+
+	size_t Logger::Drain()
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		size_t count = 0, head, tail;
+		unsigned long long dropped;
+		Record record;
+		for (const std::unique_ptr<Ring> &ring : this->rings)
+		{
+			head = ring->head.load(std::memory_order_relaxed);
+			tail = ring->tail.load(std::memory_order_acquire);
+			for (; head != tail; head++, count++)
+				this->Output(ring->records[head % ringsize]);
+			ring->head.store(head, std::memory_order_release);
+			dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+			if (dropped > 0)
+			{
+				record.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+				record.file = __FILE__;
+				record.line = __LINE__;
+				record.level = LOG_LEVEL_WARN;
+				snprintf(record.text, textsize, "log messages dropped count=%llu", dropped);
+				this->Output(record);
+				count++;
+			}
+		}
+		if (count > 0)
+			fflush(stderr);
+		return count;
+	}
+
+	void Logger::Output(const Record &record)
+	{
+		static const char *names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+		time_t seconds = (time_t)(record.time / 1000);
+		tm utc;
+#ifdef _WIN32
+		gmtime_s(&utc, &seconds);
+		const char *file = strrchr(record.file, '\\');
+#else
+		gmtime_r(&seconds, &utc);
+		const char *file = strrchr(record.file, '/');
+#endif
+		file = file == nullptr ? record.file : file + 1;
+		fprintf(stderr, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ %s %s:%d %s\n", utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+				utc.tm_hour, utc.tm_min, utc.tm_sec, (int)(record.time % 1000), names[record.level], file, record.line, record.text);
+	}
+}
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef __MAPPING_H__
+#define __MAPPING_H__
+
+#include <stdlib.h>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "balancer.hpp"
+#include "network.hpp"
+#include "shaper.hpp"
+
+namespace network
+{
+	class TlsContext;
+
+	// tls of the two sides of a mapping.
+	struct TlsSettings
+	{
+		// accept tls from clients with this certificate chain and key,empty for plain tcp.
+		std::string cert;
+		std::string key;
+		// connect to backends with tls.
+		bool connect;
+		// verify the certificates of backends against ca,the system store if empty,unless insecure.
+		std::string ca;
+		bool insecure;
+
+		TlsSettings() : cert(), key(), connect(false), ca(), insecure(false) {}
+
+		bool Enabled() const { return !this->cert.empty() || this->connect; }
+	};
+
+	// what a mapping may set besides its strategy,a mapping that sets none of one kind gets those of the command line.
+	struct MappingOptions
+	{
+		TlsSettings tls;
+		// sockets of the listener and of the clients it accepts.
+		SocketOptions client;
+		// sockets connected to backends.
+		SocketOptions upstream;
+		// compress what is sent to backends,or to clients,the forwarder on the other end of that side
+		// decompresses it and compresses what it sends back.at most one of them.
+		bool compressupstream;
+		bool compressclient;
+		// carry the clients as streams over trunkupstream trunks to the backends,which are forwarders
+		// accepting trunks,or accept trunks from clients,which are such forwarders.at most one of them.
+		int trunkupstream;
+		bool trunkclient;
+
+		MappingOptions() : tls(), client(), upstream(), compressupstream(false), compressclient(false), trunkupstream(0), trunkclient(false) {}
+
+		bool Compressed() const { return this->compressupstream || this->compressclient; }
+		bool Trunked() const { return this->trunkupstream > 0 || this->trunkclient; }
+	};
+
+	// a local port and the backends its clients are forwarded to.
+	struct Mapping
+	{
+		int localport;
+		Balancer balancer;
+		MappingOptions options;
+		// contexts built from tls by the forwarder when the mapping is loaded,nullptr for a plain side.
+		std::shared_ptr<TlsContext> accepttls;
+		std::shared_ptr<TlsContext> connecttls;
+		// the words it was defined with,a reload keeps a mapping whose definition did not change.
+		std::string definition;
+
+		Mapping() : localport(0), balancer(), options(), accepttls(), connecttls(), definition() {}
+	};
+
+	using MappingList = std::vector<std::shared_ptr<Mapping>>;
+
+	// parse "[options] localport remoteaddr remoteport[:weight] [remoteaddr remoteport[:weight]]...",
+	// options are --balance STRATEGY,--tls-cert FILE,--tls-key FILE,--tls-connect,--tls-ca FILE,--tls-insecure,
+	// --client-sockopt SPEC,--upstream-sockopt SPEC,--compress-upstream,--compress-client,--trunk-upstream N and --trunk-client,
+	// strategy and defaults apply to what they do not set.
+	// return nullptr on wrong usage.
+	std::shared_ptr<Mapping> ParseMapping(const std::vector<std::string> &words, Balancer::Strategy strategy,
+										  const MappingOptions &defaults = MappingOptions());
+	// parse the mapping option at words[i],advance i past it,return false if it is not one.
+	bool ParseMappingOption(const std::vector<std::string> &words, size_t &i, Mapping &mapping);
+	// parse SPEC,"nodelay,rcvbuf=BYTES,sndbuf=BYTES,notsent-lowat=BYTES,fastopen[=QUEUE],keepalive=SEC,autotune[=MAXBYTES]",
+	// any of them in any order,K,M and G multiply BYTES by 1024.return false if an item is wrong.
+	bool ParseSocketOptions(const std::string &spec, SocketOptions &options);
+	// read a mapping per line of path,blank lines and lines starting with # are skipped.
+	// mappings of previous whose definition did not change are kept as they are,so their balancers keep counting.
+	// return false and set error if the file can not be read,a line is wrong or two mappings share a port.
+	bool LoadMappings(const char *path, Balancer::Strategy strategy, const MappingList &previous, MappingList &mappings, std::string &error,
+					  const MappingOptions &defaults = MappingOptions());
+
+	// the mappings served now,replaced as a whole by a reload.
+	// event loops subscribe and get every new list,a subscriber passes it on to its own thread,
+	// so the lock is only taken by reloads,subscriptions and metric scrapes.
+	class MappingTable
+	{
+	public:
+		using OnUpdate = std::function<void(const MappingList &mappings)>;
+
+		MappingTable(const MappingList &mappings);
+		MappingTable(const MappingTable &rhs) = delete;
+
+		MappingTable &operator=(const MappingTable &rhs) = delete;
+
+		MappingList Get();
+		// call onUpdate with every later list,return the id of the subscription and the current list in mappings.
+		int Subscribe(OnUpdate onUpdate, MappingList &mappings);
+		void Unsubscribe(int id);
+		// replace the list and pass it to every subscriber.
+		void Replace(const MappingList &mappings);
+
+	protected:
+		std::mutex mutex;
+		MappingList mappings;
+		std::vector<std::pair<int, OnUpdate>> subscribers;
+		int nextid;
+	};
+}
+
+namespace network
+{
+	std::shared_ptr<Mapping> ParseMapping(const std::vector<std::string> &words, Balancer::Strategy strategy, const MappingOptions &defaults)
+	{
+		std::shared_ptr<Mapping> mapping = std::make_shared<Mapping>();
+		size_t i = 0;
+		mapping->balancer.SetStrategy(strategy);
+		mapping->options = defaults;
+		while (i < words.size() && words[i].compare(0, 2, "--") == 0)
+		{
+			if (!ParseMappingOption(words, i, *mapping))
+				return nullptr;
+		}
+		// a certificate without its key,or a key without its certificate.
+		if (mapping->options.tls.cert.empty() != mapping->options.tls.key.empty())
+			return nullptr;
+		if (words.size() - i < 3 || (words.size() - i) % 2 == 0)
+			return nullptr;
+		mapping->localport = atoi(words[i].c_str());
+		if (mapping->localport < 1 || mapping->localport > 65535)
+			return nullptr;
+		for (i++; i < words.size(); i += 2)
+		{
+			const char *port = words[i + 1].c_str();
+			const char *weight = strchr(port, ':');
+			// strtol saturates where atoi would overflow,Add rejects what is out of range.
+			long value = weight == nullptr ? 1 : strtol(weight + 1, nullptr, 10);
+			value = value < 0 ? 0 : (value > Balancer::MaxWeight ? Balancer::MaxWeight + 1 : value);
+			if (atoi(port) < 1 || atoi(port) > 65535 || !mapping->balancer.Add(words[i], atoi(port), (int)value))
+				return nullptr;
+		}
+		mapping->balancer.Finish();
+		for (i = 0; i < words.size(); i++)
+		{
+			if (i > 0)
+				mapping->definition += ' ';
+			mapping->definition += words[i];
+		}
+		return mapping;
+	}
+
+	bool ParseMappingOption(const std::vector<std::string> &words, size_t &i, Mapping &mapping)
+	{
+		const std::string &option = words[i];
+		bool hasvalue = i + 1 < words.size();
+		if (option == "--balance" && hasvalue)
+		{
+			if (!mapping.balancer.SetStrategy(words[i + 1].c_str()))
+				return false;
+		}
+		else if (option == "--tls-cert" && hasvalue)
+			mapping.options.tls.cert = words[i + 1];
+		else if (option == "--tls-key" && hasvalue)
+			mapping.options.tls.key = words[i + 1];
+		else if (option == "--tls-ca" && hasvalue)
+			mapping.options.tls.ca = words[i + 1];
+		else if (option == "--trunk-upstream" && hasvalue)
+		{
+			mapping.options.trunkupstream = atoi(words[i + 1].c_str());
+			mapping.options.trunkclient = false;
+			if (mapping.options.trunkupstream < 1)
+				return false;
+		}
+		else if (option == "--client-sockopt" && hasvalue)
+		{
+			mapping.options.client = SocketOptions();
+			if (!ParseSocketOptions(words[i + 1], mapping.options.client))
+				return false;
+		}
+		else if (option == "--upstream-sockopt" && hasvalue)
+		{
+			mapping.options.upstream = SocketOptions();
+			if (!ParseSocketOptions(words[i + 1], mapping.options.upstream))
+				return false;
+		}
+		else if (option == "--tls-connect")
+		{
+			mapping.options.tls.connect = true;
+			i++;
+			return true;
+		}
+		else if (option == "--tls-insecure")
+		{
+			mapping.options.tls.insecure = true;
+			i++;
+			return true;
+		}
+		else if (option == "--compress-upstream" || option == "--compress-client")
+		{
+			// a mapping compresses one side,the one it names replaces the default.
+			mapping.options.compressupstream = option == "--compress-upstream";
+			mapping.options.compressclient = option == "--compress-client";
+			i++;
+			return true;
+		}
+		else if (option == "--trunk-client")
+		{
+			mapping.options.trunkclient = true;
+			mapping.options.trunkupstream = 0;
+			i++;
+			return true;
+		}
+		else
+			return false;
+		i += 2;
+		return true;
+	}
+
+	bool ParseSocketOptions(const std::string &spec, SocketOptions &options)
+	{
+		std::istringstream stream(spec);
+		std::string item;
+		while (std::getline(stream, item, ','))
+		{
+			size_t equal = item.find('=');
+			std::string name = item.substr(0, equal);
+			int64_t value = equal == std::string::npos ? 0 : Shaper::ParseBytes(item.c_str() + equal + 1);
+			if (value < 0 || value > 0x7fffffff || (equal != std::string::npos && value == 0))
+				return false;
+			if (name == "nodelay" && equal == std::string::npos)
+				options.nodelay = true;
+			else if (name == "rcvbuf" && value > 0)
+				options.rcvbuf = (int)value;
+			else if (name == "sndbuf" && value > 0)
+				options.sndbuf = (int)value;
+			else if (name == "notsent-lowat" && value > 0)
+				options.notsentlowat = (int)value;
+			else if (name == "fastopen")
+				options.fastopen = value > 0 ? (int)value : 256;
+			else if (name == "keepalive" && value > 0)
+				options.keepalive = (int)value;
+			else if (name == "autotune")
+				options.autotune = value > 0 ? (int)value : 32 * 1024 * 1024;
+			else
+				return false;
+		}
+		return true;
+	}
+
+	bool LoadMappings(const char *path, Balancer::Strategy strategy, const MappingList &previous, MappingList &mappings, std::string &error,
+					  const MappingOptions &defaults)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			error = std::string("can not read ") + path;
+			return false;
+		}
+		std::string line, word;
+		std::vector<std::string> words;
+		mappings.clear();
+		for (int number = 1; std::getline(file, line); number++)
+		{
+			std::istringstream stream(line);
+			words.clear();
+			while (stream >> word)
+				words.push_back(word);
+			if (words.empty() || words[0][0] == '#')
+				continue;
+			std::shared_ptr<Mapping> mapping = ParseMapping(words, strategy, defaults);
+			if (!mapping)
+			{
+				error = std::string(path) + ":" + std::to_string(number) + ": wrong mapping";
+				return false;
+			}
+			for (const std::shared_ptr<Mapping> &other : mappings)
+			{
+				if (other->localport == mapping->localport)
+				{
+					error = std::string(path) + ":" + std::to_string(number) + ": port " + std::to_string(mapping->localport) + " mapped twice";
+					return false;
+				}
+			}
+			for (const std::shared_ptr<Mapping> &old : previous)
+			{
+				if (old->localport == mapping->localport && old->definition == mapping->definition)
+					mapping = old;
+			}
+			mappings.push_back(mapping);
+		}
+		if (mappings.empty())
+		{
+			error = std::string(path) + ": no mapping";
+			return false;
+		}
+		return true;
+	}
+
+	MappingTable::MappingTable(const MappingList &mappings) : mutex(), mappings(mappings), subscribers(), nextid(0) {}
+
+	MappingList MappingTable::Get()
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->mappings;
+	}
+
+	int MappingTable::Subscribe(OnUpdate onUpdate, MappingList &mappings)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		mappings = this->mappings;
+		this->subscribers.emplace_back(this->nextid, std::move(onUpdate));
+		return this->nextid++;
+	}
+
+	void MappingTable::Unsubscribe(int id)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for (size_t i = 0; i < this->subscribers.size(); i++)
+		{
+			if (this->subscribers[i].first == id)
+			{
+				this->subscribers.erase(this->subscribers.begin() + i);
+				return;
+			}
+		}
+	}
+
+	void MappingTable::Replace(const MappingList &mappings)
+	{
+		// under the lock,so a subscriber never gets an older list after a newer one.
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->mappings = mappings;
+		for (std::pair<int, OnUpdate> &subscriber : this->subscribers)
+			subscriber.second(this->mappings);
+	}
+}
+
+#endif
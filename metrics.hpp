@@ -0,0 +1,300 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace network
+{
+	// counters of one event loop.
+	// only the thread of the loop writes them,with a relaxed load and store instead of an atomic add,
+	// so counting takes no locked instruction and no cache line is shared between loops.
+	// the metrics endpoint reads them from its own thread.
+	class alignas(64) Metrics
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		enum Counter
+		{
+			Accepts,
+			// accepted connections closed,accepts minus closes are the active tunnels.
+			Closes,
+			ConnectFailures,
+			// bytes read from accepted connections.
+			BytesIn,
+			// bytes read from connected ones.
+			BytesOut,
+			// accepted connections shed by admission control,not counted in accepts.
+			Rejects,
+			// relay directions parked by bandwidth shaping.
+			Throttles,
+			// datagrams dropped in udp mode,a socket could not take them or no session was admitted.
+			Drops,
+			// tls handshakes with clients or backends that failed or timed out.
+			HandshakeFailures,
+			// accepts that failed,mostly for lack of file descriptors or memory.
+			AcceptFailures,
+			CounterCount,
+		};
+
+		static constexpr int buckets = 12;
+		// upper bounds of the connect time buckets in microseconds,the last bucket is unbounded.
+		static constexpr uint64_t bounds[buckets] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 1000000, 10000000};
+
+		Metrics();
+		Metrics(const Metrics &rhs) = delete;
+
+		Metrics &operator=(const Metrics &rhs) = delete;
+
+		void Add(Counter counter, uint64_t n = 1);
+		// record a connect to a backend that started at begin and succeeded now.
+		void Connected(Clock::time_point begin);
+
+		uint64_t Get(Counter counter) const;
+		// connects that took up to bounds[bucket],not cumulative.
+		uint64_t GetBucket(int bucket) const;
+		// total time of the recorded connects in microseconds.
+		uint64_t GetConnectTime() const;
+
+	protected:
+		std::atomic<uint64_t> counters[CounterCount];
+		std::atomic<uint64_t> connectbuckets[buckets + 1];
+		std::atomic<uint64_t> connecttime;
+
+		static void Increment(std::atomic<uint64_t> &counter, uint64_t n);
+	};
+
+	// serves the Metrics of every event loop in prometheus text format over http.
+	// it runs on its own thread,a scrape never stalls an event loop.
+	class MetricsServer
+	{
+	public:
+		// appends more samples to a scrape,for state kept outside the event loops.
+		using Collector = std::function<void(std::string &text)>;
+
+		MetricsServer();
+		MetricsServer(const MetricsServer &rhs) = delete;
+
+		MetricsServer &operator=(const MetricsServer &rhs) = delete;
+
+		// add the Metrics of one more event loop,call before the loops start.
+		Metrics *AddShard();
+		Metrics *GetShard(int shard);
+		void AddCollector(Collector collector);
+		// listen on addr:port and serve GET /metrics from a background thread.
+		bool Start(const char *addr, int port);
+		// the current samples in prometheus text format.
+		std::string Render();
+
+	protected:
+		// a deque does not move its elements,which atomics can not do.
+		std::deque<Metrics> shards;
+		std::vector<Collector> collectors;
+		int fd;
+
+		void Serve();
+		void RenderCounter(std::string &text, const char *name, const char *help, Metrics::Counter counter);
+	};
+}
+
+namespace network
+{
+	constexpr uint64_t Metrics::bounds[Metrics::buckets];
+
+	Metrics::Metrics() : counters(), connectbuckets(), connecttime(0)
+	{
+		for (std::atomic<uint64_t> &counter : this->counters)
+			counter.store(0, std::memory_order_relaxed);
+		for (std::atomic<uint64_t> &bucket : this->connectbuckets)
+			bucket.store(0, std::memory_order_relaxed);
+	}
+
+	void Metrics::Increment(std::atomic<uint64_t> &counter, uint64_t n)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	void Metrics::Add(Counter counter, uint64_t n) { Increment(this->counters[counter], n); }
+
+	void Metrics::Connected(Clock::time_point begin)
+	{
+		uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+		int bucket = 0;
+		while (bucket < buckets && us > bounds[bucket])
+			bucket++;
+		Increment(this->connectbuckets[bucket], 1);
+		Increment(this->connecttime, us);
+	}
+
+	uint64_t Metrics::Get(Counter counter) const { return this->counters[counter].load(std::memory_order_relaxed); }
+	uint64_t Metrics::GetBucket(int bucket) const { return this->connectbuckets[bucket].load(std::memory_order_relaxed); }
+	uint64_t Metrics::GetConnectTime() const { return this->connecttime.load(std::memory_order_relaxed); }
+
+	MetricsServer::MetricsServer() : shards(), collectors(), fd(-1) {}
+
+	Metrics *MetricsServer::AddShard()
+	{
+		this->shards.emplace_back();
+		return &this->shards.back();
+	}
+
+	Metrics *MetricsServer::GetShard(int shard) { return &this->shards[shard]; }
+
+	void MetricsServer::AddCollector(Collector collector) { this->collectors.push_back(std::move(collector)); }
+
+	bool MetricsServer::Start(const char *addr, int port)
+	{
+		this->fd = (int)socket(AF_INET, SOCK_STREAM, 0);
+		if (this->fd < 0)
+			return false;
+		int opt = 1;
+		setsockopt(this->fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+		sockaddr_in sockaddr;
+		memset(&sockaddr, 0, sizeof(sockaddr));
+		sockaddr.sin_family = AF_INET;
+		sockaddr.sin_port = htons(port);
+		sockaddr.sin_addr.s_addr = inet_addr(addr);
+		if (bind(this->fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) != 0 || listen(this->fd, 16) != 0)
+			return false;
+		std::thread(&MetricsServer::Serve, this).detach();
+		return true;
+	}
+
+	void MetricsServer::Serve()
+	{
+		char request[1024];
+		int cfd, size, received;
+		std::string response, body;
+		for (;;)
+		{
+			cfd = (int)accept(this->fd, nullptr, nullptr);
+			if (cfd < 0)
+			{
+				// out of fds accept fails at once until one is freed,so wait instead of spinning.
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				continue;
+			}
+			// a client that sends nothing or reads nothing would hold up the only thread of the endpoint.
+#ifdef _WIN32
+			DWORD timeout = 1000;
+			setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+			setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+#else
+			timeval timeout = {1, 0};
+			setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#endif
+			// the request line is all that matters,read until the end of the headers.
+			received = 0;
+			while (received < (int)sizeof(request) - 1)
+			{
+				size = recv(cfd, request + received, sizeof(request) - 1 - received, 0);
+				if (size <= 0)
+					break;
+				received += size;
+				request[received] = 0;
+				if (strstr(request, "\r\n\r\n") != nullptr)
+					break;
+			}
+			request[received] = 0;
+			if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+			{
+				body = this->Render();
+				response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n";
+			}
+			else
+			{
+				body = "not found\n";
+				response = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n";
+			}
+			response += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+			for (size_t sent = 0; sent < response.size(); sent += size)
+			{
+				size = send(cfd, response.data() + sent, (int)(response.size() - sent), 0);
+				if (size <= 0)
+					break;
+			}
+#ifdef _WIN32
+			closesocket(cfd);
+#else
+			close(cfd);
+#endif
+		}
+	}
+
+	void MetricsServer::RenderCounter(std::string &text, const char *name, const char *help, Metrics::Counter counter)
+	{
+		text += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n";
+		for (size_t i = 0; i < this->shards.size(); i++)
+			text += std::string(name) + "{thread=\"" + std::to_string(i) + "\"} " + std::to_string(this->shards[i].Get(counter)) + "\n";
+	}
+
+	std::string MetricsServer::Render()
+	{
+		std::string text;
+		char line[256];
+		size_t i;
+		this->RenderCounter(text, "forward_accepts_total", "Client connections accepted.", Metrics::Accepts);
+		this->RenderCounter(text, "forward_rejected_total", "Client connections shed by admission control.", Metrics::Rejects);
+		this->RenderCounter(text, "forward_throttled_total", "Relay reads parked by bandwidth shaping.", Metrics::Throttles);
+		this->RenderCounter(text, "forward_dropped_datagrams_total", "Datagrams dropped in udp mode.", Metrics::Drops);
+		this->RenderCounter(text, "forward_connect_failures_total", "Connects to a backend that failed or timed out.", Metrics::ConnectFailures);
+		this->RenderCounter(text, "forward_tls_handshake_failures_total", "TLS handshakes with clients or backends that failed or timed out.", Metrics::HandshakeFailures);
+		this->RenderCounter(text, "forward_accept_failures_total", "Accepts that failed,mostly for lack of file descriptors or memory.", Metrics::AcceptFailures);
+		text += "# HELP forward_bytes_total Bytes relayed,in from clients and out from backends.\n# TYPE forward_bytes_total counter\n";
+		for (i = 0; i < this->shards.size(); i++)
+		{
+			text += "forward_bytes_total{thread=\"" + std::to_string(i) + "\",direction=\"in\"} " + std::to_string(this->shards[i].Get(Metrics::BytesIn)) + "\n";
+			text += "forward_bytes_total{thread=\"" + std::to_string(i) + "\",direction=\"out\"} " + std::to_string(this->shards[i].Get(Metrics::BytesOut)) + "\n";
+		}
+		text += "# HELP forward_active_tunnels Client connections open.\n# TYPE forward_active_tunnels gauge\n";
+		for (i = 0; i < this->shards.size(); i++)
+		{
+			// read closes first,so a tunnel accepted in between does not make the gauge negative.
+			uint64_t closes = this->shards[i].Get(Metrics::Closes);
+			uint64_t accepts = this->shards[i].Get(Metrics::Accepts);
+			text += "forward_active_tunnels{thread=\"" + std::to_string(i) + "\"} " + std::to_string(accepts >= closes ? accepts - closes : 0) + "\n";
+		}
+		text += "# HELP forward_connect_seconds Time to connect to a backend.\n# TYPE forward_connect_seconds histogram\n";
+		for (i = 0; i < this->shards.size(); i++)
+		{
+			const Metrics &shard = this->shards[i];
+			uint64_t count = 0;
+			for (int bucket = 0; bucket <= Metrics::buckets; bucket++)
+			{
+				count += shard.GetBucket(bucket);
+				if (bucket < Metrics::buckets)
+					snprintf(line, sizeof(line), "forward_connect_seconds_bucket{thread=\"%zu\",le=\"%g\"} %llu\n", i, Metrics::bounds[bucket] / 1e6, (unsigned long long)count);
+				else
+					snprintf(line, sizeof(line), "forward_connect_seconds_bucket{thread=\"%zu\",le=\"+Inf\"} %llu\n", i, (unsigned long long)count);
+				text += line;
+			}
+			snprintf(line, sizeof(line), "forward_connect_seconds_sum{thread=\"%zu\"} %g\nforward_connect_seconds_count{thread=\"%zu\"} %llu\n",
+					 i, shard.GetConnectTime() / 1e6, i, (unsigned long long)count);
+			text += line;
+		}
+		for (Collector &collector : this->collectors)
+			collector(text);
+		return text;
+	}
+}
+
+#endif
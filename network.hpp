@@ -4,6 +4,7 @@
 #ifdef _WIN32
 
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #pragma comment(lib, "WS2_32.Lib")
 
 #else
@@ -17,6 +18,11 @@
 #include <sys/select.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #define SOCKET_ERROR -1
 #define INVALID_SOCKET -1
@@ -24,8 +30,20 @@ using SOCKET = int;
 
 #endif
 
-#include <map>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <iostream>
+#include "buffer.hpp"
+#include "slottable.hpp"
+#include "wheel.hpp"
+#include "admission.hpp"
+#include "shaper.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
 
 namespace network
 {
@@ -34,8 +52,9 @@ namespace network
 	{
 	public:
 		Socket();
+		// addr is an ipv4 or ipv6 literal,aftype is the family of an addr that is neither.
 		Socket(int aftype, int socktype, const char *addr = "0.0.0.0", int port = 0, int fd = 0);
-		Socket(int socktype, const sockaddr_in *paddr, int fd = 0);
+		Socket(int socktype, const sockaddr *paddr, int fd = 0);
 		Socket(const Socket &rhs);
 		Socket(Socket &&rhs);
 		virtual ~Socket() {}
@@ -45,28 +64,167 @@ namespace network
 
 		socket_fd GetFd();
 		int GetPort();
+		// dst holds at least INET6_ADDRSTRLEN bytes.
 		void GetAddr(char *dst);
-		const sockaddr_in *GetSockAddr();
+		const sockaddr *GetSockAddr();
 		bool Close();
 		int Errno();
+		// return and clear the pending error of the socket(SO_ERROR),0 if none.
+		int GetError();
 		int Send(const char *buf, int size);
 		int Recv(char *buf, int size);
 
 		socket_fd GetFd() const;
 		int GetPort() const;
 		void GetAddr(char *dst) const;
-		const sockaddr_in *GetSockAddr() const;
+		const sockaddr *GetSockAddr() const;
 		int Send(const char *buf, int size) const;
 		// int Recv(char *buf, int size) const;
 
 	protected:
-		sockaddr_in addr;
+		// sockaddr_in or sockaddr_in6,by ss_family.
+		sockaddr_storage addr;
 		int socktype;
 		socket_fd fd;
 
 		bool CreateSocket();
 	};
 
+	// readiness notification for many sockets.
+	// epoll in edge-triggered mode on linux, level-triggered select elsewhere.
+	// with edge-triggered polling the caller must drain a socket until it would block.
+	class Poller
+	{
+	public:
+		enum
+		{
+			Readable = 1,
+			Writable = 2,
+			Closed = 4,
+		};
+
+		struct Event
+		{
+			void *data;
+			int events;
+		};
+
+#ifdef __linux__
+		static constexpr bool EdgeTriggered = true;
+#else
+		static constexpr bool EdgeTriggered = false;
+#endif
+
+		Poller();
+		Poller(const Poller &rhs) = delete;
+		~Poller();
+
+		Poller &operator=(const Poller &rhs) = delete;
+
+		bool Add(socket_fd fd, int events, void *data);
+		bool Modify(socket_fd fd, int events, void *data);
+		bool Remove(socket_fd fd);
+		// wait up to timeoutms(-1 for infinite) and fill events,return the number of ready sockets.
+		int Wait(Event *events, int maxevents, int timeoutms = -1);
+
+	protected:
+#ifdef __linux__
+		int epfd;
+		std::vector<epoll_event> epollevents;
+#else
+		struct Entry
+		{
+			socket_fd fd;
+			int events;
+			void *data;
+		};
+		std::vector<Entry> entries;
+#endif
+	};
+
+	// return true if the last socket call failed only because it would block.
+	inline bool WouldBlock();
+	// probe an idle connection after seconds,so a peer that vanished without a FIN or RST is noticed.
+	inline bool EnableKeepAlive(socket_fd fd, int seconds);
+
+	// tcp options of a socket,a field left at its default is not set,so the socket keeps what the kernel gives it.
+	struct SocketOptions
+	{
+		// TCP_NODELAY,small writes of interactive traffic go out at once instead of waiting for an ack.
+		bool nodelay;
+		// SO_RCVBUF and SO_SNDBUF in bytes,the kernel stops tuning a buffer that is set.
+		int rcvbuf;
+		int sndbuf;
+		// TCP_NOTSENT_LOWAT,the socket is not writable while more bytes than this wait to be sent,
+		// so a large send buffer does not turn into a long queue.
+		int notsentlowat;
+		// TCP_FASTOPEN queue of a listener,TCP_FASTOPEN_CONNECT on a connect,0 off.
+		int fastopen;
+		// keepalive idle seconds,0 for those of the server.
+		int keepalive;
+		// grow the buffers of busy connections up to autotune bytes,0 off.
+		int autotune;
+
+		// what the socket options are set on is.
+		enum Role
+		{
+			Listener,
+			Accepted,
+			Connecting,
+		};
+
+		SocketOptions() : nodelay(false), rcvbuf(0), sndbuf(0), notsentlowat(0), fastopen(0), keepalive(0), autotune(0) {}
+
+		bool Empty() const;
+	};
+
+	// set options on fd,on a listener or before connect,so the window scale of the handshake fits the buffer sizes.
+	// a listener takes fastopen as the length of its queue.return false if one of them could not be set.
+	inline bool SetSocketOptions(socket_fd fd, const SocketOptions &options, SocketOptions::Role role);
+	// grow the send or receive buffer of fd to what its path carries now,measured with TCP_INFO,up to maxbytes.
+	// linux only,a no-op elsewhere.
+	inline void TuneBuffer(socket_fd fd, bool send, int maxbytes);
+	// close with a RST instead of a FIN,so a connection shed right after accept leaves no TIME_WAIT.
+	inline void CloseReset(socket_fd fd);
+	// size of the sockaddr_in or sockaddr_in6 addr is.
+	inline socklen_t SockAddrLength(const sockaddr *addr);
+	// fill storage from an ipv4 or ipv6 literal,return false if addr is neither.
+	inline bool ParseAddress(const char *addr, int port, sockaddr_storage &storage);
+	// the key of the client at addr in admission control and shaping,and of the hash balancer.
+	// an ipv4 address,also mapped into ipv6 by a dual-stack listener,is its own key,
+	// an ipv6 address is keyed by its /64,which is what a single host usually gets.
+	inline uint32_t SourceKey(const sockaddr *addr);
+
+	// a layer between a connection and its socket,tls for example.
+	// the server drives Handshake on the readiness of the socket,then reads and writes the connection
+	// through Recv and Send,or straight on the socket for a direction the kernel took over(kTLS),
+	// so a pair whose directions are all in the kernel is still spliced.
+	class Stream
+	{
+	public:
+		enum HandshakeResult
+		{
+			HandshakeDone,
+			WantRead,
+			WantWrite,
+			HandshakeFailed,
+		};
+
+		virtual ~Stream() {}
+
+		virtual HandshakeResult Handshake() = 0;
+		// like recv and send,SOCKET_ERROR with WouldBlock() true if the socket would block.
+		virtual int Recv(char *buf, int size) = 0;
+		virtual int Send(const char *buf, int size) = 0;
+		// bytes Recv holds already,the poller does not report them.
+		virtual size_t Pending() = 0;
+		// end the write side of the stream,before the socket is shut down.
+		virtual void Shutdown() = 0;
+		// the kernel handles the direction,bytes go to the socket as they are.
+		virtual bool KernelRecv() const = 0;
+		virtual bool KernelSend() const = 0;
+	};
+
 	namespace tcp
 	{
 		class Client : public Socket
@@ -74,35 +232,225 @@ namespace network
 		public:
 			Client();
 			Client(const char *addr, int port);
+			Client(const sockaddr *addr);
 			// ~Client();
 
 			bool Connect();
 			bool Connect(const char *addr, int port);
+			// connect to a resolved address of either family.
+			bool Connect(const sockaddr *addr);
+			// start connecting without blocking,return false if the connect failed immediately.
+			// the socket becomes writable once connected,then GetError() tells if it succeeded.
+			// options are set before the connect,so the handshake carries them.
+			bool ConnectNonBlocking(const SocketOptions &options = SocketOptions());
+		};
+
+		class Server;
+
+		// a connection of a Server,accepted by it or connected with Server::Connect.
+		// the record stays valid until the end of the batch of events it is closed in,
+		// keep GetHandle() and look it up with Server::GetConnection() to refer to it later.
+		class Connection : public Socket
+		{
+		public:
+			using OnData = std::function<bool(Connection &connection, char *data, int size)>;
+			using OnEvent = std::function<void(Connection &connection)>;
+
+			Connection();
+
+			// user state of the connection,the server never touches it.
+			void *context;
+			// called with the bytes read,return false to close the connection.
+			OnData onData;
+			// called when the bytes queued by Write are all sent.
+			OnEvent onWritable;
+			// called once when the connection closes,by the peer,an error or Close().
+			OnEvent onClose;
+
+			// send data,what the socket does not take now is queued and sent once it is writable.
+			// return false if the connection failed.
+			bool Write(const char *data, int size);
+			// bytes queued by Write and not sent yet.
+			size_t Queued() const;
+			// stop reading,for example while the destination of the bytes is slow,or resume.
+			void PauseRead(bool pause);
+			// read and write through stream from now on,onReady is called once its handshake is done.
+			// the connection is closed if the handshake fails or takes longer than timeoutms(0 for no timeout).
+			void SetStream(std::unique_ptr<Stream> stream, int timeoutms, OnEvent onReady);
+			// close the connection,and its relay if it has one.
+			void Close();
+			bool Closed() const;
+			SlotHandle GetHandle() const;
+			// the other connection of its relay pair,nullptr if not relaying.
+			Connection *GetRelay() const;
+
+		protected:
+			friend class Server;
+
+			Server *server;
+			SlotHandle handle;
+			// events currently registered in the poller.
+			int interest;
+			bool closed;
+			bool paused;
+			bool connecting;
+			// accepted by the server,not connected by it.
+			bool accepted;
+			// a listening socket added with Server::AddListener,the clients it accepts go to onAccept.
+			bool listening;
+			std::function<bool(Connection &connection)> onAccept;
+			std::function<void(Connection *connection)> onConnect;
+			SlotHandle connecttimer;
+			std::chrono::steady_clock::time_point connectbegin;
+			// last time bytes were read from it.
+			std::chrono::steady_clock::time_point lastactive;
+			// options of the clients a listener accepts,nullptr for those of the server.
+			std::unique_ptr<SocketOptions> acceptoptions;
+			// limit of the buffers TuneBuffer grows while bytes flow,0 off,and when it may run next.
+			int autotune;
+			std::chrono::steady_clock::time_point tuneat;
+			// the idle timer of a relay pair,held by the first connection of the pair.
+			SlotHandle idletimer;
+			// nullptr for a plain socket.
+			std::unique_ptr<Stream> stream;
+			bool handshaking;
+			OnEvent onHandshake;
+			// the peer sent its FIN,and for a relay,the FIN was passed on once relay took the last bytes.
+			bool readclosed;
+			// the write side is shut down,the relay sends nothing more to it.
+			bool writeclosed;
+			// bandwidth limits of a relay pair,shared by both connections,nullptr without shaping.
+			std::shared_ptr<Flow> flow;
+			// reading is parked until the flow has bytes to spend again.
+			bool throttled;
+			SlotHandle throttletimer;
+			std::string output;
+			size_t outputbegin;
+			Connection *relay;
+			// the direction from this connection to relay.
+			// pipe carrying its bytes when splicing,-1 on the copy path.
+			int pipe[2];
+			// bytes waiting in the pipe.
+			size_t piped;
+			// relay buffer of the copy path,taken from the pool only while the direction moves bytes.
+			char *buffer;
+			size_t buffersize;
+			// size of the next buffer,adapted to how much the reads use.
+			size_t nextsize;
+			// bytes of buffer waiting for relay.
+			size_t pendingbegin;
+			size_t pendingend;
+
+			// bytes read from this connection are waiting for relay.
+			bool Blocked() const;
 		};
 
+		// reactor running accepted and connected connections,relays and timers on one thread.
+		// callbacks are std::function,so they may carry state,and may call back into the server.
+		// the poller is edge-triggered on linux,so every ready socket is drained.
 		class Server : public Socket
 		{
 		public:
+			using OnConnection = std::function<bool(Connection &connection)>;
+			using OnConnect = std::function<void(Connection *connection)>;
+			using OnTimer = TimingWheel::OnTimer;
+			using OnError = std::function<void(const char *message)>;
+			using TimerId = TimingWheel::TimerId;
+
 			Server(const char *addr, int port, int buffersize = 1024);
 			Server(Server &&server);
 			~Server();
 
-			void SetOnNewConnection(bool (*onNewConnection)(const Socket &socket));
-			void SetOnNewData(bool (*onNewData)(const Socket &socket, char *data, int recvsize));
-			void SetOnConnectionClose(void (*onConnectionClose)(const Socket &socket));
-			void SetOnError(void (*onError)(const char *message));
+			// return false from onNewConnection to close the connection.
+			// onNewData,onWritable and onConnectionClose become the callbacks of every accepted connection.
+			void SetOnNewConnection(OnConnection onNewConnection);
+			void SetOnNewData(Connection::OnData onNewData);
+			void SetOnWritable(Connection::OnEvent onWritable);
+			void SetOnConnectionClose(Connection::OnEvent onConnectionClose);
+			void SetOnError(OnError onError);
+			// let several servers bind the same address,the kernel balances connections between them.
+			void SetReusePort(bool reuseport);
+			// how relays move bytes: splice(linux only) or recv/send through pooled buffers
+			// that start at buffermin bytes and grow up to buffermax for busy streams.
+			void SetRelay(bool splice, size_t buffermin, size_t buffermax);
+			// count accepts,connects and bytes read in metrics,owned by the caller.
+			void SetMetrics(Metrics *metrics);
+			// length of the queue of connections waiting to be accepted,capped by the kernel(somaxconn on linux).
+			void SetBacklog(int backlog);
+			// shed accepted connections admission refuses before they get a record,owned by the caller.
+			void SetAdmission(Admission *admission);
+			// hold relays to the bandwidth limits of shaper,owned by the caller.
+			void SetShaper(Shaper *shaper);
+			// close a relay pair when neither side sent anything for ms milliseconds,0 to never.
+			void SetIdleTimeout(int ms);
+			// enable tcp keepalive probes after seconds idle on accepted and connected sockets,0 to leave them off.
+			void SetKeepAlive(int seconds);
+			// options of the listener of the server and the clients it accepts,and of connects without options of their own.
+			void SetSocketOptions(const SocketOptions &accepted, const SocketOptions &connected);
 			bool Listen();
+			// run the event loop until Stop().
 			void Begin();
+			void Stop();
+
+			// stop accepting on every listener,leaving new clients in the listen backlog,or start again.
+			void PauseAccept(bool pause);
+			// listen on addr:port besides the address of the server,the clients accepted from it
+			// go to onNewConnection instead of the callback set with SetOnNewConnection,and get options.
+			// return the handle of the listener,SlotTable<Connection>::InvalidHandle if it can not listen.
+			SlotHandle AddListener(const char *addr, int port, OnConnection onNewConnection, const SocketOptions &options = SocketOptions());
+			// stop listening on listener,the connections accepted from it stay open.
+			void RemoveListener(SlotHandle listener);
+			// set options on listener and the clients it accepts from now on,return false if one could not be set.
+			// what an earlier call set and options leave out stays on the listening socket.
+			bool SetListenerOptions(SlotHandle listener, const SocketOptions &options);
+			// run task on the thread of the event loop,the only call that may come from another thread.
+			void Post(std::function<void()> task);
+			// connect to addr:port,an ipv4 or ipv6 literal,without blocking,onConnect gets the connection
+			// once established,or nullptr if the connect failed or took longer than timeoutms(0 for no timeout).
+			// set onData of the connection or relay it in onConnect.
+			// return false if the connect failed at once,onConnect is not called then.
+			bool Connect(const char *addr, int port, int timeoutms, OnConnect onConnect);
+			// connect to the first of addrs that answers,happy eyeballs(rfc 8305): the next address is tried
+			// when the one before failed or did not connect within connectdelay,the first established
+			// connection wins and the others are closed.interleave the families in addrs,so a broken
+			// ipv6 path costs one delay instead of a timeout.timeoutms bounds every attempt.
+			// options apply to every attempt,nullptr for those set with SetSocketOptions.
+			bool Connect(const std::vector<sockaddr_storage> &addrs, int timeoutms, OnConnect onConnect, const SocketOptions *options = nullptr);
+			// relay bytes both ways between a and b.
+			// a side is not read while the other side has not taken its last bytes.
+			// a FIN is passed on as a shutdown of the write side,so each direction ends on its own,
+			// the pair is closed once both ended,or on the first error.
+			bool Relay(Connection &a, Connection &b);
+			// return the connection of handle,nullptr if it is closed.
+			Connection *GetConnection(SlotHandle handle);
+			// call onTimer once after ms milliseconds.
+			TimerId AddTimer(int ms, OnTimer onTimer);
+			void CancelTimer(TimerId timer);
 
 		protected:
-			using SocketMap = std::map<socket_fd, Socket>;
+			friend class Connection;
+
+			using Clock = std::chrono::steady_clock;
+			static constexpr int maxevents = 256;
+			// head start of an address over the next one in a happy eyeballs connect,rfc 8305 recommends 250ms.
+			static constexpr int connectdelay = 250;
+			// pause of accepting after an accept failed.
+			static constexpr int acceptbackoffms = 100;
 
-			// return false if you want this connection to be closed after this callback;
-			bool (*onNewConnection)(const Socket &socket);
-			// return false if you want this connection to be closed after this callback;
-			bool (*onNewData)(const Socket &socket, char *data, int recvsize);
-			void (*onConnectionClose)(const Socket &socket);
-			void (*onError)(const char *);
+			struct ConnectRace;
+
+			enum FlushResult
+			{
+				FlushDone,
+				FlushBlocked,
+				FlushError,
+			};
+
+			OnConnection onNewConnection;
+			Connection::OnData onNewData;
+			Connection::OnEvent onWritable;
+			Connection::OnEvent onConnectionClose;
+			OnError onError;
 
 			static bool DefaultOnNewConnection(const Socket &socket);
 			static bool DefaultOnNewData(const Socket &socket, char *data, int recvsize);
@@ -110,25 +458,105 @@ namespace network
 			static void DefaultOnError(const char *msg);
 
 			Server &operator=(const Server &rhs) = delete;
-			Server &operator=(Server &&rhs);
+			Server &operator=(Server &&rhs) = delete;
 
 			void ParseCallback();
 
-			Socket &GetSocket(socket_fd cfd);
-			void AddSocket(socket_fd cfd, const sockaddr_in &sockaddr);
-			void RemoveSocket(socket_fd cfd);
+			Connection *NewConnection(socket_fd fd, const sockaddr *sockaddr);
+			// return a bound and listening socket for addr with options,INVALID_SOCKET on failure.
+			// an ipv6 wildcard address also accepts ipv4 clients.
+			socket_fd OpenListener(const sockaddr *addr, const SocketOptions &options);
+			// start connecting to addr,see Connect,return the handle of the connection,InvalidHandle if it failed at once.
+			SlotHandle StartConnect(const sockaddr *addr, int timeoutms, OnConnect onConnect, const SocketOptions &options);
+			// start the next attempt of race,and arm the delay after which the one after it starts.
+			void RaceNext(const std::shared_ptr<ConnectRace> &race);
+			// accept the clients waiting on listener,or on the address of the server if it is nullptr.
+			void Accept(Connection *listener);
+			// stop accepting for acceptbackoffms after an accept failed,out of fds or memory it would fail again.
+			void BackOffAccept();
+			// watch the listeners for clients unless accepting is paused or backing off,
+			// re-arming reports the clients that are already waiting.
+			void ArmAccept();
+			// run the tasks given to Post.
+			void RunPosted();
+			void Connected(Connection *connection);
+			// advance the handshake of the stream of connection,call its onHandshake once done.
+			void Handshake(Connection *connection);
+			// recv and send on connection,through its stream unless the kernel handles the direction.
+			static int StreamRecv(Connection *connection, char *buf, int size);
+			static int StreamSend(Connection *connection, const char *buf, int size);
+			// both directions of connection go to its socket as they are,so it may be spliced.
+			static bool Spliceable(const Connection &connection);
+			// end a connect,successful or not,and tell its owner.
+			void FinishConnect(Connection *connection, bool established);
+			void HandleEvent(Connection *connection, int events);
+			// pass what is readable to onData,return false if the connection should be closed.
+			bool Receive(Connection *connection);
+			// send what Write queued,return false on error.
+			bool FlushOutput(Connection *connection);
+			// relay what is readable on connection to its relay,return false if the pair should be closed.
+			bool Read(Connection *connection);
+			bool ReadPipe(Connection *connection);
+			// bytes connection may read now out of size,0 after parking it until its flow refills.
+			size_t Shape(Connection *connection, size_t size);
+			// connection reached its end and relay took all its bytes,shut down the write side of relay.
+			// return false once both directions ended,or if connection failed.
+			bool ShutdownRelay(Connection *connection);
+			// write the pending bytes of connection to its relay.
+			FlushResult Flush(Connection *connection);
+			void ReleaseBuffer(Connection *connection);
+			void UpdateInterest(Connection *connection);
+			void CloseConnection(Connection *connection);
+			// count size bytes read from connection,mark it active and spend them from its flow.
+			void CountRead(Connection *connection, int size);
+			// grow the buffers of connection with TuneBuffer,at most once a second.
+			void Tune(Connection *connection);
+			// arm the idle timer of the pair of connection to check it after ms.
+			void StartIdleTimer(Connection *connection, int ms);
+			// close the pair of handle if it stayed idle for the whole timeout,or check again later.
+			void CheckIdle(SlotHandle handle);
 
-			SocketMap socketmap;
-			fd_set socketset;
+			std::unique_ptr<Poller> poller;
+			SlotTable<Connection> connections;
+			// closed connections,removed from the table after the current batch of events.
+			std::vector<SlotHandle> closedlist;
+			// a timer per connect and per relay pair,so adding and cancelling them must be cheap.
+			std::unique_ptr<TimingWheel> wheel;
+			// time of the current batch of events,read once per wakeup instead of per read.
+			Clock::time_point now;
+			std::unique_ptr<BufferPool> pool;
+			bool splice;
+			bool acceptpaused;
+			bool acceptbackoff;
+			bool stopped;
+			// read buffer of onData.
 			char *buffer;
 			int buffersize;
+			bool reuseport;
+			Metrics *metrics;
+			int idletimeout;
+			int keepalive;
+			SocketOptions acceptoptions;
+			SocketOptions connectoptions;
+			int backlog;
+			Admission *admission;
+			Shaper *shaper;
+			// Listen() succeeded on the address of the server.
+			bool listening;
+			// handles of the listeners added with AddListener.
+			std::vector<SlotHandle> listeners;
+			std::mutex postmutex;
+			std::vector<std::function<void()>> posted;
+			// Post writes a byte to wakeup[1] to wake the loop up,-1 on windows,where posted tasks
+			// wait for the next event.
+			int wakeup[2];
 		};
 	}
 }
 
 namespace network
 {
-	constexpr int SOCKADDR_IN_SIZE = sizeof(sockaddr_in);
+	inline socklen_t SockAddrLength(const sockaddr *addr) { return addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in); }
 
 #ifdef _WIN32
 
@@ -151,6 +579,7 @@ namespace network
 	void (*Init)() = []() -> void
 	{ WSAInit(); };
 	inline int GetErrno() { return WSAGetLastError(); }
+	inline bool WouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
 	using socklen_t = int;
 
 #else
@@ -163,7 +592,160 @@ namespace network
 	inline void itoa(int value, char *buf, int unuse) { sprintf(buf, "%d", value); }
 	int (*closesocket)(int) = close;
 	inline int GetErrno() { return errno; }
+	inline bool WouldBlock() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+
+#endif
+
+#ifdef MSG_NOSIGNAL
+	// a peer closing while we write must fail the write instead of raising SIGPIPE.
+	constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+	constexpr int SEND_FLAGS = 0;
+#endif
 
+#ifdef _WIN32
+	constexpr int SHUTDOWN_SEND = SD_SEND;
+#else
+	constexpr int SHUTDOWN_SEND = SHUT_WR;
+#endif
+
+	inline bool EnableKeepAlive(socket_fd fd, int seconds)
+	{
+		int opt = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char *)&opt, sizeof(opt)) == SOCKET_ERROR)
+			return false;
+#ifdef TCP_KEEPIDLE
+		// probe every few seconds after the idle time,give up after 3 unanswered probes.
+		int interval = seconds < 30 ? (seconds + 2) / 3 : 10, count = 3;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (const char *)&seconds, sizeof(seconds)) == SOCKET_ERROR ||
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (const char *)&interval, sizeof(interval)) == SOCKET_ERROR ||
+			setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (const char *)&count, sizeof(count)) == SOCKET_ERROR)
+			return false;
+#endif
+		return true;
+	}
+
+	bool SocketOptions::Empty() const
+	{
+		return !this->nodelay && this->rcvbuf == 0 && this->sndbuf == 0 && this->notsentlowat == 0 && this->fastopen == 0 &&
+			   this->keepalive == 0 && this->autotune == 0;
+	}
+
+	inline bool SetSocketOptions(socket_fd fd, const SocketOptions &options, SocketOptions::Role role)
+	{
+		bool ok = true;
+		int opt = 1;
+		if (options.nodelay)
+			ok = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&opt, sizeof(opt)) != SOCKET_ERROR && ok;
+		if (options.rcvbuf > 0)
+			ok = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char *)&options.rcvbuf, sizeof(options.rcvbuf)) != SOCKET_ERROR && ok;
+		if (options.sndbuf > 0)
+			ok = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const char *)&options.sndbuf, sizeof(options.sndbuf)) != SOCKET_ERROR && ok;
+#ifdef TCP_NOTSENT_LOWAT
+		if (options.notsentlowat > 0)
+			ok = setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char *)&options.notsentlowat, sizeof(options.notsentlowat)) != SOCKET_ERROR && ok;
+#endif
+#ifdef TCP_FASTOPEN
+		if (options.fastopen > 0 && role == SocketOptions::Listener)
+			ok = setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (const char *)&options.fastopen, sizeof(options.fastopen)) != SOCKET_ERROR && ok;
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+		// the syn leaves with the first write instead of at connect.
+		if (options.fastopen > 0 && role == SocketOptions::Connecting)
+			ok = setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (const char *)&opt, sizeof(opt)) != SOCKET_ERROR && ok;
+#endif
+		if (options.keepalive > 0 && role != SocketOptions::Listener)
+			ok = EnableKeepAlive(fd, options.keepalive) && ok;
+		return ok;
+	}
+
+	inline void TuneBuffer(socket_fd fd, bool send, int maxbytes)
+	{
+#ifdef __linux__
+		tcp_info info;
+		socklen_t len = sizeof(info);
+		if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == SOCKET_ERROR)
+			return;
+		// a round trip of data: the congestion window when sending,what arrived in the last round trip when receiving.
+		int64_t bdp = send ? (int64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss : (int64_t)info.tcpi_rcv_space;
+		// the kernel doubles a size it is given for its bookkeeping and reports that.asking for two round trips
+		// leaves a flow held back by its buffer room to speed up,so the buffer doubles every step until it is not.
+		// a buffer the kernel tuned larger on its own is left to it.
+		int64_t wanted = bdp * 2 < maxbytes ? bdp * 2 : maxbytes;
+		int option = send ? SO_SNDBUF : SO_RCVBUF, current = 0;
+		len = sizeof(current);
+		if (getsockopt(fd, SOL_SOCKET, option, (char *)&current, &len) == SOCKET_ERROR || wanted * 2 <= current)
+			return;
+		int size = (int)wanted;
+		setsockopt(fd, SOL_SOCKET, option, (const char *)&size, sizeof(size));
+#endif
+	}
+
+	inline bool ParseAddress(const char *addr, int port, sockaddr_storage &storage)
+	{
+		memset(&storage, 0, sizeof(storage));
+		sockaddr_in *addr4 = (sockaddr_in *)&storage;
+		sockaddr_in6 *addr6 = (sockaddr_in6 *)&storage;
+		if (inet_pton(AF_INET, addr, &addr4->sin_addr) == 1)
+		{
+			addr4->sin_family = AF_INET;
+			addr4->sin_port = htons(port);
+			return true;
+		}
+		if (inet_pton(AF_INET6, addr, &addr6->sin6_addr) == 1)
+		{
+			addr6->sin6_family = AF_INET6;
+			addr6->sin6_port = htons(port);
+			return true;
+		}
+		return false;
+	}
+
+	inline uint32_t SourceKey(const sockaddr *addr)
+	{
+		if (addr->sa_family != AF_INET6)
+			return ((const sockaddr_in *)addr)->sin_addr.s_addr;
+		const unsigned char *bytes = ((const sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+		static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+		uint32_t key;
+		if (memcmp(bytes, mapped, sizeof(mapped)) == 0)
+		{
+			memcpy(&key, bytes + 12, sizeof(key));
+			return key;
+		}
+		// fnv-1a of the /64.
+		key = 2166136261u;
+		for (int i = 0; i < 8; i++)
+			key = (key ^ bytes[i]) * 16777619u;
+		return key;
+	}
+
+	inline void CloseReset(socket_fd fd)
+	{
+		linger opt;
+		opt.l_onoff = 1;
+		opt.l_linger = 0;
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, (const char *)&opt, sizeof(opt));
+		closesocket(fd);
+	}
+
+#ifdef __linux__
+	constexpr size_t SPLICE_SIZE = 1 << 16;
+
+	// create the socket->pipe->socket path of a relay direction,return false if splice is not usable.
+	inline bool OpenPipe(int pipe[2]) { return pipe2(pipe, O_NONBLOCK | O_CLOEXEC) == 0; }
+
+	inline void ClosePipe(int pipe[2])
+	{
+		if (pipe[0] == -1)
+			return;
+		close(pipe[0]);
+		close(pipe[1]);
+		pipe[0] = pipe[1] = -1;
+	}
+#else
+	inline bool OpenPipe(int pipe[2]) { return false; }
+	inline void ClosePipe(int pipe[2]) {}
 #endif
 
 	Socket &Socket::operator=(const Socket &rhs)
@@ -177,10 +759,7 @@ namespace network
 	Socket &Socket::operator=(Socket &&rhs)
 	{
 		*this = static_cast<const Socket &>(rhs);
-		rhs.addr.sin_port = 0;
-		rhs.addr.sin_family = 0;
-		rhs.addr.sin_zero[0] = 0;
-		rhs.addr.sin_addr.s_addr = 0;
+		memset(&rhs.addr, 0, sizeof(rhs.addr));
 		rhs.fd = 0;
 		return *this;
 	}
@@ -189,49 +768,48 @@ namespace network
 	Socket::Socket(Socket &&rhs) : addr(rhs.addr), socktype(rhs.socktype), fd(rhs.fd)
 	{
 		rhs.socktype = 0;
-		rhs.fd = 0;
-		rhs.addr.sin_port = 0;
-		rhs.addr.sin_family = 0;
-		rhs.addr.sin_zero[0] = 0;
-		rhs.addr.sin_addr.s_addr = 0;
+		memset(&rhs.addr, 0, sizeof(rhs.addr));
 		rhs.fd = 0;
 	}
 
-	Socket::Socket() : addr{0, 0, 0, {0}}, socktype(0), fd(0) { Init(); }
-	Socket::Socket(int sockType, const sockaddr_in *paddr, int fd) : socktype(sockType), fd(fd), addr(*paddr) { Init(); }
-	Socket::Socket(int afType, int socktype, const char *addr, int port, int fd) : socktype(socktype),
-																				   fd(fd), addr{0, 0, 0, {0}}
+	Socket::Socket() : addr(), socktype(0), fd(0) { Init(); }
+	Socket::Socket(int sockType, const sockaddr *paddr, int fd) : addr(), socktype(sockType), fd(fd)
 	{
-		this->addr.sin_family = afType;
-		this->addr.sin_addr.s_addr = inet_addr(addr);
-		this->addr.sin_port = htons(port);
+		memcpy(&this->addr, paddr, SockAddrLength(paddr));
 		Init();
 	}
-
-	void Socket::GetAddr(char *dst) const
+	Socket::Socket(int afType, int socktype, const char *addr, int port, int fd) : addr(), socktype(socktype), fd(fd)
 	{
-		for (int i = 0; i < 4; i++)
+		if (!ParseAddress(addr, port, this->addr))
 		{
-			itoa((this->addr.sin_addr.s_addr & 0xFF << (8 * i)) >> (8 * i), dst, 10);
-			size_t size = strlen(dst);
-			if (i != 3)
-			{
-				dst[size] = '.';
-				dst += size + 1;
-				continue;
-			}
-			dst[size] = '\0';
-			break;
+			sockaddr_in *addr4 = (sockaddr_in *)&this->addr;
+			addr4->sin_family = afType;
+			addr4->sin_addr.s_addr = INADDR_NONE;
+			addr4->sin_port = htons(port);
 		}
+		Init();
+	}
+
+	void Socket::GetAddr(char *dst) const
+	{
+		const void *src = this->addr.ss_family == AF_INET6 ? (const void *)&((const sockaddr_in6 *)&this->addr)->sin6_addr
+														   : (const void *)&((const sockaddr_in *)&this->addr)->sin_addr;
+		if (inet_ntop(this->addr.ss_family, src, dst, INET6_ADDRSTRLEN) == nullptr)
+			dst[0] = '\0';
 	}
 
-	int Socket::GetPort() const { return ntohs(this->addr.sin_port); }
+	int Socket::GetPort() const
+	{
+		if (this->addr.ss_family == AF_INET6)
+			return ntohs(((const sockaddr_in6 *)&this->addr)->sin6_port);
+		return ntohs(((const sockaddr_in *)&this->addr)->sin_port);
+	}
 	socket_fd Socket::GetFd() const { return this->fd; }
 	socket_fd Socket::GetFd() { return const_cast<const Socket &>(*this).GetFd(); }
 
 	bool Socket::CreateSocket()
 	{
-		this->fd = socket(this->addr.sin_family, this->socktype, 0);
+		this->fd = socket(this->addr.ss_family, this->socktype, 0);
 		return this->fd != INVALID_SOCKET;
 	}
 
@@ -245,11 +823,21 @@ namespace network
 	int Socket::Send(const char *buf, int bufsize) const { return send(this->fd, buf, bufsize, 0); }
 	int Socket::Recv(char *buf, int bufsize) { return recv(fd, buf, bufsize, 0); }
 	int Socket::Errno() { return GetErrno(); }
-	const sockaddr_in *Socket::GetSockAddr() const { return const_cast<const sockaddr_in *>(&this->addr); }
+
+	int Socket::GetError()
+	{
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (getsockopt(this->fd, SOL_SOCKET, SO_ERROR, (char *)&error, &len) == SOCKET_ERROR)
+			return GetErrno();
+		return error;
+	}
+	const sockaddr *Socket::GetSockAddr() const { return (const sockaddr *)&this->addr; }
 
 	// tcp::Client::~Client() { this->Close(); }
 	tcp::Client::Client(const char *addr, int port) : Socket(AF_INET, SOCK_STREAM, addr, port) { this->CreateSocket(); }
 	tcp::Client::Client() : Socket(AF_INET, SOCK_STREAM) { this->CreateSocket(); }
+	tcp::Client::Client(const sockaddr *addr) : Socket(SOCK_STREAM, addr) { this->CreateSocket(); }
 
 	bool tcp::Client::Connect()
 	{
@@ -258,280 +846,1410 @@ namespace network
 			if (!this->CreateSocket())
 				return false;
 		}
-		return connect(this->fd, (sockaddr *)this->GetSockAddr(), SOCKADDR_IN_SIZE) != SOCKET_ERROR;
+		return connect(this->fd, this->GetSockAddr(), SockAddrLength(this->GetSockAddr())) != SOCKET_ERROR;
+	}
+
+	bool tcp::Client::ConnectNonBlocking(const SocketOptions &options)
+	{
+		if (this->fd == INVALID_SOCKET)
+		{
+			if (!this->CreateSocket())
+				return false;
+		}
+		u_long arg = 1;
+		if (ioctlsocket(this->fd, FIONBIO, &arg))
+			return false;
+		if (!options.Empty() && !SetSocketOptions(this->fd, options, SocketOptions::Connecting))
+			return false;
+		if (connect(this->fd, this->GetSockAddr(), SockAddrLength(this->GetSockAddr())) != SOCKET_ERROR)
+			return true;
+#ifdef _WIN32
+		return GetErrno() == WSAEWOULDBLOCK;
+#else
+		return GetErrno() == EINPROGRESS;
+#endif
 	}
 
 	bool tcp::Client::Connect(const char *addr, int port)
 	{
-		this->addr.sin_port = htons(port);
-		this->addr.sin_addr.s_addr = inet_addr(addr);
+		Socket address(AF_INET, SOCK_STREAM, addr, port);
+		return this->Connect(address.GetSockAddr());
+	}
+
+	bool tcp::Client::Connect(const sockaddr *addr)
+	{
+		// a socket of the other family can not connect to addr.
+		if (this->fd != INVALID_SOCKET && this->addr.ss_family != addr->sa_family)
+		{
+			closesocket(this->fd);
+			this->fd = INVALID_SOCKET;
+		}
+		memcpy(&this->addr, addr, SockAddrLength(addr));
 		return this->Connect();
 	}
 
+	tcp::Connection::Connection() : Socket(), context(nullptr), onData(), onWritable(), onClose(), server(nullptr),
+									handle(SlotTable<Connection>::InvalidHandle), interest(0), closed(false), paused(false),
+									connecting(false), accepted(false), listening(false), onAccept(), onConnect(), connecttimer(TimingWheel::InvalidTimer), connectbegin(),
+									lastactive(), acceptoptions(), autotune(0), tuneat(), idletimer(TimingWheel::InvalidTimer), stream(), handshaking(false), onHandshake(),
+									readclosed(false), writeclosed(false),
+									flow(), throttled(false), throttletimer(TimingWheel::InvalidTimer),
+									output(), outputbegin(0), relay(nullptr), pipe{-1, -1}, piped(0), buffer(nullptr),
+									buffersize(0), nextsize(0), pendingbegin(0), pendingend(0) {}
+
+	bool tcp::Connection::Write(const char *data, int size)
+	{
+		if (this->closed || this->writeclosed)
+			return false;
+		// bytes go out in order,so they are queued while anything is waiting before them.
+		if (this->Queued() == 0 && !this->connecting && !this->handshaking && (this->relay == nullptr || !this->relay->Blocked()))
+		{
+			int sent = Server::StreamSend(this, data, size);
+			if (sent == SOCKET_ERROR)
+			{
+				if (!WouldBlock())
+					return false;
+				sent = 0;
+			}
+			if (sent == size)
+				return true;
+			data += sent;
+			size -= sent;
+		}
+		this->output.append(data, size);
+		this->server->UpdateInterest(this);
+		return true;
+	}
+
+	size_t tcp::Connection::Queued() const { return this->output.size() - this->outputbegin; }
+
+	void tcp::Connection::PauseRead(bool pause)
+	{
+		this->paused = pause;
+		this->server->UpdateInterest(this);
+	}
+
+	void tcp::Connection::SetStream(std::unique_ptr<Stream> stream, int timeoutms, OnEvent onReady)
+	{
+		Server *server = this->server;
+		SlotHandle handle = this->handle;
+		this->stream = std::move(stream);
+		this->handshaking = true;
+		this->onHandshake = std::move(onReady);
+		if (timeoutms > 0)
+			this->connecttimer = server->AddTimer(timeoutms, [server, handle]() -> void
+												  {
+													  Connection *connection = server->GetConnection(handle);
+													  if (connection == nullptr)
+														  return;
+													  connection->connecttimer = TimingWheel::InvalidTimer;
+													  if (server->metrics != nullptr)
+														  server->metrics->Add(Metrics::HandshakeFailures);
+													  connection->Close(); });
+		// the first event tells which way the handshake starts.
+		this->interest = Poller::Readable | Poller::Writable;
+		if (!server->poller->Modify(this->fd, this->interest, this))
+			this->Close();
+	}
+
+	void tcp::Connection::Close()
+	{
+		if (this->server != nullptr)
+			this->server->CloseConnection(this);
+	}
+
+	bool tcp::Connection::Closed() const { return this->closed; }
+	SlotHandle tcp::Connection::GetHandle() const { return this->handle; }
+	tcp::Connection *tcp::Connection::GetRelay() const { return this->relay; }
+	bool tcp::Connection::Blocked() const { return this->piped > 0 || this->pendingbegin < this->pendingend; }
+
 	tcp::Server::Server(const char *addr, int port, int buffersize) : Socket(AF_INET, SOCK_STREAM, addr, port),
-																	  onNewConnection(nullptr),
-																	  onConnectionClose(nullptr),
-																	  onNewData(nullptr),
-																	  onError(nullptr),
-																	  socketmap(),
-																	  socketset(),
+																	  onNewConnection(),
+																	  onNewData(),
+																	  onWritable(),
+																	  onConnectionClose(),
+																	  onError(),
+																	  poller(new Poller()),
+																	  connections(),
+																	  closedlist(),
+																	  wheel(new TimingWheel()),
+																	  now(Clock::now()),
+																	  pool(new BufferPool()),
+																	  splice(false),
+																	  acceptpaused(false),
+																	  acceptbackoff(false),
+																	  stopped(false),
 																	  buffer(nullptr),
-																	  buffersize(0)
+																	  buffersize(0),
+																	  reuseport(false),
+																	  metrics(nullptr),
+																	  idletimeout(0),
+																	  keepalive(0),
+																	  acceptoptions(),
+																	  connectoptions(),
+																	  backlog(SOMAXCONN),
+																	  admission(nullptr),
+																	  shaper(nullptr),
+																	  listening(false),
+																	  listeners(),
+																	  postmutex(),
+																	  posted(),
+																	  wakeup{-1, -1}
 	{
-		FD_ZERO(&this->socketset);
 		this->buffersize = buffersize;
-		this->buffer = (char *)malloc(this->buffersize);
+		// one more byte,so onData may terminate the data as a string.
+		this->buffer = (char *)malloc(this->buffersize + 1);
+#ifndef _WIN32
+		if (pipe(this->wakeup) == 0)
+		{
+			fcntl(this->wakeup[0], F_SETFL, O_NONBLOCK);
+			fcntl(this->wakeup[1], F_SETFL, O_NONBLOCK);
+			fcntl(this->wakeup[0], F_SETFD, FD_CLOEXEC);
+			fcntl(this->wakeup[1], F_SETFD, FD_CLOEXEC);
+			this->poller->Add(this->wakeup[0], Poller::Readable, this);
+		}
+#endif
 	}
 
 	tcp::Server::Server(Server &&server) : Socket(std::forward<Server>(server)),
-										   socketmap(std::move(server.socketmap)),
-										   socketset(server.socketset),
+										   onNewConnection(std::move(server.onNewConnection)),
+										   onNewData(std::move(server.onNewData)),
+										   onWritable(std::move(server.onWritable)),
+										   onConnectionClose(std::move(server.onConnectionClose)),
+										   onError(std::move(server.onError)),
+										   poller(std::move(server.poller)),
+										   connections(std::move(server.connections)),
+										   closedlist(std::move(server.closedlist)),
+										   wheel(std::move(server.wheel)),
+										   now(server.now),
+										   pool(std::move(server.pool)),
+										   splice(server.splice),
+										   acceptpaused(server.acceptpaused),
+										   acceptbackoff(server.acceptbackoff),
+										   stopped(server.stopped),
 										   buffer(server.buffer),
-										   buffersize(server.buffersize)
+										   buffersize(server.buffersize),
+										   reuseport(server.reuseport),
+										   metrics(server.metrics),
+										   idletimeout(server.idletimeout),
+										   keepalive(server.keepalive),
+										   acceptoptions(server.acceptoptions),
+										   connectoptions(server.connectoptions),
+										   backlog(server.backlog),
+										   admission(server.admission),
+										   shaper(server.shaper),
+										   listening(server.listening),
+										   listeners(std::move(server.listeners)),
+										   postmutex(),
+										   posted(std::move(server.posted)),
+										   wakeup{server.wakeup[0], server.wakeup[1]}
 	{
-		memset(&server.socketset, 0, sizeof(server.socketset));
 		server.buffer = nullptr;
 		server.buffersize = 0;
-	}
-
-	tcp::Server &tcp::Server::operator=(Server &&rhs)
-	{
-		Socket::operator=(std::forward<Socket>(rhs));
-		memset(&rhs.socketset, 0, sizeof(rhs.socketset));
-		rhs.buffer = nullptr;
-		rhs.buffersize = 0;
-		return *this;
+		server.wakeup[0] = server.wakeup[1] = -1;
+		// the wakeup event carries the address of the server.
+		if (this->wakeup[0] != -1)
+			this->poller->Modify(this->wakeup[0], Poller::Readable, this);
 	}
 
 	tcp::Server::~Server()
 	{
 		if (this->buffer != nullptr)
 			free(this->buffer);
+#ifndef _WIN32
+		if (this->wakeup[0] != -1)
+		{
+			close(this->wakeup[0]);
+			close(this->wakeup[1]);
+		}
+#endif
 	}
 
-	bool tcp::Server::Listen()
+	socket_fd tcp::Server::OpenListener(const sockaddr *addr, const SocketOptions &options)
 	{
-		if (!this->CreateSocket())
-			return false;
+		socket_fd fd = socket(addr->sa_family, SOCK_STREAM, 0);
+		if (fd == INVALID_SOCKET)
+			return INVALID_SOCKET;
+		int opt = 1;
 		u_long arg = 1;
-		if (ioctlsocket(this->fd, FIONBIO, &arg))
-			return false;
-		if (bind(this->fd, (sockaddr *)&this->addr, SOCKADDR_IN_SIZE) == SOCKET_ERROR)
+		bool listening = ioctlsocket(fd, FIONBIO, &arg) == 0;
+		if (listening && addr->sa_family == AF_INET6)
+		{
+			int v6only = 0;
+			listening = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&v6only, sizeof(v6only)) != SOCKET_ERROR;
+		}
+#ifndef _WIN32
+		// a port listened on again,after a reload,may still have connections accepted from the old listener.
+		if (listening)
+			listening = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt)) != SOCKET_ERROR;
+#endif
+		if (listening && this->reuseport)
+		{
+#ifdef SO_REUSEPORT
+			listening = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&opt, sizeof(opt)) != SOCKET_ERROR;
+#else
+			listening = false;
+#endif
+		}
+		if (listening && !options.Empty())
+			listening = network::SetSocketOptions(fd, options, SocketOptions::Listener);
+		if (listening)
+			listening = bind(fd, addr, SockAddrLength(addr)) != SOCKET_ERROR && listen(fd, this->backlog) != SOCKET_ERROR;
+		if (!listening)
+		{
+			closesocket(fd);
+			return INVALID_SOCKET;
+		}
+		return fd;
+	}
+
+	bool tcp::Server::Listen()
+	{
+		this->fd = this->OpenListener(this->GetSockAddr(), this->acceptoptions);
+		if (this->fd == INVALID_SOCKET)
 			return false;
-		if (listen(this->fd, 10) == SOCKET_ERROR)
+		this->listening = this->poller->Add(this->fd, this->acceptpaused || this->acceptbackoff ? 0 : Poller::Readable, nullptr);
+		return this->listening;
+	}
+
+	SlotHandle tcp::Server::AddListener(const char *addr, int port, OnConnection onNewConnection, const SocketOptions &options)
+	{
+		Socket address(AF_INET, SOCK_STREAM, addr, port);
+		socket_fd fd = this->OpenListener(address.GetSockAddr(), options);
+		if (fd == INVALID_SOCKET)
+			return SlotTable<Connection>::InvalidHandle;
+		Connection *listener = this->NewConnection(fd, address.GetSockAddr());
+		listener->listening = true;
+		listener->onAccept = std::move(onNewConnection);
+		listener->acceptoptions.reset(new SocketOptions(options));
+		listener->interest = this->acceptpaused || this->acceptbackoff ? 0 : Poller::Readable;
+		if (!this->poller->Add(fd, listener->interest, listener))
+		{
+			listener->Close();
+			return SlotTable<Connection>::InvalidHandle;
+		}
+		this->listeners.push_back(listener->handle);
+		return listener->handle;
+	}
+
+	void tcp::Server::RemoveListener(SlotHandle handle)
+	{
+		for (size_t i = 0; i < this->listeners.size(); i++)
+		{
+			if (this->listeners[i] == handle)
+			{
+				this->listeners.erase(this->listeners.begin() + i);
+				break;
+			}
+		}
+		Connection *listener = this->GetConnection(handle);
+		if (listener != nullptr && listener->listening)
+			listener->Close();
+	}
+
+	bool tcp::Server::SetListenerOptions(SlotHandle handle, const SocketOptions &options)
+	{
+		Connection *listener = this->GetConnection(handle);
+		if (listener == nullptr || !listener->listening)
 			return false;
-		return true;
+		listener->acceptoptions.reset(new SocketOptions(options));
+		return options.Empty() || network::SetSocketOptions(listener->fd, options, SocketOptions::Listener);
+	}
+
+	void tcp::Server::Post(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->postmutex);
+			this->posted.push_back(std::move(task));
+		}
+#ifndef _WIN32
+		char byte = 0;
+		// a full pipe already wakes the loop up.
+		if (write(this->wakeup[1], &byte, 1) == -1)
+			return;
+#endif
+	}
+
+	void tcp::Server::RunPosted()
+	{
+#ifndef _WIN32
+		char bytes[64];
+		while (read(this->wakeup[0], bytes, sizeof(bytes)) > 0)
+			;
+#endif
+		std::vector<std::function<void()>> tasks;
+		{
+			std::lock_guard<std::mutex> lock(this->postmutex);
+			tasks.swap(this->posted);
+		}
+		for (std::function<void()> &task : tasks)
+			task();
 	}
 
-#ifdef _WIN32
 	void tcp::Server::Begin()
 	{
 		this->ParseCallback();
-		FD_SET(this->fd, &this->socketset);
-		fd_set readableset;
-		int status, recvsize;
-		unsigned int i;
-		sockaddr_in clientaddr;
-		socket_fd cfd;
-		int addrlen = sizeof(clientaddr);
-		for (;;)
+		Poller::Event events[maxevents];
+		int count, i;
+		this->stopped = false;
+		while (!this->stopped)
 		{
-			readableset = this->socketset;
-			status = select(NULL, &readableset, NULL, NULL, NULL);
-			if (status == SOCKET_ERROR)
+			count = this->poller->Wait(events, maxevents, this->wheel->NextTimeout(Clock::now()));
+			if (count == SOCKET_ERROR)
 			{
-				this->onError("socket error on I/O select");
+				this->onError("socket error on I/O poll");
 				return;
 			}
-			for (i = 0; i < readableset.fd_count; i++)
+			this->now = Clock::now();
+			for (i = 0; i < count; i++)
 			{
-				if (readableset.fd_array[i] == this->fd)
+				if (events[i].data == nullptr)
 				{
-					cfd = accept(this->fd, (sockaddr *)&clientaddr, &addrlen);
-					if (cfd == SOCKET_ERROR)
-					{
-						this->onError("accept socket failed");
-						return;
-					}
-					this->AddSocket(cfd, clientaddr);
-					Socket &rsocket = this->GetSocket(cfd);
-					if (!this->onNewConnection(rsocket))
-					{
-						rsocket.Close();
-						this->RemoveSocket(cfd);
-					}
+					this->Accept(nullptr);
+					continue;
 				}
-				else
+				if (events[i].data == this)
 				{
-					cfd = readableset.fd_array[i];
-					Socket &rsocket = GetSocket(cfd);
-					recvsize = rsocket.Recv(this->buffer, this->buffersize);
-					if (recvsize > 0)
-					{
-						if (!this->onNewData(rsocket, this->buffer, recvsize))
-						{
-							rsocket.Close();
-							this->RemoveSocket(cfd);
-						}
-					}
-					else
-					{
-						this->onConnectionClose(rsocket);
-						this->RemoveSocket(cfd);
-					}
+					this->RunPosted();
+					continue;
 				}
+				// the record of the connection is the event data,no lookup needed.
+				Connection *connection = static_cast<Connection *>(events[i].data);
+				if (connection->closed)
+					continue;
+				if (connection->listening)
+					this->Accept(connection);
+				else
+					this->HandleEvent(connection, events[i].events);
 			}
+#ifdef _WIN32
+			this->RunPosted();
+#endif
+			this->wheel->Advance(this->now);
+			// a later event of the same batch may still point to a closed record,
+			// so slots are reused only after the batch.
+			for (SlotHandle handle : this->closedlist)
+				this->connections.Remove(handle);
+			this->closedlist.clear();
 		}
 	}
-#else
-	void tcp::Server::Begin()
+
+	void tcp::Server::Stop() { this->stopped = true; }
+
+	tcp::Connection *tcp::Server::NewConnection(socket_fd fd, const sockaddr *sockaddr)
 	{
-		this->ParseCallback();
-		FD_SET(this->fd, &this->socketset);
-		fd_set readableset;
-		int count, recvsize;
-		int maxfd = this->fd;
-		unsigned int i;
-		sockaddr_in clientaddr;
-		socklen_t addrlen = sizeof(clientaddr);
+		SlotHandle handle;
+		Connection *connection = this->connections.Add(handle);
+		static_cast<Socket &>(*connection) = Socket(SOCK_STREAM, sockaddr, fd);
+		connection->server = this;
+		connection->handle = handle;
+		return connection;
+	}
+
+	void tcp::Server::Accept(Connection *listener)
+	{
+		sockaddr_storage clientaddr;
+		socklen_t addrlen;
 		socket_fd cfd;
-		int clientfdlist[1024];
-		for (i = 0; i < 1024; i++)
-			clientfdlist[i] = 0;
-		for (;;)
+		socket_fd lfd = listener != nullptr ? listener->fd : this->fd;
+		const SocketOptions &options = listener != nullptr ? *listener->acceptoptions : this->acceptoptions;
+		// drain the backlog on every wakeup,a connect storm is taken in a few batches instead of one by one.
+		// a callback may remove the listener,its record stays until the end of the batch.
+		while (!this->acceptpaused && !this->acceptbackoff && (listener == nullptr || !listener->closed))
 		{
-			readableset = this->socketset;
-			count = select(maxfd + 1, &readableset, NULL, NULL, NULL);
-			if (count == SOCKET_ERROR)
-			{
-				this->onError("socket error on I/O select");
-				return;
-			}
-			if (FD_ISSET(this->fd, &readableset))
+			addrlen = sizeof(clientaddr);
+#ifdef __linux__
+			cfd = accept4(lfd, (sockaddr *)&clientaddr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+			cfd = accept(lfd, (sockaddr *)&clientaddr, &addrlen);
+#endif
+			if (cfd == INVALID_SOCKET)
 			{
-				count--;
-				cfd = accept(this->fd, (sockaddr *)&clientaddr, &addrlen);
-				if (cfd == SOCKET_ERROR)
+				if (!WouldBlock())
 				{
+					if (this->metrics != nullptr)
+						this->metrics->Add(Metrics::AcceptFailures);
 					this->onError("accept socket failed");
-					return;
+					// the listeners are edge triggered,clients left in the backlog would wait for the next one
+					// to connect,so accepting stops a while and is armed again.
+					this->BackOffAccept();
 				}
-				if (cfd > maxfd)
-					maxfd = cfd;
-				this->AddSocket(cfd, clientaddr);
-				Socket &rsocket = this->GetSocket(cfd);
-				if (!this->onNewConnection(rsocket))
-				{
-					rsocket.Close();
-					this->RemoveSocket(cfd);
-				}
-				else
+				return;
+			}
+			// shed before the connection costs a record,a poller registration or a callback.
+			if (this->admission != nullptr && !this->admission->Admit(SourceKey((const sockaddr *)&clientaddr)))
+			{
+				CloseReset(cfd);
+				if (this->metrics != nullptr)
+					this->metrics->Add(Metrics::Rejects);
+				continue;
+			}
+#ifndef __linux__
+			u_long arg = 1;
+			ioctlsocket(cfd, FIONBIO, &arg);
+#endif
+			if (this->keepalive > 0 && options.keepalive == 0)
+				EnableKeepAlive(cfd, this->keepalive);
+			if (!options.Empty() && !network::SetSocketOptions(cfd, options, SocketOptions::Accepted))
+				this->onError("set socket options failed");
+			Connection *connection = this->NewConnection(cfd, (const sockaddr *)&clientaddr);
+			connection->accepted = true;
+			connection->autotune = options.autotune;
+			if (this->metrics != nullptr)
+				this->metrics->Add(Metrics::Accepts);
+			connection->interest = Poller::Readable;
+			if (!this->poller->Add(cfd, connection->interest, connection))
+			{
+				connection->Close();
+				continue;
+			}
+			connection->onData = this->onNewData;
+			connection->onWritable = this->onWritable;
+			connection->onClose = this->onConnectionClose;
+			// a connection refused by onNewConnection is closed without onClose.
+			if (!(listener != nullptr ? listener->onAccept(*connection) : this->onNewConnection(*connection)))
+			{
+				connection->onClose = nullptr;
+				connection->Close();
+			}
+		}
+	}
+
+	void tcp::Server::PauseAccept(bool pause)
+	{
+		if (this->acceptpaused == pause)
+			return;
+		this->acceptpaused = pause;
+		if (!this->acceptbackoff)
+			this->ArmAccept();
+	}
+
+	void tcp::Server::BackOffAccept()
+	{
+		if (this->acceptbackoff)
+			return;
+		this->acceptbackoff = true;
+		if (!this->acceptpaused)
+			this->ArmAccept();
+		this->AddTimer(acceptbackoffms, [this]() -> void
+					   {
+						   this->acceptbackoff = false;
+						   if (!this->acceptpaused)
+							   this->ArmAccept(); });
+	}
+
+	void tcp::Server::ArmAccept()
+	{
+		int interest = this->acceptpaused || this->acceptbackoff ? 0 : Poller::Readable;
+		if (this->listening)
+			this->poller->Modify(this->fd, interest, nullptr);
+		for (SlotHandle handle : this->listeners)
+		{
+			Connection *listener = this->GetConnection(handle);
+			if (listener == nullptr)
+				continue;
+			listener->interest = interest;
+			this->poller->Modify(listener->fd, listener->interest, listener);
+		}
+	}
+
+	bool tcp::Server::Connect(const char *addr, int port, int timeoutms, OnConnect onConnect)
+	{
+		Socket address(AF_INET, SOCK_STREAM, addr, port);
+		return this->StartConnect(address.GetSockAddr(), timeoutms, std::move(onConnect), this->connectoptions) != SlotTable<Connection>::InvalidHandle;
+	}
+
+	// the attempts of a happy eyeballs connect,held by the callbacks of its attempts and of its delay timer.
+	struct tcp::Server::ConnectRace
+	{
+		std::vector<sockaddr_storage> addrs;
+		// index of the next address to try.
+		size_t next;
+		// attempts started and not finished.
+		int pending;
+		bool done;
+		int timeoutms;
+		SocketOptions options;
+		OnConnect onConnect;
+		TimerId delaytimer;
+		std::vector<SlotHandle> attempts;
+	};
+
+	bool tcp::Server::Connect(const std::vector<sockaddr_storage> &addrs, int timeoutms, OnConnect onConnect, const SocketOptions *options)
+	{
+		if (addrs.empty())
+			return false;
+		if (options == nullptr)
+			options = &this->connectoptions;
+		if (addrs.size() == 1)
+			return this->StartConnect((const sockaddr *)&addrs[0], timeoutms, std::move(onConnect), *options) != SlotTable<Connection>::InvalidHandle;
+		std::shared_ptr<ConnectRace> race = std::make_shared<ConnectRace>();
+		race->addrs = addrs;
+		race->next = 0;
+		race->pending = 0;
+		race->done = false;
+		race->timeoutms = timeoutms;
+		race->options = *options;
+		race->onConnect = std::move(onConnect);
+		race->delaytimer = TimingWheel::InvalidTimer;
+		this->RaceNext(race);
+		if (race->pending > 0)
+			return true;
+		// every address failed at once,the callback is not called then.
+		race->done = true;
+		this->CancelTimer(race->delaytimer);
+		return false;
+	}
+
+	void tcp::Server::RaceNext(const std::shared_ptr<ConnectRace> &race)
+	{
+		this->CancelTimer(race->delaytimer);
+		race->delaytimer = TimingWheel::InvalidTimer;
+		while (race->next < race->addrs.size())
+		{
+			const sockaddr *addr = (const sockaddr *)&race->addrs[race->next++];
+			SlotHandle attempt = this->StartConnect(addr, race->timeoutms, [this, race](Connection *connection) -> void
+											  {
+												  race->pending--;
+												  if (race->done)
+												  {
+													  if (connection != nullptr)
+														  connection->Close();
+													  return;
+												  }
+												  if (connection == nullptr)
+												  {
+													  // the next address gets its turn at once instead of after the delay.
+													  if (race->next < race->addrs.size())
+														  this->RaceNext(race);
+													  if (race->pending == 0)
+													  {
+														  race->done = true;
+														  race->onConnect(nullptr);
+													  }
+													  return;
+												  }
+												  race->done = true;
+												  this->CancelTimer(race->delaytimer);
+												  for (SlotHandle handle : race->attempts)
+												  {
+													  Connection *other = this->GetConnection(handle);
+													  if (other != nullptr && other != connection && other->connecting)
+														  other->Close();
+												  }
+												  race->onConnect(connection); },
+											  race->options);
+			if (attempt == SlotTable<Connection>::InvalidHandle)
+				continue;
+			race->pending++;
+			race->attempts.push_back(attempt);
+			if (race->next < race->addrs.size())
+				race->delaytimer = this->AddTimer(connectdelay, [this, race]() -> void
+												  {
+													  race->delaytimer = TimingWheel::InvalidTimer;
+													  if (!race->done)
+														  this->RaceNext(race); });
+			return;
+		}
+	}
+
+	SlotHandle tcp::Server::StartConnect(const sockaddr *addr, int timeoutms, OnConnect onConnect, const SocketOptions &options)
+	{
+		Client client(addr);
+		if (!client.ConnectNonBlocking(options))
+		{
+			client.Close();
+			if (this->metrics != nullptr)
+				this->metrics->Add(Metrics::ConnectFailures);
+			return SlotTable<Connection>::InvalidHandle;
+		}
+		if (this->keepalive > 0 && options.keepalive == 0)
+			EnableKeepAlive(client.GetFd(), this->keepalive);
+		Connection *connection = this->NewConnection(client.GetFd(), client.GetSockAddr());
+		connection->connecting = true;
+		connection->autotune = options.autotune;
+		connection->connectbegin = Clock::now();
+		connection->interest = Poller::Writable;
+		if (!this->poller->Add(connection->fd, connection->interest, connection))
+		{
+			connection->Close();
+			return SlotTable<Connection>::InvalidHandle;
+		}
+		connection->onConnect = std::move(onConnect);
+		if (timeoutms > 0)
+		{
+			SlotHandle handle = connection->handle;
+			connection->connecttimer = this->AddTimer(timeoutms, [this, handle]() -> void
+													  {
+														  Connection *connection = this->GetConnection(handle);
+														  if (connection != nullptr && connection->connecting)
+															  this->FinishConnect(connection, false); });
+		}
+		return connection->handle;
+	}
+
+	// the connecting socket became writable,check whether the connect succeeded.
+	void tcp::Server::Connected(Connection *connection) { this->FinishConnect(connection, connection->GetError() == 0); }
+
+	void tcp::Server::FinishConnect(Connection *connection, bool established)
+	{
+		connection->connecting = false;
+		this->CancelTimer(connection->connecttimer);
+		connection->connecttimer = TimingWheel::InvalidTimer;
+		OnConnect onConnect = std::move(connection->onConnect);
+		connection->onConnect = nullptr;
+		if (this->metrics != nullptr)
+		{
+			if (established)
+				this->metrics->Connected(connection->connectbegin);
+			else
+				this->metrics->Add(Metrics::ConnectFailures);
+		}
+		if (!established)
+		{
+			connection->Close();
+			onConnect(nullptr);
+			return;
+		}
+		onConnect(connection);
+		this->UpdateInterest(connection);
+	}
+
+	void tcp::Server::Handshake(Connection *connection)
+	{
+		int interest;
+		switch (connection->stream->Handshake())
+		{
+		case Stream::WantRead:
+			interest = Poller::Readable;
+			break;
+		case Stream::WantWrite:
+			interest = Poller::Writable;
+			break;
+		case Stream::HandshakeDone:
+		{
+			connection->handshaking = false;
+			this->CancelTimer(connection->connecttimer);
+			connection->connecttimer = TimingWheel::InvalidTimer;
+			Connection::OnEvent onReady = std::move(connection->onHandshake);
+			connection->onHandshake = nullptr;
+			// register again even if the interest did not change,so bytes that came after the handshake are reported.
+			connection->interest = -1;
+			onReady(*connection);
+			this->UpdateInterest(connection);
+			return;
+		}
+		default:
+			if (this->metrics != nullptr)
+				this->metrics->Add(Metrics::HandshakeFailures);
+			connection->Close();
+			return;
+		}
+		if (interest == connection->interest)
+			return;
+		connection->interest = interest;
+		if (!this->poller->Modify(connection->fd, interest, connection))
+			connection->Close();
+	}
+
+	int tcp::Server::StreamRecv(Connection *connection, char *buf, int size)
+	{
+		Stream *stream = connection->stream.get();
+		if (stream == nullptr)
+			return recv(connection->fd, buf, size, 0);
+		if (!stream->KernelRecv())
+			return stream->Recv(buf, size);
+		int received = recv(connection->fd, buf, size, 0);
+#ifdef __linux__
+		// kTLS fails a plain recv at a record that is not data,an alert or a session ticket,
+		// the stream reads it with its type,data may follow it.
+		while (received == SOCKET_ERROR && errno == EIO)
+		{
+			received = stream->Recv(buf, size);
+			if (received != SOCKET_ERROR || !WouldBlock())
+				return received;
+			received = recv(connection->fd, buf, size, 0);
+		}
+#endif
+		return received;
+	}
+
+	int tcp::Server::StreamSend(Connection *connection, const char *buf, int size)
+	{
+		if (connection->stream == nullptr || connection->stream->KernelSend())
+			return send(connection->fd, buf, size, SEND_FLAGS);
+		return connection->stream->Send(buf, size);
+	}
+
+	bool tcp::Server::Spliceable(const Connection &connection)
+	{
+		return connection.stream == nullptr || (connection.stream->KernelRecv() && connection.stream->KernelSend());
+	}
+
+	bool tcp::Server::Relay(Connection &a, Connection &b)
+	{
+		if (a.closed || b.closed || a.connecting || b.connecting || a.relay != nullptr || b.relay != nullptr)
+			return false;
+		a.relay = &b;
+		b.relay = &a;
+		a.paused = b.paused = false;
+		a.nextsize = b.nextsize = this->pool->MinSize();
+		a.lastactive = b.lastactive = Clock::now();
+		if (this->shaper != nullptr)
+			a.flow = b.flow = std::make_shared<Flow>(*this->shaper, SourceKey((a.accepted ? a : b).GetSockAddr()));
+		if (this->idletimeout > 0)
+			this->StartIdleTimer(&a, this->idletimeout);
+		if (this->splice && Spliceable(a) && Spliceable(b) && (!OpenPipe(a.pipe) || !OpenPipe(b.pipe)))
+		{
+			ClosePipe(a.pipe);
+			ClosePipe(b.pipe);
+		}
+		// register again even if the interest did not change,so bytes that arrived before are reported.
+		a.interest = b.interest = -1;
+		this->UpdateInterest(&a);
+		this->UpdateInterest(&b);
+		return true;
+	}
+
+	tcp::Connection *tcp::Server::GetConnection(SlotHandle handle)
+	{
+		Connection *connection = this->connections.Get(handle);
+		if (connection == nullptr || connection->closed)
+			return nullptr;
+		return connection;
+	}
+
+	void tcp::Server::HandleEvent(Connection *connection, int events)
+	{
+		if (connection->connecting)
+		{
+			if (events & (Poller::Writable | Poller::Closed))
+				this->Connected(connection);
+			return;
+		}
+		if (connection->handshaking)
+		{
+			this->Handshake(connection);
+			return;
+		}
+		Connection *relay = connection->relay;
+		if (events & Poller::Writable)
+		{
+			if (!this->FlushOutput(connection))
+			{
+				connection->Close();
+				return;
+			}
+			if (connection->closed)
+				return;
+			// connection accepts bytes again,flush what its relay has pending and resume reading it.
+			if (relay != nullptr && connection->Queued() == 0)
+			{
+				switch (this->Flush(relay))
 				{
-					for (i = 0; i < 1024; i++)
+				case FlushError:
+					connection->Close();
+					return;
+				case FlushDone:
+					if (!this->Read(relay))
 					{
-						if (clientfdlist[i] == 0)
-						{
-							clientfdlist[i] = cfd;
-							break;
-						}
+						connection->Close();
+						return;
 					}
+					break;
+				case FlushBlocked:
+					break;
 				}
 			}
-			for (i = 0; i < 1024; i++)
+		}
+		if ((events & Poller::Readable) && !connection->paused)
+		{
+			if (relay != nullptr ? !this->Read(connection) : !this->Receive(connection))
+			{
+				connection->Close();
+				return;
+			}
+			if (connection->closed)
+				return;
+		}
+		this->UpdateInterest(connection);
+		if (relay != nullptr)
+			this->UpdateInterest(relay);
+	}
+
+	bool tcp::Server::Receive(Connection *connection)
+	{
+		int recvsize;
+		for (;;)
+		{
+			// onData may have paused,closed or relayed the connection.
+			if (!connection->onData || connection->paused || connection->closed || connection->relay != nullptr)
+				return true;
+			recvsize = StreamRecv(connection, this->buffer, this->buffersize);
+			if (recvsize == 0)
+				return false;
+			if (recvsize == SOCKET_ERROR)
+				return WouldBlock();
+			this->CountRead(connection, recvsize);
+			if (!connection->onData(*connection, this->buffer, recvsize))
+				return false;
+			if (!Poller::EdgeTriggered && (connection->stream == nullptr || connection->stream->Pending() == 0))
+				return true;
+		}
+	}
+
+	bool tcp::Server::FlushOutput(Connection *connection)
+	{
+		if (connection->Queued() == 0)
+			return true;
+		int size;
+		while (connection->outputbegin < connection->output.size())
+		{
+			size = StreamSend(connection, connection->output.data() + connection->outputbegin,
+							  (int)(connection->output.size() - connection->outputbegin));
+			if (size > 0)
+				connection->outputbegin += size;
+			else if (size == SOCKET_ERROR && WouldBlock())
+				return true;
+			else
+				return false;
+		}
+		connection->output.clear();
+		connection->outputbegin = 0;
+		if (connection->onWritable)
+			connection->onWritable(*connection);
+		return true;
+	}
+
+	tcp::Server::FlushResult tcp::Server::Flush(Connection *connection)
+	{
+		Connection *relay = connection->relay;
+#ifdef __linux__
+		ssize_t spliced;
+		while (connection->piped > 0)
+		{
+			spliced = ::splice(connection->pipe[0], NULL, relay->fd, NULL, connection->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (spliced > 0)
+				connection->piped -= spliced;
+			else if (spliced == -1 && errno == EAGAIN)
+				return FlushBlocked;
+			else
+				return FlushError;
+		}
+#endif
+		int size;
+		while (connection->pendingbegin < connection->pendingend)
+		{
+			size = StreamSend(relay, connection->buffer + connection->pendingbegin,
+							  (int)(connection->pendingend - connection->pendingbegin));
+			if (size > 0)
+				connection->pendingbegin += size;
+			else if (size == SOCKET_ERROR && WouldBlock())
+				return FlushBlocked;
+			else
+				return FlushError;
+		}
+		connection->pendingbegin = connection->pendingend = 0;
+		return FlushDone;
+	}
+
+	void tcp::Server::ReleaseBuffer(Connection *connection)
+	{
+		if (connection->buffer == nullptr)
+			return;
+		this->pool->Put(connection->buffer, connection->buffersize);
+		connection->buffer = nullptr;
+		connection->pendingbegin = connection->pendingend = 0;
+	}
+
+#ifdef __linux__
+	// move bytes through the pipe without copying them to user space.
+	bool tcp::Server::ReadPipe(Connection *connection)
+	{
+		ssize_t size;
+		size_t allowed;
+		for (;;)
+		{
+			if ((allowed = this->Shape(connection, SPLICE_SIZE)) == 0)
+				return true;
+			size = ::splice(connection->fd, NULL, connection->pipe[1], NULL, allowed, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			// the pipe is flushed after every splice,so relay already has all the bytes.
+			if (size == 0)
+			{
+				connection->readclosed = true;
+				return this->ShutdownRelay(connection);
+			}
+			if (size == -1)
 			{
-				cfd = clientfdlist[i];
-				if (FD_ISSET(cfd, &readableset))
+				if (errno == EAGAIN)
+					return true;
+				if ((errno == EINVAL || errno == ENOSYS) && connection->relay->piped == 0)
 				{
-					count--;
-					Socket &rsocket = GetSocket(cfd);
-					recvsize = rsocket.Recv(this->buffer, this->buffersize);
-					if (recvsize > 0)
-					{
-						if (!this->onNewData(rsocket, this->buffer, recvsize))
-						{
-							rsocket.Close();
-							this->RemoveSocket(cfd);
-							clientfdlist[i] = 0;
-						}
-					}
-					else
-					{
-						this->onConnectionClose(rsocket);
-						this->RemoveSocket(cfd);
-						clientfdlist[i] = 0;
-					}
+					// splice is not supported for these sockets,use the copy path for the whole pair.
+					ClosePipe(connection->pipe);
+					ClosePipe(connection->relay->pipe);
+					return this->Read(connection);
 				}
-				if (count == 0)
-					break;
+				return false;
+			}
+			connection->piped += size;
+			this->CountRead(connection, (int)size);
+			switch (this->Flush(connection))
+			{
+			case FlushError:
+				return false;
+			case FlushBlocked:
+				return true;
+			case FlushDone:
+				break;
 			}
 		}
 	}
-
+#else
+	bool tcp::Server::ReadPipe(Connection *connection) { return false; }
 #endif
 
-	void tcp::Server::AddSocket(socket_fd cfd, const sockaddr_in &sockaddr)
+	bool tcp::Server::Read(Connection *connection)
+	{
+		Connection *relay = connection->relay;
+		if (connection->Blocked() || relay->Queued() > 0)
+			return true;
+		if (connection->readclosed)
+			return this->ShutdownRelay(connection);
+		if (connection->throttled)
+			return true;
+		if (connection->pipe[0] != -1)
+			return this->ReadPipe(connection);
+		int size, sent;
+		size_t allowed;
+		for (;;)
+		{
+			if ((allowed = this->Shape(connection, connection->nextsize)) == 0)
+			{
+				this->ReleaseBuffer(connection);
+				return true;
+			}
+			if (connection->buffer == nullptr)
+			{
+				connection->buffersize = connection->nextsize;
+				connection->buffer = this->pool->Get(connection->buffersize);
+				if (connection->buffer == nullptr)
+					return false;
+			}
+			size = StreamRecv(connection, connection->buffer, (int)(allowed < connection->buffersize ? allowed : connection->buffersize));
+			if (size == 0)
+			{
+				this->ReleaseBuffer(connection);
+				connection->readclosed = true;
+				return this->ShutdownRelay(connection);
+			}
+			if (size == SOCKET_ERROR)
+			{
+				// the direction is idle,it does not need a buffer until the next read.
+				this->ReleaseBuffer(connection);
+				return WouldBlock();
+			}
+			connection->nextsize = this->pool->NextSize(connection->buffersize, size);
+			this->CountRead(connection, size);
+			sent = StreamSend(relay, connection->buffer, size);
+			if (sent == SOCKET_ERROR)
+			{
+				if (!WouldBlock())
+					return false;
+				sent = 0;
+			}
+			if (sent < size)
+			{
+				connection->pendingbegin = sent;
+				connection->pendingend = size;
+				return true;
+			}
+			// what the stream holds already is not reported again by the poller.
+			bool pending = connection->stream != nullptr && connection->stream->Pending() > 0;
+			if (connection->nextsize != connection->buffersize || (!Poller::EdgeTriggered && !pending))
+				this->ReleaseBuffer(connection);
+			if (!Poller::EdgeTriggered && !pending)
+				return true;
+		}
+	}
+
+	size_t tcp::Server::Shape(Connection *connection, size_t size)
 	{
-		FD_SET(cfd, &this->socketset);
-		this->socketmap.emplace(cfd, Socket(SOCK_STREAM, &sockaddr, cfd));
+		if (!connection->flow)
+			return size;
+		int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(this->now.time_since_epoch()).count();
+		int64_t available = connection->flow->Available(now);
+		if (available > 0)
+			return available < (int64_t)size ? (size_t)available : size;
+		// an edge-triggered poller reports the bytes left in the socket again once Readable is back in the interest.
+		connection->throttled = true;
+		SlotHandle handle = connection->handle;
+		connection->throttletimer = this->AddTimer(connection->flow->Wait(now), [this, handle]() -> void
+												   {
+													   Connection *connection = this->GetConnection(handle);
+													   if (connection == nullptr)
+														   return;
+													   connection->throttletimer = TimingWheel::InvalidTimer;
+													   connection->throttled = false;
+													   // the poller does not report what the stream holds already.
+													   if (connection->stream != nullptr && connection->stream->Pending() > 0 && connection->relay != nullptr)
+													   {
+														   if (!this->Read(connection))
+														   {
+															   connection->Close();
+															   return;
+														   }
+														   this->UpdateInterest(connection->relay);
+													   }
+													   this->UpdateInterest(connection); });
+		if (this->metrics != nullptr)
+			this->metrics->Add(Metrics::Throttles);
+		return 0;
 	}
 
-	void tcp::Server::RemoveSocket(socket_fd cfd)
+	bool tcp::Server::ShutdownRelay(Connection *connection)
 	{
-		FD_CLR(cfd, &this->socketset);
-		this->socketmap.erase(cfd);
+		// nothing is read any more,an error is what is left to notice.
+		if (connection->GetError() != 0)
+			return false;
+		Connection *relay = connection->relay;
+		if (!relay->writeclosed)
+		{
+			relay->writeclosed = true;
+			if (relay->stream != nullptr)
+				relay->stream->Shutdown();
+			if (shutdown(relay->fd, SHUTDOWN_SEND) == SOCKET_ERROR)
+				return false;
+		}
+		return !connection->writeclosed;
 	}
 
-	Socket &tcp::Server::GetSocket(socket_fd cfd) { return socketmap.at(cfd); }
+	void tcp::Server::UpdateInterest(Connection *connection)
+	{
+		if (connection->closed || connection->handshaking)
+			return;
+		int interest = 0;
+		Connection *relay = connection->relay;
+		if (connection->connecting)
+			interest = Poller::Writable;
+		else
+		{
+			// a relay side is read only while the other side took all its bytes.
+			if (!connection->paused && !connection->readclosed && !connection->throttled && (relay == nullptr || (!connection->Blocked() && relay->Queued() == 0)))
+				interest |= Poller::Readable;
+			if (connection->Queued() > 0 || (relay != nullptr && relay->Blocked()))
+				interest |= Poller::Writable;
+		}
+		if (interest == connection->interest)
+			return;
+		connection->interest = interest;
+		if (!this->poller->Modify(connection->fd, interest, connection))
+			connection->Close();
+	}
+
+	void tcp::Server::CloseConnection(Connection *connection)
+	{
+		if (connection->closed)
+			return;
+		connection->closed = true;
+		this->CancelTimer(connection->connecttimer);
+		this->CancelTimer(connection->idletimer);
+		this->CancelTimer(connection->throttletimer);
+		this->poller->Remove(connection->fd);
+		connection->stream.reset();
+		connection->handshaking = false;
+		connection->onHandshake = nullptr;
+		connection->Socket::Close();
+		ClosePipe(connection->pipe);
+		this->ReleaseBuffer(connection);
+		connection->flow.reset();
+		// a connect closed before it finished is not reported,and its callback may hold state.
+		connection->onConnect = nullptr;
+		connection->output.clear();
+		connection->outputbegin = 0;
+		this->closedlist.push_back(connection->handle);
+		if (connection->accepted && this->metrics != nullptr)
+			this->metrics->Add(Metrics::Closes);
+		if (connection->accepted && this->admission != nullptr)
+			this->admission->Release(SourceKey(connection->GetSockAddr()));
+		if (connection->onClose)
+			connection->onClose(*connection);
+		if (connection->relay != nullptr)
+			connection->relay->Close();
+	}
+
+	void tcp::Server::CountRead(Connection *connection, int size)
+	{
+		connection->lastactive = this->now;
+		// what is read from connection is sent on its relay.
+		this->Tune(connection);
+		if (connection->relay != nullptr)
+			this->Tune(connection->relay);
+		if (connection->flow)
+			connection->flow->Take(size, std::chrono::duration_cast<std::chrono::nanoseconds>(this->now.time_since_epoch()).count());
+		if (this->metrics != nullptr)
+			this->metrics->Add(connection->accepted ? Metrics::BytesIn : Metrics::BytesOut, size);
+	}
+
+	void tcp::Server::Tune(Connection *connection)
+	{
+		if (connection->autotune == 0 || this->now < connection->tuneat)
+			return;
+		connection->tuneat = this->now + std::chrono::seconds(1);
+		TuneBuffer(connection->fd, false, connection->autotune);
+		TuneBuffer(connection->fd, true, connection->autotune);
+	}
+
+	tcp::Server::TimerId tcp::Server::AddTimer(int ms, OnTimer onTimer) { return this->wheel->Add(ms, std::move(onTimer)); }
+	void tcp::Server::CancelTimer(TimerId timer) { this->wheel->Cancel(timer); }
+
+	void tcp::Server::StartIdleTimer(Connection *connection, int ms)
+	{
+		SlotHandle handle = connection->handle;
+		connection->idletimer = this->AddTimer(ms, [this, handle]() -> void
+											   { this->CheckIdle(handle); });
+	}
+
+	void tcp::Server::CheckIdle(SlotHandle handle)
+	{
+		Connection *connection = this->GetConnection(handle);
+		if (connection == nullptr)
+			return;
+		connection->idletimer = TimingWheel::InvalidTimer;
+		Clock::time_point lastactive = connection->lastactive;
+		if (connection->relay != nullptr && connection->relay->lastactive > lastactive)
+			lastactive = connection->relay->lastactive;
+		// a busy pair costs nothing per read,its timer only moves when it fires.
+		int idle = (int)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - lastactive).count();
+		if (idle >= this->idletimeout)
+		{
+			LOG_DEBUG("idle relay closed fd=%d idle=%dms", (int)connection->fd, idle);
+			connection->Close();
+			return;
+		}
+		this->StartIdleTimer(connection, this->idletimeout - idle);
+	}
+
+#ifdef __linux__
+	Poller::Poller() : epfd(epoll_create1(EPOLL_CLOEXEC)), epollevents() {}
+	Poller::~Poller()
+	{
+		if (this->epfd != -1)
+			close(this->epfd);
+	}
+
+	inline uint32_t ToEpollEvents(int events)
+	{
+		// the end of the peer is reported only while reading,a half-closed socket would report it again on every change.
+		uint32_t ev = EPOLLET;
+		if (events & Poller::Readable)
+			ev |= EPOLLIN | EPOLLRDHUP;
+		if (events & Poller::Writable)
+			ev |= EPOLLOUT;
+		return ev;
+	}
+
+	bool Poller::Add(socket_fd fd, int events, void *data)
+	{
+		epoll_event ev;
+		ev.events = ToEpollEvents(events);
+		ev.data.ptr = data;
+		return epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev) != -1;
+	}
+
+	bool Poller::Modify(socket_fd fd, int events, void *data)
+	{
+		epoll_event ev;
+		ev.events = ToEpollEvents(events);
+		ev.data.ptr = data;
+		return epoll_ctl(this->epfd, EPOLL_CTL_MOD, fd, &ev) != -1;
+	}
+
+	bool Poller::Remove(socket_fd fd) { return epoll_ctl(this->epfd, EPOLL_CTL_DEL, fd, nullptr) != -1; }
+
+	int Poller::Wait(Event *events, int maxevents, int timeoutms)
+	{
+		if (this->epollevents.size() < (size_t)maxevents)
+			this->epollevents.resize(maxevents);
+		int count = epoll_wait(this->epfd, this->epollevents.data(), maxevents, timeoutms);
+		if (count == -1)
+			return errno == EINTR ? 0 : SOCKET_ERROR;
+		for (int i = 0; i < count; i++)
+		{
+			const epoll_event &ev = this->epollevents[i];
+			events[i].data = ev.data.ptr;
+			events[i].events = 0;
+			if (ev.events & EPOLLIN)
+				events[i].events |= Readable;
+			if (ev.events & EPOLLOUT)
+				events[i].events |= Writable;
+			if (ev.events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+				events[i].events |= Closed | Readable;
+		}
+		return count;
+	}
+#else
+	Poller::Poller() : entries() { Init(); }
+	Poller::~Poller() {}
+
+	bool Poller::Add(socket_fd fd, int events, void *data)
+	{
+		if (this->entries.size() >= FD_SETSIZE)
+			return false;
+		this->entries.push_back(Entry{fd, events, data});
+		return true;
+	}
+
+	bool Poller::Modify(socket_fd fd, int events, void *data)
+	{
+		for (Entry &entry : this->entries)
+		{
+			if (entry.fd == fd)
+			{
+				entry.events = events;
+				entry.data = data;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool Poller::Remove(socket_fd fd)
+	{
+		for (size_t i = 0; i < this->entries.size(); i++)
+		{
+			if (this->entries[i].fd == fd)
+			{
+				this->entries[i] = this->entries.back();
+				this->entries.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	int Poller::Wait(Event *events, int maxevents, int timeoutms)
+	{
+		// a failed non-blocking connect is reported in the except set on windows.
+		fd_set readableset, writableset, exceptset;
+		FD_ZERO(&readableset);
+		FD_ZERO(&writableset);
+		FD_ZERO(&exceptset);
+		socket_fd maxfd = 0;
+		for (const Entry &entry : this->entries)
+		{
+			if (entry.events & Readable)
+				FD_SET(entry.fd, &readableset);
+			if (entry.events & Writable)
+			{
+				FD_SET(entry.fd, &writableset);
+				FD_SET(entry.fd, &exceptset);
+			}
+			if (entry.fd > maxfd)
+				maxfd = entry.fd;
+		}
+		timeval tv;
+		tv.tv_sec = timeoutms / 1000;
+		tv.tv_usec = (timeoutms % 1000) * 1000;
+		int count = select((int)maxfd + 1, &readableset, &writableset, &exceptset, timeoutms < 0 ? NULL : &tv);
+		// a signal is no error,the loop just waits again,as with epoll.
+		if (count == SOCKET_ERROR)
+#ifdef _WIN32
+			return WSAGetLastError() == WSAEINTR ? 0 : SOCKET_ERROR;
+#else
+			return errno == EINTR ? 0 : SOCKET_ERROR;
+#endif
+		int ready = 0;
+		for (size_t i = 0; i < this->entries.size() && ready < maxevents; i++)
+		{
+			const Entry &entry = this->entries[i];
+			int ev = 0;
+			if (FD_ISSET(entry.fd, &readableset))
+				ev |= Readable;
+			if (FD_ISSET(entry.fd, &writableset))
+				ev |= Writable;
+			if (FD_ISSET(entry.fd, &exceptset))
+				ev |= Writable | Closed;
+			if (ev != 0)
+			{
+				events[ready].data = entry.data;
+				events[ready].events = ev;
+				ready++;
+			}
+		}
+		return ready;
+	}
+#endif
 
 	// return false if you want to close this connection.
-	void tcp::Server::SetOnNewConnection(bool (*onNewConnection)(const Socket &socket)) { this->onNewConnection = onNewConnection; }
+	void tcp::Server::SetOnNewConnection(OnConnection onNewConnection) { this->onNewConnection = std::move(onNewConnection); }
 	// return false if you want to close this connection.
-	void tcp::Server::SetOnNewData(bool (*onNewData)(const Socket &socket, char *data, int recvsize)) { this->onNewData = onNewData; }
-	void tcp::Server::SetOnConnectionClose(void (*onConnectionClose)(const Socket &socket)) { this->onConnectionClose = onConnectionClose; }
-	void tcp::Server::SetOnError(void (*onError)(const char *message)) { this->onError = onError; }
+	void tcp::Server::SetOnNewData(Connection::OnData onNewData) { this->onNewData = std::move(onNewData); }
+	void tcp::Server::SetOnWritable(Connection::OnEvent onWritable) { this->onWritable = std::move(onWritable); }
+	void tcp::Server::SetOnConnectionClose(Connection::OnEvent onConnectionClose) { this->onConnectionClose = std::move(onConnectionClose); }
+	void tcp::Server::SetOnError(OnError onError) { this->onError = std::move(onError); }
+	void tcp::Server::SetReusePort(bool reuseport) { this->reuseport = reuseport; }
+
+	void tcp::Server::SetRelay(bool splice, size_t buffermin, size_t buffermax)
+	{
+		this->splice = splice;
+		this->pool.reset(new BufferPool(buffermin, buffermax));
+	}
+
+	void tcp::Server::SetMetrics(Metrics *metrics) { this->metrics = metrics; }
+	void tcp::Server::SetIdleTimeout(int ms) { this->idletimeout = ms; }
+	void tcp::Server::SetKeepAlive(int seconds) { this->keepalive = seconds; }
+
+	void tcp::Server::SetSocketOptions(const SocketOptions &accepted, const SocketOptions &connected)
+	{
+		this->acceptoptions = accepted;
+		this->connectoptions = connected;
+	}
+	void tcp::Server::SetBacklog(int backlog) { this->backlog = backlog; }
+	void tcp::Server::SetAdmission(Admission *admission) { this->admission = admission; }
+	void tcp::Server::SetShaper(Shaper *shaper) { this->shaper = shaper; }
 
 	bool tcp::Server::DefaultOnNewConnection(const Socket &socket)
 	{
-		static char buf[64];
+		char buf[64];
 		socket.GetAddr(buf);
-		std::cout << "new connection: " << buf << ':' << socket.GetPort() << std::endl;
+		LOG_INFO("new connection addr=%s:%d", buf, socket.GetPort());
 		return true;
 	}
 
 	bool tcp::Server::DefaultOnNewData(const Socket &socket, char *data, int recvsize)
 	{
-		static char buf[64];
+		char buf[64];
 		socket.GetAddr(buf);
 		data[recvsize] = 0;
-		std::cout << "new data received from " << buf << ':' << socket.GetPort() << std::endl
-				  << data << std::endl;
+		LOG_INFO("new data addr=%s:%d size=%d data=%s", buf, socket.GetPort(), recvsize, data);
 		return true;
 	}
 
 	void tcp::Server::DefaultOnConnectionClose(const Socket &socket)
 	{
-		static char buf[64];
+		char buf[64];
 		socket.GetAddr(buf);
-		std::cout << "client closed its connection: " << buf << ':' << socket.GetPort() << std::endl;
+		LOG_INFO("connection closed addr=%s:%d", buf, socket.GetPort());
 	}
 
 	void tcp::Server::ParseCallback()
 	{
-		if (this->onNewConnection == nullptr)
+		if (!this->onNewConnection)
 			this->onNewConnection = DefaultOnNewConnection;
-		if (this->onNewData == nullptr)
+		if (!this->onNewData)
 			this->onNewData = DefaultOnNewData;
-		if (this->onConnectionClose == nullptr)
+		if (!this->onConnectionClose)
 			this->onConnectionClose = DefaultOnConnectionClose;
-		if (this->onError == nullptr)
+		if (!this->onError)
 			this->onError = DefaultOnError;
 	}
 
-	void tcp::Server::DefaultOnError(const char *msg) { std::cout << msg << std::endl; }
+	void tcp::Server::DefaultOnError(const char *msg) { LOG_ERROR("%s", msg); }
 
 	int network::Socket::GetPort() { return const_cast<const network::Socket &>(*this).GetPort(); }
 	void network::Socket::GetAddr(char *dst) { return const_cast<const network::Socket &>(*this).GetAddr(dst); }
-	const sockaddr_in *network::Socket::GetSockAddr() { return const_cast<const network::Socket &>(*this).GetSockAddr(); }
+	const sockaddr *network::Socket::GetSockAddr() { return const_cast<const network::Socket &>(*this).GetSockAddr(); }
 	int network::Socket::Send(const char *buf, int size) { return const_cast<const network::Socket &>(*this).Send(buf, size); }
 	// int network::Socket::Recv(char *buf, int size) { return const_cast<const network::Socket &>(*this).Recv(buf, size); }
 }
@@ -0,0 +1,753 @@
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include "network.hpp"
+#include <ctype.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <poll.h>
+#endif
+
+namespace network
+{
+	// non-blocking name resolution of backends,shared by every event loop.
+	// a thread of its own asks the nameservers of /etc/resolv.conf for the A and AAAA records of a name
+	// over udp,so no event loop ever blocks in getaddrinfo,and caches the answer for as long as its ttl allows.
+	// address literals and the names of /etc/hosts are answered at once.
+	// a cached name used in the last tenth of its ttl is refreshed in the background while it is still served,
+	// so a busy backend does not wait for its lookups,and a name no nameserver answers for keeps the
+	// addresses it had for a while(serve stale) instead of failing every connect.
+	// search domains are not applied,names are looked up as they are written.
+	// windows has no resolv.conf,the thread calls getaddrinfo there and keeps answers for fallbackttl.
+	class Resolver
+	{
+	public:
+		using Addresses = std::vector<sockaddr_storage>;
+		// addresses is empty if the name does not exist or could not be resolved.
+		using OnResolve = std::function<void(const Addresses &addresses)>;
+
+		Resolver();
+		Resolver(const Resolver &rhs) = delete;
+		~Resolver();
+
+		Resolver &operator=(const Resolver &rhs) = delete;
+
+		// read the nameservers and /etc/hosts and start the thread,return false if it can not run.
+		bool Start();
+		void Stop();
+		// fill addresses with the addresses of name and port if they are known now,without blocking.
+		// ipv6 and ipv4 addresses alternate,ipv6 first,as happy eyeballs wants them.
+		// return false if name must be looked up first with Resolve.
+		bool Lookup(const std::string &name, int port, Addresses &addresses);
+		// look name up,onResolve is called on the thread of the resolver,pass the result on to the event loop.
+		void Resolve(const std::string &name, int port, OnResolve onResolve);
+
+	protected:
+		using Clock = std::chrono::steady_clock;
+
+		static constexpr int typeA = 1;
+		static constexpr int typeCname = 5;
+		static constexpr int typeSoa = 6;
+		static constexpr int typeAaaa = 28;
+		// ttls are kept within these bounds,so a ttl of 0 does not send a query per connect.
+		static constexpr int minttl = 1;
+		static constexpr int maxttl = 86400;
+		// how long a name that does not exist is cached if the answer does not say.
+		static constexpr int negativettl = 5;
+		// how long the old addresses are served after no nameserver answered a refresh.
+		static constexpr int stalettl = 30;
+		static constexpr int fallbackttl = 60;
+		// a nameserver that does not answer within timeoutms is asked again,or the next one is,
+		// every nameserver gets rounds chances.
+		static constexpr int timeoutms = 1000;
+		static constexpr int rounds = 3;
+
+		struct Entry
+		{
+			// ports are 0.
+			Addresses addrs;
+			Clock::time_point expires;
+			// a Lookup after this refreshes the entry in the background.
+			Clock::time_point refresh;
+		};
+
+		struct Waiter
+		{
+			int port;
+			OnResolve onResolve;
+		};
+
+		// a lookup in flight,an A and an AAAA query.
+		struct Query
+		{
+			std::string name;
+			// the question as it is sent,the name encoded in labels.
+			std::string question;
+			// AAAA first,then A.
+			uint16_t ids[2];
+			bool answered[2];
+			Addresses addrs[2];
+			// smallest ttl of the records of an answer,or its negative ttl if it has no address.
+			int ttls[2];
+			int attempt;
+			Clock::time_point retry;
+			std::vector<Waiter> waiters;
+		};
+
+		std::mutex mutex;
+		std::unordered_map<std::string, Entry> cache;
+		// names of /etc/hosts,never change after Start.
+		std::unordered_map<std::string, Addresses> hosts;
+		// names given to Resolve and names to refresh,for the thread.
+		std::vector<std::pair<std::string, Waiter>> incoming;
+		// names being refreshed in the background.
+		std::unordered_set<std::string> refreshing;
+		bool stopped;
+		std::thread thread;
+#ifdef _WIN32
+		std::condition_variable wakeup;
+#else
+		// owned by the thread.
+		std::vector<sockaddr_storage> nameservers;
+		std::unordered_map<std::string, Query> queries;
+		std::unordered_map<uint16_t, std::string> ids;
+		std::mt19937 random;
+		int wakeup[2];
+		// a socket per family of the nameservers,INVALID_SOCKET if unused.
+		socket_fd sockets[2];
+#endif
+
+		static std::string Normalize(const std::string &name);
+		// ipv6 first,then the families alternate,port set on every address.
+		static Addresses Interleave(const Addresses &addrs, int port);
+		static void SetPort(sockaddr_storage &addr, int port);
+
+		void LoadHosts();
+		void Run();
+		// queue name for the thread and wake it up,waiter.onResolve is empty for a refresh.
+		void Enqueue(const std::string &name, Waiter waiter);
+		// cache the addresses of name for ttl seconds,or keep the stale ones if it could not be resolved,
+		// and return what the waiters get.
+		Addresses Store(const std::string &name, bool resolved, const Addresses &addresses, int ttl);
+#ifndef _WIN32
+		// return the offset after the name at offset,0 if the packet ends in it.
+		static size_t SkipName(const unsigned char *packet, size_t size, size_t offset);
+		static uint32_t Read32(const unsigned char *bytes);
+
+		void LoadNameservers();
+		// start or join the lookups given to Resolve.
+		void TakeIncoming();
+		void Send(Query &query, int type);
+		void Receive(socket_fd fd);
+		void Parse(const unsigned char *packet, size_t size);
+		// retry the queries not answered in time,finish those out of attempts.
+		void Retry();
+		// end the lookup of name and call its waiters.
+		void Finish(const std::string &name);
+		int NextTimeout();
+#endif
+	};
+}
+
+namespace network
+{
+#ifdef _WIN32
+	Resolver::Resolver() : mutex(), cache(), hosts(), incoming(), refreshing(), stopped(true), thread(), wakeup() {}
+#else
+	Resolver::Resolver() : mutex(), cache(), hosts(), incoming(), refreshing(), stopped(true), thread(), nameservers(),
+						   queries(), ids(), random(std::random_device()()), wakeup{-1, -1}, sockets{INVALID_SOCKET, INVALID_SOCKET} {}
+#endif
+
+	Resolver::~Resolver() { this->Stop(); }
+
+	bool Resolver::Start()
+	{
+		if (this->thread.joinable())
+			return true;
+		this->LoadHosts();
+#ifndef _WIN32
+		this->LoadNameservers();
+		if (pipe(this->wakeup) != 0)
+			return false;
+		fcntl(this->wakeup[0], F_SETFL, O_NONBLOCK);
+		fcntl(this->wakeup[1], F_SETFL, O_NONBLOCK);
+		for (const sockaddr_storage &nameserver : this->nameservers)
+		{
+			int index = nameserver.ss_family == AF_INET6 ? 1 : 0;
+			if (this->sockets[index] != INVALID_SOCKET)
+				continue;
+			this->sockets[index] = socket(nameserver.ss_family, SOCK_DGRAM, 0);
+			if (this->sockets[index] != INVALID_SOCKET)
+				fcntl(this->sockets[index], F_SETFL, O_NONBLOCK);
+		}
+#endif
+		this->stopped = false;
+		this->thread = std::thread(&Resolver::Run, this);
+		return true;
+	}
+
+	void Resolver::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			if (this->stopped)
+				return;
+			this->stopped = true;
+		}
+#ifdef _WIN32
+		this->wakeup.notify_one();
+#else
+		char byte = 0;
+		if (write(this->wakeup[1], &byte, 1) == -1)
+			LOG_WARN("resolver wakeup failed errno=%d", errno);
+#endif
+		this->thread.join();
+#ifndef _WIN32
+		close(this->wakeup[0]);
+		close(this->wakeup[1]);
+		for (socket_fd &fd : this->sockets)
+		{
+			if (fd != INVALID_SOCKET)
+				closesocket(fd);
+			fd = INVALID_SOCKET;
+		}
+#endif
+	}
+
+	bool Resolver::Lookup(const std::string &name, int port, Addresses &addresses)
+	{
+		sockaddr_storage addr;
+		addresses.clear();
+		if (ParseAddress(name.c_str(), port, addr))
+		{
+			addresses.push_back(addr);
+			return true;
+		}
+		std::string key = Normalize(name);
+		std::unordered_map<std::string, Addresses>::iterator host = this->hosts.find(key);
+		if (host != this->hosts.end())
+		{
+			addresses = Interleave(host->second, port);
+			return true;
+		}
+		bool refresh = false;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			std::unordered_map<std::string, Entry>::iterator it = this->cache.find(key);
+			Clock::time_point now = Clock::now();
+			if (it == this->cache.end() || now >= it->second.expires)
+				return false;
+			addresses = it->second.addrs;
+			refresh = now >= it->second.refresh && this->refreshing.insert(key).second;
+		}
+		for (sockaddr_storage &address : addresses)
+			SetPort(address, port);
+		if (refresh)
+			this->Enqueue(key, Waiter{0, nullptr});
+		return true;
+	}
+
+	void Resolver::Resolve(const std::string &name, int port, OnResolve onResolve)
+	{
+		Addresses addresses;
+		if (this->Lookup(name, port, addresses))
+		{
+			onResolve(addresses);
+			return;
+		}
+		this->Enqueue(Normalize(name), Waiter{port, std::move(onResolve)});
+	}
+
+	void Resolver::Enqueue(const std::string &name, Waiter waiter)
+	{
+		bool queued = false;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			if (!this->stopped)
+			{
+				this->incoming.emplace_back(name, std::move(waiter));
+				queued = true;
+			}
+		}
+		// not started,nothing will ever answer.
+		if (!queued)
+		{
+			if (waiter.onResolve)
+				waiter.onResolve(Addresses());
+			return;
+		}
+#ifdef _WIN32
+		this->wakeup.notify_one();
+#else
+		char byte = 0;
+		// a full pipe already wakes the thread up.
+		if (write(this->wakeup[1], &byte, 1) == -1)
+			return;
+#endif
+	}
+
+	std::string Resolver::Normalize(const std::string &name)
+	{
+		std::string key(name);
+		std::transform(key.begin(), key.end(), key.begin(), [](char c) -> char
+					   { return (char)tolower((unsigned char)c); });
+		if (!key.empty() && key.back() == '.')
+			key.pop_back();
+		return key;
+	}
+
+	Resolver::Addresses Resolver::Interleave(const Addresses &addrs, int port)
+	{
+		Addresses addrs6, addrs4, ordered;
+		for (const sockaddr_storage &addr : addrs)
+			(addr.ss_family == AF_INET6 ? addrs6 : addrs4).push_back(addr);
+		for (size_t i = 0; i < addrs6.size() || i < addrs4.size(); i++)
+		{
+			if (i < addrs6.size())
+				ordered.push_back(addrs6[i]);
+			if (i < addrs4.size())
+				ordered.push_back(addrs4[i]);
+		}
+		for (sockaddr_storage &addr : ordered)
+			SetPort(addr, port);
+		return ordered;
+	}
+
+	Resolver::Addresses Resolver::Store(const std::string &name, bool resolved, const Addresses &addresses, int ttl)
+	{
+		Clock::time_point now = Clock::now();
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->refreshing.erase(name);
+		Entry &entry = this->cache[name];
+		if (resolved)
+		{
+			ttl = std::max(ttl, (int)minttl);
+			entry.addrs = Interleave(addresses, 0);
+			entry.expires = now + std::chrono::seconds(ttl);
+			entry.refresh = now + std::chrono::milliseconds(ttl * 900);
+		}
+		else if (!entry.addrs.empty())
+		{
+			LOG_WARN("resolve failed name=%s,serving stale addresses", name.c_str());
+			entry.expires = now + std::chrono::seconds(stalettl);
+			entry.refresh = now + std::chrono::seconds(negativettl);
+		}
+		else
+		{
+			LOG_WARN("resolve failed name=%s", name.c_str());
+			entry.expires = entry.refresh = now + std::chrono::seconds(negativettl);
+		}
+		return entry.addrs;
+	}
+
+	void Resolver::SetPort(sockaddr_storage &addr, int port)
+	{
+		if (addr.ss_family == AF_INET6)
+			((sockaddr_in6 *)&addr)->sin6_port = htons(port);
+		else
+			((sockaddr_in *)&addr)->sin_port = htons(port);
+	}
+
+	void Resolver::LoadHosts()
+	{
+#ifdef _WIN32
+		std::ifstream file("C:\\Windows\\System32\\drivers\\etc\\hosts");
+#else
+		std::ifstream file("/etc/hosts");
+#endif
+		std::string line, word;
+		while (std::getline(file, line))
+		{
+			line = line.substr(0, line.find('#'));
+			std::istringstream stream(line);
+			sockaddr_storage addr;
+			if (!(stream >> word) || !ParseAddress(word.c_str(), 0, addr))
+				continue;
+			while (stream >> word)
+				this->hosts[Normalize(word)].push_back(addr);
+		}
+		if (this->hosts.find("localhost") == this->hosts.end())
+		{
+			sockaddr_storage addr;
+			ParseAddress("127.0.0.1", 0, addr);
+			this->hosts["localhost"].push_back(addr);
+		}
+	}
+
+#ifndef _WIN32
+	void Resolver::LoadNameservers()
+	{
+		std::ifstream file("/etc/resolv.conf");
+		std::string line, word, addr;
+		while (std::getline(file, line))
+		{
+			std::istringstream stream(line);
+			sockaddr_storage nameserver;
+			// scoped addresses(fe80::1%eth0) do not parse and are skipped.
+			if (stream >> word >> addr && word == "nameserver" && ParseAddress(addr.c_str(), 53, nameserver))
+				this->nameservers.push_back(nameserver);
+		}
+		if (this->nameservers.empty())
+		{
+			sockaddr_storage nameserver;
+			ParseAddress("127.0.0.1", 53, nameserver);
+			this->nameservers.push_back(nameserver);
+		}
+	}
+
+#endif
+
+#ifdef _WIN32
+	void Resolver::Run()
+	{
+		std::unique_lock<std::mutex> lock(this->mutex);
+		while (!this->stopped)
+		{
+			if (this->incoming.empty())
+			{
+				this->wakeup.wait(lock);
+				continue;
+			}
+			std::pair<std::string, Waiter> request = std::move(this->incoming.front());
+			this->incoming.erase(this->incoming.begin());
+			lock.unlock();
+			addrinfo hints = {}, *result = nullptr;
+			hints.ai_socktype = SOCK_STREAM;
+			Addresses addrs;
+			int error = getaddrinfo(request.first.c_str(), nullptr, &hints, &result);
+			for (addrinfo *info = result; info != nullptr; info = info->ai_next)
+			{
+				sockaddr_storage addr = {};
+				memcpy(&addr, info->ai_addr, info->ai_addrlen);
+				addrs.push_back(addr);
+			}
+			if (result != nullptr)
+				freeaddrinfo(result);
+			// a name that does not exist is an answer,a failing lookup is not.
+			Addresses addresses = Interleave(this->Store(request.first, error == 0 || error == EAI_NONAME, addrs, addrs.empty() ? negativettl : fallbackttl),
+											 request.second.port);
+			if (request.second.onResolve)
+				request.second.onResolve(addresses);
+			lock.lock();
+		}
+	}
+#else
+	void Resolver::Run()
+	{
+		for (;;)
+		{
+			pollfd fds[3];
+			int count = 0;
+			fds[count++] = pollfd{this->wakeup[0], POLLIN, 0};
+			for (socket_fd fd : this->sockets)
+			{
+				if (fd != INVALID_SOCKET)
+					fds[count++] = pollfd{fd, POLLIN, 0};
+			}
+			if (poll(fds, count, this->NextTimeout()) < 0 && errno != EINTR)
+			{
+				LOG_ERROR("resolver poll failed errno=%d", errno);
+				return;
+			}
+			if (fds[0].revents != 0)
+			{
+				char bytes[64];
+				while (read(this->wakeup[0], bytes, sizeof(bytes)) > 0)
+					;
+				{
+					std::lock_guard<std::mutex> lock(this->mutex);
+					if (this->stopped)
+						return;
+				}
+				this->TakeIncoming();
+			}
+			for (int i = 1; i < count; i++)
+			{
+				if (fds[i].revents != 0)
+					this->Receive(fds[i].fd);
+			}
+			this->Retry();
+		}
+	}
+
+	void Resolver::TakeIncoming()
+	{
+		std::vector<std::pair<std::string, Waiter>> requests;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			requests.swap(this->incoming);
+		}
+		for (std::pair<std::string, Waiter> &request : requests)
+		{
+			std::unordered_map<std::string, Query>::iterator it = this->queries.find(request.first);
+			if (it != this->queries.end())
+			{
+				// one lookup per name however many clients wait for it.
+				if (request.second.onResolve)
+					it->second.waiters.push_back(std::move(request.second));
+				continue;
+			}
+			// a name longer than dns allows is answered as not existing.
+			std::string question;
+			std::istringstream stream(request.first);
+			std::string label;
+			bool valid = !request.first.empty() && request.first.size() <= 253;
+			while (valid && std::getline(stream, label, '.'))
+			{
+				valid = !label.empty() && label.size() <= 63;
+				question += (char)label.size();
+				question += label;
+			}
+			question += '\0';
+			Query &query = this->queries[request.first];
+			query.name = request.first;
+			query.question = question;
+			query.attempt = 0;
+			if (request.second.onResolve)
+				query.waiters.push_back(std::move(request.second));
+			for (int type = 0; type < 2; type++)
+			{
+				query.answered[type] = !valid;
+				query.ttls[type] = negativettl;
+				do
+					query.ids[type] = (uint16_t)this->random();
+				while (!this->ids.emplace(query.ids[type], query.name).second);
+			}
+			if (!valid)
+			{
+				this->Finish(request.first);
+				continue;
+			}
+			this->Send(query, 0);
+			this->Send(query, 1);
+			query.retry = Clock::now() + std::chrono::milliseconds(timeoutms);
+		}
+	}
+
+	void Resolver::Send(Query &query, int type)
+	{
+		const sockaddr_storage &nameserver = this->nameservers[query.attempt % this->nameservers.size()];
+		socket_fd fd = this->sockets[nameserver.ss_family == AF_INET6 ? 1 : 0];
+		if (fd == INVALID_SOCKET)
+			return;
+		// id,flags with recursion desired,one question.
+		unsigned char header[12] = {(unsigned char)(query.ids[type] >> 8), (unsigned char)query.ids[type], 1, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+		int qtype = type == 0 ? typeAaaa : typeA;
+		std::string packet((const char *)header, sizeof(header));
+		packet += query.question;
+		packet += (char)(qtype >> 8);
+		packet += (char)qtype;
+		packet += '\0';
+		packet += '\1';
+		if (sendto(fd, packet.data(), packet.size(), 0, (const sockaddr *)&nameserver, SockAddrLength((const sockaddr *)&nameserver)) < 0)
+			LOG_WARN("resolver send failed name=%s errno=%d", query.name.c_str(), errno);
+	}
+
+	void Resolver::Receive(socket_fd fd)
+	{
+		unsigned char packet[4096];
+		sockaddr_storage from;
+		for (;;)
+		{
+			socklen_t fromlen = sizeof(from);
+			ssize_t size = recvfrom(fd, packet, sizeof(packet), 0, (sockaddr *)&from, &fromlen);
+			if (size < 0)
+				return;
+			// only answers of a nameserver count,not datagrams anyone could send to the port.
+			bool known = false;
+			for (const sockaddr_storage &nameserver : this->nameservers)
+				known = known || memcmp(&nameserver, &from, SockAddrLength((const sockaddr *)&nameserver)) == 0;
+			if (known)
+				this->Parse(packet, (size_t)size);
+		}
+	}
+
+	size_t Resolver::SkipName(const unsigned char *packet, size_t size, size_t offset)
+	{
+		while (offset < size)
+		{
+			unsigned char length = packet[offset];
+			if (length == 0)
+				return offset + 1;
+			// a pointer to a name elsewhere ends the name.
+			if ((length & 0xc0) == 0xc0)
+				return offset + 2 <= size ? offset + 2 : 0;
+			if ((length & 0xc0) != 0)
+				return 0;
+			offset += 1 + length;
+		}
+		return 0;
+	}
+
+	uint32_t Resolver::Read32(const unsigned char *bytes) { return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3]; }
+
+	void Resolver::Parse(const unsigned char *packet, size_t size)
+	{
+		if (size < 12 || (packet[2] & 0x80) == 0)
+			return;
+		std::unordered_map<uint16_t, std::string>::iterator id = this->ids.find((uint16_t)(packet[0] << 8 | packet[1]));
+		if (id == this->ids.end())
+			return;
+		std::string name = id->second;
+		Query &query = this->queries[name];
+		int type = query.ids[0] == id->first ? 0 : 1;
+		int qtype = type == 0 ? typeAaaa : typeA;
+		int rcode = packet[3] & 0x0f;
+		// a reply cut to fit a datagram(TC) may still hold some complete records.
+		bool truncated = (packet[2] & 0x02) != 0;
+		int questions = packet[4] << 8 | packet[5], answers = packet[6] << 8 | packet[7], authorities = packet[8] << 8 | packet[9];
+		// the question must be ours,names compare without case.
+		size_t offset = 12 + query.question.size();
+		if (query.answered[type] || questions != 1 || offset + 4 > size || (packet[offset] << 8 | packet[offset + 1]) != qtype)
+			return;
+		for (size_t i = 0; i < query.question.size(); i++)
+		{
+			if (tolower(packet[12 + i]) != tolower((unsigned char)query.question[i]))
+				return;
+		}
+		// a failing nameserver is not an answer,the query is sent again when it times out.
+		if (rcode != 0 && rcode != 3)
+			return;
+		offset += 4;
+		Addresses addrs;
+		int ttl = maxttl;
+		for (int i = 0; i < answers + authorities; i++)
+		{
+			offset = SkipName(packet, size, offset);
+			if (offset == 0 || offset + 10 > size)
+			{
+				if (truncated)
+					break;
+				return;
+			}
+			int rrtype = packet[offset] << 8 | packet[offset + 1];
+			int rrclass = packet[offset + 2] << 8 | packet[offset + 3];
+			int rrttl = (int)std::min<uint32_t>(Read32(packet + offset + 4), maxttl);
+			size_t length = packet[offset + 8] << 8 | packet[offset + 9];
+			offset += 10;
+			if (offset + length > size)
+			{
+				if (truncated)
+					break;
+				return;
+			}
+			if (rrclass == 1 && i < answers && (rrtype == qtype || rrtype == typeCname))
+			{
+				// a name behind a cname is as old as the oldest record of the chain.
+				ttl = std::min(ttl, rrttl);
+				sockaddr_storage addr = {};
+				if (rrtype == typeA && length == 4)
+				{
+					addr.ss_family = AF_INET;
+					memcpy(&((sockaddr_in *)&addr)->sin_addr, packet + offset, 4);
+					addrs.push_back(addr);
+				}
+				else if (rrtype == typeAaaa && length == 16)
+				{
+					addr.ss_family = AF_INET6;
+					memcpy(&((sockaddr_in6 *)&addr)->sin6_addr, packet + offset, 16);
+					addrs.push_back(addr);
+				}
+			}
+			else if (rrclass == 1 && i >= answers && rrtype == typeSoa && addrs.empty())
+			{
+				// rfc 2308: a missing name is cached for the smaller of the ttl and the minimum of the soa.
+				size_t end = SkipName(packet, offset + length, SkipName(packet, offset + length, offset));
+				if (end != 0 && end + 20 <= offset + length)
+					ttl = std::min(ttl, std::min(rrttl, (int)std::min<uint32_t>(Read32(packet + end + 16), maxttl)));
+			}
+			offset += length;
+		}
+		// a truncated reply without addresses says nothing about the name,it is treated like a failing nameserver
+		// instead of being cached as a missing name,the records that did fit are used.
+		if (truncated && addrs.empty())
+			return;
+		if (addrs.empty() && ttl == maxttl)
+			ttl = negativettl;
+		query.answered[type] = true;
+		query.addrs[type] = addrs;
+		query.ttls[type] = ttl;
+		if (query.answered[0] && query.answered[1])
+			this->Finish(name);
+	}
+
+	void Resolver::Retry()
+	{
+		Clock::time_point now = Clock::now();
+		std::vector<std::string> finished;
+		for (std::pair<const std::string, Query> &it : this->queries)
+		{
+			Query &query = it.second;
+			if (now < query.retry)
+				continue;
+			query.attempt++;
+			if (query.attempt >= rounds * (int)this->nameservers.size())
+			{
+				finished.push_back(it.first);
+				continue;
+			}
+			for (int type = 0; type < 2; type++)
+			{
+				if (!query.answered[type])
+					this->Send(query, type);
+			}
+			query.retry = now + std::chrono::milliseconds(timeoutms);
+		}
+		for (const std::string &name : finished)
+			this->Finish(name);
+	}
+
+	int Resolver::NextTimeout()
+	{
+		if (this->queries.empty())
+			return -1;
+		Clock::time_point now = Clock::now(), next = Clock::time_point::max();
+		for (std::pair<const std::string, Query> &it : this->queries)
+			next = std::min(next, it.second.retry);
+		if (next <= now)
+			return 0;
+		return (int)std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1;
+	}
+
+	void Resolver::Finish(const std::string &name)
+	{
+		Query query = std::move(this->queries[name]);
+		this->queries.erase(name);
+		this->ids.erase(query.ids[0]);
+		this->ids.erase(query.ids[1]);
+		// a nameserver that answers A but never AAAA,or the other way round,still gives an answer.
+		bool answered = query.answered[0] || query.answered[1];
+		Addresses addresses(query.addrs[0]);
+		addresses.insert(addresses.end(), query.addrs[1].begin(), query.addrs[1].end());
+		// the ttl of a family without addresses only counts if neither has any,
+		// a host without ipv6 is not looked up again every few seconds.
+		int ttl = maxttl;
+		for (int type = 0; type < 2; type++)
+		{
+			if (query.answered[type] && (!query.addrs[type].empty() || addresses.empty()))
+				ttl = std::min(ttl, query.ttls[type]);
+		}
+		addresses = this->Store(name, answered, addresses, ttl);
+		for (Waiter &waiter : query.waiters)
+			waiter.onResolve(Interleave(addresses, waiter.port));
+	}
+#endif
+}
+
+#endif
@@ -0,0 +1,312 @@
+#ifndef __SHAPER_H__
+#define __SHAPER_H__
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace network
+{
+	// token bucket of bytes,kept as the time it is full again(GCRA),so taking and refilling
+	// is one atomic,and every event loop may share it.
+	class TokenBucket
+	{
+	public:
+		// rate bytes per second,up to burst bytes at once.
+		TokenBucket(int64_t rate, int64_t burst);
+		TokenBucket(const TokenBucket &rhs) = delete;
+
+		TokenBucket &operator=(const TokenBucket &rhs) = delete;
+
+		// bytes that may be taken at now(nanoseconds),keeping reserve bytes in the bucket.
+		int64_t Available(int64_t now, int64_t reserve = 0) const;
+		// take size bytes,the bucket may go into debt by what other loops took meanwhile.
+		void Take(int64_t size, int64_t now);
+		// nanoseconds until size bytes above reserve are available.
+		int64_t Wait(int64_t size, int64_t now, int64_t reserve = 0) const;
+		int64_t GetBurst() const;
+
+	protected:
+		// nanoseconds a byte is worth,scaled by 1024 so high rates keep their precision.
+		int64_t cost;
+		int64_t burst;
+		std::atomic<int64_t> full;
+	};
+
+	// limits of relayed bytes per tunnel,per client address and for the whole process.
+	// a rate of 0 is no limit.
+	// with a bulk threshold,flows moving more than it per second are bulk,they may not take
+	// the last quarter of the shared buckets,which stays for interactive flows.
+	class Shaper
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		Shaper();
+		Shaper(const Shaper &rhs) = delete;
+
+		Shaper &operator=(const Shaper &rhs) = delete;
+
+		// rates in bytes per second,call before the event loops start.
+		void SetTunnelRate(int64_t rate);
+		void SetSourceRate(int64_t rate);
+		void SetGlobalRate(int64_t rate);
+		void SetBulkThreshold(int64_t threshold);
+		// true if any rate is set.
+		bool Enabled() const;
+
+		static int64_t Now();
+		// a byte count with an optional K,M or G suffix(powers of 1024),-1 if text is not one.
+		static int64_t ParseBytes(const char *text);
+
+	protected:
+		friend class Flow;
+
+		static constexpr int stripes = 64;
+
+		struct Source
+		{
+			std::unique_ptr<TokenBucket> bucket;
+			int flows;
+		};
+
+		struct alignas(64) Stripe
+		{
+			std::mutex mutex;
+			std::unordered_map<uint32_t, Source> sources;
+		};
+
+		int64_t tunnelrate;
+		int64_t sourcerate;
+		int64_t bulkthreshold;
+		std::unique_ptr<TokenBucket> global;
+		Stripe sources[stripes];
+
+		// the bucket of source,shared by its flows until the last one releases it.
+		TokenBucket *AcquireSource(uint32_t source);
+		void ReleaseSource(uint32_t source);
+		// bursts are 100ms of the rate,and at least a large read.
+		static int64_t Burst(int64_t rate);
+	};
+
+	// the limits one tunnel is held to,both directions draw from the same buckets.
+	// only the event loop of the tunnel uses it.
+	class Flow
+	{
+	public:
+		Flow(Shaper &shaper, uint32_t source);
+		Flow(const Flow &rhs) = delete;
+		~Flow();
+
+		Flow &operator=(const Flow &rhs) = delete;
+
+		// bytes the tunnel may read now,0 if it has to wait.
+		int64_t Available(int64_t now);
+		// the tunnel read size bytes.
+		void Take(int64_t size, int64_t now);
+		// milliseconds until the tunnel may read again,at least 1.
+		int Wait(int64_t now);
+		bool Bulk() const;
+
+	protected:
+		static constexpr int64_t window = 1000000000;
+
+		Shaper &shaper;
+		uint32_t source;
+		std::unique_ptr<TokenBucket> tunnel;
+		TokenBucket *sourcebucket;
+		// bytes moved in the current second,to tell bulk flows from interactive ones.
+		int64_t windowstart;
+		int64_t windowbytes;
+		bool bulk;
+
+		int64_t Reserve(const TokenBucket *bucket) const;
+	};
+}
+
+namespace network
+{
+	TokenBucket::TokenBucket(int64_t rate, int64_t burst) : cost(1024 * 1000000000LL / rate), burst(burst), full(0)
+	{
+		if (this->cost < 1)
+			this->cost = 1;
+	}
+
+	int64_t TokenBucket::Available(int64_t now, int64_t reserve) const
+	{
+		int64_t full = this->full.load(std::memory_order_relaxed);
+		// a bucket full since before now holds burst bytes.
+		int64_t available = full <= now ? this->burst : this->burst - (full - now) * 1024 / this->cost;
+		available -= reserve;
+		return available > 0 ? available : 0;
+	}
+
+	void TokenBucket::Take(int64_t size, int64_t now)
+	{
+		int64_t full = this->full.load(std::memory_order_relaxed), start;
+		do
+		{
+			// credit beyond burst is not kept.
+			start = full < now ? now : full;
+		} while (!this->full.compare_exchange_weak(full, start + size * this->cost / 1024, std::memory_order_relaxed));
+	}
+
+	int64_t TokenBucket::Wait(int64_t size, int64_t now, int64_t reserve) const
+	{
+		int64_t missing = size + reserve - this->Available(now);
+		return missing > 0 ? missing * this->cost / 1024 : 0;
+	}
+
+	int64_t TokenBucket::GetBurst() const { return this->burst; }
+
+	Shaper::Shaper() : tunnelrate(0), sourcerate(0), bulkthreshold(0), global(), sources() {}
+
+	void Shaper::SetTunnelRate(int64_t rate) { this->tunnelrate = rate; }
+	void Shaper::SetSourceRate(int64_t rate) { this->sourcerate = rate; }
+
+	void Shaper::SetGlobalRate(int64_t rate)
+	{
+		if (rate > 0)
+			this->global.reset(new TokenBucket(rate, Burst(rate)));
+		else
+			this->global.reset();
+	}
+
+	void Shaper::SetBulkThreshold(int64_t threshold) { this->bulkthreshold = threshold; }
+
+	bool Shaper::Enabled() const { return this->tunnelrate > 0 || this->sourcerate > 0 || this->global; }
+
+	int64_t Shaper::Now() { return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count(); }
+
+	int64_t Shaper::ParseBytes(const char *text)
+	{
+		char *end;
+		errno = 0;
+		int64_t bytes = strtoll(text, &end, 10), factor = 1;
+		if (end == text || bytes < 0 || errno == ERANGE)
+			return -1;
+		switch (*end)
+		{
+		case 'G':
+		case 'g':
+			factor = 1024 * 1024 * 1024;
+			end++;
+			break;
+		case 'M':
+		case 'm':
+			factor = 1024 * 1024;
+			end++;
+			break;
+		case 'K':
+		case 'k':
+			factor = 1024;
+			end++;
+			break;
+		}
+		// a rate that does not fit is no rate,rather than an overflow.
+		if (*end != '\0' || bytes > INT64_MAX / factor)
+			return -1;
+		return bytes * factor;
+	}
+
+	int64_t Shaper::Burst(int64_t rate) { return rate / 10 > 65536 ? rate / 10 : 65536; }
+
+	TokenBucket *Shaper::AcquireSource(uint32_t source)
+	{
+		Stripe &stripe = this->sources[(source * 2654435761u) >> 26];
+		std::lock_guard<std::mutex> lock(stripe.mutex);
+		Source &entry = stripe.sources[source];
+		if (!entry.bucket)
+			entry.bucket.reset(new TokenBucket(this->sourcerate, Burst(this->sourcerate)));
+		entry.flows++;
+		return entry.bucket.get();
+	}
+
+	void Shaper::ReleaseSource(uint32_t source)
+	{
+		Stripe &stripe = this->sources[(source * 2654435761u) >> 26];
+		std::lock_guard<std::mutex> lock(stripe.mutex);
+		std::unordered_map<uint32_t, Source>::iterator it = stripe.sources.find(source);
+		if (it != stripe.sources.end() && --it->second.flows == 0)
+			stripe.sources.erase(it);
+	}
+
+	Flow::Flow(Shaper &shaper, uint32_t source) : shaper(shaper), source(source), tunnel(), sourcebucket(nullptr),
+												  windowstart(0), windowbytes(0), bulk(false)
+	{
+		if (shaper.tunnelrate > 0)
+			this->tunnel.reset(new TokenBucket(shaper.tunnelrate, Shaper::Burst(shaper.tunnelrate)));
+		if (shaper.sourcerate > 0)
+			this->sourcebucket = shaper.AcquireSource(source);
+	}
+
+	Flow::~Flow()
+	{
+		if (this->sourcebucket != nullptr)
+			this->shaper.ReleaseSource(this->source);
+	}
+
+	int64_t Flow::Reserve(const TokenBucket *bucket) const
+	{
+		return this->bulk ? bucket->GetBurst() / 4 : 0;
+	}
+
+	int64_t Flow::Available(int64_t now)
+	{
+		int64_t available = INT64_MAX, bytes;
+		if (this->tunnel)
+			available = this->tunnel->Available(now);
+		if (this->sourcebucket != nullptr && (bytes = this->sourcebucket->Available(now, this->Reserve(this->sourcebucket))) < available)
+			available = bytes;
+		const TokenBucket *global = this->shaper.global.get();
+		if (global != nullptr && (bytes = global->Available(now, this->Reserve(global))) < available)
+			available = bytes;
+		return available;
+	}
+
+	void Flow::Take(int64_t size, int64_t now)
+	{
+		if (this->tunnel)
+			this->tunnel->Take(size, now);
+		if (this->sourcebucket != nullptr)
+			this->sourcebucket->Take(size, now);
+		if (this->shaper.global)
+			this->shaper.global->Take(size, now);
+		if (this->shaper.bulkthreshold <= 0)
+			return;
+		if (now - this->windowstart >= window)
+		{
+			this->bulk = this->windowbytes > this->shaper.bulkthreshold;
+			this->windowstart = now;
+			this->windowbytes = 0;
+		}
+		this->windowbytes += size;
+		if (this->windowbytes > this->shaper.bulkthreshold)
+			this->bulk = true;
+	}
+
+	int Flow::Wait(int64_t now)
+	{
+		// wait for a useful amount,not for the first byte.
+		const int64_t chunk = 4096;
+		int64_t wait = 0, bytes;
+		if (this->tunnel && (bytes = this->tunnel->Wait(chunk, now)) > wait)
+			wait = bytes;
+		if (this->sourcebucket != nullptr && (bytes = this->sourcebucket->Wait(chunk, now, this->Reserve(this->sourcebucket))) > wait)
+			wait = bytes;
+		const TokenBucket *global = this->shaper.global.get();
+		if (global != nullptr && (bytes = global->Wait(chunk, now, this->Reserve(global))) > wait)
+			wait = bytes;
+		int ms = (int)(wait / 1000000);
+		return ms < 1 ? 1 : ms;
+	}
+
+	bool Flow::Bulk() const { return this->bulk; }
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef __SLOTTABLE_H__
+#define __SLOTTABLE_H__
+
+#include <memory>
+#include <vector>
+
+namespace network
+{
+	// handle of a record in a SlotTable,the slot index in the low 32 bits
+	// and the generation of the slot in the high 32 bits.
+	using SlotHandle = unsigned long long;
+
+	// dense table of per-connection records.
+	// records live in fixed size chunks,so they never move and neighbours share cache lines,
+	// removed slots are reused first,Add and Remove are O(1).
+	// the generation of a slot changes when its record is removed,so a stale handle finds nothing.
+	template <typename T>
+	class SlotTable
+	{
+	public:
+		static constexpr SlotHandle InvalidHandle = ~0ULL;
+
+		SlotTable();
+		SlotTable(const SlotTable &rhs) = delete;
+		SlotTable(SlotTable &&rhs) = default;
+
+		SlotTable &operator=(const SlotTable &rhs) = delete;
+
+		// return a value-initialized record and its handle,removed records are reset.
+		T *Add(SlotHandle &handle);
+		// return the record of handle,nullptr if it was removed.
+		T *Get(SlotHandle handle);
+		void Remove(SlotHandle handle);
+		size_t Size() const;
+
+	protected:
+		static constexpr unsigned chunkbits = 8;
+		static constexpr unsigned chunksize = 1 << chunkbits;
+
+		struct Slot
+		{
+			T record;
+			unsigned generation;
+			bool used;
+		};
+
+		std::vector<std::unique_ptr<Slot[]>> chunks;
+		std::vector<unsigned> freelist;
+		unsigned slots;
+		size_t size;
+
+		Slot &GetSlot(unsigned index);
+	};
+}
+
+namespace network
+{
+	template <typename T>
+	SlotTable<T>::SlotTable() : chunks(), freelist(), slots(0), size(0) {}
+
+	template <typename T>
+	typename SlotTable<T>::Slot &SlotTable<T>::GetSlot(unsigned index) { return this->chunks[index >> chunkbits][index & (chunksize - 1)]; }
+
+	template <typename T>
+	T *SlotTable<T>::Add(SlotHandle &handle)
+	{
+		unsigned index;
+		if (!this->freelist.empty())
+		{
+			// the most recently freed slot is the most likely to be in cache.
+			index = this->freelist.back();
+			this->freelist.pop_back();
+		}
+		else
+		{
+			if ((this->slots & (chunksize - 1)) == 0)
+				this->chunks.emplace_back(new Slot[chunksize]());
+			index = this->slots++;
+		}
+		Slot &slot = this->GetSlot(index);
+		slot.used = true;
+		this->size++;
+		handle = (SlotHandle)slot.generation << 32 | index;
+		return &slot.record;
+	}
+
+	template <typename T>
+	T *SlotTable<T>::Get(SlotHandle handle)
+	{
+		unsigned index = (unsigned)handle;
+		if (index >= this->slots)
+			return nullptr;
+		Slot &slot = this->GetSlot(index);
+		if (!slot.used || slot.generation != (unsigned)(handle >> 32))
+			return nullptr;
+		return &slot.record;
+	}
+
+	template <typename T>
+	void SlotTable<T>::Remove(SlotHandle handle)
+	{
+		if (this->Get(handle) == nullptr)
+			return;
+		unsigned index = (unsigned)handle;
+		Slot &slot = this->GetSlot(index);
+		// release what the record holds now instead of when the slot is reused.
+		slot.record = T();
+		slot.used = false;
+		slot.generation++;
+		this->freelist.push_back(index);
+		this->size--;
+	}
+
+	template <typename T>
+	size_t SlotTable<T>::Size() const { return this->size; }
+}
+
+#endif
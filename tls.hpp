@@ -0,0 +1,299 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+// tls needs openssl,compile with -DFORWARD_TLS and link -lssl -lcrypto.
+#ifdef FORWARD_TLS
+
+#include <errno.h>
+#include <memory>
+#include <string>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include "network.hpp"
+#include "log.hpp"
+
+namespace network
+{
+	// the openssl context of one side of a mapping,shared by every event loop.
+	// handshakes run on the socket of the connection itself,so once one is done openssl can hand
+	// the record layer to the kernel(kTLS,linux 4.13 and later with the tls module),then the relay
+	// moves plain bytes on the socket and may still splice.where the kernel can not take a direction,
+	// its records are sealed and opened by openssl on the copy path of the relay.
+	class TlsContext
+	{
+	public:
+		TlsContext(const TlsContext &rhs) = delete;
+		~TlsContext();
+
+		TlsContext &operator=(const TlsContext &rhs) = delete;
+
+		// accept clients with the certificate chain of cert and the private key of key,both pem.
+		// return nullptr and set error if they can not be loaded.
+		static std::shared_ptr<TlsContext> NewServer(const std::string &cert, const std::string &key, std::string &error);
+		// connect to backends,their certificates are verified against the pem file ca,
+		// or the system store if it is empty,unless insecure.
+		static std::shared_ptr<TlsContext> NewClient(const std::string &ca, bool insecure, std::string &error);
+
+		// a stream on fd,nullptr if openssl is out of memory.
+		// a client sends servername(sni) unless it is an address,and checks the certificate of the backend for it.
+		std::unique_ptr<Stream> NewStream(socket_fd fd, const std::string &servername);
+
+	protected:
+		SSL_CTX *ctx;
+		bool server;
+
+		TlsContext(SSL_CTX *ctx, bool server);
+
+		// options shared by both sides.
+		static SSL_CTX *NewContext(const SSL_METHOD *method);
+		// the oldest error openssl queued,for messages.
+		static std::string LastError();
+	};
+
+	class TlsStream : public Stream
+	{
+	public:
+		TlsStream(SSL *ssl);
+		TlsStream(const TlsStream &rhs) = delete;
+		~TlsStream();
+
+		TlsStream &operator=(const TlsStream &rhs) = delete;
+
+		HandshakeResult Handshake() override;
+		int Recv(char *buf, int size) override;
+		int Send(const char *buf, int size) override;
+		size_t Pending() override;
+		void Shutdown() override;
+		bool KernelRecv() const override;
+		bool KernelSend() const override;
+
+	protected:
+		SSL *ssl;
+		bool kernelrecv;
+		bool kernelsend;
+
+		// turn what SSL_read or SSL_write returned into what recv or send would.
+		int Result(int ret);
+	};
+}
+
+namespace network
+{
+	TlsContext::TlsContext(SSL_CTX *ctx, bool server) : ctx(ctx), server(server) {}
+
+	TlsContext::~TlsContext() { SSL_CTX_free(this->ctx); }
+
+	SSL_CTX *TlsContext::NewContext(const SSL_METHOD *method)
+	{
+		SSL_CTX *ctx = SSL_CTX_new(method);
+		if (ctx == nullptr)
+			return nullptr;
+		SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+		SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+		// ktls and the option below are openssl 3.0 and later,1.1.1 keeps records in user space.
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+		// a peer closing without close_notify ends the stream like a fin,so half-close still works.
+		// 1.1.1 reports it as SSL_ERROR_SYSCALL with errno 0,Result takes that for the end of the stream.
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+		SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+		// the relay retries a write with what is pending,which may have moved,and takes partial writes.
+		// idle streams give their record buffers back like idle relay directions do.
+		SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+		return ctx;
+	}
+
+	std::string TlsContext::LastError()
+	{
+		char message[256];
+		unsigned long code = ERR_get_error();
+		ERR_clear_error();
+		if (code == 0)
+			return "unknown error";
+		ERR_error_string_n(code, message, sizeof(message));
+		return message;
+	}
+
+	std::shared_ptr<TlsContext> TlsContext::NewServer(const std::string &cert, const std::string &key, std::string &error)
+	{
+		SSL_CTX *ctx = NewContext(TLS_server_method());
+		if (ctx == nullptr)
+		{
+			error = LastError();
+			return nullptr;
+		}
+		std::shared_ptr<TlsContext> context(new TlsContext(ctx, true));
+		if (SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) != 1)
+		{
+			error = cert + ": " + LastError();
+			return nullptr;
+		}
+		if (SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
+		{
+			error = key + ": " + LastError();
+			return nullptr;
+		}
+		return context;
+	}
+
+	std::shared_ptr<TlsContext> TlsContext::NewClient(const std::string &ca, bool insecure, std::string &error)
+	{
+		SSL_CTX *ctx = NewContext(TLS_client_method());
+		if (ctx == nullptr)
+		{
+			error = LastError();
+			return nullptr;
+		}
+		std::shared_ptr<TlsContext> context(new TlsContext(ctx, false));
+		if (insecure)
+		{
+			SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+			return context;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+		if ((ca.empty() ? SSL_CTX_set_default_verify_paths(ctx) : SSL_CTX_load_verify_locations(ctx, ca.c_str(), nullptr)) != 1)
+		{
+			error = (ca.empty() ? std::string("system store") : ca) + ": " + LastError();
+			return nullptr;
+		}
+		return context;
+	}
+
+	std::unique_ptr<Stream> TlsContext::NewStream(socket_fd fd, const std::string &servername)
+	{
+		SSL *ssl = SSL_new(this->ctx);
+		if (ssl == nullptr)
+			return nullptr;
+		// the bio does not own fd,the connection closes it.
+		if (SSL_set_fd(ssl, fd) != 1)
+		{
+			SSL_free(ssl);
+			return nullptr;
+		}
+		if (this->server)
+		{
+			SSL_set_accept_state(ssl);
+			return std::unique_ptr<Stream>(new TlsStream(ssl));
+		}
+		SSL_set_connect_state(ssl);
+		sockaddr_storage addr;
+		if (ParseAddress(servername.c_str(), 0, addr))
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), servername.c_str());
+		else
+		{
+			SSL_set_tlsext_host_name(ssl, servername.c_str());
+			SSL_set1_host(ssl, servername.c_str());
+		}
+		return std::unique_ptr<Stream>(new TlsStream(ssl));
+	}
+
+	TlsStream::TlsStream(SSL *ssl) : ssl(ssl), kernelrecv(false), kernelsend(false) {}
+
+	TlsStream::~TlsStream() { SSL_free(this->ssl); }
+
+	Stream::HandshakeResult TlsStream::Handshake()
+	{
+		ERR_clear_error();
+		int ret = SSL_do_handshake(this->ssl);
+		if (ret == 1)
+		{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+			this->kernelsend = BIO_get_ktls_send(SSL_get_wbio(this->ssl)) == 1;
+			this->kernelrecv = BIO_get_ktls_recv(SSL_get_rbio(this->ssl)) == 1;
+#endif
+			LOG_DEBUG("tls handshake done version=%s cipher=%s ktls_send=%d ktls_recv=%d", SSL_get_version(this->ssl),
+					  SSL_get_cipher_name(this->ssl), (int)this->kernelsend, (int)this->kernelrecv);
+			return HandshakeDone;
+		}
+		switch (SSL_get_error(this->ssl, ret))
+		{
+		case SSL_ERROR_WANT_READ:
+			return WantRead;
+		case SSL_ERROR_WANT_WRITE:
+			return WantWrite;
+		default:
+			LOG_DEBUG("tls handshake failed error=%s", ERR_reason_error_string(ERR_peek_error()));
+			ERR_clear_error();
+			return HandshakeFailed;
+		}
+	}
+
+	int TlsStream::Result(int ret)
+	{
+		if (ret > 0)
+			return ret;
+		switch (SSL_get_error(this->ssl, ret))
+		{
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return SOCKET_ERROR;
+		case SSL_ERROR_SYSCALL:
+#ifndef SSL_OP_IGNORE_UNEXPECTED_EOF
+			// an eof without close_notify on 1.1.1,the error queue is empty and the call returned 0.
+			if (ret == 0 && errno == 0 && ERR_peek_error() == 0)
+				return 0;
+#endif
+			// errno is what the socket failed with.
+			if (errno == 0)
+				errno = ECONNRESET;
+			ERR_clear_error();
+			return SOCKET_ERROR;
+		default:
+			ERR_clear_error();
+			errno = EPROTO;
+			return SOCKET_ERROR;
+		}
+	}
+
+	int TlsStream::Recv(char *buf, int size)
+	{
+		ERR_clear_error();
+		errno = 0;
+		return this->Result(SSL_read(this->ssl, buf, size));
+	}
+
+	int TlsStream::Send(const char *buf, int size)
+	{
+		// a partial write returns after every record,the relay takes a short write for a full socket,
+		// so records are written until the socket takes no more.
+		int sent = 0, ret = 0;
+		while (sent < size)
+		{
+			ERR_clear_error();
+			errno = 0;
+			ret = SSL_write(this->ssl, buf + sent, size - sent);
+			if (ret <= 0)
+				break;
+			sent += ret;
+		}
+		if (sent > 0)
+		{
+			ERR_clear_error();
+			return sent;
+		}
+		return this->Result(ret);
+	}
+
+	size_t TlsStream::Pending() { return (size_t)SSL_pending(this->ssl); }
+
+	void TlsStream::Shutdown()
+	{
+		// send close_notify,the answer of the peer is not waited for.
+		ERR_clear_error();
+		SSL_shutdown(this->ssl);
+		ERR_clear_error();
+	}
+
+	bool TlsStream::KernelRecv() const { return this->kernelrecv; }
+	bool TlsStream::KernelSend() const { return this->kernelsend; }
+}
+
+#endif
+
+#endif
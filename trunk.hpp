@@ -0,0 +1,82 @@
+#ifndef __TRUNK_H__
+#define __TRUNK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace network
+{
+	// a trunk is a tcp connection between two forwarders that carries many streams,each one a client tunnel,
+	// as frames of a header and a payload.the forwarder near the clients opens the streams,the one near the
+	// backends connects each of them to a backend.the header is the type,the id of the stream and a length,
+	// big endian,only Open and Data have a payload of length bytes.
+	// every side may send InitialWindow bytes of Data on a stream,then waits for the other side to grant more
+	// with Window as it writes them out,so a slow client or backend never holds up the other streams.
+	struct TrunkFrame
+	{
+		enum Type
+		{
+			// a new stream,the payload is the 4 byte SourceKey of its client,Data may follow at once.
+			Open = 1,
+			Data,
+			// length more bytes may be sent on the stream.
+			Window,
+			// the sender shut down its side of the stream,like a FIN.
+			Fin,
+			// the stream failed,both sides close it.
+			Reset,
+		};
+
+		static constexpr size_t HeaderSize = 9;
+		static constexpr uint32_t InitialWindow = 1 << 20;
+		// the largest Data payload,so a bulk stream does not delay the frames of the others for long.
+		static constexpr uint32_t MaxData = 64 << 10;
+
+		Type type;
+		uint32_t stream;
+		uint32_t length;
+
+		TrunkFrame() : type(Data), stream(0), length(0) {}
+		TrunkFrame(Type type, uint32_t stream, uint32_t length) : type(type), stream(stream), length(length) {}
+
+		void Encode(char *header) const;
+		// return false if header is not one a trunk sends.
+		bool Decode(const char *header);
+	};
+}
+
+namespace network
+{
+	inline void TrunkFrame::Encode(char *header) const
+	{
+		header[0] = (char)this->type;
+		for (int i = 0; i < 4; i++)
+		{
+			header[1 + i] = (char)(this->stream >> (24 - 8 * i));
+			header[5 + i] = (char)(this->length >> (24 - 8 * i));
+		}
+	}
+
+	inline bool TrunkFrame::Decode(const char *header)
+	{
+		const unsigned char *bytes = (const unsigned char *)header;
+		if (bytes[0] < Open || bytes[0] > Reset)
+			return false;
+		this->type = (Type)bytes[0];
+		this->stream = (uint32_t)bytes[1] << 24 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 8 | bytes[4];
+		this->length = (uint32_t)bytes[5] << 24 | (uint32_t)bytes[6] << 16 | (uint32_t)bytes[7] << 8 | bytes[8];
+		switch (this->type)
+		{
+		case Open:
+			return this->length == 4;
+		case Data:
+			return this->length > 0 && this->length <= MaxData;
+		case Window:
+			return this->length > 0 && this->length <= InitialWindow;
+		default:
+			return this->length == 0;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,607 @@
+#ifndef __UDP_H__
+#define __UDP_H__
+
+#include "network.hpp"
+#include <stdint.h>
+#include <unordered_map>
+#ifdef __linux__
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+namespace network
+{
+	namespace udp
+	{
+		class Server;
+
+		// a client address of a Server and the socket connected to the upstream its datagrams go to.
+		// the socket address is the upstream,what the upstream answers goes back to the client.
+		// the record stays valid until the end of the batch of events it is closed in,
+		// keep GetHandle() and look it up with Server::GetSession() to refer to it later.
+		class Session : public Socket
+		{
+		public:
+			using OnEvent = std::function<void(Session &session)>;
+
+			Session();
+
+			// user state of the session,the server never touches it.
+			void *context;
+			// called once when the session closes,after the idle timeout or by Close().
+			OnEvent onClose;
+
+			// where the datagrams of the client go,set it in the OnSession callback.
+			// addr is an ipv4 or ipv6 literal.
+			void SetUpstream(const char *addr, int port);
+			void SetUpstream(const sockaddr *addr);
+			const sockaddr_in &GetClient() const;
+			void Close();
+			bool Closed() const;
+			SlotHandle GetHandle() const;
+
+		protected:
+			friend class Server;
+
+			Server *server;
+			SlotHandle handle;
+			sockaddr_in client;
+			bool closed;
+			// last time a datagram went either way.
+			std::chrono::steady_clock::time_point lastactive;
+			SlotHandle idletimer;
+		};
+
+		// forwards the datagrams sent to a listening socket,every client address gets a session
+		// with a socket of its own to an upstream,closed once no datagram went either way for the idle timeout.
+		// on linux datagrams are moved in batches with recvmmsg/sendmmsg,consecutive datagrams of
+		// a client go out in one call.with offload GRO coalesces the datagrams of a flow into one
+		// buffer and GSO splits it again on the way out,so a train of datagrams costs one buffer.
+		// a datagram a socket can not take at once is dropped,like a full network queue would.
+		class Server : public Socket
+		{
+		public:
+			// choose the upstream of session from its client,return false to drop the datagram.
+			using OnSession = std::function<bool(Session &session)>;
+			using OnError = std::function<void(const char *message)>;
+
+			Server(const char *addr, int port);
+			Server(const Server &rhs) = delete;
+
+			Server &operator=(const Server &rhs) = delete;
+
+			void SetOnSession(OnSession onSession);
+			void SetOnError(OnError onError);
+			// let several servers bind the same address,the kernel hashes every client to one of them.
+			void SetReusePort(bool reuseport);
+			// close a session when no datagram went either way for ms milliseconds(default 30000).
+			void SetIdleTimeout(int ms);
+			// coalesce received datagrams with UDP_GRO and send them with UDP_SEGMENT,linux only.
+			void SetOffload(bool offload);
+			// count sessions,bytes and drops in metrics,owned by the caller.
+			void SetMetrics(Metrics *metrics);
+			// open sessions only for clients admission lets in,owned by the caller.
+			void SetAdmission(Admission *admission);
+			bool Listen();
+			// run the event loop until Stop().
+			void Begin();
+			void Stop();
+
+			// return the session of handle,nullptr if it is closed.
+			Session *GetSession(SlotHandle handle);
+
+		protected:
+			friend class Session;
+
+			using Clock = std::chrono::steady_clock;
+			static constexpr int maxevents = 256;
+			// datagrams moved by one recvmmsg/sendmmsg.
+			static constexpr int batchsize = 64;
+			// the largest datagram,and the largest train GRO coalesces.
+			static constexpr size_t slotsize = 65536;
+			// socket buffers,a burst of datagrams the loop has not read yet must not overflow them.
+			// capped by net.core.rmem_max and wmem_max on linux,memory is only taken while datagrams wait.
+			static constexpr int socketbuffer = 4 << 20;
+
+			struct Datagram
+			{
+				char *data;
+				size_t size;
+				sockaddr_in addr;
+				// size of the datagrams GRO coalesced into data,0 for a single datagram.
+				int segment;
+			};
+
+			OnSession onSession;
+			OnError onError;
+
+			static void DefaultOnError(const char *message);
+
+			// the session of the client at addr,opened if it has none,nullptr if it may not have one.
+			Session *FindSession(const sockaddr_in &addr);
+			void CloseSession(Session *session);
+			// forward what clients sent to the upstreams of their sessions.
+			void ReceiveClients();
+			// forward what the upstream of session sent to its client.
+			void ReceiveUpstream(Session *session);
+			// receive up to batchsize datagrams from fd,return the count,0 if none is waiting,-1 on error.
+			int ReceiveBatch(socket_fd fd);
+			// send count datagrams from begin to to,or to the connected address if to is nullptr.
+			// return how many were sent,the others are dropped.
+			int SendBatch(socket_fd fd, int begin, int count, const sockaddr_in *to);
+			// count size bytes of count datagrams from the side of session given by in.
+			void CountRead(Session *session, bool in, size_t size);
+			void StartIdleTimer(Session *session, int ms);
+			// close the session of handle if it stayed idle for the whole timeout,or check again later.
+			void CheckIdle(SlotHandle handle);
+			// enlarge the buffers of fd and enable GRO on it with offload.
+			void SetupSocket(socket_fd fd);
+
+			std::unique_ptr<Poller> poller;
+			SlotTable<Session> sessions;
+			// sessions by client address and port.
+			std::unordered_map<uint64_t, SlotHandle> clients;
+			// closed sessions,removed from the table after the current batch of events.
+			std::vector<SlotHandle> closedlist;
+			std::unique_ptr<TimingWheel> wheel;
+			// time of the current batch of events.
+			Clock::time_point now;
+			// datagrams of the current batch,every one has a slot of slotsize bytes.
+			std::unique_ptr<char[]> slots;
+			Datagram datagrams[batchsize];
+#ifdef __linux__
+			mmsghdr headers[batchsize];
+			iovec iovecs[batchsize];
+			// a UDP_GRO cmsg on receive,a UDP_SEGMENT cmsg on send.
+			alignas(cmsghdr) char controls[batchsize][CMSG_SPACE(sizeof(int))];
+#endif
+			bool stopped;
+			bool reuseport;
+			bool offload;
+			int idletimeout;
+			Metrics *metrics;
+			Admission *admission;
+		};
+	}
+}
+
+namespace network
+{
+	inline uint64_t ClientKey(const sockaddr_in &addr) { return (uint64_t)addr.sin_addr.s_addr << 16 | addr.sin_port; }
+
+	// a connected udp socket reports the icmp errors of earlier datagrams once,reading goes on after them.
+	inline bool PendingError()
+	{
+#ifdef _WIN32
+		return WSAGetLastError() == WSAECONNRESET;
+#else
+		return errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH;
+#endif
+	}
+
+	udp::Session::Session() : Socket(), context(nullptr), onClose(), server(nullptr), handle(SlotTable<Session>::InvalidHandle),
+							  client{0, 0, 0, {0}}, closed(false), lastactive(), idletimer(TimingWheel::InvalidTimer) {}
+
+	void udp::Session::SetUpstream(const char *addr, int port)
+	{
+		Socket address(AF_INET, SOCK_DGRAM, addr, port);
+		this->SetUpstream(address.GetSockAddr());
+	}
+
+	void udp::Session::SetUpstream(const sockaddr *addr) { memcpy(&this->addr, addr, SockAddrLength(addr)); }
+
+	const sockaddr_in &udp::Session::GetClient() const { return this->client; }
+
+	void udp::Session::Close()
+	{
+		if (this->server != nullptr)
+			this->server->CloseSession(this);
+	}
+
+	bool udp::Session::Closed() const { return this->closed; }
+	SlotHandle udp::Session::GetHandle() const { return this->handle; }
+
+	udp::Server::Server(const char *addr, int port) : Socket(AF_INET, SOCK_DGRAM, addr, port),
+													  onSession(),
+													  onError(),
+													  poller(new Poller()),
+													  sessions(),
+													  clients(),
+													  closedlist(),
+													  wheel(new TimingWheel()),
+													  now(Clock::now()),
+													  slots(new char[batchsize * slotsize]),
+													  datagrams(),
+													  stopped(false),
+													  reuseport(false),
+													  offload(false),
+													  idletimeout(30000),
+													  metrics(nullptr),
+													  admission(nullptr)
+	{
+		for (int i = 0; i < batchsize; i++)
+			this->datagrams[i].data = this->slots.get() + i * slotsize;
+	}
+
+	void udp::Server::SetOnSession(OnSession onSession) { this->onSession = std::move(onSession); }
+	void udp::Server::SetOnError(OnError onError) { this->onError = std::move(onError); }
+	void udp::Server::SetReusePort(bool reuseport) { this->reuseport = reuseport; }
+	void udp::Server::SetIdleTimeout(int ms) { this->idletimeout = ms; }
+	void udp::Server::SetOffload(bool offload) { this->offload = offload; }
+	void udp::Server::SetMetrics(Metrics *metrics) { this->metrics = metrics; }
+	void udp::Server::SetAdmission(Admission *admission) { this->admission = admission; }
+	void udp::Server::Stop() { this->stopped = true; }
+	void udp::Server::DefaultOnError(const char *message) { LOG_ERROR("%s", message); }
+
+	bool udp::Server::Listen()
+	{
+		if (!this->CreateSocket())
+			return false;
+		u_long arg = 1;
+		if (ioctlsocket(this->fd, FIONBIO, &arg))
+			return false;
+		if (this->reuseport)
+		{
+#ifdef SO_REUSEPORT
+			int opt = 1;
+			if (setsockopt(this->fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&opt, sizeof(opt)) == SOCKET_ERROR)
+				return false;
+#else
+			return false;
+#endif
+		}
+		if (bind(this->fd, this->GetSockAddr(), SockAddrLength(this->GetSockAddr())) == SOCKET_ERROR)
+			return false;
+		this->SetupSocket(this->fd);
+		return this->poller->Add(this->fd, Poller::Readable, nullptr);
+	}
+
+	void udp::Server::SetupSocket(socket_fd fd)
+	{
+		int size = socketbuffer;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char *)&size, sizeof(size));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const char *)&size, sizeof(size));
+#ifdef __linux__
+		// without GRO nothing is coalesced,and every datagram goes out on its own.
+		int opt = 1;
+		if (this->offload)
+			setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt));
+#endif
+	}
+
+	void udp::Server::Begin()
+	{
+		if (!this->onError)
+			this->onError = DefaultOnError;
+		Poller::Event events[maxevents];
+		int count, i;
+		this->stopped = false;
+		while (!this->stopped)
+		{
+			count = this->poller->Wait(events, maxevents, this->wheel->NextTimeout(Clock::now()));
+			if (count == SOCKET_ERROR)
+			{
+				this->onError("socket error on I/O poll");
+				return;
+			}
+			this->now = Clock::now();
+			for (i = 0; i < count; i++)
+			{
+				if (events[i].data == nullptr)
+				{
+					this->ReceiveClients();
+					continue;
+				}
+				Session *session = static_cast<Session *>(events[i].data);
+				if (!session->closed)
+					this->ReceiveUpstream(session);
+			}
+			this->wheel->Advance(this->now);
+			for (SlotHandle handle : this->closedlist)
+				this->sessions.Remove(handle);
+			this->closedlist.clear();
+		}
+	}
+
+	udp::Session *udp::Server::GetSession(SlotHandle handle)
+	{
+		Session *session = this->sessions.Get(handle);
+		if (session == nullptr || session->closed)
+			return nullptr;
+		return session;
+	}
+
+	udp::Session *udp::Server::FindSession(const sockaddr_in &addr)
+	{
+		std::unordered_map<uint64_t, SlotHandle>::iterator it = this->clients.find(ClientKey(addr));
+		if (it != this->clients.end())
+			return this->sessions.Get(it->second);
+		if (this->admission != nullptr && !this->admission->Admit(SourceKey((const sockaddr *)&addr)))
+		{
+			if (this->metrics != nullptr)
+				this->metrics->Add(Metrics::Rejects);
+			return nullptr;
+		}
+		SlotHandle handle;
+		Session *session = this->sessions.Add(handle);
+		session->server = this;
+		session->handle = handle;
+		session->client = addr;
+		session->lastactive = this->now;
+		if (!this->onSession || !this->onSession(*session))
+		{
+			// nothing was opened yet,the client is let go without onClose.
+			if (this->admission != nullptr)
+				this->admission->Release(SourceKey((const sockaddr *)&addr));
+			this->sessions.Remove(handle);
+			return nullptr;
+		}
+		this->clients[ClientKey(addr)] = handle;
+		if (this->metrics != nullptr)
+			this->metrics->Add(Metrics::Accepts);
+		session->socktype = SOCK_DGRAM;
+		u_long arg = 1;
+		if (!session->CreateSocket() || ioctlsocket(session->fd, FIONBIO, &arg) ||
+			connect(session->fd, session->GetSockAddr(), SockAddrLength(session->GetSockAddr())) == SOCKET_ERROR ||
+			!this->poller->Add(session->fd, Poller::Readable, session))
+		{
+			this->onError("open upstream socket failed");
+			session->Close();
+			return nullptr;
+		}
+		this->SetupSocket(session->fd);
+		if (this->idletimeout > 0)
+			this->StartIdleTimer(session, this->idletimeout);
+		return session;
+	}
+
+	void udp::Server::CloseSession(Session *session)
+	{
+		if (session->closed)
+			return;
+		session->closed = true;
+		this->wheel->Cancel(session->idletimer);
+		if (session->fd != INVALID_SOCKET)
+		{
+			this->poller->Remove(session->fd);
+			session->Socket::Close();
+		}
+		this->clients.erase(ClientKey(session->client));
+		if (this->admission != nullptr)
+			this->admission->Release(SourceKey((const sockaddr *)&session->client));
+		if (this->metrics != nullptr)
+			this->metrics->Add(Metrics::Closes);
+		this->closedlist.push_back(session->handle);
+		Session::OnEvent onClose = std::move(session->onClose);
+		session->onClose = nullptr;
+		if (onClose)
+			onClose(*session);
+	}
+
+	void udp::Server::ReceiveClients()
+	{
+		int count, begin, end, sent;
+		size_t size;
+		for (;;)
+		{
+			count = this->ReceiveBatch(this->fd);
+			if (count < 0)
+			{
+				if (PendingError())
+					continue;
+				this->onError("receive datagram failed");
+				return;
+			}
+			if (count == 0)
+				return;
+			for (begin = 0; begin < count; begin = end)
+			{
+				// consecutive datagrams of a client go out in one call.
+				const sockaddr_in &addr = this->datagrams[begin].addr;
+				size = this->datagrams[begin].size;
+				for (end = begin + 1; end < count && this->datagrams[end].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+									  this->datagrams[end].addr.sin_port == addr.sin_port;
+					 end++)
+					size += this->datagrams[end].size;
+				Session *session = this->FindSession(addr);
+				if (session == nullptr || session->closed)
+				{
+					if (this->metrics != nullptr)
+						this->metrics->Add(Metrics::Drops, end - begin);
+					continue;
+				}
+				this->CountRead(session, true, size);
+				sent = this->SendBatch(session->fd, begin, end - begin, nullptr);
+				if (sent < end - begin && this->metrics != nullptr)
+					this->metrics->Add(Metrics::Drops, end - begin - sent);
+			}
+			// a short batch emptied the socket,a datagram arriving later is a new edge.
+			if (count < batchsize)
+				return;
+		}
+	}
+
+	void udp::Server::ReceiveUpstream(Session *session)
+	{
+		int count, sent, i;
+		size_t size;
+		for (;;)
+		{
+			count = this->ReceiveBatch(session->fd);
+			if (count < 0)
+			{
+				if (PendingError())
+					continue;
+				session->Close();
+				return;
+			}
+			if (count == 0)
+				return;
+			for (size = 0, i = 0; i < count; i++)
+				size += this->datagrams[i].size;
+			this->CountRead(session, false, size);
+			sent = this->SendBatch(this->fd, 0, count, &session->client);
+			if (sent < count && this->metrics != nullptr)
+				this->metrics->Add(Metrics::Drops, count - sent);
+			if (count < batchsize)
+				return;
+		}
+	}
+
+#ifdef __linux__
+	int udp::Server::ReceiveBatch(socket_fd fd)
+	{
+		int i, count;
+		for (i = 0; i < batchsize; i++)
+		{
+			msghdr &header = this->headers[i].msg_hdr;
+			this->iovecs[i].iov_base = this->datagrams[i].data;
+			this->iovecs[i].iov_len = slotsize;
+			header.msg_name = &this->datagrams[i].addr;
+			header.msg_namelen = sizeof(sockaddr_in);
+			header.msg_iov = &this->iovecs[i];
+			header.msg_iovlen = 1;
+			header.msg_control = this->offload ? this->controls[i] : nullptr;
+			header.msg_controllen = this->offload ? sizeof(this->controls[i]) : 0;
+			header.msg_flags = 0;
+		}
+		count = recvmmsg(fd, this->headers, batchsize, MSG_DONTWAIT, nullptr);
+		if (count == -1)
+			return WouldBlock() ? 0 : -1;
+		for (i = 0; i < count; i++)
+		{
+			Datagram &datagram = this->datagrams[i];
+			datagram.size = this->headers[i].msg_len;
+			datagram.segment = 0;
+			if (!this->offload)
+				continue;
+			msghdr &header = this->headers[i].msg_hdr;
+			for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr; cmsg = CMSG_NXTHDR(&header, cmsg))
+			{
+				if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+					memcpy(&datagram.segment, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+		return count;
+	}
+
+	int udp::Server::SendBatch(socket_fd fd, int begin, int count, const sockaddr_in *to)
+	{
+		int i, sent = 0, result;
+		for (i = 0; i < count; i++)
+		{
+			const Datagram &datagram = this->datagrams[begin + i];
+			msghdr &header = this->headers[i].msg_hdr;
+			this->iovecs[i].iov_base = datagram.data;
+			this->iovecs[i].iov_len = datagram.size;
+			header.msg_name = (void *)to;
+			header.msg_namelen = to != nullptr ? sizeof(sockaddr_in) : 0;
+			header.msg_iov = &this->iovecs[i];
+			header.msg_iovlen = 1;
+			header.msg_control = nullptr;
+			header.msg_controllen = 0;
+			header.msg_flags = 0;
+			// a coalesced train is split into datagrams of its segment size again.
+			if (datagram.segment > 0 && datagram.size > (size_t)datagram.segment)
+			{
+				header.msg_control = this->controls[i];
+				header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+				cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				uint16_t segment = (uint16_t)datagram.segment;
+				memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+			}
+		}
+		for (i = 0; i < count;)
+		{
+			result = sendmmsg(fd, this->headers + i, count - i, MSG_DONTWAIT);
+			if (result > 0)
+			{
+				i += result;
+				sent += result;
+			}
+			else if (WouldBlock())
+				break;
+			else
+				// the datagram the error is about is dropped,the rest may still go.
+				i++;
+		}
+		return sent;
+	}
+#else
+	int udp::Server::ReceiveBatch(socket_fd fd)
+	{
+		int i, size;
+		socklen_t addrlen;
+		for (i = 0; i < batchsize; i++)
+		{
+			Datagram &datagram = this->datagrams[i];
+			addrlen = sizeof(sockaddr_in);
+			size = recvfrom(fd, datagram.data, (int)slotsize, 0, (sockaddr *)&datagram.addr, &addrlen);
+			if (size == SOCKET_ERROR)
+			{
+				if (i > 0 || WouldBlock())
+					break;
+				return -1;
+			}
+			datagram.size = size;
+			datagram.segment = 0;
+		}
+		return i;
+	}
+
+	int udp::Server::SendBatch(socket_fd fd, int begin, int count, const sockaddr_in *to)
+	{
+		int i, sent = 0;
+		for (i = begin; i < begin + count; i++)
+		{
+			const Datagram &datagram = this->datagrams[i];
+			if (sendto(fd, datagram.data, (int)datagram.size, 0, (const sockaddr *)to, to != nullptr ? (int)sizeof(sockaddr_in) : 0) != SOCKET_ERROR)
+				sent++;
+			else if (WouldBlock())
+				break;
+		}
+		return sent;
+	}
+#endif
+
+	void udp::Server::CountRead(Session *session, bool in, size_t size)
+	{
+		session->lastactive = this->now;
+		if (this->metrics != nullptr)
+			this->metrics->Add(in ? Metrics::BytesIn : Metrics::BytesOut, size);
+	}
+
+	void udp::Server::StartIdleTimer(Session *session, int ms)
+	{
+		SlotHandle handle = session->handle;
+		session->idletimer = this->wheel->Add(ms, [this, handle]() -> void
+											  { this->CheckIdle(handle); });
+	}
+
+	void udp::Server::CheckIdle(SlotHandle handle)
+	{
+		Session *session = this->GetSession(handle);
+		if (session == nullptr)
+			return;
+		session->idletimer = TimingWheel::InvalidTimer;
+		// a busy session costs nothing per datagram,its timer only moves when it fires.
+		int idle = (int)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - session->lastactive).count();
+		if (idle >= this->idletimeout)
+		{
+			LOG_DEBUG("idle udp session closed port=%d idle=%dms", ntohs(session->client.sin_port), idle);
+			session->Close();
+			return;
+		}
+		this->StartIdleTimer(session, this->idletimeout - idle);
+	}
+}
+
+#endif
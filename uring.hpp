@@ -0,0 +1,307 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace network
+{
+	// minimal io_uring wrapper on top of the raw syscalls,no liburing needed.
+	// sqes are queued with GetSqe() and handed to the kernel in one io_uring_enter by Submit().
+	class Uring
+	{
+	public:
+		// user_data of completions generated by the wrapper itself,callers skip them.
+		static constexpr unsigned long long InternalUserData = ~0ULL;
+
+		Uring();
+		Uring(const Uring &rhs) = delete;
+		~Uring();
+
+		Uring &operator=(const Uring &rhs) = delete;
+
+		bool Init(unsigned entries);
+		// return a zeroed sqe,or nullptr if the submission queue is full.
+		io_uring_sqe *GetSqe();
+		// submit all queued sqes and wait for at least waitnr completions.
+		int Submit(unsigned waitnr);
+
+		// call f(const io_uring_cqe &) for every available completion,return the count.
+		template <typename F>
+		unsigned ForEachCqe(F f);
+
+		// register a ring of provided buffers for IOSQE_BUFFER_SELECT under group bgid.
+		// entries must be a power of 2,buffers are carved out of one allocation.
+		// if the kernel accepts the ring but does not select from it,buffers are
+		// provided with IORING_OP_PROVIDE_BUFFERS instead.
+		// must be called before any other sqe is queued.
+		bool RegisterBufferRing(unsigned short bgid, unsigned entries, unsigned buffersize);
+		char *GetBuffer(unsigned short bid);
+		unsigned GetBufferSize();
+		// give buffer bid back to the kernel.
+		void ProvideBuffer(unsigned short bid);
+
+	protected:
+		int fd;
+		io_uring_params params;
+
+		void *sqring;
+		size_t sqringsize;
+		void *cqring;
+		size_t cqringsize;
+		io_uring_sqe *sqes;
+		size_t sqessize;
+
+		unsigned *sqhead;
+		unsigned *sqtail;
+		unsigned *sqmask;
+		unsigned *sqarray;
+		unsigned sqlocaltail;
+		unsigned sqsubmitted;
+
+		unsigned *cqhead;
+		unsigned *cqtail;
+		unsigned *cqmask;
+		io_uring_cqe *cqes;
+
+		io_uring_buf_ring *bufring;
+		size_t bufringsize;
+		unsigned bufentries;
+		unsigned buffersize;
+		char *buffers;
+		unsigned short bufgroup;
+		bool bufringmapped;
+
+		bool ProbeBufferRing();
+	};
+}
+
+namespace network
+{
+	template <typename T>
+	inline T LoadAcquire(const T *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+	template <typename T>
+	inline void StoreRelease(T *p, T v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+
+	Uring::Uring() : fd(-1), params(), sqring(MAP_FAILED), sqringsize(0), cqring(MAP_FAILED), cqringsize(0),
+					 sqes(nullptr), sqessize(0), sqhead(nullptr), sqtail(nullptr), sqmask(nullptr), sqarray(nullptr),
+					 sqlocaltail(0), sqsubmitted(0), cqhead(nullptr), cqtail(nullptr), cqmask(nullptr), cqes(nullptr),
+					 bufring(nullptr), bufringsize(0), bufentries(0), buffersize(0), buffers(nullptr), bufgroup(0),
+					 bufringmapped(false) {}
+
+	Uring::~Uring()
+	{
+		if (this->bufring != nullptr)
+			munmap(this->bufring, this->bufringsize);
+		if (this->buffers != nullptr)
+			munmap(this->buffers, (size_t)this->bufentries * this->buffersize);
+		if (this->sqes != nullptr)
+			munmap(this->sqes, this->sqessize);
+		if (this->cqring != MAP_FAILED && this->cqring != this->sqring)
+			munmap(this->cqring, this->cqringsize);
+		if (this->sqring != MAP_FAILED)
+			munmap(this->sqring, this->sqringsize);
+		if (this->fd != -1)
+			close(this->fd);
+	}
+
+	bool Uring::Init(unsigned entries)
+	{
+		memset(&this->params, 0, sizeof(this->params));
+		this->fd = (int)syscall(__NR_io_uring_setup, entries, &this->params);
+		if (this->fd == -1)
+			return false;
+		io_uring_params &p = this->params;
+		this->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		this->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			if (this->cqringsize > this->sqringsize)
+				this->sqringsize = this->cqringsize;
+			this->cqringsize = this->sqringsize;
+		}
+		this->sqring = mmap(nullptr, this->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQ_RING);
+		if (this->sqring == MAP_FAILED)
+			return false;
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			this->cqring = this->sqring;
+		else
+		{
+			this->cqring = mmap(nullptr, this->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_CQ_RING);
+			if (this->cqring == MAP_FAILED)
+				return false;
+		}
+		this->sqessize = p.sq_entries * sizeof(io_uring_sqe);
+		void *sqes = mmap(nullptr, this->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+		this->sqes = static_cast<io_uring_sqe *>(sqes);
+
+		char *sq = static_cast<char *>(this->sqring);
+		this->sqhead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+		this->sqtail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+		this->sqmask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+		this->sqarray = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+		this->sqlocaltail = this->sqsubmitted = *this->sqtail;
+
+		char *cq = static_cast<char *>(this->cqring);
+		this->cqhead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+		this->cqtail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+		this->cqmask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+		this->cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+		return true;
+	}
+
+	io_uring_sqe *Uring::GetSqe()
+	{
+		if (this->sqlocaltail - LoadAcquire(this->sqhead) >= this->params.sq_entries)
+			return nullptr;
+		unsigned index = this->sqlocaltail & *this->sqmask;
+		this->sqarray[index] = index;
+		this->sqlocaltail++;
+		io_uring_sqe *sqe = &this->sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	int Uring::Submit(unsigned waitnr)
+	{
+		unsigned count = this->sqlocaltail - this->sqsubmitted;
+		StoreRelease(this->sqtail, this->sqlocaltail);
+		int status = (int)syscall(__NR_io_uring_enter, this->fd, count, waitnr, waitnr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if (status >= 0)
+			this->sqsubmitted += status;
+		else if (errno == EINTR || errno == EBUSY || errno == EAGAIN)
+			return 0;
+		return status;
+	}
+
+	template <typename F>
+	unsigned Uring::ForEachCqe(F f)
+	{
+		unsigned head = *this->cqhead;
+		unsigned tail = LoadAcquire(this->cqtail);
+		unsigned count = tail - head;
+		for (; head != tail; head++)
+			f(const_cast<const io_uring_cqe &>(this->cqes[head & *this->cqmask]));
+		StoreRelease(this->cqhead, head);
+		return count;
+	}
+
+	bool Uring::RegisterBufferRing(unsigned short bgid, unsigned entries, unsigned buffersize)
+	{
+		this->bufringsize = entries * sizeof(io_uring_buf);
+		void *ring = mmap(nullptr, this->bufringsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (ring == MAP_FAILED)
+			return false;
+		this->bufring = static_cast<io_uring_buf_ring *>(ring);
+		void *buffers = mmap(nullptr, (size_t)entries * buffersize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (buffers == MAP_FAILED)
+			return false;
+		this->buffers = static_cast<char *>(buffers);
+		this->bufentries = entries;
+		this->buffersize = buffersize;
+		this->bufgroup = bgid;
+
+		io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (unsigned long)this->bufring;
+		reg.ring_entries = entries;
+		reg.bgid = bgid;
+		this->bufringmapped = syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+		for (unsigned i = 0; this->bufringmapped && i < entries; i++)
+			this->ProvideBuffer((unsigned short)i);
+		if (this->bufringmapped && !this->ProbeBufferRing())
+		{
+			syscall(__NR_io_uring_register, this->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+			this->bufringmapped = false;
+		}
+		if (this->bufringmapped)
+			return true;
+
+		io_uring_sqe *sqe = this->GetSqe();
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = entries;
+		sqe->addr = (unsigned long)this->buffers;
+		sqe->len = buffersize;
+		sqe->buf_group = bgid;
+		sqe->user_data = InternalUserData;
+		if (this->Submit(1) != 1)
+			return false;
+		int status = -1;
+		this->ForEachCqe([&status](const io_uring_cqe &cqe) -> void
+						 { status = cqe.res; });
+		return status >= 0;
+	}
+
+	// recv one byte through the buffer ring to check the kernel really selects from it.
+	bool Uring::ProbeBufferRing()
+	{
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+			return false;
+		bool ok = false;
+		io_uring_sqe *sqe = this->GetSqe();
+		if (sqe != nullptr && write(sv[1], "", 1) == 1)
+		{
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = sv[0];
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = this->bufgroup;
+			sqe->user_data = InternalUserData;
+			if (this->Submit(1) == 1)
+			{
+				this->ForEachCqe([this, &ok](const io_uring_cqe &cqe) -> void
+								 {
+									 ok = cqe.res == 1;
+									 if (cqe.flags & IORING_CQE_F_BUFFER)
+										 this->ProvideBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT); });
+			}
+		}
+		close(sv[0]);
+		close(sv[1]);
+		return ok;
+	}
+
+	char *Uring::GetBuffer(unsigned short bid) { return this->buffers + (size_t)bid * this->buffersize; }
+	unsigned Uring::GetBufferSize() { return this->buffersize; }
+
+	void Uring::ProvideBuffer(unsigned short bid)
+	{
+		if (!this->bufringmapped)
+		{
+			io_uring_sqe *sqe = this->GetSqe();
+			while (sqe == nullptr)
+			{
+				this->Submit(0);
+				sqe = this->GetSqe();
+			}
+			sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+			sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+			sqe->fd = 1;
+			sqe->addr = (unsigned long)this->GetBuffer(bid);
+			sqe->len = this->buffersize;
+			sqe->off = bid;
+			sqe->buf_group = this->bufgroup;
+			sqe->user_data = InternalUserData;
+			return;
+		}
+		unsigned short tail = this->bufring->tail;
+		io_uring_buf &buf = this->bufring->bufs[tail & (this->bufentries - 1)];
+		buf.addr = (unsigned long)this->GetBuffer(bid);
+		buf.len = this->buffersize;
+		buf.bid = bid;
+		StoreRelease(&this->bufring->tail, (unsigned short)(tail + 1));
+	}
+}
+
+#endif
+
+#endif
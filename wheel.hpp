@@ -0,0 +1,216 @@
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include "slottable.hpp"
+
+namespace network
+{
+	// hierarchical timing wheel,adding,cancelling and expiring a timer are O(1).
+	// time moves in ticks of tickms,4 levels of 256 slots cover 2^32 ticks.
+	// a timer lands in the lowest level its delay fits in,and moves down a level each time
+	// the level below wraps around,until it expires from level 0.
+	// not thread safe,every event loop owns its wheel.
+	class TimingWheel
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+		using TimerId = SlotHandle;
+		using OnTimer = std::function<void()>;
+
+		static constexpr TimerId InvalidTimer = SlotTable<int>::InvalidHandle;
+
+		TimingWheel(int tickms = 10);
+		TimingWheel(const TimingWheel &rhs) = delete;
+
+		TimingWheel &operator=(const TimingWheel &rhs) = delete;
+
+		// call onTimer once,ms milliseconds from now,rounded up to a tick.
+		TimerId Add(int ms, OnTimer onTimer);
+		// cancelling an expired or invalid timer does nothing.
+		void Cancel(TimerId timer);
+		// run the timers expired at now.
+		void Advance(Clock::time_point now);
+		// milliseconds until Advance may have timers to run,-1 if there are none.
+		int NextTimeout(Clock::time_point now) const;
+		size_t Size() const;
+
+	protected:
+		static constexpr int levels = 4;
+		static constexpr int levelbits = 8;
+		static constexpr int slots = 1 << levelbits;
+
+		struct Timer
+		{
+			uint64_t expire;
+			TimerId id;
+			Timer *prev;
+			Timer *next;
+			OnTimer onTimer;
+		};
+
+		int tickms;
+		Clock::time_point start;
+		// ticks run so far.
+		uint64_t current;
+		SlotTable<Timer> timers;
+		Timer *wheel[levels][slots];
+		// bit i of occupied[level][i/64] tells whether wheel[level][i] has timers.
+		uint64_t occupied[levels][slots / 64];
+
+		void Link(Timer *timer);
+		void Unlink(Timer *timer);
+		// move the timers of a slot of a higher level down to the levels their expiry fits in now.
+		void Cascade(int level, int index);
+		// ticks from current to the next occupied slot of level 0 at most slots ahead.
+		uint64_t NextOccupied() const;
+	};
+}
+
+namespace network
+{
+	TimingWheel::TimingWheel(int tickms) : tickms(tickms < 1 ? 1 : tickms), start(Clock::now()), current(0), timers(), wheel(), occupied() {}
+
+	TimingWheel::TimerId TimingWheel::Add(int ms, OnTimer onTimer)
+	{
+		TimerId id;
+		Timer *timer = this->timers.Add(id);
+		uint64_t ticks = ms <= 0 ? 1 : ((uint64_t)ms + this->tickms - 1) / this->tickms;
+		if (ticks >= (1ULL << (levels * levelbits)))
+			ticks = (1ULL << (levels * levelbits)) - 1;
+		timer->expire = this->current + ticks;
+		timer->id = id;
+		timer->onTimer = std::move(onTimer);
+		this->Link(timer);
+		return id;
+	}
+
+	void TimingWheel::Cancel(TimerId id)
+	{
+		Timer *timer = this->timers.Get(id);
+		if (timer == nullptr)
+			return;
+		this->Unlink(timer);
+		this->timers.Remove(id);
+	}
+
+	void TimingWheel::Link(Timer *timer)
+	{
+		uint64_t delta = timer->expire > this->current ? timer->expire - this->current : 0;
+		int level = 0;
+		while (level < levels - 1 && delta >= (1ULL << ((level + 1) * levelbits)))
+			level++;
+		int index = (int)((timer->expire >> (level * levelbits)) & (slots - 1));
+		Timer *&head = this->wheel[level][index];
+		timer->prev = nullptr;
+		timer->next = head;
+		if (head != nullptr)
+			head->prev = timer;
+		head = timer;
+		this->occupied[level][index / 64] |= 1ULL << (index % 64);
+	}
+
+	void TimingWheel::Unlink(Timer *timer)
+	{
+		if (timer->next != nullptr)
+			timer->next->prev = timer->prev;
+		if (timer->prev != nullptr)
+		{
+			timer->prev->next = timer->next;
+			return;
+		}
+		// the head of its slot,find the slot again from its expiry.
+		for (int level = 0; level < levels; level++)
+		{
+			int index = (int)((timer->expire >> (level * levelbits)) & (slots - 1));
+			if (this->wheel[level][index] == timer)
+			{
+				this->wheel[level][index] = timer->next;
+				if (timer->next == nullptr)
+					this->occupied[level][index / 64] &= ~(1ULL << (index % 64));
+				return;
+			}
+		}
+	}
+
+	void TimingWheel::Cascade(int level, int index)
+	{
+		Timer *timer = this->wheel[level][index];
+		this->wheel[level][index] = nullptr;
+		this->occupied[level][index / 64] &= ~(1ULL << (index % 64));
+		Timer *next;
+		for (; timer != nullptr; timer = next)
+		{
+			next = timer->next;
+			this->Link(timer);
+		}
+	}
+
+	void TimingWheel::Advance(Clock::time_point now)
+	{
+		uint64_t target = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(now - this->start).count() / this->tickms;
+		int index, level;
+		while (this->current < target)
+		{
+			if (this->timers.Size() == 0)
+			{
+				this->current = target;
+				return;
+			}
+			this->current++;
+			index = (int)(this->current & (slots - 1));
+			for (level = 1; level < levels && (this->current & ((1ULL << (level * levelbits)) - 1)) == 0; level++)
+				this->Cascade(level, (int)((this->current >> (level * levelbits)) & (slots - 1)));
+			// a timer may add or cancel others,so take one at a time.
+			while (this->wheel[0][index] != nullptr)
+			{
+				Timer *timer = this->wheel[0][index];
+				this->Unlink(timer);
+				OnTimer onTimer = std::move(timer->onTimer);
+				this->timers.Remove(timer->id);
+				onTimer();
+			}
+		}
+	}
+
+	uint64_t TimingWheel::NextOccupied() const
+	{
+		int position = (int)(this->current & (slots - 1));
+		int index, word;
+		uint64_t bits;
+		for (uint64_t ahead = 1; ahead <= slots;)
+		{
+			index = (position + (int)ahead) & (slots - 1);
+			word = index / 64;
+			bits = this->occupied[0][word] >> (index % 64);
+			if (bits != 0)
+			{
+				for (; (bits & 1) == 0; bits >>= 1)
+					ahead++;
+				return ahead > slots ? slots : ahead;
+			}
+			ahead += 64 - index % 64;
+		}
+		return slots;
+	}
+
+	int TimingWheel::NextTimeout(Clock::time_point now) const
+	{
+		if (this->timers.Size() == 0)
+			return -1;
+		// higher levels cascade when level 0 wraps around,their timers may expire right after.
+		uint64_t next = this->current + this->NextOccupied();
+		uint64_t wrap = (this->current | (slots - 1)) + 1;
+		if (wrap < next)
+			next = wrap;
+		long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - this->start).count();
+		long long left = (long long)next * this->tickms - elapsed;
+		return left <= 0 ? 0 : (int)left;
+	}
+
+	size_t TimingWheel::Size() const { return this->timers.Size(); }
+}
+
+#endif